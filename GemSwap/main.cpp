@@ -2,14 +2,26 @@
 #define _USE_MATH_DEFINES
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <utility>
 #include <chrono>
 #include <thread>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -160,37 +172,1148 @@ struct vec2
     }
 };
 
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_set_parallel_for(void (*run)(void *user, void (*task)(void *arg, int index), void *arg, int count), void *user);
+extern "C" void stbi_set_post_process(int flags);
+extern "C" int stbi_is_thread_safe(void);
+// flags for stbi_set_post_process, as defined in stb_image.c
+enum { STBI_FLIP_VERTICALLY = 1, STBI_PREMULTIPLY_ALPHA = 2 };
+// textures come out the way GL and the blending want them, with no extra
+// pass over the pixels
+const int imagePostProcess = STBI_FLIP_VERTICALLY | STBI_PREMULTIPLY_ALPHA;
+extern "C" int stbi_required_size(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" int stbi_load_into(char const *filename, unsigned char *out, int out_size, int *x, int *y, int *comp, int req_comp);
+extern "C" int stbi_required_size_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" int stbi_load_from_memory_into(unsigned char const *buffer, int len, unsigned char *out, int out_size, int *x, int *y, int *comp, int req_comp);
+
+// 64-bit FNV-1a, continue a hash by passing the previous result as h
+unsigned long long hashBytes(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+unsigned long long hashString(const char* str, unsigned long long h = 14695981039346656037ULL)
+{
+    return hashBytes(str ? str : "", str ? strlen(str) : 0, h);
+}
+
+// a directory for one kind of cache file in the user's own cache folder
+// (XDG_CACHE_HOME, else ~/Library/Caches or ~/.cache), created if missing;
+// empty if there is none this user owns, and nothing is cached then
+std::string cacheDirectory(const char* name)
+{
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    std::string path;
+    if (xdg && xdg[0]) {
+        path = xdg;
+    } else if (home && home[0]) {
+#if defined(__APPLE__)
+        path = std::string(home) + "/Library/Caches";
+#else
+        path = std::string(home) + "/.cache";
+#endif
+    } else {
+        return "";
+    }
+    mkdir(path.c_str(), 0700);
+    path += '/';
+    path += name;
+    mkdir(path.c_str(), 0700);
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) return "";
+    return path;
+}
+
+// creates a file with a unique name beside path, to be renamed over it
+// by finishCacheFile; NULL if it could not be created
+FILE* createCacheFile(const std::string& path, std::string& temp)
+{
+    if (path.empty()) return NULL;
+    temp = path + ".XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd < 0) return NULL;
+    FILE* f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        remove(temp.c_str());
+    }
+    return f;
+}
+
+// closes a file from createCacheFile and, if all of it was written, renames
+// it over path, so a reader never sees a half written file
+void finishCacheFile(FILE* f, bool ok, const std::string& temp, const std::string& path)
+{
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) remove(temp.c_str());
+}
+
+// images are packed into one archive by tools/pack_assets.cpp; the layout
+// is described there and the structs below must match it
+const unsigned int assetArchiveMagic = 0x4B505347; // "GSPK"
+const unsigned int assetArchiveVersion = 1;
+
+struct AssetArchiveHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int entryCount;
+    unsigned int namesSize;
+    unsigned long long namesOffset;
+    unsigned long long size;
+};
+
+struct AssetEntry
+{
+    unsigned long long nameHash;
+    unsigned long long contentHash;     // hashBytes of the contents
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned int nameOffset;
+    unsigned int nameLength;
+};
+
+// where the archive, and any image it does not have, are looked for;
+// empty for the working directory, else ending in '/'. Set at startup by
+// findAssetDirectory
+std::string assetDirectory;
+
+// a directory holding the archive or the loose images
+bool isAssetDirectory(const std::string& dir)
+{
+    struct stat st;
+    return stat((dir + "assets.pak").c_str(), &st) == 0 || stat((dir + "asteroid.png").c_str(), &st) == 0;
+}
+
+// the --assets argument if given, else GEMSWAP_ASSETS, else the first of
+// the working directory, its GemSwap folder (run from the repository) and
+// the executable's folder that holds the assets; the working directory if
+// none does
+std::string findAssetDirectory(int argc, char* argv[])
+{
+    const char* given = getenv("GEMSWAP_ASSETS");
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--assets") == 0) given = argv[i + 1];
+    }
+    if (given && given[0]) {
+        std::string dir = given;
+        if (dir[dir.size() - 1] != '/') dir += '/';
+        return dir;
+    }
+    
+    std::vector<std::string> candidates;
+    candidates.push_back("");
+    candidates.push_back("GemSwap/");
+    std::string executable = argc > 0 ? argv[0] : "";
+    size_t slash = executable.rfind('/');
+    if (slash != std::string::npos) {
+        candidates.push_back(executable.substr(0, slash + 1));
+        candidates.push_back(executable.substr(0, slash + 1) + "GemSwap/");
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (isAssetDirectory(candidates[i])) return candidates[i];
+    }
+    return "";
+}
+
+// the asset archive mapped read-only; an image is found by a binary search
+// of the sorted index and decoded in place, so no file is opened per image.
+// Nothing changes after Open, so the loader threads share it freely
+class AssetArchive
+{
+    void* mapping;
+    size_t mappingSize;
+    const AssetArchiveHeader* header;
+    const AssetEntry* entries;
+    const char* names;
+    
+    static bool NameHashLess(const AssetEntry& entry, unsigned long long hash) { return entry.nameHash < hash; }
+    
+public:
+    AssetArchive() : mapping(0), mappingSize(0), header(0), entries(0), names(0) {}
+    
+    ~AssetArchive() { Close(); }
+    
+    // false if there is no archive or it is damaged; images are then read as loose files
+    bool Open(const std::string& path)
+    {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void* m = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(AssetArchiveHeader))
+            m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED) return false;
+        mapping = m;
+        mappingSize = st.st_size;
+        header = (const AssetArchiveHeader*)mapping;
+        
+        unsigned long long count = header->entryCount;
+        bool ok = header->magic == assetArchiveMagic && header->version == assetArchiveVersion && header->size == mappingSize &&
+                  header->namesOffset == sizeof(AssetArchiveHeader) + count * sizeof(AssetEntry) &&
+                  header->namesOffset <= mappingSize && header->namesSize <= mappingSize - header->namesOffset;
+        if (ok) {
+            entries = (const AssetEntry*)(header + 1);
+            names = (const char*)mapping + header->namesOffset;
+        }
+        for (unsigned int i = 0; ok && i < header->entryCount; i++) {
+            const AssetEntry& entry = entries[i];
+            ok = entry.nameOffset <= header->namesSize && entry.nameLength <= header->namesSize - entry.nameOffset &&
+                 entry.offset <= mappingSize && entry.size <= mappingSize - entry.offset && entry.size <= INT_MAX &&
+                 (i == 0 || entries[i - 1].nameHash <= entry.nameHash);
+        }
+        if (!ok) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+    
+    void Close()
+    {
+        if (mapping) munmap(mapping, mappingSize);
+        mapping = 0;
+        mappingSize = 0;
+        header = 0;
+        entries = 0;
+        names = 0;
+    }
+    
+    const AssetEntry* Find(const std::string& name) const
+    {
+        if (!mapping) return 0;
+        unsigned long long hash = hashBytes(name.data(), name.size());
+        const AssetEntry* end = entries + header->entryCount;
+        for (const AssetEntry* entry = std::lower_bound(entries, end, hash, NameHashLess); entry != end && entry->nameHash == hash; entry++) {
+            if (entry->nameLength == name.size() && memcmp(names + entry->nameOffset, name.data(), name.size()) == 0) return entry;
+        }
+        return 0;
+    }
+    
+    const unsigned char* Data(const AssetEntry* entry) const { return (const unsigned char*)mapping + entry->offset; }
+};
+
+AssetArchive assets;
+
+// the loose file for an asset name; absolute paths are kept as they are
+std::string assetFile(const std::string& name)
+{
+    if (!name.empty() && name[0] == '/') return name;
+    return assetDirectory + name;
+}
+
+// decodes an image as RGBA straight into pixels, sized from the header;
+// from the archive if it has the name, else from the loose file
+static bool loadImage(const std::string& name, std::vector<unsigned char>& pixels, int& width, int& height)
+{
+    // the loader threads take turns if the decoder keeps its state in globals
+    static std::mutex decodeMutex;
+    std::unique_lock<std::mutex> lock(decodeMutex, std::defer_lock);
+    if (!stbi_is_thread_safe()) lock.lock();
+    
+    int nComponents;
+    const AssetEntry* entry = assets.Find(name);
+    std::string path = entry ? std::string() : assetFile(name);
+    int size = entry ? stbi_required_size_from_memory(assets.Data(entry), (int)entry->size, &width, &height, &nComponents, 4)
+                     : stbi_required_size(path.c_str(), &width, &height, &nComponents, 4);
+    if (size == 0) return false;
+    pixels.resize(size);
+    int ok = entry ? stbi_load_from_memory_into(assets.Data(entry), (int)entry->size, &pixels[0], size, &width, &height, &nComponents, 4)
+                   : stbi_load_into(path.c_str(), &pixels[0], size, &width, &height, &nComponents, 4);
+    if (!ok) {
+        pixels.clear();
+        return false;
+    }
+    return true;
+}
+
+// block-compressed formats may be missing from older headers
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT1_EXT 0x83F1
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+#ifndef GL_COMPRESSED_RGBA8_ETC2_EAC
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#endif
+
+// check the core profile extension list
+bool hasExtension(const char* name)
+{
+    int count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int i = 0; i < count; i++) {
+        const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if (ext && strcmp(ext, name) == 0) return true;
+    }
+    return false;
+}
+
+enum TextureFormat
+{
+    TEXTURE_RGBA,   // uncompressed, 4 bytes per texel
+    TEXTURE_BC1,    // 0.5 bytes per texel, 1 bit alpha
+    TEXTURE_BC3,    // 1 byte per texel, full alpha
+    TEXTURE_BC7,    // 1 byte per texel, best quality
+    TEXTURE_ETC2    // 1 byte per texel, where BCn is unavailable
+};
+
+// as tools/bc_encode.cpp names its output
+const char* textureFormatNames[] = { "rgba", "bc1", "bc3", "bc7", "etc2" };
+
+struct TextureOptions
+{
+    TextureFormat format;
+    bool mipmaps;
+    
+    TextureOptions(TextureFormat f = TEXTURE_RGBA, bool m = true) : format(f), mipmaps(m) {}
+};
+
+// decoded textures are kept on disk as they are uploaded, RGBA or in the
+// blocks of a compressed format, with their mip chain, so a later launch
+// maps the file and uploads it without decoding or compressing. RGBA entries
+// are written from the decoded pixels on the loader threads; compressed ones
+// from the blocks the driver made, read back once without stalling the GL
+// thread. An entry belongs to one source file and set of options, and is
+// used while the source keeps its size and modification time, or failing
+// that, its contents
+const unsigned int textureCacheMagic = 0x54435347; // "GSCT"
+const unsigned int textureCacheVersion = 3;
+const int textureCacheMaxLevels = 16;
+const unsigned int textureCacheMaxSize = 1 << 15;   // in either dimension
+
+// the version of a source file an entry was made from
+struct TextureSource
+{
+    unsigned long long size;
+    long long time;             // modification time, seconds
+    unsigned long long hash;    // of the whole file
+};
+
+struct TextureCacheLevel
+{
+    unsigned int width, height;
+    unsigned long long offset, size;    // offset from the start of the file
+};
+
+struct TextureCacheHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long key;
+    TextureSource source;
+    unsigned int internalFormat;        // GL_RGBA8, or the compressed format of the levels
+    unsigned int mipmaps;
+    unsigned int levelCount;
+    unsigned int reserved;
+    TextureCacheLevel levels[textureCacheMaxLevels];
+};
+
+// an entry mapped read-only; levels point straight into the mapping
+struct CachedTexture
+{
+    void* mapping;
+    size_t mappingSize;
+    const TextureCacheHeader* header;
+    
+    CachedTexture() : mapping(0), mappingSize(0), header(0) {}
+    
+    const unsigned char* Level(int i) const { return (const unsigned char*)mapping + header->levels[i].offset; }
+};
+
+// number of mip levels from width x height down to 1x1
+int mipLevelCount(unsigned int width, unsigned int height)
+{
+    int count = 1;
+    for (; width > 1 || height > 1; width = std::max(width / 2, 1u), height = std::max(height / 2, 1u)) count++;
+    return count;
+}
+
+// bytes in one level of the given format; the compressed formats all use
+// 4x4 blocks, of 8 bytes for DXT1 and 16 for the rest
+unsigned long long textureLevelSize(unsigned int internalFormat, unsigned int width, unsigned int height)
+{
+    if (internalFormat == GL_RGBA8) return (unsigned long long)width * height * 4;
+    unsigned long long blockBytes = internalFormat == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? 8 : 16;
+    return (unsigned long long)((width + 3) / 4) * ((height + 3) / 4) * blockBytes;
+}
+
+// 2x2 box filter of an RGBA image, odd edges are clamped
+void downsampleImage(const unsigned char* src, int w, int h, unsigned char* dst, int dw, int dh)
+{
+    for (int y = 0; y < dh; y++) {
+        int y0 = std::min(y * 2, h - 1), y1 = std::min(y * 2 + 1, h - 1);
+        for (int x = 0; x < dw; x++) {
+            int x0 = std::min(x * 2, w - 1), x1 = std::min(x * 2 + 1, w - 1);
+            for (int c = 0; c < 4; c++) {
+                int sum = src[(y0 * w + x0) * 4 + c] + src[(y0 * w + x1) * 4 + c] +
+                          src[(y1 * w + x0) * 4 + c] + src[(y1 * w + x1) * 4 + c];
+                dst[(y * dw + x) * 4 + c] = (unsigned char)((sum + 2) >> 2);
+            }
+        }
+    }
+}
+
+// the levels below an RGBA image down to 1x1, each filtered from the one
+// above; built on the loader threads, as not every driver generates mipmaps
+// for compressed formats, and cached with the image
+void buildMipChain(const unsigned char* data, int width, int height, std::vector<std::vector<unsigned char> >& levels)
+{
+    int w = width, h = height;
+    while (w > 1 || h > 1) {
+        int nw = std::max(w / 2, 1), nh = std::max(h / 2, 1);
+        std::vector<unsigned char> next(nw * nh * 4);
+        downsampleImage(levels.empty() ? data : &levels.back()[0], w, h, &next[0], nw, nh);
+        levels.push_back(std::vector<unsigned char>());
+        levels.back().swap(next);
+        w = nw; h = nh;
+    }
+}
+
+// an image and the chain below it as one list of levels
+std::vector<const unsigned char*> imageLevels(const unsigned char* data, const std::vector<std::vector<unsigned char> >& chain)
+{
+    std::vector<const unsigned char*> levels(1, data);
+    for (size_t i = 0; i < chain.size(); i++) levels.push_back(&chain[i][0]);
+    return levels;
+}
+
+unsigned long long textureCacheKey(const std::string& source, unsigned int internalFormat, bool mipmaps)
+{
+    unsigned int options[4] = {textureCacheVersion, internalFormat, mipmaps, (unsigned int)imagePostProcess};
+    return hashBytes(options, sizeof(options), hashString(source.c_str()));
+}
+
+std::string textureCachePath(unsigned long long key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.tex", key);
+    std::string dir = cacheDirectory("gemswap-textures");
+    return dir.empty() ? dir : dir + name;
+}
+
+// size and time of a source file, and with withHash its contents hashed;
+// archived images have no time, and the hash is read from the index
+bool ReadTextureSource(const std::string& name, TextureSource& source, bool withHash)
+{
+    if (const AssetEntry* entry = assets.Find(name)) {
+        source.size = entry->size;
+        source.time = 0;
+        source.hash = entry->contentHash;
+        return true;
+    }
+    
+    std::string path = assetFile(name);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    source.size = st.st_size;
+    source.time = st.st_mtime;
+    source.hash = 0;
+    if (!withHash) return true;
+    
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    std::vector<char> buffer(1 << 16);
+    unsigned long long h = hashBytes(0, 0);
+    size_t n;
+    while ((n = fread(&buffer[0], 1, buffer.size(), f)) > 0) h = hashBytes(&buffer[0], n, h);
+    fclose(f);
+    source.hash = h;
+    return true;
+}
+
+void CloseCachedTexture(CachedTexture& cached)
+{
+    if (cached.mapping) munmap(cached.mapping, cached.mappingSize);
+    cached = CachedTexture();
+}
+
+// maps the entry for source if it has a valid one for these options; needs
+// no GL, so it can run on the loader threads
+bool OpenCachedTexture(const std::string& source, unsigned long long key, unsigned int internalFormat, bool mipmaps,
+                       CachedTexture& cached)
+{
+    TextureSource current;
+    if (!ReadTextureSource(source, current, false)) return false;
+    
+    std::string path = textureCachePath(key);
+    if (path.empty()) return false;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(TextureCacheHeader))
+        mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    cached.mapping = mapping;
+    cached.mappingSize = st.st_size;
+    cached.header = (const TextureCacheHeader*)mapping;
+    
+    const TextureCacheHeader* header = cached.header;
+    unsigned int width = header->levels[0].width, height = header->levels[0].height;
+    bool ok = header->magic == textureCacheMagic && header->version == textureCacheVersion && header->key == key &&
+              header->internalFormat == internalFormat && header->mipmaps == (unsigned int)mipmaps &&
+              header->source.size == current.size && width >= 1 && height >= 1 &&
+              width <= textureCacheMaxSize && height <= textureCacheMaxSize &&
+              (int)header->levelCount == (mipmaps ? mipLevelCount(width, height) : 1);
+    // every level must be the size its dimensions call for, and lie after the header
+    for (unsigned int i = 0; ok && i < header->levelCount; i++) {
+        const TextureCacheLevel& level = header->levels[i];
+        ok = level.width == std::max(width >> i, 1u) && level.height == std::max(height >> i, 1u) &&
+             level.size == textureLevelSize(internalFormat, level.width, level.height) && level.offset >= sizeof(TextureCacheHeader) &&
+             level.offset <= cached.mappingSize && level.size <= cached.mappingSize - level.offset;
+    }
+    if (ok && current.hash) {
+        // archived, so the hash is already known
+        ok = current.hash == header->source.hash;
+    } else if (ok && header->source.time != current.time) {
+        // touched but perhaps not changed, as by a checkout; the contents
+        // decide, and the new time is noted so the next launch need not hash
+        ok = ReadTextureSource(source, current, true) && current.hash == header->source.hash;
+        FILE* f = ok ? fopen(path.c_str(), "r+b") : NULL;
+        if (f) {
+            fseek(f, offsetof(TextureCacheHeader, source) + offsetof(TextureSource, time), SEEK_SET);
+            fwrite(&current.time, sizeof(current.time), 1, f);
+            fclose(f);
+        }
+    }
+    if (!ok) {
+        CloseCachedTexture(cached);
+        return false;
+    }
+    // page it in now rather than on the GL thread during the upload
+    madvise(mapping, cached.mappingSize, MADV_WILLNEED);
+    return true;
+}
+
+// writes the levels of an image, RGBA or compressed as internalFormat says,
+// as the entry for a source file of the given version; with mipmaps there
+// must be every level down to 1x1. Needs no GL, so the loader threads write
+// entries
+void StoreCachedTexture(unsigned long long key, const TextureSource& source, unsigned int internalFormat, bool mipmaps,
+                        int width, int height, const std::vector<const unsigned char*>& levels)
+{
+    if (width < 1 || height < 1 || width > (int)textureCacheMaxSize || height > (int)textureCacheMaxSize) return;
+    if ((int)levels.size() != (mipmaps ? mipLevelCount(width, height) : 1)) return;
+    
+    TextureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = textureCacheMagic;
+    header.version = textureCacheVersion;
+    header.key = key;
+    header.source = source;
+    header.internalFormat = internalFormat;
+    header.mipmaps = mipmaps;
+    header.levelCount = (unsigned int)levels.size();
+    if (header.levelCount > (unsigned int)textureCacheMaxLevels) return;
+    
+    // levels start on 16 byte boundaries in the file
+    unsigned long long offset = (sizeof(header) + 15) & ~15ULL;
+    for (unsigned int i = 0; i < header.levelCount; i++) {
+        unsigned int w = std::max((unsigned int)width >> i, 1u), h = std::max((unsigned int)height >> i, 1u);
+        TextureCacheLevel level = {w, h, offset, textureLevelSize(internalFormat, w, h)};
+        header.levels[i] = level;
+        offset = (offset + level.size + 15) & ~15ULL;
+    }
+    
+    std::string path = textureCachePath(key), temp;
+    FILE* f = createCacheFile(path, temp);
+    if (!f) return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (unsigned int i = 0; ok && i < header.levelCount; i++) {
+        ok = fseek(f, header.levels[i].offset, SEEK_SET) == 0 &&
+             fwrite(levels[i], 1, header.levels[i].size, f) == header.levels[i].size;
+    }
+    finishCacheFile(f, ok, temp, path);
+}
+
+// textures compressed ahead of time by tools/bc_encode.cpp, as KTX files
+// beside the image (asteroid.png as BC3 is asteroid.bc3.ktx); the levels
+// are uploaded as stored, so nothing is decoded or compressed at load
+const int compressedTextureMaxLevels = 16;
+
+struct CompressedTexture
+{
+    unsigned int internalFormat;
+    int levelCount;
+    int widths[compressedTextureMaxLevels], heights[compressedTextureMaxLevels];
+    size_t offsets[compressedTextureMaxLevels], sizes[compressedTextureMaxLevels];
+    const unsigned char* archived;      // the file in the asset archive
+    std::vector<unsigned char> file;    // or read from a loose file
+    
+    CompressedTexture() : internalFormat(0), levelCount(0), archived(0) {}
+    
+    const unsigned char* Level(int i) const { return (archived ? archived : &file[0]) + offsets[i]; }
+};
+
+// finds and checks the KTX file for an image in the given format; false if
+// there is none or the driver cannot sample its format, and the image is
+// then decoded instead
+bool ReadCompressedTexture(const std::string& name, TextureOptions options, unsigned int internalFormat, CompressedTexture& texture)
+{
+    if (options.format == TEXTURE_RGBA || internalFormat == GL_RGBA8) return false;
+    size_t dot = name.rfind('.');
+    size_t slash = name.rfind('/');
+    std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? name.substr(0, dot) : name;
+    std::string ktxName = stem + "." + textureFormatNames[options.format] + ".ktx";
+    
+    const unsigned char* data;
+    size_t size;
+    if (const AssetEntry* entry = assets.Find(ktxName)) {
+        texture.archived = data = assets.Data(entry);
+        size = entry->size;
+    } else {
+        FILE* f = fopen(assetFile(ktxName).c_str(), "rb");
+        if (!f) return false;
+        fseek(f, 0, SEEK_END);
+        long length = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        texture.file.resize(length > 0 ? length : 0);
+        bool ok = length > 0 && fread(&texture.file[0], 1, length, f) == (size_t)length;
+        fclose(f);
+        if (!ok) return false;
+        data = &texture.file[0];
+        size = texture.file.size();
+    }
+    
+    // KTX 1.1: identifier, 13 words of header, key/value data, then each
+    // level as its size followed by the blocks
+    static const unsigned char identifier[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+    unsigned int header[13];
+    if (size < sizeof(identifier) + sizeof(header) || memcmp(data, identifier, sizeof(identifier)) != 0) return false;
+    memcpy(header, data + sizeof(identifier), sizeof(header));
+    unsigned int width = header[6], height = header[7], levels = header[11];
+    if (header[0] != 0x04030201 || header[1] != 0 || header[3] != 0 || header[4] != internalFormat ||
+        header[8] != 0 || header[9] != 0 || header[10] != 1 || width == 0 || height == 0 ||
+        levels == 0 || levels > (unsigned int)compressedTextureMaxLevels) return false;
+    
+    // every level, down to 1x1, when mipmaps are wanted; otherwise just the first
+    if (options.mipmaps && levels != (unsigned int)mipLevelCount(width, height)) return false;
+    texture.internalFormat = internalFormat;
+    texture.levelCount = options.mipmaps ? levels : 1;
+    
+    size_t offset = sizeof(identifier) + sizeof(header);
+    if (header[12] > size - offset) return false;
+    offset += header[12];
+    for (int i = 0; i < texture.levelCount; i++) {
+        unsigned int w = std::max(width >> i, 1u), h = std::max(height >> i, 1u), levelSize;
+        if (size - offset < sizeof(levelSize)) return false;
+        memcpy(&levelSize, data + offset, sizeof(levelSize));
+        offset += sizeof(levelSize);
+        if (levelSize != textureLevelSize(internalFormat, w, h) || levelSize > size - offset) return false;
+        texture.widths[i] = w;
+        texture.heights[i] = h;
+        texture.offsets[i] = offset;
+        texture.sizes[i] = levelSize;
+        offset += (levelSize + 3) & ~3u;
+    }
+    return true;
+}
 
 class Texture {
     unsigned int textureId;
+    
+    void SetFilters(bool mipmaps)
+    {
+        if (mipmaps) {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        } else {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    
 public:
     
-    Texture(const std::string& inputFileName){
-        unsigned char* data;
-        int width; int height; int nComponents = 4;
+    // internal format for the requested compression, GL_RGBA8 if the driver cannot do it
+    static unsigned int InternalFormat(TextureFormat format)
+    {
+        switch (format) {
+            case TEXTURE_BC1:
+                if (hasExtension("GL_EXT_texture_compression_s3tc")) return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+                break;
+            case TEXTURE_BC3:
+                if (hasExtension("GL_EXT_texture_compression_s3tc")) return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+                break;
+            case TEXTURE_BC7:
+                if (majorVersion > 4 || (majorVersion == 4 && minorVersion >= 2) ||
+                    hasExtension("GL_ARB_texture_compression_bptc")) return GL_COMPRESSED_RGBA_BPTC_UNORM;
+                break;
+            case TEXTURE_ETC2:
+                if (majorVersion > 4 || (majorVersion == 4 && minorVersion >= 3) ||
+                    hasExtension("GL_ARB_ES3_compatibility")) return GL_COMPRESSED_RGBA8_ETC2_EAC;
+                break;
+            default:
+                break;
+        }
+        return GL_RGBA8;
+    }
+    
+    // empty texture, samples the placeholder until Upload is called
+    Texture()
+    {
+        textureId = 0;
+    }
+    
+    Texture(const std::string& inputFileName, TextureOptions options = TextureOptions()){
+        std::vector<unsigned char> pixels;
+        int width; int height;
+        
+        textureId = 0;
+        CompressedTexture compressed;
+        if (ReadCompressedTexture(inputFileName, options, InternalFormat(options.format), compressed)) {
+            Upload(compressed);
+            return;
+        }
         
-        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+        unsigned long long key = textureCacheKey(inputFileName, InternalFormat(options.format), options.mipmaps);
+        CachedTexture cached;
+        if (OpenCachedTexture(inputFileName, key, InternalFormat(options.format), options.mipmaps, cached)) {
+            Upload(cached);
+            CloseCachedTexture(cached);
+            return;
+        }
         
-        if(data == NULL) { return; }
+        TextureSource source;
+        if (!ReadTextureSource(inputFileName, source, true)) { return; }
+        if (!loadImage(inputFileName, pixels, width, height)) { return; }
         
-        glGenTextures(1, &textureId);
+        std::vector<std::vector<unsigned char> > chain;
+        if (options.mipmaps) buildMipChain(&pixels[0], width, height, chain);
+        Upload(&pixels[0], width, height, chain, options);
+        // compressed entries are only written by TextureLoader, which reads
+        // the driver's blocks back without waiting for them
+        if (InternalFormat(options.format) == GL_RGBA8)
+            StoreCachedTexture(key, source, GL_RGBA8, options.mipmaps, width, height, imageLevels(&pixels[0], chain));
+    }
+    
+    // uploads an RGBA image straight from the decoded pixels, with the mip
+    // chain buildMipChain made for it when mipmaps are wanted; the driver
+    // compresses each level if the format asks for it
+    void Upload(const unsigned char* data, int width, int height, const std::vector<std::vector<unsigned char> >& chain,
+                TextureOptions options)
+    {
+        if (textureId == 0) glGenTextures(1, &textureId);
         glBindTexture(GL_TEXTURE_2D, textureId);
         
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        unsigned int internalFormat = InternalFormat(options.format);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        for (size_t i = 0; i < chain.size(); i++)
+            glTexImage2D(GL_TEXTURE_2D, (int)i + 1, internalFormat, std::max(width >> (i + 1), 1),
+                         std::max(height >> (i + 1), 1), 0, GL_RGBA, GL_UNSIGNED_BYTE, &chain[i][0]);
+        SetFilters(options.mipmaps);
+    }
+    
+    // uploads a disk cache entry, every level as stored
+    void Upload(const CachedTexture& cached)
+    {
+        if (textureId == 0) glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        const TextureCacheHeader* header = cached.header;
+        for (unsigned int i = 0; i < header->levelCount; i++) {
+            const TextureCacheLevel& level = header->levels[i];
+            if (header->internalFormat == GL_RGBA8)
+                glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, cached.Level(i));
+            else
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, header->internalFormat, level.width, level.height, 0,
+                                       (int)level.size, cached.Level(i));
+        }
+        SetFilters(header->mipmaps);
+    }
+    
+    // uploads a texture compressed by tools/bc_encode.cpp
+    void Upload(const CompressedTexture& compressed)
+    {
+        if (textureId == 0) glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
         
-        delete data;
+        for (int i = 0; i < compressed.levelCount; i++)
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, compressed.internalFormat, compressed.widths[i], compressed.heights[i], 0,
+                                   (int)compressed.sizes[i], compressed.Level(i));
+        SetFilters(compressed.levelCount > 1);
+        if (compressed.levelCount > 1) glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, compressed.levelCount - 1);
     }
     
+    bool IsReady() { return textureId != 0; }
+    
     void Bind()
     {
+        if (textureId == 0) {
+            glBindTexture(GL_TEXTURE_2D, Placeholder());
+            return;
+        }
         glBindTexture(GL_TEXTURE_2D, textureId);
     }
+    
+    // 1x1 grey texture shown while the real image is still loading
+    static unsigned int Placeholder()
+    {
+        static unsigned int placeholderId = 0;
+        if (placeholderId == 0) {
+            unsigned char grey[4] = {128, 128, 128, 255};
+            glGenTextures(1, &placeholderId);
+            glBindTexture(GL_TEXTURE_2D, placeholderId);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        return placeholderId;
+    }
+};
+
+// runs the indices of a loop on worker threads; the calling thread helps,
+// so several threads can run loops at once without waiting on each other
+class ThreadPool
+{
+    struct Job
+    {
+        void (*task)(void* arg, int index);
+        void* arg;
+        int count;
+        std::atomic<int> next;
+        int active;                 // threads inside Run, guarded by mutex
+    };
+    
+    std::vector<std::thread> workers;
+    std::deque<Job*> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool quit;
+    
+    static void Run(Job* job)
+    {
+        for (int i = job->next++; i < job->count; i = job->next++)
+            job->task(job->arg, i);
+    }
+    
+    void Work()
+    {
+        for (;;) {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return quit || !jobs.empty(); });
+                if (quit) return;
+                job = jobs.front();
+                job->active++;
+            }
+            
+            Run(job);
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!jobs.empty() && jobs.front() == job) jobs.pop_front();
+            job->active--;
+            finished.notify_all();
+        }
+    }
+    
+public:
+    ThreadPool()
+    {
+        quit = false;
+    }
+    
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+    
+    void ParallelFor(void (*task)(void* arg, int index), void* arg, int count)
+    {
+        Job job;
+        job.task = task;
+        job.arg = arg;
+        job.count = count;
+        job.next = 0;
+        job.active = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // threads are started on first use
+            if (workers.empty()) {
+                int threadCount = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+                for (int i = 0; i < threadCount; i++) workers.push_back(std::thread(&ThreadPool::Work, this));
+            }
+            jobs.push_back(&job);
+        }
+        wake.notify_all();
+        
+        Run(&job);
+        
+        // every index is claimed; wait for the workers still running one
+        std::unique_lock<std::mutex> lock(mutex);
+        std::deque<Job*>::iterator it = std::find(jobs.begin(), jobs.end(), &job);
+        if (it != jobs.end()) jobs.erase(it);
+        finished.wait(lock, [&job] { return job.active == 0; });
+    }
+    
+    // matches the image decoder's parallel_for hook
+    static void ParallelForCallback(void* user, void (*task)(void* arg, int index), void* arg, int count)
+    {
+        ((ThreadPool*)user)->ParallelFor(task, arg, count);
+    }
 };
 
+ThreadPool threadPool;
+
+// decodes images on worker threads and uploads them on the GL thread,
+// a few per frame, so startup does not wait for every asset
+class TextureLoader
+{
+    struct Request
+    {
+        Texture* texture;
+        std::string path;
+        TextureOptions options;
+        unsigned int internalFormat;
+        unsigned long long cacheKey;
+        CachedTexture cached;       // the mapped entry, on a hit
+        CompressedTexture compressed;   // compressed ahead of time, if it was
+        TextureSource source;           // of the decoded image, as it was before the decode
+        std::vector<unsigned char> pixels;
+        std::vector<std::vector<unsigned char> > chain;    // the levels below pixels
+        int width;
+        int height;
+    };
+    
+    // levels for the disk cache, one after another in data
+    struct CacheWrite
+    {
+        unsigned long long cacheKey;
+        TextureSource source;
+        unsigned int internalFormat;
+        bool mipmaps;
+        int width, height;
+        std::vector<size_t> offsets;
+        std::vector<unsigned char> data;
+    };
+    
+    // the levels the driver compressed, being copied into a pixel buffer
+    struct Readback
+    {
+        unsigned int buffer;
+        GLsync fence;               // passed once the copy is done
+        size_t size;
+        CacheWrite entry;           // the data is filled in from the buffer
+    };
+    
+    std::vector<std::thread> workers;
+    std::deque<Request> pending;    // waiting to be decoded
+    std::deque<Request> decoded;    // waiting to be uploaded
+    std::deque<CacheWrite> writes;  // waiting to be written, after any decoding
+    std::vector<Readback> readbacks;    // GL thread only
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit;
+    int threadCount;
+    
+    void Work()
+    {
+        for (;;) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return quit || !pending.empty() || !writes.empty(); });
+                if (quit) return;
+                if (pending.empty()) {
+                    CacheWrite write = std::move(writes.front());
+                    writes.pop_front();
+                    lock.unlock();
+                    std::vector<const unsigned char*> levels;
+                    for (size_t i = 0; i < write.offsets.size(); i++) levels.push_back(&write.data[write.offsets[i]]);
+                    StoreCachedTexture(write.cacheKey, write.source, write.internalFormat, write.mipmaps, write.width, write.height, levels);
+                    continue;
+                }
+                request = std::move(pending.front());
+                pending.pop_front();
+            }
+            
+            // the source is hashed before it is decoded, so an edit made
+            // during the decode leaves an entry that will not match it
+            bool loaded = ReadCompressedTexture(request.path, request.options, request.internalFormat, request.compressed) ||
+                          OpenCachedTexture(request.path, request.cacheKey, request.internalFormat, request.options.mipmaps, request.cached);
+            if (!loaded && ReadTextureSource(request.path, request.source, true) &&
+                loadImage(request.path, request.pixels, request.width, request.height)) {
+                if (request.options.mipmaps) buildMipChain(&request.pixels[0], request.width, request.height, request.chain);
+                // an RGBA entry is written from the decoded pixels here; a
+                // compressed one once the GL thread has the driver's blocks
+                if (request.internalFormat == GL_RGBA8)
+                    StoreCachedTexture(request.cacheKey, request.source, GL_RGBA8, request.options.mipmaps, request.width,
+                                       request.height, imageLevels(&request.pixels[0], request.chain));
+                loaded = true;
+            }
+            if (!loaded) printf("could not load %s\n", request.path.c_str());
+            
+            std::lock_guard<std::mutex> lock(mutex);
+            decoded.push_back(std::move(request));
+        }
+    }
+    
+    // queues a copy of the levels the driver compressed for a just uploaded
+    // texture into a pixel buffer; the copy runs on the GPU and FinishReadbacks
+    // collects it once its fence has passed, so nothing here waits on the driver
+    void StartReadback(const Request& request)
+    {
+        if (majorVersion < 3 || (majorVersion == 3 && minorVersion < 2 && !hasExtension("GL_ARB_sync"))) return;
+        Readback readback;
+        CacheWrite& entry = readback.entry;
+        entry.cacheKey = request.cacheKey;
+        entry.source = request.source;
+        entry.internalFormat = request.internalFormat;
+        entry.mipmaps = request.options.mipmaps;
+        entry.width = request.width;
+        entry.height = request.height;
+        
+        // a driver that stored a level some other way gets no entry
+        request.texture->Bind();
+        readback.size = 0;
+        for (int i = 0; i <= (int)request.chain.size(); i++) {
+            int compressed = 0, size = 0;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED, &compressed);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, i, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+            unsigned int w = std::max(request.width >> i, 1), h = std::max(request.height >> i, 1);
+            if (!compressed || (unsigned long long)size != textureLevelSize(request.internalFormat, w, h)) return;
+            entry.offsets.push_back(readback.size);
+            readback.size += size;
+        }
+        
+        glGenBuffers(1, &readback.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, readback.size, NULL, GL_STREAM_READ);
+        for (size_t i = 0; i < entry.offsets.size(); i++)
+            glGetCompressedTexImage(GL_TEXTURE_2D, (int)i, (void*)entry.offsets[i]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        readbacks.push_back(std::move(readback));
+    }
+    
+    // hands the readbacks whose copies are done to the loader threads to be
+    // written; the others are left for a later frame
+    void FinishReadbacks()
+    {
+        bool queued = false;
+        for (size_t i = 0; i < readbacks.size();) {
+            Readback& readback = readbacks[i];
+            GLenum status = glClientWaitSync(readback.fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                i++;
+                continue;
+            }
+            glDeleteSync(readback.fence);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+            const void* mapped = status == GL_WAIT_FAILED ? NULL : glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback.size, GL_MAP_READ_BIT);
+            if (mapped) {
+                readback.entry.data.assign((const unsigned char*)mapped, (const unsigned char*)mapped + readback.size);
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            glDeleteBuffers(1, &readback.buffer);
+            if (!readback.entry.data.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                writes.push_back(std::move(readback.entry));
+                queued = true;
+            }
+            readbacks.erase(readbacks.begin() + i);
+        }
+        if (queued) wake.notify_one();
+    }
+    
+public:
+    TextureLoader(int threads = 0)
+    {
+        quit = false;
+        threadCount = threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency() - 1);
+    }
+    
+    ~TextureLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+    
+    // returns immediately; the texture shows the placeholder until it is uploaded
+    Texture* Load(const std::string& path, TextureOptions options = TextureOptions())
+    {
+        Texture* texture = new Texture();
+        Request request;
+        request.texture = texture;
+        request.path = path;
+        request.options = options;
+        // the format depends on the driver, so it is settled here on the GL thread
+        request.internalFormat = Texture::InternalFormat(options.format);
+        request.cacheKey = textureCacheKey(path, request.internalFormat, options.mipmaps);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(request));
+            // threads are started on first use, after the GL context exists
+            while ((int)workers.size() < threadCount) workers.push_back(std::thread(&TextureLoader::Work, this));
+        }
+        wake.notify_one();
+        return texture;
+    }
+    
+    // uploads decoded images until the time budget (in seconds) is spent;
+    // at least one image is uploaded per call so loading always progresses
+    void Update(double budget)
+    {
+        FinishReadbacks();
+        auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            Request request;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (decoded.empty()) return;
+                request = std::move(decoded.front());
+                decoded.pop_front();
+            }
+            
+            if (request.compressed.levelCount) {
+                request.texture->Upload(request.compressed);
+            } else if (request.cached.mapping) {
+                request.texture->Upload(request.cached);
+                CloseCachedTexture(request.cached);
+            } else if (!request.pixels.empty()) {
+                request.texture->Upload(&request.pixels[0], request.width, request.height, request.chain, request.options);
+                if (request.internalFormat != GL_RGBA8) StartReadback(request);
+            }
+            
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed.count() >= budget) return;
+        }
+    }
+    
+    bool IsIdle()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending.empty() && decoded.empty();
+    }
+};
+
+TextureLoader textureLoader;
+
 class Camera
 {
     vec2 center;
@@ -296,16 +1419,115 @@ public:
 
 Camera camera;
 
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#endif
+#ifndef GL_NUM_PROGRAM_BINARY_FORMATS
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+// linked program binaries are stored on disk so later launches can skip
+// compiling; a binary only matches the exact sources and driver that built it
+const unsigned int programCacheMagic = 0x42505347; // "GSPB"
+
+struct ProgramCacheHeader
+{
+    unsigned int magic;
+    unsigned int binaryFormat;
+    unsigned int length;
+    unsigned int reserved;
+    unsigned long long key;
+};
+
+unsigned long long programCacheKey(const char *vertexSource, const char *fragmentSource)
+{
+    unsigned long long h = hashString(vertexSource);
+    h = hashString(fragmentSource, h);
+    h = hashString((const char*)glGetString(GL_VENDOR), h);
+    h = hashString((const char*)glGetString(GL_RENDERER), h);
+    h = hashString((const char*)glGetString(GL_VERSION), h);
+    return h;
+}
+
+std::string programCachePath(unsigned long long key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", key);
+    std::string dir = cacheDirectory("gemswap-shaders");
+    return dir.empty() ? dir : dir + name;
+}
+
+bool programBinarySupported()
+{
+    int formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+// returns true if program was linked from a cached binary
+bool LoadProgramBinary(unsigned int program, unsigned long long key)
+{
+    if (!programBinarySupported()) return false;
+    
+    FILE* f = fopen(programCachePath(key).c_str(), "rb");
+    if (!f) return false;
+    
+    ProgramCacheHeader header;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == programCacheMagic && header.key == key;
+    // the length is read from disk, so it must be what the file holds
+    // before anything is allocated for it
+    struct stat st;
+    ok = ok && fstat(fileno(f), &st) == 0 && header.length > 0 &&
+         header.length <= (unsigned long long)st.st_size - sizeof(header);
+    std::vector<char> binary;
+    if (ok) {
+        binary.resize(header.length);
+        ok = fread(&binary[0], 1, header.length, f) == header.length;
+    }
+    fclose(f);
+    if (!ok) return false;
+    
+    // the driver rejects binaries from a different build, compile again in that case
+    glProgramBinary(program, header.binaryFormat, &binary[0], header.length);
+    int linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked != 0;
+}
+
+void StoreProgramBinary(unsigned int program, unsigned long long key)
+{
+    if (!programBinarySupported()) return;
+    
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    
+    std::vector<char> binary(length);
+    unsigned int binaryFormat = 0;
+    glGetProgramBinary(program, length, &length, &binaryFormat, &binary[0]);
+    
+    ProgramCacheHeader header = {programCacheMagic, binaryFormat, (unsigned int)length, 0, key};
+    std::string path = programCachePath(key), temp;
+    FILE* f = createCacheFile(path, temp);
+    if (!f) return;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(&binary[0], 1, length, f) == (size_t)length;
+    finishCacheFile(f, ok, temp, path);
+}
+
 class SuperShader
 {
 protected:
     //shader ID
     unsigned int shaderProgram;
+    unsigned long long cacheKey;
+    bool fromCache;
     
 public:
     SuperShader()
     {
         shaderProgram = 0;
+        cacheKey = 0;
+        fromCache = false;
     }
     
     ~SuperShader()
@@ -315,6 +1537,14 @@ public:
     
     void CompileProgram(const char *vertexSource, const char *fragmentSource)
     {
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        // a cached binary already has attribute and output locations baked in
+        cacheKey = programCacheKey(vertexSource, fragmentSource);
+        fromCache = LoadProgramBinary(shaderProgram, cacheKey);
+        if (fromCache) return;
+        
         // create vertex shader from string
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
@@ -332,9 +1562,6 @@ public:
         checkShader(fragmentShader, "Fragment shader error");
         
         // attach shaders to a single program
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
         glAttachShader(shaderProgram, vertexShader);
         glAttachShader(shaderProgram, fragmentShader);
         
@@ -343,9 +1570,16 @@ public:
     
     void LinkProgram()
     {
+        if (fromCache) return;
+        
         // program packaging
+        glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(shaderProgram); // link program
         checkLinking(shaderProgram);
+        
+        int linked = 0;
+        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linked);
+        if (linked) StoreProgramBinary(shaderProgram, cacheKey);
         printf("link break\n");
     }
     
@@ -529,15 +1763,94 @@ public:
     
 };
 
+// every static shape lives in one interleaved (x, y, u, v) vertex buffer
+// behind a single vao; identical vertex data is stored only once
+class GeometryRegistry
+{
+    unsigned int vao;
+    unsigned int vbo;
+    std::vector<float> vertices;
+    bool dirty;
+    
+public:
+    GeometryRegistry()
+    {
+        vao = 0;
+        vbo = 0;
+        dirty = false;
+    }
+    
+    ~GeometryRegistry()
+    {
+        if (vbo) glDeleteBuffers(1, &vbo);
+        if (vao) glDeleteVertexArrays(1, &vao);
+    }
+    
+    // returns the first vertex of the range holding the given data
+    int Add(const float* positions, const float* texCoords, int count)
+    {
+        std::vector<float> packed(count * 4);
+        for (int i = 0; i < count; i++) {
+            packed[i * 4] = positions[i * 2];
+            packed[i * 4 + 1] = positions[i * 2 + 1];
+            packed[i * 4 + 2] = texCoords ? texCoords[i * 2] : 0;
+            packed[i * 4 + 3] = texCoords ? texCoords[i * 2 + 1] : 0;
+        }
+        
+        // reuse an existing range if the same vertices were already added
+        for (int first = 0; (first + count) * 4 <= (int)vertices.size(); first++) {
+            if (memcmp(&vertices[first * 4], &packed[0], packed.size() * sizeof(float)) == 0) return first;
+        }
+        
+        int first = (int)vertices.size() / 4;
+        vertices.insert(vertices.end(), packed.begin(), packed.end());
+        dirty = true;
+        return first;
+    }
+    
+    void Bind()
+    {
+        if (vao == 0) {
+            glGenVertexArrays(1, &vao);
+            glGenBuffers(1, &vbo);
+        }
+        glBindVertexArray(vao);
+        if (!dirty) return;
+        
+        // upload lazily so all shapes created during initialization end up in one buffer
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), NULL);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+        dirty = false;
+    }
+};
+
+GeometryRegistry geometryRegistry;
+
 class Geometry
 {
-protected: unsigned int vao;
+protected:
+    unsigned int mode;
+    int first;
+    int count;
+    
+    void Register(unsigned int m, const float* positions, const float* texCoords, int n)
+    {
+        mode = m;
+        count = n;
+        first = geometryRegistry.Add(positions, texCoords, n);
+    }
     
 public:
     
     Geometry()
     {
-        glGenVertexArrays(1, &vao);
+        mode = GL_TRIANGLES;
+        first = 0;
+        count = 0;
     }
     
     virtual ~Geometry()
@@ -545,7 +1858,25 @@ public:
         delete this;
     }
     
-    virtual void Draw() = 0;
+    // state shared by every draw of this shape
+    virtual void Begin()
+    {
+        geometryRegistry.Bind();
+    }
+    
+    void Submit()
+    {
+        glDrawArrays(mode, first, count);
+    }
+    
+    virtual void End() {}
+    
+    void Draw()
+    {
+        Begin();
+        Submit();
+        End();
+    }
 };
 
 class Mesh
@@ -566,9 +1897,27 @@ public:
     SuperShader* getShader() {return material->getShader();}
     
     void Draw()
+    {
+        Begin();
+        geometry->Submit();
+        End();
+    }
+    
+    // split form of Draw for submitting many objects with the same mesh
+    void Begin()
     {
         material->UploadAttributes();
-        geometry->Draw();
+        geometry->Begin();
+    }
+    
+    void Submit()
+    {
+        geometry->Submit();
+    }
+    
+    void End()
+    {
+        geometry->End();
     }
     
     int getID() {return objectID;}
@@ -646,6 +1995,13 @@ public:
         mesh->Draw();
     }
     
+    void Run()
+    {
+        shader->Run();
+    }
+    
+    Mesh* GetMesh() {return mesh;}
+    
     int getID() {
         return mesh->getID();
     }
@@ -665,100 +2021,54 @@ public:
 
 class Triangle : public Geometry
 {
-    unsigned int vbo;    // vertex array object id
-    
 public:
     
     Triangle()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
         static float vertexCoords[] = {-0.8, -0.8, 0, 0.8, 0.8, -0.8};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords),
-                     vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-    }
-    
-    void Draw()
-    {
-        glBindVertexArray(vao);    // make the vao and its vbos active playing the role of the data source
-        glDrawArrays(GL_TRIANGLES, 0, 3); // draw a single triangle with vertices defined in vao
+        Register(GL_TRIANGLES, vertexCoords, NULL, 3);
     }
 };
 
 class Quad : public Geometry
 {
-    unsigned int vbo;
-    
 public:
     Quad()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
         static float vertexCoords[] = {-0.7, 0.7, 0.7, 0.7, -0.7, -0.7, 0.7, -0.7};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-    }
-    
-    void Draw()
-    {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        Register(GL_TRIANGLE_STRIP, vertexCoords, NULL, 4);
     }
 };
 
 class TexturedQuad : public Quad
 {
-    unsigned int vboTex;
-    
 public:
     TexturedQuad()
     {
-        glBindVertexArray(vao);
-        glGenBuffers(1, &vboTex);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vboTex);
-        static float vertexTexCoords[] = {0,0,1,0,0,1,1,1};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexTexCoords), vertexTexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-        // define the texture coordinates here
-        // assign the array of texture coordinates to
-        // vertex attribute array 1
+        static float vertexCoords[] = {-0.7, 0.7, 0.7, 0.7, -0.7, -0.7, 0.7, -0.7};
+        // textures are loaded bottom row first, so v runs up the quad
+        static float vertexTexCoords[] = {0,1,1,1,0,0,1,0};
+        Register(GL_TRIANGLE_STRIP, vertexCoords, vertexTexCoords, 4);
     }
     
-    void Draw()
+    void Begin()
     {
         glEnable(GL_BLEND); // necessary for transparent pixels
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); // textures are premultiplied
+        Geometry::Begin();
+    }
+    
+    void End()
+    {
         glDisable(GL_BLEND);
     }
 };
 
 class Star : public Geometry
 {
-    unsigned int vbo;
-    
 public:
     Star()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        
         float R = 1.0;
         float r = R * cos(2*M_PI/5) / cos(M_PI/5);
         
@@ -783,33 +2093,15 @@ public:
         vertexCoords[22] = 0;
         vertexCoords[23] = R;
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-    }
-    
-    void Draw()
-    {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 12);
+        Register(GL_TRIANGLE_FAN, vertexCoords, NULL, 12);
     }
 };
 
 class Heart : public Geometry
 {
-    unsigned int vbo;
-    
 public:
     Heart()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        
-        
         static float vertexCoords[100];
         
         float t = -1 * M_PI;
@@ -825,42 +2117,246 @@ public:
             t += change;
         }
         
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-        
+        Register(GL_TRIANGLE_FAN, vertexCoords, NULL, 50);
     }
-    
-    void Draw()
+};
+
+class Empty : public Geometry
+{
+public:
+    Empty()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 50);
+        static float vertexCoords[] = {-0.7, 0.7, 0.7, 0.7, -0.7, -0.7, 0.7, -0.7};
+        Register(GL_TRIANGLE_STRIP, vertexCoords, NULL, 4);
     }
 };
 
-class Empty : public Geometry
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+// per-frame timing of scoped CPU zones and GL_TIME_ELAPSED query zones;
+// queries are read back a few frames late so the CPU never waits on the GPU
+class Profiler
 {
-    unsigned int vbo;
+    struct Zone
+    {
+        const char* name;
+        double start;       // seconds since the profiler was created
+        double duration;
+        bool gpu;
+    };
+    
+    struct Frame
+    {
+        unsigned long long number;
+        double start;
+        double duration;
+        double gpuTime;
+        std::vector<Zone> zones;
+    };
+    
+    struct PendingQuery
+    {
+        const char* name;
+        unsigned int query;
+        double start;
+        unsigned long long frame;
+    };
+    
+    static const int queryLatency = 3;      // frames a query may stay in flight
+    static const int historySize = 300;
+    
+    std::chrono::steady_clock::time_point epoch;
+    std::deque<Frame> history;
+    Frame current;
+    bool frameOpen;
+    unsigned long long frameNumber;
+    std::vector<PendingQuery> pending[queryLatency];
+    std::vector<unsigned int> freeQueries;
+    int openQuery;      // GL_TIME_ELAPSED queries cannot nest
+    
+    Frame* FindFrame(unsigned long long number)
+    {
+        for (int i = (int)history.size() - 1; i >= 0; i--) {
+            if (history[i].number == number) return &history[i];
+        }
+        return NULL;
+    }
+    
+    // collect the queries issued queryLatency frames ago
+    void ResolveQueries(std::vector<PendingQuery>& queries)
+    {
+        for (size_t i = 0; i < queries.size(); i++) {
+            int available = 0;
+            glGetQueryObjectiv(queries[i].query, GL_QUERY_RESULT_AVAILABLE, &available);
+            Frame* frame = FindFrame(queries[i].frame);
+            if (available && frame) {
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(queries[i].query, GL_QUERY_RESULT, &ns);
+                Zone zone = {queries[i].name, queries[i].start, ns * 1e-9, true};
+                frame->zones.push_back(zone);
+                frame->gpuTime += zone.duration;
+            }
+            freeQueries.push_back(queries[i].query);
+        }
+        queries.clear();
+    }
     
 public:
-    Empty()
+    bool enabled;
+    bool overlay;
+    
+    Profiler()
     {
-        glBindVertexArray(vao);
-        
-        glGenBuffers(1, &vbo);
+        epoch = std::chrono::steady_clock::now();
+        frameOpen = false;
+        frameNumber = 0;
+        openQuery = -1;
+        enabled = true;
+        overlay = false;
+    }
+    
+    double Now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count();
+    }
+    
+    void BeginFrame()
+    {
+        if (!enabled || frameOpen) return;
+        frameOpen = true;
+        ResolveQueries(pending[frameNumber % queryLatency]);
+        current.number = frameNumber;
+        current.start = Now();
+        current.duration = 0;
+        current.gpuTime = 0;
+        current.zones.clear();
+    }
+    
+    void EndFrame()
+    {
+        if (!frameOpen) return;
+        frameOpen = false;
+        current.duration = Now() - current.start;
+        history.push_back(current);
+        if (history.size() > historySize) history.pop_front();
+        frameNumber++;
+    }
+    
+    int BeginCpu(const char* name)
+    {
+        if (!frameOpen) return -1;
+        Zone zone = {name, Now(), 0, false};
+        current.zones.push_back(zone);
+        return (int)current.zones.size() - 1;
+    }
+    
+    void EndCpu(int index)
+    {
+        if (index < 0 || !frameOpen) return;
+        current.zones[index].duration = Now() - current.zones[index].start;
+    }
+    
+    // false if no query was started: outside a frame, or inside another GPU zone
+    bool BeginGpu(const char* name)
+    {
+        if (!frameOpen || openQuery >= 0) return false;
+        unsigned int query;
+        if (freeQueries.empty()) glGenQueries(1, &query);
+        else { query = freeQueries.back(); freeQueries.pop_back(); }
         
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        static float vertexCoords[] = {-0.7, 0.7, 0.7, 0.7, -0.7, -0.7, 0.7, -0.7};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+        PendingQuery p = {name, query, Now(), frameNumber};
+        std::vector<PendingQuery>& queries = pending[frameNumber % queryLatency];
+        queries.push_back(p);
+        openQuery = (int)queries.size() - 1;
+        glBeginQuery(GL_TIME_ELAPSED, query);
+        return true;
     }
     
-    void Draw()
+    void EndGpu()
     {
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        if (openQuery < 0) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        openQuery = -1;
+    }
+    
+    // chrome://tracing and Perfetto both read this format
+    void WriteTrace(const char* path)
+    {
+        FILE* f = fopen(path, "w");
+        if (!f) { printf("could not write %s\n", path); return; }
+        fprintf(f, "{\"traceEvents\":[\n");
+        bool first = true;
+        for (size_t i = 0; i < history.size(); i++) {
+            Frame& frame = history[i];
+            fprintf(f, "%s{\"name\":\"frame %llu\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",\n", frame.number, frame.start * 1e6, frame.duration * 1e6);
+            first = false;
+            for (size_t j = 0; j < frame.zones.size(); j++) {
+                Zone& zone = frame.zones[j];
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                        zone.name, zone.gpu ? 2 : 1, zone.start * 1e6, zone.duration * 1e6);
+            }
+        }
+        fprintf(f, "\n],\n\"displayTimeUnit\":\"ms\"}\n");
+        fclose(f);
+        printf("wrote %d frames to %s\n", (int)history.size(), path);
     }
+    
+    // one bar per recent frame along the bottom of the screen: CPU frame time
+    // colored by budget, GPU time as a narrower blue bar; full height is 50ms
+    void DrawOverlay(SuperShader* shader, Geometry* quad)
+    {
+        if (!overlay || history.empty()) return;
+        
+        const int bars = 60;
+        const float left = -0.95, bottom = -0.95, width = 1.2, height = 0.5;
+        const float quadHalf = 0.7; // half extent of Quad's vertices
+        
+        shader->Run();
+        quad->Begin();
+        int count = std::min(bars, (int)history.size());
+        for (int i = 0; i < count; i++) {
+            Frame& frame = history[history.size() - count + i];
+            float x = left + (i + 0.5) * width / bars;
+            float times[2] = {(float)frame.duration, (float)frame.gpuTime};
+            for (int k = 0; k < 2; k++) {
+                float h = std::min(times[k] / 0.05f, 1.0f) * height;
+                if (h <= 0) continue;
+                float halfWidth = (k == 0 ? 0.4f : 0.2f) * width / bars;
+                mat4 M = mat4(
+                              halfWidth / quadHalf, 0.0, 0.0, 0.0,
+                              0.0, h * 0.5 / quadHalf, 0.0, 0.0,
+                              0.0, 0.0, 1.0, 0.0,
+                              x, bottom + h * 0.5, 0.0, 1.0);
+                shader->UploadM(M);
+                if (k == 1) shader->UploadColor(vec4(0.2, 0.4, 1));
+                else if (times[k] < 1.0 / 60) shader->UploadColor(vec4(0, 0.8, 0));
+                else if (times[k] < 1.0 / 30) shader->UploadColor(vec4(0.9, 0.8, 0));
+                else shader->UploadColor(vec4(0.9, 0, 0));
+                quad->Submit();
+            }
+        }
+        quad->End();
+    }
+};
+
+Profiler profiler;
+
+// RAII markers, e.g. CpuZone zone("Scene::Draw");
+struct CpuZone
+{
+    int index;
+    CpuZone(const char* name) { index = profiler.BeginCpu(name); }
+    ~CpuZone() { profiler.EndCpu(index); }
+};
+
+struct GpuZone
+{
+    bool begun;
+    GpuZone(const char* name) { begun = profiler.BeginGpu(name); }
+    ~GpuZone() { if (begun) profiler.EndGpu(); }
 };
 
 class Scene {
@@ -886,8 +2382,8 @@ public:
         shader = new Shader();
         textureShader = new TexturedShader();
         
-        asteroid = new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/GemSwap/GemSwap/asteroid.png");
-        fireball = new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/GemSwap/GemSwap/fireball.png");
+        asteroid = textureLoader.Load("asteroid.png", TextureOptions(TEXTURE_BC3));
+        fireball = textureLoader.Load("fireball.png", TextureOptions(TEXTURE_BC3));
         
         
         
@@ -1036,6 +2532,7 @@ public:
     }
     
     void ThreeInARow() {
+        CpuZone zone("Scene::ThreeInARow");
         if (activateThree) {
         for (int i = 0; i < 10; i++) {
             for (int j = 0; j < 10; j++) {
@@ -1074,12 +2571,40 @@ public:
     
     void Draw()
     {
+        CpuZone zone("Scene::Draw");
+        GpuZone gpuZone("Scene::Draw");
+        
+        // gems sharing a mesh are submitted back to back, so shader, material
+        // and vertex state are set once per mesh instead of once per gem
+        for (size_t k = 0; k < meshes.size(); k++) {
+            bool begun = false;
+            for (int j = 0; j < 10; j++) {
+                for (int i = 0; i < 10; i++) {
+                    if (grid[j][i]->GetMesh() != meshes[k]) continue;
+                    if (!begun) {
+                        grid[j][i]->Run();
+                        meshes[k]->Begin();
+                        begun = true;
+                    }
+                    grid[j][i]->UploadAttributes();
+                    meshes[k]->Submit();
+                }
+            }
+            if (begun) meshes[k]->End();
+        }
+        
+        // a gem whose mesh was never registered is still drawn, on its own
         for (int j = 0; j < 10; j++) {
             for (int i = 0; i < 10; i++) {
-                grid[j][i]->Draw();
+                if (std::find(meshes.begin(), meshes.end(), grid[j][i]->GetMesh()) == meshes.end()) grid[j][i]->Draw();
             }
         }
     }
+    
+    void DrawOverlay()
+    {
+        profiler.DrawOverlay(shader, geometries[1]);
+    }
 };
 
 Scene scene;
@@ -1090,6 +2615,11 @@ void onInitialization()
     for(int i = 0; i < 256; i++) keyboardState[i] = false;
     
     glViewport(0, 0, windowWidth, windowHeight);
+    // large JPEGs decode across the pool
+    stbi_set_parallel_for(ThreadPool::ParallelForCallback, &threadPool);
+    stbi_set_post_process(imagePostProcess);
+    // one open for every image; without the archive they are read loose
+    assets.Open(assetDirectory + "assets.pak");
     scene.Initialize();
     
 }
@@ -1133,14 +2663,19 @@ void onDisplay()
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
     
     scene.Draw();
+    scene.DrawOverlay();
     
     glutSwapBuffers(); // exchange the two buffers
+    profiler.EndFrame();
     
 }
 
 void onKeyboard(unsigned char key, int x, int y)
 {
     keyboardState[key] = true;
+    
+    if (key == 'p') profiler.WriteTrace("gemswap-trace.json");
+    if (key == 'o') profiler.overlay = !profiler.overlay;
 }
 
 void onKeyboardUp(unsigned char key, int x, int y)
@@ -1166,8 +2701,19 @@ void onIdle( ) {
     // store time
     lastTime = t;
     
-    camera.Move(dt);
-    camera.Quake();
+    profiler.BeginFrame();
+    CpuZone zone("onIdle");
+    
+    {
+        CpuZone uploadZone("TextureLoader::Update");
+        textureLoader.Update(0.002);
+    }
+    
+    {
+        CpuZone cameraZone("Camera");
+        camera.Move(dt);
+        camera.Quake();
+    }
     scene.QuakeBye();
     scene.ThreeInARow();
     
@@ -1177,6 +2723,8 @@ void onIdle( ) {
 int main(int argc, char * argv[])
 {
     glutInit(&argc, argv);
+    assetDirectory = findAssetDirectory(argc, argv);
+    printf("Assets       : %s\n", assetDirectory.empty() ? "./" : assetDirectory.c_str());
 #if !defined(__APPLE__)
     glutInitContextVersion(majorVersion, minorVersion);
 #endif
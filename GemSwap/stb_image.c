@@ -20,6 +20,17 @@
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
       - overridable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      - SSE2/AVX2 PNG unfiltering on x86, picked at runtime (define STBI_NO_SIMD to remove)
+      - SSE2 JPEG IDCT, upsampling and YCbCr-to-RGB on x86, same output as the C code
+      - SSSE3/AVX2 conversion between 1-4 components for req_comp, in place when shrinking
+      - 8-bit to float through a lookup table; SSE2 RGBE expansion and float to 8-bit
+      - JPEG restart intervals and color conversion, and Adam7 PNG passes, spread over your threads (stbi_set_parallel_for)
+      - JPEG decoding at 1/2, 1/4 or 1/8 size in the IDCT (stbi_load_scaled)
+      - incremental PNG/JPEG/GIF decoding row by row as data arrives (stbi_stream)
+      - animated GIFs a frame at a time, with delays and disposal (stbi_gif_anim)
+      - vertical flip, premultiplied alpha, BGR order and sRGB curves applied as rows are written (stbi_set_post_process)
+      - decoder scratch memory kept between loads, so batches make almost no heap calls (stbi_context)
+      - BMP, TGA, PSD and PIC read a row or run at a time, with SSSE3/AVX2 BGR swizzles
 
    Latest revisions:
       1.33 (2011-07-14) minor fixes suggested by Dave Moore
@@ -34,9 +45,6 @@
 
    See end of file for full revision history.
 
-   TODO:
-      stbi_info support for BMP,PSD,HDR,PIC
-
 
  ============================    Contributors    =========================
 
@@ -195,6 +203,8 @@
 
 #define STBI_VERSION 1
 
+#include <stddef.h> // size_t
+
 enum
 {
    STBI_default = 0, // only used for req_comp
@@ -264,12 +274,65 @@ extern int      stbi_is_hdr_from_file(FILE *f);
 
 
 // get a VERY brief reason for failure
-// NOT THREADSAFE
+// the reason is kept per thread, so it describes this thread's last failure
 extern const char *stbi_failure_reason  (void);
 
-// free the loaded image -- this is just free()
+// free the loaded image -- this is free(), or the allocator's free if one is set
 extern void     stbi_image_free      (void *retval_from_stbi_load);
 
+// route every allocation (results and scratch memory) through custom
+// functions; pass NULL to go back to malloc/realloc/free. Memory returned
+// by the library must then be released with stbi_image_free. Set this
+// before any thread starts decoding; the functions themselves must be
+// threadsafe if several threads decode at once.
+typedef struct
+{
+   void *(*malloc)  (void *user, size_t size);
+   void *(*realloc) (void *user, void *p, size_t size);
+   void  (*free)    (void *user, void *p);
+   void *user;
+} stbi_allocator;
+
+extern void     stbi_set_allocator   (stbi_allocator const *allocator);
+
+// decode straight into caller memory, e.g. a mapped pixel buffer: first ask
+// for the size in bytes (x*y*req_comp, or x*y*comp if req_comp is 0; 0 on
+// failure), then decode into a buffer at least that large. The _into
+// functions return 1 on success, 0 on failure.
+extern int      stbi_required_size_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_load_from_memory_into    (stbi_uc const *buffer, int len, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+
+#ifndef STBI_NO_STDIO
+extern int      stbi_required_size   (char const *filename, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_load_into       (char const *filename, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+#endif
+
+// decode at 1/scale size (scale is 1, 2, 4 or 8; sizes round up), e.g. for
+// previews and low mip levels. JPEGs are reduced inside the IDCT, so they
+// take a fraction of the time and memory of a full decode; other formats
+// are decoded in full and box-filtered down.
+extern stbi_uc *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale);
+
+#ifndef STBI_NO_STDIO
+extern stbi_uc *stbi_load_scaled     (char const *filename, int *x, int *y, int *comp, int req_comp, int scale);
+#endif
+
+// a decoder context keeps the decoders' temporary memory (inflate output,
+// JPEG component planes, line buffers, ...) from one load to the next, so
+// loading many images makes about one heap call each, for the result, once
+// the context has grown to fit the largest. Results are still freed with
+// stbi_image_free. A context is for one thread at a time; give each loading
+// thread its own.
+typedef struct stbi_context stbi_context;
+
+extern stbi_context *stbi_context_create (void);
+extern void          stbi_context_destroy(stbi_context *ctx);
+extern stbi_uc      *stbi_load_from_memory_ctx(stbi_context *ctx, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+
+#ifndef STBI_NO_STDIO
+extern stbi_uc      *stbi_load_ctx       (stbi_context *ctx, char const *filename, int *x, int *y, int *comp, int req_comp);
+#endif
+
 // get image dimensions & components without fully decoding
 extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 extern int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
@@ -280,6 +343,45 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 
 #endif
 
+// incremental decoding of PNG, JPEG and GIF, for data that arrives a piece
+// at a time: feed bytes as they come, and 'row' is called with each row
+// (top to bottom, req_comp components or else the count stbi_stream_info
+// gives) as soon as it can be decoded. Memory stays at a few rows plus the compressed
+// data they need, except for interlaced PNGs and GIFs and multi-scan JPEGs,
+// which are kept whole and decoded when the input ends; iPhone PNGs are not
+// supported. stbi_stream_feed returns 0 on errors (see stbi_failure_reason);
+// call it with len 0 when the input ends, since the last rows can wait for
+// that. stbi_stream_info works once the header has arrived, e.g. from the
+// first row callback. GIFs give their first frame, as stbi_load does. With
+// STBI_FLIP_VERTICALLY (see stbi_set_post_process) rows still arrive top
+// first, but y counts from the bottom.
+typedef struct stbi_stream stbi_stream;
+typedef void (*stbi_stream_row)(void *user, int y, stbi_uc const *row);
+
+extern stbi_stream *stbi_stream_begin(int req_comp, stbi_stream_row row, void *user);
+extern int          stbi_stream_feed (stbi_stream *st, stbi_uc const *data, int len);
+extern int          stbi_stream_info (stbi_stream *st, int *x, int *y, int *comp);
+extern int          stbi_stream_done (stbi_stream *st); // all rows passed on
+extern void         stbi_stream_end  (stbi_stream *st); // frees it, done or not
+
+// animated GIFs, decoded a frame at a time as they are shown. Each call to
+// stbi_gif_anim_next draws the next frame over the ones before it (keeping
+// what its transparent pixels cover, and undoing the previous frame as its
+// disposal method says) and returns the whole canvas, x*y RGBA, with the
+// post-processing of stbi_set_post_process applied. The canvas belongs to
+// 'anim' and stays valid until the next call. It returns NULL after the
+// last frame or on errors (see stbi_failure_reason); rewind to loop. The
+// memory passed to stbi_gif_anim_open_memory must outlive 'anim'.
+typedef struct stbi_gif_anim stbi_gif_anim;
+
+extern stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y);
+#ifndef STBI_NO_STDIO
+extern stbi_gif_anim *stbi_gif_anim_open  (char const *filename, int *x, int *y);
+#endif
+extern stbi_uc       *stbi_gif_anim_next  (stbi_gif_anim *anim, int *delay_ms);
+extern void           stbi_gif_anim_rewind(stbi_gif_anim *anim);
+extern void           stbi_gif_anim_close (stbi_gif_anim *anim);
+
 
 
 // for image formats that explicitly notate that they have premultiplied alpha,
@@ -291,6 +393,40 @@ extern void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply
 // or just pass them through "as-is"
 extern void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
+// the settings above (and the hdr gamma/scale) are process-wide, and are
+// meant to be set before decoding starts; every decode works from a copy
+// taken when it begins. A thread that wants its own settings calls this
+// with 1: it gets a copy of the current process-wide settings, and from
+// then on the setters called on that thread only affect that thread.
+extern void stbi_set_thread_local_settings(int flag_true_if_thread_local);
+
+// 1 if several threads may decode at once; 0 when the compiler has no
+// thread-local storage, and callers must then decode one at a time
+extern int stbi_is_thread_safe(void);
+
+// the library has no threads of its own, but can spread large decodes over
+// yours: 'run' must call task(arg, i) once for every i in [0,count), on any
+// threads and in any order, and return once all of them have finished.
+// Tasks never allocate, and do not call back into 'run'. Used for JPEGs
+// with restart markers and for interlaced PNGs; NULL (the default) decodes
+// on the calling thread.
+typedef void (*stbi_parallel_for)(void *user, void (*task)(void *arg, int index), void *arg, int count);
+extern void stbi_set_parallel_for(stbi_parallel_for run, void *user);
+
+// post-processing of 8-bit results, a combination of the flags below. It is
+// done as the decoder writes out each row (after converting to req_comp),
+// so it does not cost another pass over the image. Swapping is ignored
+// for grey images and premultiplying for images without alpha. The sRGB
+// curves apply to the colour channels only and come before premultiplying;
+// at 8 bits, STBI_SRGB_TO_LINEAR loses precision in the darks. Float loads
+// (stbi_loadf) ignore these.
+#define STBI_FLIP_VERTICALLY     1   // bottom row first, as glTexImage2D expects
+#define STBI_PREMULTIPLY_ALPHA   2   // colour times alpha; premultiplied iPhone PNGs are left as they are
+#define STBI_SWAP_RB             4   // BGR(A) order
+#define STBI_SRGB_TO_LINEAR      8
+#define STBI_LINEAR_TO_SRGB     16
+extern void stbi_set_post_process(int flags);
+
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -317,6 +453,8 @@ typedef void (*stbi_YCbCr_to_RGB_run)(stbi_uc *output, stbi_uc const  *y, stbi_u
 //     cb: Cb input channel; scale/biased to be 0..255
 //     cr: Cr input channel; scale/biased to be 0..255
 
+// installed functions replace the built-in ones, which already use SSE2
+// where the CPU has it; install NULL to go back to those
 extern void stbi_install_idct(stbi_idct_8x8 func);
 extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #endif // STBI_SIMD
@@ -333,8 +471,8 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 
 #ifndef STBI_HEADER_FILE_ONLY
 
+#include <math.h>  // ldexp, pow (also for the sRGB curves)
 #ifndef STBI_NO_HDR
-#include <math.h>  // ldexp
 #include <string.h> // strcmp, strtok
 #endif
 
@@ -342,10 +480,20 @@ extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #include <stdio.h>
 #endif
 #include <stdlib.h>
+#include <stddef.h> // offsetof
 #include <memory.h>
 #include <assert.h>
 #include <stdarg.h>
 
+// stbi_load and stbi_loadf map the file and decode it in place where possible
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define STBI_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifndef _MSC_VER
    #ifdef __cplusplus
    #define stbi_inline inline
@@ -364,6 +512,11 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+#ifdef _MSC_VER
+typedef unsigned __int64 uint64;
+#else
+typedef unsigned long long uint64;
+#endif
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
@@ -374,6 +527,23 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
 
 #define STBI_NOTUSED(v)  (void)sizeof(v)
 
+// per-thread state (the failure reason, thread-local settings); define
+// STBI_THREAD_LOCAL yourself for compilers not listed here
+#ifndef STBI_THREAD_LOCAL
+   #if defined(__cplusplus) && __cplusplus >= 201103L
+      #define STBI_THREAD_LOCAL thread_local
+   #elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+      #define STBI_THREAD_LOCAL _Thread_local
+   #elif defined(__GNUC__)
+      #define STBI_THREAD_LOCAL __thread
+   #elif defined(_MSC_VER)
+      #define STBI_THREAD_LOCAL __declspec(thread)
+   #else
+      #define STBI_THREAD_LOCAL  // no thread-local storage: not threadsafe
+      #define STBI__NO_THREAD_LOCAL
+   #endif
+#endif
+
 #ifdef _MSC_VER
 #define STBI_HAS_LROTL
 #endif
@@ -384,6 +554,292 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
    #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
 #endif
 
+// 16-byte aligned locals, for blocks handed to SIMD kernels
+#if defined(_MSC_VER)
+   #define STBI__ALIGN16  __declspec(align(16))
+#elif defined(__GNUC__)
+   #define STBI__ALIGN16  __attribute__((aligned(16)))
+#else
+   #define STBI__ALIGN16
+#endif
+
+// x86 SIMD kernels are compiled in unless STBI_NO_SIMD is defined, and picked
+// at runtime from CPUID, so the library still runs on machines without them.
+// The SSE2 kernels are compiled for the baseline target, so 32-bit builds
+// get them only when SSE2 is enabled (-msse2, /arch:SSE2)
+#if !defined(STBI_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define STBI_SSE2
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+   // allows SSSE3/AVX2 intrinsics in individual functions without -mavx2
+   #define STBI__TARGET(x)  __attribute__((target(x)))
+#else
+   #define STBI__TARGET(x)
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+enum
+{
+   STBI__CPU_SSE2  = 1,
+   STBI__CPU_AVX2  = 2,
+   STBI__CPU_SSSE3 = 4
+};
+
+// cached per thread, so no thread ever reads a half-initialised value
+static STBI_THREAD_LOCAL int stbi__cpu_flags = -1;
+
+static int stbi__cpu(void)
+{
+   if (stbi__cpu_flags < 0) {
+      int flags = 0;
+   #ifdef _MSC_VER
+      int info[4];
+      __cpuid(info, 1);
+      if (info[3] & (1 << 26)) flags |= STBI__CPU_SSE2;
+      if (info[2] & (1 <<  9)) flags |= STBI__CPU_SSSE3;
+      // AVX2 also needs the OS to save ymm state (OSXSAVE + XCR0)
+      if ((info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+         __cpuidex(info, 7, 0);
+         if (info[1] & (1 << 5)) flags |= STBI__CPU_AVX2;
+      }
+   #else
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("sse2")) flags |= STBI__CPU_SSE2;
+      if (__builtin_cpu_supports("ssse3")) flags |= STBI__CPU_SSSE3;
+      if (__builtin_cpu_supports("avx2")) flags |= STBI__CPU_AVX2;
+   #endif
+      stbi__cpu_flags = flags;
+   }
+   return stbi__cpu_flags;
+}
+#endif // STBI_SSE2
+
+///////////////////////////////////////////////
+//
+//  memory
+
+// all zero means the C library
+static stbi_allocator allocator;
+
+static void *stbi__malloc(size_t size)
+{
+   if (allocator.malloc) return allocator.malloc(allocator.user, size);
+   return malloc(size);
+}
+
+static void *stbi__realloc(void *p, size_t size)
+{
+   if (allocator.realloc) return allocator.realloc(allocator.user, p, size);
+   return realloc(p, size);
+}
+
+static void stbi__free(void *p)
+{
+   if (allocator.free) { if (p) allocator.free(allocator.user, p); }
+   else free(p);
+}
+
+///////////////////////////////////////////////
+//
+//  scratch arena (see stbi_context)
+//
+// Scratch blocks are carved off the end of a chunk and all released at once
+// when a decode ends; freeing or growing the last block works in place, and
+// freeing any other block does nothing. A decode that outgrows the chunk
+// gets more chunks, and the reset after it swaps them all for one chunk of
+// the peak size, so the next decode like it makes no heap calls at all.
+// Every block is preceded by its size, and 16-byte aligned.
+
+#define STBI__ARENA_HEADER  16
+
+typedef struct stbi_arena_chunk
+{
+   struct stbi_arena_chunk *next;
+   size_t size, used;
+} stbi_arena_chunk;
+
+typedef struct
+{
+   stbi_arena_chunk *chunks;  // the one blocks come from first
+   size_t total, peak;        // bytes in use now, and the most this decode
+} stbi_arena;
+
+static uint8 *arena_data(stbi_arena_chunk *c)
+{
+   return (uint8 *) c + ((sizeof(*c) + 15) & ~15);
+}
+
+static stbi_arena_chunk *arena_chunk(size_t size)
+{
+   stbi_arena_chunk *c = (stbi_arena_chunk *) stbi__malloc(((sizeof(*c) + 15) & ~15) + size);
+   if (c == NULL) return NULL;
+   c->next = NULL;
+   c->size = size;
+   c->used = 0;
+   return c;
+}
+
+static void *arena_malloc(stbi_arena *a, size_t size)
+{
+   stbi_arena_chunk *c = a->chunks;
+   size_t need = STBI__ARENA_HEADER + ((size + 15) & ~(size_t) 15);
+   uint8 *block;
+   if (c == NULL || c->size - c->used < need) {
+      size_t grow = c ? c->size * 2 : 65536;
+      c = arena_chunk(need > grow ? need : grow);
+      if (c == NULL) return NULL;
+      c->next = a->chunks;
+      a->chunks = c;
+   }
+   block = arena_data(c) + c->used;
+   *(size_t *) block = need;
+   c->used += need;
+   a->total += need;
+   if (a->total > a->peak) a->peak = a->total;
+   return block + STBI__ARENA_HEADER;
+}
+
+// whether p is the last block of the current chunk
+static int arena_is_last(stbi_arena *a, void *p)
+{
+   stbi_arena_chunk *c = a->chunks;
+   uint8 *block = (uint8 *) p - STBI__ARENA_HEADER;
+   return c && block + *(size_t *) block == arena_data(c) + c->used;
+}
+
+static void arena_free(stbi_arena *a, void *p)
+{
+   if (p && arena_is_last(a, p)) {
+      size_t need = *(size_t *) ((uint8 *) p - STBI__ARENA_HEADER);
+      a->chunks->used -= need;
+      a->total -= need;
+   }
+}
+
+static void *arena_realloc(stbi_arena *a, void *p, size_t size)
+{
+   uint8 *block;
+   size_t have, need = STBI__ARENA_HEADER + ((size + 15) & ~(size_t) 15);
+   void *q;
+   if (p == NULL) return arena_malloc(a, size);
+   block = (uint8 *) p - STBI__ARENA_HEADER;
+   have = *(size_t *) block;
+   if (need <= have) return p;
+   if (arena_is_last(a, p) && a->chunks->size - a->chunks->used >= need - have) {
+      a->chunks->used += need - have;
+      a->total += need - have;
+      if (a->total > a->peak) a->peak = a->total;
+      *(size_t *) block = need;
+      return p;
+   }
+   q = arena_malloc(a, size);
+   if (q == NULL) return NULL;
+   memcpy(q, p, have - STBI__ARENA_HEADER);
+   arena_free(a, p);
+   return q;
+}
+
+// releases every block; called between decodes
+static void arena_reset(stbi_arena *a)
+{
+   stbi_arena_chunk *c = a->chunks;
+   if (c && c->next) {
+      while (c) {
+         stbi_arena_chunk *next = c->next;
+         stbi__free(c);
+         c = next;
+      }
+      a->chunks = arena_chunk(a->peak);  // NULL is fine, it regrows
+   }
+   if (a->chunks) a->chunks->used = 0;
+   a->total = 0;
+   a->peak = 0;
+}
+
+static void arena_release(stbi_arena *a)
+{
+   arena_reset(a);
+   stbi__free(a->chunks);
+   a->chunks = NULL;
+}
+
+// decoders get their temporary buffers here: from the arena when decoding
+// through a stbi_context, and from the heap otherwise
+static void *scratch_malloc(stbi_arena *a, size_t size)
+{
+   return a ? arena_malloc(a, size) : stbi__malloc(size);
+}
+
+static void *scratch_realloc(stbi_arena *a, void *p, size_t size)
+{
+   return a ? arena_realloc(a, p, size) : stbi__realloc(p, size);
+}
+
+static void scratch_free(stbi_arena *a, void *p)
+{
+   if (a) arena_free(a, p); else stbi__free(p);
+}
+
+///////////////////////////////////////////////
+//
+//  settings
+
+typedef struct
+{
+   int png_partial;
+   int unpremultiply_on_load;
+   int de_iphone;
+   float h2l_gamma_i, h2l_scale_i;
+   float l2h_gamma, l2h_scale;
+   stbi_parallel_for parallel_for;
+   void *parallel_user;
+   int post;  // STBI_FLIP_VERTICALLY etc.
+} stbi_settings;
+
+static stbi_settings settings_global = { 0, 0, 0, 1.0f/2.2f, 1.0f, 2.2f, 1.0f, NULL, NULL, 0 };
+static STBI_THREAD_LOCAL stbi_settings settings_local;
+static STBI_THREAD_LOCAL int settings_local_active;
+
+int stbi_png_partial; // only decode the first row of a PNG; for real incremental decoding see stbi_stream
+
+// the settings the setters change on this thread
+static stbi_settings *settings_current(void)
+{
+   return settings_local_active ? &settings_local : &settings_global;
+}
+
+void stbi_set_thread_local_settings(int flag_true_if_thread_local)
+{
+   if (flag_true_if_thread_local && !settings_local_active)
+      settings_local = settings_global;
+   settings_local_active = flag_true_if_thread_local;
+}
+
+int stbi_is_thread_safe(void)
+{
+#ifdef STBI__NO_THREAD_LOCAL
+   return 0;
+#else
+   return 1;
+#endif
+}
+
+void stbi_set_parallel_for(stbi_parallel_for run, void *user)
+{
+   settings_current()->parallel_for  = run;
+   settings_current()->parallel_user = user;
+}
+
+void stbi_set_post_process(int flags)
+{
+   settings_current()->post = flags;
+}
+
 ///////////////////////////////////////////////
 //
 //  stbi struct and start_xxx functions
@@ -404,14 +860,76 @@ typedef struct
 
    uint8 *img_buffer, *img_buffer_end;
    uint8 *img_buffer_original;
+   int overrun;  // a read went past the end of memory input (see stbi_stream)
+
+   // caller memory to decode into (see result_malloc)
+   uint8 *target;
+   size_t target_size;
+   int target_used;
+
+   // requested downscale as a shift; a decoder that applies it itself
+   // sets scale_done (see load_scaled_main)
+   int scale_shift, scale_done;
+
+   // a decoder that did settings.post itself, while writing its rows, sets
+   // post_done (see stbi_load_main)
+   int post_done;
+
+   // where scratch_malloc gets memory; NULL for the heap (see stbi_context)
+   stbi_arena *arena;
+
+   // copied when decoding starts, so changing them mid-decode is harmless
+   stbi_settings settings;
 } stbi;
 
+// allocates a buffer that may become the returned image. When decoding into
+// caller memory, the first request of exactly the final size gets that
+// memory, so the decoder writes its result in place.
+static void *result_malloc(stbi *s, size_t size)
+{
+   if (s->target && !s->target_used && size == s->target_size) {
+      s->target_used = 1;
+      return s->target;
+   }
+   return stbi__malloc(size);
+}
+
+// frees a buffer from result_malloc; caller memory is never freed
+static void result_free(stbi *s, void *p)
+{
+   if (p != s->target) stbi__free(p);
+}
+
 
 static void refill_buffer(stbi *s);
 
+// state shared by every kind of context
+static void start_common(stbi *s)
+{
+   s->target = NULL;
+   s->arena = NULL;
+   s->scale_shift = s->scale_done = 0;
+   s->post_done = 0;
+   s->overrun = 0;
+   s->settings = *settings_current();
+   s->settings.png_partial = stbi_png_partial;
+}
+
+// runs task(arg, 0..count-1), on the caller's threads if it gave us some
+static void stbi_parallel(stbi *s, void (*task)(void *arg, int index), void *arg, int count)
+{
+   int i;
+   if (s->settings.parallel_for && count > 1)
+      s->settings.parallel_for(s->settings.parallel_user, task, arg, count);
+   else
+      for (i=0; i < count; ++i)
+         task(arg, i);
+}
+
 // initialize a memory-decode context
 static void start_mem(stbi *s, uint8 const *buffer, int len)
 {
+   start_common(s);
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (uint8 *) buffer;
@@ -421,11 +939,12 @@ static void start_mem(stbi *s, uint8 const *buffer, int len)
 // initialize a callback-based context
 static void start_callbacks(stbi *s, stbi_io_callbacks *c, void *user)
 {
+   start_common(s);
    s->io = *c;
    s->io_user_data = user;
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
-   s->img_buffer_original = s->buffer_start;
+   s->img_buffer = s->img_buffer_end = s->img_buffer_original = s->buffer_start;
    refill_buffer(s);
 }
 
@@ -492,8 +1011,8 @@ static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp);
 static int      stbi_gif_info(stbi *s, int *x, int *y, int *comp);
 
 
-// this is not threadsafe
-static const char *failure_reason;
+// kept per thread, so concurrent decodes do not overwrite each other's errors
+static STBI_THREAD_LOCAL const char *failure_reason;
 
 const char *stbi_failure_reason(void)
 {
@@ -523,15 +1042,24 @@ static int e(const char *str)
 
 void stbi_image_free(void *retval_from_stbi_load)
 {
-   free(retval_from_stbi_load);
+   stbi__free(retval_from_stbi_load);
+}
+
+void stbi_set_allocator(stbi_allocator const *a)
+{
+   if (a) allocator = *a;
+   else   memset(&allocator, 0, sizeof(allocator));
 }
 
 #ifndef STBI_NO_HDR
-static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
-static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
+static float   *ldr_to_hdr(stbi *s, stbi_uc *data, int x, int y, int comp);
+static stbi_uc *hdr_to_ldr(stbi *s, float   *data, int x, int y, int comp);
 #endif
 
-static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+static int stbi_info_main(stbi *s, int *x, int *y, int *comp);
+static void post_image(stbi *s, stbi_uc *data, int n, int w, int h);
+
+static unsigned char *load_by_type(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
    if (stbi_jpeg_test(s)) return stbi_jpeg_load(s,x,y,comp,req_comp);
    if (stbi_png_test(s))  return stbi_png_load(s,x,y,comp,req_comp);
@@ -543,7 +1071,8 @@ static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req
    #ifndef STBI_NO_HDR
    if (stbi_hdr_test(s)) {
       float *hdr = stbi_hdr_load(s, x,y,comp,req_comp);
-      return hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+      if (hdr == NULL) return NULL;
+      return hdr_to_ldr(s, hdr, *x, *y, req_comp ? req_comp : *comp);
    }
    #endif
 
@@ -553,11 +1082,60 @@ static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req
    return epuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
+static unsigned char *stbi_load_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   int n;
+   unsigned char *result = load_by_type(s,x,y,&n,req_comp);
+   if (result == NULL) return NULL;
+   // the decoders that don't post-process as they go get a pass here
+   if (s->settings.post && !s->post_done)
+      post_image(s, result, req_comp ? req_comp : n, *x, *y);
+   if (comp) *comp = n;
+   return result;
+}
+
+#ifdef STBI_MMAP
+// maps a whole file read-only; anything that cannot be mapped (pipes, empty
+// files, files over 2GB) returns NULL and is read through stdio instead
+static uint8 *map_file(char const *filename, int *len)
+{
+   struct stat st;
+   void *p;
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) return NULL;
+   if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+      close(fd);
+      return NULL;
+   }
+   p = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (p == MAP_FAILED) return NULL;
+   madvise(p, (size_t) st.st_size, MADV_SEQUENTIAL);
+   *len = (int) st.st_size;
+   return (uint8 *) p;
+}
+
+static void unmap_file(uint8 *p, int len)
+{
+   munmap(p, (size_t) len);
+}
+#endif // STBI_MMAP
+
 #ifndef STBI_NO_STDIO
 unsigned char *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = fopen(filename, "rb");
+   FILE *f;
    unsigned char *result;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_load_from_memory(map, len, x, y, comp, req_comp);
+      unmap_file(map, len);
+      return result;
+   }
+   #endif
+   f = fopen(filename, "rb");
    if (!f) return epuc("can't fopen", "Unable to open file");
    result = stbi_load_from_file(f,x,y,comp,req_comp);
    fclose(f);
@@ -586,84 +1164,344 @@ unsigned char *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *use
    return stbi_load_main(&s,x,y,comp,req_comp);
 }
 
-#ifndef STBI_NO_HDR
+// byte size of the decoded image, from the header alone
+static int required_size_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   int w, h, n;
+   size_t size;
+   if (req_comp < 0 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (!stbi_info_main(s, &w, &h, &n)) return 0;
+   size = (size_t) w * h * (req_comp ? req_comp : n);
+   if (size == 0 || size > 0x7fffffff) return e("too large", "Image too large to decode");
+   if (x) *x = w;
+   if (y) *y = h;
+   if (comp) *comp = n;
+   return (int) size;
+}
 
-float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+// decodes with the caller's buffer as the target of result_malloc; a
+// decoder whose final buffer did not come from there is copied over
+static int load_into_main(stbi *s, stbi_uc *out, int out_size, int expected, int *x, int *y, int *comp, int req_comp)
 {
-   unsigned char *data;
-   #ifndef STBI_NO_HDR
-   if (stbi_hdr_test(s))
-      return stbi_hdr_load(s,x,y,comp,req_comp);
-   #endif
-   data = stbi_load_main(s, x, y, comp, req_comp);
-   if (data)
-      return ldr_to_hdr(data, *x, *y, req_comp ? req_comp : *comp);
-   return epf("unknown image type", "Image not of any known type, or corrupt");
+   int w, h, n;
+   size_t size;
+   unsigned char *result;
+   s->target = out;
+   s->target_size = expected;
+   s->target_used = 0;
+   result = stbi_load_main(s, &w, &h, &n, req_comp);
+   if (result == NULL) return 0;
+   if (result != out) {
+      size = (size_t) w * h * (req_comp ? req_comp : n);
+      if (size > (size_t) out_size) {
+         stbi__free(result);
+         return e("buffer too small", "Output buffer too small for image");
+      }
+      memcpy(out, result, size);
+      stbi__free(result);
+   }
+   if (x) *x = w;
+   if (y) *y = h;
+   if (comp) *comp = n;
+   return 1;
 }
 
-float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+// averages each (1<<shift)-square of pixels; squares cut off by the right
+// and bottom edges average only the pixels they cover
+static uint8 *box_downsample(stbi *s, uint8 *data, int w, int h, int n, int shift)
+{
+   int i,j,k,x,y, w2 = (w + (1<<shift)-1) >> shift, h2 = (h + (1<<shift)-1) >> shift;
+   uint8 *out = (uint8 *) result_malloc(s, w2 * h2 * n);
+   if (out == NULL) { stbi__free(data); return epuc("outofmem", "Out of memory"); }
+   for (j=0; j < h2; ++j) {
+      int y0 = j << shift, y1 = (y0 + (1<<shift)) < h ? y0 + (1<<shift) : h;
+      for (i=0; i < w2; ++i) {
+         int x0 = i << shift, x1 = (x0 + (1<<shift)) < w ? x0 + (1<<shift) : w;
+         int count = (x1-x0) * (y1-y0);
+         for (k=0; k < n; ++k) {
+            int sum = count >> 1;
+            for (y=y0; y < y1; ++y)
+               for (x=x0; x < x1; ++x)
+                  sum += data[(y*w + x)*n + k];
+            out[(j*w2 + i)*n + k] = (uint8) (sum / count);
+         }
+      }
+   }
+   stbi__free(data);
+   return out;
+}
+
+static unsigned char *load_scaled_main(stbi *s, int *x, int *y, int *comp, int req_comp, int scale)
 {
-   stbi s;
-   start_mem(&s,buffer,len);
-   return stbi_loadf_main(&s,x,y,comp,req_comp);
+   int w, h, n;
+   unsigned char *result;
+   for (s->scale_shift=0; s->scale_shift < 3 && (1 << s->scale_shift) != scale; ++s->scale_shift)
+      ;
+   if ((1 << s->scale_shift) != scale) return epuc("bad scale", "Scale must be 1, 2, 4 or 8");
+   result = stbi_load_main(s, &w, &h, &n, req_comp);
+   if (result == NULL) return NULL;
+   if (s->scale_shift && !s->scale_done) {
+      result = box_downsample(s, result, w, h, req_comp ? req_comp : n, s->scale_shift);
+      if (result == NULL) return NULL;
+      w = (w + scale-1) >> s->scale_shift;
+      h = (h + scale-1) >> s->scale_shift;
+   }
+   *x = w;
+   *y = h;
+   if (comp) *comp = n;
+   return result;
 }
 
-float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+unsigned char *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale)
 {
    stbi s;
-   start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
-   return stbi_loadf_main(&s,x,y,comp,req_comp);
+   start_mem(&s,buffer,len);
+   return load_scaled_main(&s,x,y,comp,req_comp,scale);
 }
 
 #ifndef STBI_NO_STDIO
-float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+unsigned char *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale)
 {
-   FILE *f = fopen(filename, "rb");
-   float *result;
-   if (!f) return epf("can't fopen", "Unable to open file");
-   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
+   FILE *f;
+   stbi s;
+   unsigned char *result;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_load_scaled_from_memory(map, len, x, y, comp, req_comp, scale);
+      unmap_file(map, len);
+      return result;
+   }
+   #endif
+   f = fopen(filename, "rb");
+   if (!f) return epuc("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = load_scaled_main(&s,x,y,comp,req_comp,scale);
    fclose(f);
    return result;
 }
+#endif // !STBI_NO_STDIO
 
-float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+int stbi_required_size_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
 {
    stbi s;
-   start_file(&s,f);
-   return stbi_loadf_main(&s,x,y,comp,req_comp);
+   start_mem(&s,buffer,len);
+   return required_size_main(&s,x,y,comp,req_comp);
 }
-#endif // !STBI_NO_STDIO
-
-#endif // !STBI_NO_HDR
-
-// these is-hdr-or-not is defined independent of whether STBI_NO_HDR is
-// defined, for API simplicity; if STBI_NO_HDR is defined, it always
-// reports false!
 
-int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+int stbi_load_from_memory_into(stbi_uc const *buffer, int len, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
 {
-   #ifndef STBI_NO_HDR
    stbi s;
+   int size = stbi_required_size_from_memory(buffer,len,NULL,NULL,NULL,req_comp);
+   if (size == 0) return 0;
+   if (size > out_size) return e("buffer too small", "Output buffer too small for image");
    start_mem(&s,buffer,len);
-   return stbi_hdr_test(&s);
-   #else
-   STBI_NOTUSED(buffer);
-   STBI_NOTUSED(len);
-   return 0;
-   #endif
+   return load_into_main(&s,out,out_size,size,x,y,comp,req_comp);
 }
 
 #ifndef STBI_NO_STDIO
-extern int      stbi_is_hdr          (char const *filename)
+int stbi_required_size(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = fopen(filename, "rb");
-   int result=0;
-   if (f) {
-      result = stbi_is_hdr_from_file(f);
-      fclose(f);
+   FILE *f;
+   stbi s;
+   int result;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_required_size_from_memory(map, len, x, y, comp, req_comp);
+      unmap_file(map, len);
+      return result;
    }
-   return result;
-}
+   #endif
+   f = fopen(filename, "rb");
+   if (!f) return e("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = required_size_main(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_load_into(char const *filename, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   stbi s;
+   int size, result = 0;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_load_from_memory_into(map, len, out, out_size, x, y, comp, req_comp);
+      unmap_file(map, len);
+      return result;
+   }
+   #endif
+   f = fopen(filename, "rb");
+   if (!f) return e("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   size = required_size_main(&s,NULL,NULL,NULL,req_comp);
+   if (size > out_size)
+      e("buffer too small", "Output buffer too small for image");
+   else if (size != 0) {
+      fseek(f, 0, SEEK_SET);
+      start_file(&s,f);
+      result = load_into_main(&s,out,out_size,size,x,y,comp,req_comp);
+   }
+   fclose(f);
+   return result;
+}
+#endif // !STBI_NO_STDIO
+
+struct stbi_context
+{
+   stbi_arena arena;
+};
+
+stbi_context *stbi_context_create(void)
+{
+   stbi_context *ctx = (stbi_context *) stbi__malloc(sizeof(*ctx));
+   if (ctx == NULL) return (stbi_context *) epuc("outofmem", "Out of memory");
+   memset(ctx, 0, sizeof(*ctx));
+   return ctx;
+}
+
+void stbi_context_destroy(stbi_context *ctx)
+{
+   if (ctx == NULL) return;
+   arena_release(&ctx->arena);
+   stbi__free(ctx);
+}
+
+static unsigned char *load_ctx_main(stbi_context *ctx, stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   s->arena = &ctx->arena;
+   result = stbi_load_main(s,x,y,comp,req_comp);
+   arena_reset(&ctx->arena);
+   return result;
+}
+
+unsigned char *stbi_load_from_memory_ctx(stbi_context *ctx, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return load_ctx_main(ctx,&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+unsigned char *stbi_load_ctx(stbi_context *ctx, char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   stbi s;
+   unsigned char *result;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_load_from_memory_ctx(ctx, map, len, x, y, comp, req_comp);
+      unmap_file(map, len);
+      return result;
+   }
+   #endif
+   f = fopen(filename, "rb");
+   if (!f) return epuc("can't fopen", "Unable to open file");
+   start_file(&s,f);
+   result = load_ctx_main(ctx,&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+#endif // !STBI_NO_STDIO
+
+#ifndef STBI_NO_HDR
+
+float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *data;
+   #ifndef STBI_NO_HDR
+   if (stbi_hdr_test(s))
+      return stbi_hdr_load(s,x,y,comp,req_comp);
+   #endif
+   s->settings.post = 0;
+   data = stbi_load_main(s, x, y, comp, req_comp);
+   if (data)
+      return ldr_to_hdr(s, data, *x, *y, req_comp ? req_comp : *comp);
+   return epf("unknown image type", "Image not of any known type, or corrupt");
+}
+
+float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_loadf_main(&s,x,y,comp,req_comp);
+}
+
+float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi_loadf_main(&s,x,y,comp,req_comp);
+}
+
+#ifndef STBI_NO_STDIO
+float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f;
+   float *result;
+   #ifdef STBI_MMAP
+   int len;
+   uint8 *map = map_file(filename, &len);
+   if (map) {
+      result = stbi_loadf_from_memory(map, len, x, y, comp, req_comp);
+      unmap_file(map, len);
+      return result;
+   }
+   #endif
+   f = fopen(filename, "rb");
+   if (!f) return epf("can't fopen", "Unable to open file");
+   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+float *stbi_loadf_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_file(&s,f);
+   return stbi_loadf_main(&s,x,y,comp,req_comp);
+}
+#endif // !STBI_NO_STDIO
+
+#endif // !STBI_NO_HDR
+
+// these is-hdr-or-not is defined independent of whether STBI_NO_HDR is
+// defined, for API simplicity; if STBI_NO_HDR is defined, it always
+// reports false!
+
+int stbi_is_hdr_from_memory(stbi_uc const *buffer, int len)
+{
+   #ifndef STBI_NO_HDR
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_hdr_test(&s);
+   #else
+   STBI_NOTUSED(buffer);
+   STBI_NOTUSED(len);
+   return 0;
+   #endif
+}
+
+#ifndef STBI_NO_STDIO
+extern int      stbi_is_hdr          (char const *filename)
+{
+   FILE *f = fopen(filename, "rb");
+   int result=0;
+   if (f) {
+      result = stbi_is_hdr_from_file(f);
+      fclose(f);
+   }
+   return result;
+}
 
 extern int      stbi_is_hdr_from_file(FILE *f)
 {
@@ -689,14 +1527,11 @@ extern int      stbi_is_hdr_from_callbacks(stbi_io_callbacks const *clbk, void *
 }
 
 #ifndef STBI_NO_HDR
-static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
-static float l2h_gamma=2.2f, l2h_scale=1.0f;
+void   stbi_hdr_to_ldr_gamma(float gamma) { settings_current()->h2l_gamma_i = 1/gamma; }
+void   stbi_hdr_to_ldr_scale(float scale) { settings_current()->h2l_scale_i = 1/scale; }
 
-void   stbi_hdr_to_ldr_gamma(float gamma) { h2l_gamma_i = 1/gamma; }
-void   stbi_hdr_to_ldr_scale(float scale) { h2l_scale_i = 1/scale; }
-
-void   stbi_ldr_to_hdr_gamma(float gamma) { l2h_gamma = gamma; }
-void   stbi_ldr_to_hdr_scale(float scale) { l2h_scale = scale; }
+void   stbi_ldr_to_hdr_gamma(float gamma) { settings_current()->l2h_gamma = gamma; }
+void   stbi_ldr_to_hdr_scale(float scale) { settings_current()->l2h_scale = scale; }
 #endif
 
 
@@ -709,17 +1544,18 @@ enum
 {
    SCAN_load=0,
    SCAN_type,
-   SCAN_header
+   SCAN_header,
+   SCAN_stream   // png: stop at the first IDAT, see stbi_stream
 };
 
 static void refill_buffer(stbi *s)
 {
    int n = (s->io.read)(s->io_user_data,(char*)s->buffer_start,s->buflen);
    if (n == 0) {
-      // at end of file, treat same as if from memory
+      // at end of file, treat same as if from memory. The buffer is left as
+      // it is: after the format tests, stbi_rewind reads it again
       s->read_from_callbacks = 0;
-      s->img_buffer = s->img_buffer_end-1;
-      *s->img_buffer = 0;
+      s->img_buffer = s->img_buffer_end;
    } else {
       s->img_buffer = s->buffer_start;
       s->img_buffer_end = s->buffer_start + n;
@@ -732,20 +1568,19 @@ stbi_inline static int get8(stbi *s)
       return *s->img_buffer++;
    if (s->read_from_callbacks) {
       refill_buffer(s);
-      return *s->img_buffer++;
+      if (s->img_buffer < s->img_buffer_end)
+         return *s->img_buffer++;
    }
+   s->overrun = 1;
    return 0;
 }
 
 stbi_inline static int at_eof(stbi *s)
 {
-   if (s->io.read) {
-      if (!(s->io.eof)(s->io_user_data)) return 0;
-      // if feof() is true, check if buffer = end
-      // special case: we've only got the special 0 character at the end
-      if (s->read_from_callbacks == 0) return 1;
-   }
-
+   if (s->img_buffer < s->img_buffer_end) return 0;
+   if (!s->read_from_callbacks || (s->io.eof)(s->io_user_data)) return 1;
+   // feof() only turns true once a read comes up short, so try one
+   refill_buffer(s);
    return s->img_buffer >= s->img_buffer_end;
 }
 
@@ -756,7 +1591,14 @@ stbi_inline static uint8 get8u(stbi *s)
 
 static void skip(stbi *s, int n)
 {
-   if (s->io.read) {
+   if (n < 0) {
+      // a corrupt length; the input ends here, from memory or callbacks alike
+      s->img_buffer = s->img_buffer_end;
+      s->read_from_callbacks = 0;
+      s->overrun = 1;
+      return;
+   }
+   if (s->read_from_callbacks) {
       int blen = s->img_buffer_end - s->img_buffer;
       if (blen < n) {
          s->img_buffer = s->img_buffer_end;
@@ -764,12 +1606,17 @@ static void skip(stbi *s, int n)
          return;
       }
    }
-   s->img_buffer += n;
+   // a corrupt length must not move past the end of the data
+   if (n > s->img_buffer_end - s->img_buffer) {
+      s->img_buffer = s->img_buffer_end;
+      s->overrun = 1;
+   } else
+      s->img_buffer += n;
 }
 
 static int getn(stbi *s, stbi_uc *buffer, int n)
 {
-   if (s->io.read) {
+   if (s->read_from_callbacks) {
       int blen = s->img_buffer_end - s->img_buffer;
       if (blen < n) {
          int res, count;
@@ -787,8 +1634,43 @@ static int getn(stbi *s, stbi_uc *buffer, int n)
       memcpy(buffer, s->img_buffer, n);
       s->img_buffer += n;
       return 1;
-   } else
+   } else {
+      s->overrun = 1;
       return 0;
+   }
+}
+
+// reads n bytes exactly as n calls to get8 would, zeros past the end and
+// all, so the loaders can fetch a row or a run at a time without decoding
+// short files any differently
+static void getn_pad(stbi *s, stbi_uc *buffer, int n)
+{
+   while (n > 0) {
+      int blen = (int) (s->img_buffer_end - s->img_buffer);
+      if (blen > 0) {
+         if (blen > n) blen = n;
+         memcpy(buffer, s->img_buffer, blen);
+         s->img_buffer += blen;
+         buffer += blen;
+         n -= blen;
+         continue;
+      }
+      if (!s->read_from_callbacks) break;
+      if (n >= s->buflen) {
+         // too big for the buffer, so read it straight into place
+         int count = (s->io.read)(s->io_user_data, (char *) buffer, n);
+         if (count > 0) {
+            buffer += count;
+            n -= count;
+            continue;
+         }
+      }
+      refill_buffer(s);
+   }
+   if (n > 0) {
+      memset(buffer, 0, n);
+      s->overrun = 1;
+   }
 }
 
 static int get16(stbi *s)
@@ -831,79 +1713,555 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
-static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
+#ifdef STBI_SSE2
+// The conversions that only move bytes are pshufb table lookups: a step
+// loads 16 bytes holding 'pixels' source pixels, and writes 'stores'
+// 16-byte vectors, the last of which may be partly garbage that the next
+// step overwrites. Loads come before stores and no store reaches past the
+// next step's load, so converting to fewer components works in place.
+typedef struct
 {
-   int i,j;
+   uint8 img_n, req_comp, pixels, stores;
+   uint8 shuffle[4][16];  // 0x80 gives 0
+   uint8 fill[4][16];     // or'ed in after, for alpha = 255
+} stbi_convert_shuffle;
+
+static const stbi_convert_shuffle convert_shuffles[] =
+{
+   { 1,2,16,2, { {0,0x80,1,0x80,2,0x80,3,0x80,4,0x80,5,0x80,6,0x80,7,0x80}, {8,0x80,9,0x80,10,0x80,11,0x80,12,0x80,13,0x80,14,0x80,15,0x80} },
+               { {0,255,0,255,0,255,0,255,0,255,0,255,0,255,0,255}, {0,255,0,255,0,255,0,255,0,255,0,255,0,255,0,255} } },
+   { 1,3,16,3, { {0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5}, {5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10}, {10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15} },
+               { {0} } },
+   { 1,4,16,4, { {0,0,0,0x80,1,1,1,0x80,2,2,2,0x80,3,3,3,0x80}, {4,4,4,0x80,5,5,5,0x80,6,6,6,0x80,7,7,7,0x80},
+                 {8,8,8,0x80,9,9,9,0x80,10,10,10,0x80,11,11,11,0x80}, {12,12,12,0x80,13,13,13,0x80,14,14,14,0x80,15,15,15,0x80} },
+               { {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255}, {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255},
+                 {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255}, {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255} } },
+   { 2,1, 8,1, { {0,2,4,6,8,10,12,14,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80} },
+               { {0} } },
+   { 2,3, 8,2, { {0,0,0,2,2,2,4,4,4,6,6,6,8,8,8,10}, {10,10,12,12,12,14,14,14,0x80,0x80,0x80,0x80,0x80,0x80,0x80,0x80} },
+               { {0} } },
+   { 2,4, 8,2, { {0,0,0,1,2,2,2,3,4,4,4,5,6,6,6,7}, {8,8,8,9,10,10,10,11,12,12,12,13,14,14,14,15} },
+               { {0} } },
+   { 3,4, 4,1, { {0,1,2,0x80,3,4,5,0x80,6,7,8,0x80,9,10,11,0x80} },
+               { {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255} } },
+   { 4,3, 4,1, { {0,1,2,4,5,6,8,9,10,12,13,14,0x80,0x80,0x80,0x80} },
+               { {0} } },
+};
+
+// BGR(A) to RGB(A), for the formats that store blue first (BMP, TGA)
+static const stbi_convert_shuffle swizzle_shuffles[] =
+{
+   { 3,3, 4,1, { {2,1,0,5,4,3,8,7,6,11,10,9,0x80,0x80,0x80,0x80} },
+               { {0} } },
+   { 3,4, 4,1, { {2,1,0,0x80,5,4,3,0x80,8,7,6,0x80,11,10,9,0x80} },
+               { {0,0,0,255,0,0,0,255,0,0,0,255,0,0,0,255} } },
+   { 4,3, 4,1, { {2,1,0,6,5,4,10,9,8,14,13,12,0x80,0x80,0x80,0x80} },
+               { {0} } },
+   { 4,4, 4,1, { {2,1,0,3,6,5,4,7,10,9,8,11,14,13,12,15} },
+               { {0} } },
+};
+
+STBI__TARGET("ssse3")
+static int convert_row_shuffle_ssse3(stbi_convert_shuffle const *t, uint8 *dest, uint8 const *src, int x)
+{
+   int i, k, n = t->img_n, m = t->req_comp;
+   __m128i shuffle[4], fill[4];
+   for (k=0; k < t->stores; ++k) {
+      shuffle[k] = _mm_loadu_si128((__m128i const *) t->shuffle[k]);
+      fill[k]    = _mm_loadu_si128((__m128i const *) t->fill[k]);
+   }
+   for (i=0; i*n + 16 <= x*n && i*m + 16*t->stores <= x*m; i += t->pixels) {
+      __m128i v = _mm_loadu_si128((__m128i const *) (src + i*n));
+      for (k=0; k < t->stores; ++k)
+         _mm_storeu_si128((__m128i *) (dest + i*m + 16*k), _mm_or_si128(_mm_shuffle_epi8(v, shuffle[k]), fill[k]));
+   }
+   return i;
+}
+
+// two stores' worth per 32-byte store: either the 16 loaded bytes in both
+// lanes with the masks of two consecutive stores, or for single-store steps
+// two steps side by side, with the lanes' results moved together when they
+// are shorter than 16 bytes
+STBI__TARGET("avx2")
+static int convert_row_shuffle_avx2(stbi_convert_shuffle const *t, uint8 *dest, uint8 const *src, int x)
+{
+   int i, k, n = t->img_n, m = t->req_comp, p = t->pixels, pairs = (t->stores + 1) / 2;
+   __m256i shuffle[2], fill[2];
+   if (t->stores == 1) {
+      __m256i compact = p*m == 12 ? _mm256_setr_epi32(0,1,2,4,5,6,7,7) : _mm256_setr_epi32(0,1,4,5,2,3,6,7);
+      shuffle[0] = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) t->shuffle[0]));
+      fill[0]    = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) t->fill[0]));
+      for (i=0; (i+p)*n + 16 <= x*n && i*m + 32 <= x*m; i += 2*p) {
+         __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*n))),
+                                             _mm_loadu_si128((__m128i const *) (src + (i+p)*n)), 1);
+         v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle[0]), fill[0]);
+         if (p*m != 16) v = _mm256_permutevar8x32_epi32(v, compact);
+         _mm256_storeu_si256((__m256i *) (dest + i*m), v);
+      }
+      return i;
+   }
+   for (k=0; k < pairs; ++k) {
+      // with an odd count the last upper half writes junk, which the loop
+      // bound keeps inside the row for the next step to overwrite
+      shuffle[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) t->shuffle[2*k])),
+                                           _mm_loadu_si128((__m128i const *) t->shuffle[2*k+1]), 1);
+      fill[k]    = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) t->fill[2*k])),
+                                           _mm_loadu_si128((__m128i const *) t->fill[2*k+1]), 1);
+   }
+   for (i=0; i*n + 16 <= x*n && i*m + 32*pairs <= x*m; i += p) {
+      __m256i v = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) (src + i*n)));
+      for (k=0; k < pairs; ++k)
+         _mm256_storeu_si256((__m256i *) (dest + i*m + 32*k), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle[k]), fill[k]));
+   }
+   return i;
+}
+
+// RGB(A) to grey(+alpha), eight pixels a step: RGB is first shuffled to
+// RGBx, then channels are split out of 32-bit lanes into 16-bit ones, where
+// the sum is exactly compute_y's
+STBI__TARGET("ssse3")
+static int convert_row_grey_ssse3(uint8 *dest, uint8 const *src, int img_n, int req_comp, int x)
+{
+   __m128i to_rgbx = _mm_loadu_si128((__m128i const *) convert_shuffles[6].shuffle[0]);
+   __m128i low = _mm_set1_epi32(255), opaque = _mm_set1_epi16((short) 0xff00);
+   __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29);
+   int i;
+   for (i=0; i*img_n + (img_n == 3 ? 28 : 32) <= x*img_n; i += 8) {
+      uint8 const *p = src + i*img_n;
+      __m128i a, b, r, g, bl, y;
+      if (img_n == 3) {
+         a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) p), to_rgbx);
+         b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (p + 12)), to_rgbx);
+      } else {
+         a = _mm_loadu_si128((__m128i const *) p);
+         b = _mm_loadu_si128((__m128i const *) (p + 16));
+      }
+      r  = _mm_packs_epi32(_mm_and_si128(a, low), _mm_and_si128(b, low));
+      g  = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 8), low), _mm_and_si128(_mm_srli_epi32(b, 8), low));
+      bl = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a, 16), low), _mm_and_si128(_mm_srli_epi32(b, 16), low));
+      y  = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg)), _mm_mullo_epi16(bl, wb));
+      y  = _mm_srli_epi16(y, 8);
+      if (req_comp == 1)
+         _mm_storel_epi64((__m128i *) (dest + i), _mm_packus_epi16(y, y));
+      else if (img_n == 3)
+         _mm_storeu_si128((__m128i *) (dest + i*2), _mm_or_si128(y, opaque));
+      else
+         _mm_storeu_si128((__m128i *) (dest + i*2), _mm_or_si128(y, _mm_slli_epi16(_mm_packs_epi32(_mm_srli_epi32(a, 24), _mm_srli_epi32(b, 24)), 8)));
+   }
+   return i;
+}
+
+// the same, sixteen pixels a step; the in-lane packs leave the pixels in
+// the order 0-3 8-11 4-7 12-15, which a cross-lane permute puts right
+STBI__TARGET("avx2")
+static int convert_row_grey_avx2(uint8 *dest, uint8 const *src, int img_n, int req_comp, int x)
+{
+   __m256i to_rgbx = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *) convert_shuffles[6].shuffle[0]));
+   __m256i low = _mm256_set1_epi32(255), opaque = _mm256_set1_epi16((short) 0xff00);
+   __m256i wr = _mm256_set1_epi16(77), wg = _mm256_set1_epi16(150), wb = _mm256_set1_epi16(29);
+   __m256i order = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+   int i;
+   for (i=0; i*img_n + (img_n == 3 ? 52 : 64) <= x*img_n; i += 16) {
+      uint8 const *p = src + i*img_n;
+      __m256i a, b, r, g, bl, y;
+      if (img_n == 3) {
+         a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) p)),
+                                     _mm_loadu_si128((__m128i const *) (p + 12)), 1);
+         b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((__m128i const *) (p + 24))),
+                                     _mm_loadu_si128((__m128i const *) (p + 36)), 1);
+         a = _mm256_shuffle_epi8(a, to_rgbx);
+         b = _mm256_shuffle_epi8(b, to_rgbx);
+      } else {
+         a = _mm256_loadu_si256((__m256i const *) p);
+         b = _mm256_loadu_si256((__m256i const *) (p + 32));
+      }
+      r  = _mm256_packs_epi32(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+      g  = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 8), low), _mm256_and_si256(_mm256_srli_epi32(b, 8), low));
+      bl = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(a, 16), low), _mm256_and_si256(_mm256_srli_epi32(b, 16), low));
+      y  = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, wr), _mm256_mullo_epi16(g, wg)), _mm256_mullo_epi16(bl, wb));
+      y  = _mm256_srli_epi16(y, 8);
+      if (req_comp == 1) {
+         y = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(y, y), order);
+         _mm_storeu_si128((__m128i *) (dest + i), _mm256_castsi256_si128(y));
+      } else {
+         if (img_n == 3)
+            y = _mm256_or_si256(y, opaque);
+         else
+            y = _mm256_or_si256(y, _mm256_slli_epi16(_mm256_packs_epi32(_mm256_srli_epi32(a, 24), _mm256_srli_epi32(b, 24)), 8));
+         _mm256_storeu_si256((__m256i *) (dest + i*2), _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3,1,2,0)));
+      }
+   }
+   return i;
+}
+
+// runs the entry of the table for img_n to req_comp, if it has one, over as
+// many of the x pixels as it takes, returns how many
+static int convert_row_table(stbi_convert_shuffle const *table, int count, uint8 *dest, uint8 const *src, int img_n, int req_comp, int x)
+{
+   int i = 0, k;
+   for (k=0; k < count; ++k) {
+      stbi_convert_shuffle const *t = &table[k];
+      if (t->img_n != img_n || t->req_comp != req_comp) continue;
+      if (stbi__cpu() & STBI__CPU_AVX2) i = convert_row_shuffle_avx2(t, dest, src, x);
+      return i + convert_row_shuffle_ssse3(t, dest + i*req_comp, src + i*img_n, x - i);
+   }
+   return 0;
+}
+
+// converts as many of the x pixels as the kernels take, returns how many
+static int convert_row_simd(uint8 *dest, uint8 const *src, int img_n, int req_comp, int x)
+{
+   int cpu = stbi__cpu(), i = 0;
+   if (!(cpu & STBI__CPU_SSSE3)) return 0;
+   if (img_n >= 3 && req_comp <= 2) {
+      if (cpu & STBI__CPU_AVX2) i = convert_row_grey_avx2(dest, src, img_n, req_comp, x);
+      return i + convert_row_grey_ssse3(dest + i*req_comp, src + i*img_n, img_n, req_comp, x - i);
+   }
+   return convert_row_table(convert_shuffles, sizeof(convert_shuffles) / sizeof(convert_shuffles[0]), dest, src, img_n, req_comp, x);
+}
+
+static int swizzle_row_simd(uint8 *dest, uint8 const *src, int img_n, int req_comp, int x)
+{
+   if (!(stbi__cpu() & STBI__CPU_SSSE3)) return 0;
+   return convert_row_table(swizzle_shuffles, sizeof(swizzle_shuffles) / sizeof(swizzle_shuffles[0]), dest, src, img_n, req_comp, x);
+}
+#endif // STBI_SSE2
+
+// converts x pixels with img_n components to req_comp components
+static void convert_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, uint x)
+{
+   int i;
+   #ifdef STBI_SSE2
+   int done = convert_row_simd(dest, src, img_n, req_comp, (int) x);
+   dest += done * req_comp;
+   src  += done * img_n;
+   x    -= done;
+   #endif
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
+// converts x pixels of BGR or BGRA to RGB or RGBA, alpha 255 if it is added
+static void swizzle_row(unsigned char *dest, unsigned char const *src, int img_n, int req_comp, int x)
+{
+   int i;
+   #ifdef STBI_SSE2
+   int done = swizzle_row_simd(dest, src, img_n, req_comp, x);
+   dest += done * req_comp;
+   src  += done * img_n;
+   x    -= done;
+   #endif
+   for (i=0; i < x; ++i, src += img_n, dest += req_comp) {
+      dest[0] = src[2];
+      dest[1] = src[1];
+      dest[2] = src[0];
+      if (req_comp == 4) dest[3] = img_n == 4 ? src[3] : 255;
+   }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  post-processing (stbi_set_post_process), one row at a time, so decoders
+//  can do it on each row as they write it out
+
+typedef struct
+{
+   int flags, n;
+   uint8 lut[256];  // sRGB <-> linear for the colour channels
+} stbi_post;
+
+// sets up for n-component rows, returns the flags that have any effect
+static int post_start(stbi_post *p, int flags, int n)
+{
+   int i;
+   if (n < 3) flags &= ~STBI_SWAP_RB;
+   if (n & 1) flags &= ~STBI_PREMULTIPLY_ALPHA;
+   if ((flags & STBI_SRGB_TO_LINEAR) && (flags & STBI_LINEAR_TO_SRGB))
+      flags &= ~(STBI_SRGB_TO_LINEAR | STBI_LINEAR_TO_SRGB);
+   for (i=0; i < 256 && (flags & (STBI_SRGB_TO_LINEAR | STBI_LINEAR_TO_SRGB)); ++i) {
+      float c = i / 255.0f;
+      if (flags & STBI_SRGB_TO_LINEAR)
+         c = c <= 0.04045f ? c / 12.92f : (float) pow((c + 0.055f) / 1.055f, 2.4f);
+      else
+         c = c <= 0.0031308f ? c * 12.92f : 1.055f * (float) pow(c, 1/2.4f) - 0.055f;
+      p->lut[i] = (uint8) (c * 255 + 0.5f);
+   }
+   p->flags = flags;
+   p->n = n;
+   return flags;
+}
+
+// c*a/255, rounded
+static uint8 premultiply(int c, int a)
+{
+   int t = c*a + 128;
+   return (uint8) ((t + (t >> 8)) >> 8);
+}
+
+#ifdef STBI_SSE2
+// swap and premultiply for RGBA, four pixels at a time in 16-bit lanes;
+// returns how many pixels it did
+static int post_row_rgba_sse2(int flags, uint8 *dest, uint8 const *src, int w)
+{
+   __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+   __m128i alpha = _mm_set_epi16(-1,0,0,0,-1,0,0,0);
+   int i;
+   for (i=0; i+4 <= w; i += 4) {
+      __m128i px = _mm_loadu_si128((__m128i const *) (src + i*4));
+      __m128i lo = _mm_unpacklo_epi8(px, zero);
+      __m128i hi = _mm_unpackhi_epi8(px, zero);
+      if (flags & STBI_SWAP_RB) {
+         lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+         hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3,0,1,2)), _MM_SHUFFLE(3,0,1,2));
+      }
+      if (flags & STBI_PREMULTIPLY_ALPHA) {
+         __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+         __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+         // same rounding as premultiply(); alpha itself is kept
+         __m128i tlo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), half);
+         __m128i thi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), half);
+         tlo = _mm_srli_epi16(_mm_add_epi16(tlo, _mm_srli_epi16(tlo, 8)), 8);
+         thi = _mm_srli_epi16(_mm_add_epi16(thi, _mm_srli_epi16(thi, 8)), 8);
+         lo = _mm_or_si128(_mm_and_si128(alpha, lo), _mm_andnot_si128(alpha, tlo));
+         hi = _mm_or_si128(_mm_and_si128(alpha, hi), _mm_andnot_si128(alpha, thi));
+      }
+      _mm_storeu_si128((__m128i *) (dest + i*4), _mm_packus_epi16(lo, hi));
+   }
+   return i;
+}
+#endif // STBI_SSE2
+
+// post-processes w pixels from src into dest, which may be the same row;
+// flipping is up to the caller, which picks the row to write
+static void post_row(stbi_post *p, uint8 *dest, uint8 const *src, int w)
+{
+   int i=0, k, n = p->n, color = n < 3 ? 1 : 3;
+   if (!(p->flags & ~STBI_FLIP_VERTICALLY)) {
+      if (dest != src) memcpy(dest, src, w * n);
+      return;
+   }
+   #ifdef STBI_SSE2
+   if (n == 4 && !(p->flags & (STBI_SRGB_TO_LINEAR | STBI_LINEAR_TO_SRGB)) && (stbi__cpu() & STBI__CPU_SSE2)) {
+      i = post_row_rgba_sse2(p->flags, dest, src, w);
+      src += i*n;
+      dest += i*n;
+   }
+   #endif
+   for (; i < w; ++i, src += n, dest += n) {
+      uint8 c[4];
+      for (k=0; k < n; ++k) c[k] = src[k];
+      if (p->flags & STBI_SWAP_RB) {
+         uint8 t = c[0]; c[0] = c[2]; c[2] = t;
+      }
+      if (p->flags & (STBI_SRGB_TO_LINEAR | STBI_LINEAR_TO_SRGB))
+         for (k=0; k < color; ++k) c[k] = p->lut[c[k]];
+      if (p->flags & STBI_PREMULTIPLY_ALPHA)
+         for (k=0; k < color; ++k) c[k] = premultiply(c[k], c[n-1]);
+      for (k=0; k < n; ++k) dest[k] = c[k];
+   }
+}
+
+// post-processes a finished image in place, for decoders that can't do it
+// as they go; flipping swaps rows a piece at a time through the stack
+static void post_image(stbi *s, uint8 *data, int n, int w, int h)
+{
+   stbi_post p;
+   uint8 tmp[256*4];
+   int i, j, m, stride = n * w, piece = sizeof(tmp) / n;
+   if (!post_start(&p, s->settings.post, n)) return;
+   if (!(p.flags & STBI_FLIP_VERTICALLY)) {
+      for (j=0; j < h; ++j)
+         post_row(&p, data + j*stride, data + j*stride, w);
+      return;
+   }
+   for (j=0; j < h/2; ++j) {
+      uint8 *top = data + j*stride, *bottom = data + (h-1-j)*stride;
+      for (i=0; i < w; i += m) {
+         m = w - i < piece ? w - i : piece;
+         post_row(&p, tmp, top + i*n, m);
+         post_row(&p, top + i*n, bottom + i*n, m);
+         memcpy(bottom + i*n, tmp, m*n);
+      }
+   }
+   if (h & 1)
+      post_row(&p, data + (h/2)*stride, data + (h/2)*stride, w);
+}
+
+// converts to req_comp components, post-processing each row as it goes.
+// Dropping components without flipping goes in place, since every row
+// then starts at or before where its source did; the buffer is shrunk
+// after, unless it has to end up in caller memory.
+static unsigned char *convert_format(stbi *s, unsigned char *data, int img_n, int req_comp, uint x, uint y)
+{
+   int j, in_place;
    unsigned char *good;
+   stbi_post p;
 
    if (req_comp == img_n) return data;
    assert(req_comp >= 1 && req_comp <= 4);
 
-   good = (unsigned char *) malloc(req_comp * x * y);
+   post_start(&p, s->settings.post, req_comp);
+   in_place = req_comp < img_n && !(p.flags & STBI_FLIP_VERTICALLY) && data != s->target && !(s->target && !s->target_used);
+   good = in_place ? data : (unsigned char *) result_malloc(s, req_comp * x * y);
    if (good == NULL) {
-      free(data);
+      result_free(s, data);
       return epuc("outofmem", "Out of memory");
    }
 
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
+      uint8 *dest = good + (p.flags & STBI_FLIP_VERTICALLY ? (int) y-1-j : j) * x * req_comp;
+      convert_row(dest, data + j * x * img_n, img_n, req_comp, x);
+      post_row(&p, dest, dest, x);
    }
+   s->post_done = 1;
 
-   free(data);
+   if (in_place) {
+      // realloc to 0 bytes would free it
+      good = x && y ? (unsigned char *) stbi__realloc(data, req_comp * x * y) : NULL;
+      return good ? good : data;
+   }
+   result_free(s, data);
    return good;
 }
 
 #ifndef STBI_NO_HDR
-static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
+// there are only 256 inputs, so each is converted once, not once per pixel
+static float   *ldr_to_hdr(stbi *s, stbi_uc *data, int x, int y, int comp)
 {
    int i,k,n;
-   float *output = (float *) malloc(x * y * comp * sizeof(float));
-   if (output == NULL) { free(data); return epf("outofmem", "Out of memory"); }
+   float colour[256], alpha[256];
+   float *output = (float *) stbi__malloc(x * y * comp * sizeof(float));
+   if (output == NULL) { stbi__free(data); return epf("outofmem", "Out of memory"); }
+   for (i=0; i < 256; ++i) {
+      colour[i] = (float) pow(i/255.0f, s->settings.l2h_gamma) * s->settings.l2h_scale;
+      alpha[i]  = i/255.0f;
+   }
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
-      for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, l2h_gamma) * l2h_scale;
-      }
-      if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
+      for (k=0; k < n; ++k)
+         output[i*comp + k] = colour[data[i*comp+k]];
+      if (k < comp) output[i*comp + k] = alpha[data[i*comp+k]];
    }
-   free(data);
+   stbi__free(data);
    return output;
 }
 
+#ifdef STBI_SSE2
+// pow(x,p) for x > 0 as exp2(p*log2(x)), with polynomials good to about
+// 1e-6 relative, far finer than the 1/255 steps the result is rounded to;
+// x <= 0 and NaN give 0
+static __m128 pow_ps(__m128 x, __m128 p)
+{
+   __m128i bits = _mm_castps_si128(x), i;
+   __m128 one = _mm_set1_ps(1.0f);
+   __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+   __m128 t = _mm_sub_ps(_mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x7fffff)), _mm_castps_si128(one))), one);
+   __m128 l, y, fi, f, r;
+
+   // log2(1+t) for t in [0,1)
+   l = _mm_set1_ps(-0.0257915274f);
+   l = _mm_add_ps(_mm_mul_ps(l, t), _mm_set1_ps( 0.1214707340f));
+   l = _mm_add_ps(_mm_mul_ps(l, t), _mm_set1_ps(-0.2773394316f));
+   l = _mm_add_ps(_mm_mul_ps(l, t), _mm_set1_ps( 0.4571571246f));
+   l = _mm_add_ps(_mm_mul_ps(l, t), _mm_set1_ps(-0.7180333966f));
+   l = _mm_add_ps(_mm_mul_ps(l, t), _mm_set1_ps( 1.4425347675f));
+   l = _mm_mul_ps(l, t);
+
+   // split into integer and fraction, staying inside normal floats
+   y  = _mm_mul_ps(p, _mm_add_ps(e, l));
+   y  = _mm_min_ps(_mm_max_ps(y, _mm_set1_ps(-126.0f)), _mm_set1_ps(127.0f));
+   fi = _mm_cvtepi32_ps(_mm_cvttps_epi32(y));
+   fi = _mm_sub_ps(fi, _mm_and_ps(_mm_cmpgt_ps(fi, y), one));
+   f  = _mm_sub_ps(y, fi);
+   i  = _mm_cvttps_epi32(fi);
+
+   // 2^f for f in [0,1)
+   r = _mm_set1_ps(0.0018951080f);
+   r = _mm_add_ps(_mm_mul_ps(r, f), _mm_set1_ps(0.0089462198f));
+   r = _mm_add_ps(_mm_mul_ps(r, f), _mm_set1_ps(0.0558632705f));
+   r = _mm_add_ps(_mm_mul_ps(r, f), _mm_set1_ps(0.2401407785f));
+   r = _mm_add_ps(_mm_mul_ps(r, f), _mm_set1_ps(0.6931546180f));
+   r = _mm_add_ps(_mm_mul_ps(r, f), _mm_set1_ps(0.9999998959f));
+   r = _mm_mul_ps(r, _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23)));
+
+   return _mm_and_ps(r, _mm_cmpgt_ps(x, _mm_setzero_ps()));
+}
+
+// sixteen floats a step; with 2 or 4 components the alpha ones fall in the
+// same lanes of every vector. The last partial step goes through a buffer,
+// so the whole image gets the same rounding.
+static void hdr_to_ldr_sse2(stbi_uc *out, float const *in, int count, int comp, float scale, float gamma)
+{
+   __m128 sv = _mm_set1_ps(scale), gv = _mm_set1_ps(gamma);
+   __m128 k255 = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+   __m128 alpha = _mm_castsi128_ps(comp == 2 ? _mm_setr_epi32(0,-1,0,-1) : comp == 4 ? _mm_setr_epi32(0,0,0,-1) : _mm_setzero_si128());
+   float tail[16];
+   stbi_uc tail_out[16];
+   int i, k;
+   for (i=0; i < count; i += 16) {
+      float const *p = in + i;
+      __m128i q[4], packed;
+      if (count - i < 16) {
+         memset(tail, 0, sizeof(tail));
+         memcpy(tail, in + i, (count - i) * sizeof(float));
+         p = tail;
+      }
+      for (k=0; k < 4; ++k) {
+         __m128 v = _mm_loadu_ps(p + 4*k);
+         __m128 c = pow_ps(_mm_mul_ps(v, sv), gv);
+         c = _mm_or_ps(_mm_and_ps(alpha, v), _mm_andnot_ps(alpha, c));
+         c = _mm_add_ps(_mm_mul_ps(c, k255), half);
+         c = _mm_min_ps(_mm_max_ps(c, zero), k255);  // maxps gives 0 for NaN
+         q[k] = _mm_cvttps_epi32(c);
+      }
+      packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+      if (p == tail) {
+         _mm_storeu_si128((__m128i *) tail_out, packed);
+         memcpy(out + i, tail_out, count - i);
+      } else
+         _mm_storeu_si128((__m128i *) (out + i), packed);
+   }
+}
+#endif // STBI_SSE2
+
 #define float2int(x)   ((int) (x))
-static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
+static stbi_uc *hdr_to_ldr(stbi *s, float   *data, int x, int y, int comp)
 {
    int i,k,n;
-   stbi_uc *output = (stbi_uc *) malloc(x * y * comp);
-   if (output == NULL) { free(data); return epuc("outofmem", "Out of memory"); }
+   stbi_uc *output = (stbi_uc *) result_malloc(s, x * y * comp);
+   if (output == NULL) { stbi__free(data); return epuc("outofmem", "Out of memory"); }
+   #ifdef STBI_SSE2
+   if (stbi__cpu() & STBI__CPU_SSE2) {
+      hdr_to_ldr_sse2(output, data, x * y * comp, comp, s->settings.h2l_scale_i, s->settings.h2l_gamma_i);
+      stbi__free(data);
+      return output;
+   }
+   #endif
    // compute number of non-alpha components
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
+         float z = (float) pow(data[i*comp+k]*s->settings.h2l_scale_i, s->settings.h2l_gamma_i) * 255 + 0.5f;
          if (z < 0) z = 0;
          if (z > 255) z = 255;
          output[i*comp + k] = (uint8) float2int(z);
@@ -915,7 +2273,7 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
          output[i*comp + k] = (uint8) float2int(z);
       }
    }
-   free(data);
+   stbi__free(data);
    return output;
 }
 #endif
@@ -961,15 +2319,31 @@ typedef struct
    int    delta[17];   // old 'firstsymbol' - old 'firstcode'
 } huffman;
 
+// installable IDCTs take 16-bit quantizers
+#ifdef STBI_SIMD
+typedef unsigned short stbi_dequantize_t;
+#else
+typedef uint8 stbi_dequantize_t;
+#endif
+
 typedef struct
 {
-   #ifdef STBI_SIMD
-   unsigned short dequant2[4][64];
-   #endif
    stbi *s;
    huffman huff_dc[4];
    huffman huff_ac[4];
-   uint8 dequant[4][64];
+   stbi_dequantize_t dequant[4][64];
+
+// kernels for this decode, see jpeg_select_kernels; the IDCT is indexed by
+// a component's scale shift
+   void   (*idct_block_kernel[4])(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize);
+   void   (*YCbCr_to_RGB_kernel)(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step);
+   uint8 *(*resample_row_hv_2_kernel)(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs);
+
+// the output is 1/(1 << scale_shift) of the image's size, see idct_block_4x4
+   int scale_shift;
+// if nonzero, the component planes hold this many MCU rows and are reused
+// as a ring, for the streaming decoder; otherwise they hold the whole image
+   int ring_mcu_rows;
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -986,6 +2360,7 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      int shift;     // blocks decode to (8 >> shift) pixels square
       uint8 *data;
       void *raw_data;
       uint8 *linebuf;
@@ -1059,7 +2434,7 @@ static void grow_buffer_unsafe(jpeg *j)
 }
 
 // (1 << n) - 1
-static uint32 bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
+static const uint32 bmask[17]={0,1,3,7,15,31,63,127,255,511,1023,2047,4095,8191,16383,32767,65535};
 
 // decode a jpeg huffman value from the bitstream
 stbi_inline static int decode(jpeg *j, huffman *h)
@@ -1140,7 +2515,7 @@ stbi_inline static int extend_receive(jpeg *j, int n)
 
 // given a value that's at position X in the zigzag stream,
 // where does it appear in the 8x8 matrix coded as row-major?
-static uint8 dezigzag[64+15] =
+static const uint8 dezigzag[64+15] =
 {
     0,  1,  8, 16,  9,  2,  3, 10,
    17, 24, 32, 25, 18, 11,  4,  5,
@@ -1242,12 +2617,6 @@ stbi_inline static uint8 clamp(int x)
    t1 += p2+p4;                                \
    t0 += p1+p3;
 
-#ifdef STBI_SIMD
-typedef unsigned short stbi_dequantize_t;
-#else
-typedef uint8 stbi_dequantize_t;
-#endif
-
 // .344 seconds on 3*anemones.jpg
 static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
 {
@@ -1310,8 +2679,279 @@ static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequanti
    }
 }
 
+// For downscaled decoding, the 8x8 block averaged down to n x n pixels is
+// an n-point IDCT, for a fraction of the work. Averaging two neighbouring
+// outputs of an 8-point IDCT leaves a 4-point one of the coefficients
+// folded: G(u) = F(u) cos(u*pi/16) - F(8-u) cos((8-u)*pi/16) for u = 1..3,
+// G(0) = F(0), and F(4) drops out; folding G the same way gives 2 points.
+// The IDCT constants are C(u) * cos((2x+1)u*pi/2n) scaled by 1<<12, with
+// C(0) = 1/sqrt(2); the 1/2 per axis of the 2-D IDCT leaves 1<<17 to remove
+// in all after the row pass, same as idct_block.
+#define IDCT_FOLD(a,b,ka,kb)  (((a) * (ka) - (b) * (kb) + 2048) >> 12)
+
+// dequantizes a block and folds it to the 4x4 coefficients; returns
+// nonzero if any but the DC term are
+static int idct_fold_4x4(int c[16], short data[64], stbi_dequantize_t *dq)
+{
+   int i,f[32],ac=0;
+   // columns: 8 coefficients down to 4 in each
+   for (i=0; i < 8; ++i) {
+      f[   i] = data[   i] * dq[   i];
+      f[ 8+i] = IDCT_FOLD(data[ 8+i] * dq[ 8+i], data[56+i] * dq[56+i], 4017,  799);
+      f[16+i] = IDCT_FOLD(data[16+i] * dq[16+i], data[48+i] * dq[48+i], 3784, 1567);
+      f[24+i] = IDCT_FOLD(data[24+i] * dq[24+i], data[40+i] * dq[40+i], 3406, 2276);
+   }
+   // then rows
+   for (i=0; i < 4; ++i) {
+      int *r = f + i*8;
+      c[i*4  ] = r[0];
+      c[i*4+1] = IDCT_FOLD(r[1], r[7], 4017,  799);
+      c[i*4+2] = IDCT_FOLD(r[2], r[6], 3784, 1567);
+      c[i*4+3] = IDCT_FOLD(r[3], r[5], 3406, 2276);
+   }
+   for (i=1; i < 16; ++i) ac |= c[i];
+   return ac;
+}
+
+static void idct_block_4x4(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dq)
+{
+   int i,c[16],val[16],*v;
+   // flat blocks are common and need no transform
+   if (!idct_fold_4x4(c, data, dq)) {
+      uint8 dc = clamp(((c[0] + 4) >> 3) + 128);
+      for (i=0; i < 4; ++i, out += out_stride)
+         out[0] = out[1] = out[2] = out[3] = dc;
+      return;
+   }
+   // columns, keeping 3 bits of the constants' precision
+   for (i=0; i < 4; ++i) {
+      int t0 = (c[i] + c[8+i]) * 2896 + 256, t1 = (c[i] - c[8+i]) * 2896 + 256;
+      int o0 = c[4+i] * 3784 + c[12+i] * 1567, o1 = c[4+i] * 1567 - c[12+i] * 3784;
+      val[   i] = (t0 + o0) >> 9;
+      val[12+i] = (t0 - o0) >> 9;
+      val[ 4+i] = (t1 + o1) >> 9;
+      val[ 8+i] = (t1 - o1) >> 9;
+   }
+   // rows, rounding and adding 128 to bring -128..127 to 0..255
+   for (i=0, v=val; i < 4; ++i, v += 4, out += out_stride) {
+      int t0 = (v[0] + v[2]) * 2896 + 65536 + (128<<17), t1 = (v[0] - v[2]) * 2896 + 65536 + (128<<17);
+      int o0 = v[1] * 3784 + v[3] * 1567, o1 = v[1] * 1567 - v[3] * 3784;
+      out[0] = clamp((t0 + o0) >> 17);
+      out[3] = clamp((t0 - o0) >> 17);
+      out[1] = clamp((t1 + o1) >> 17);
+      out[2] = clamp((t1 - o1) >> 17);
+   }
+}
+
+static void idct_block_2x2(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dq)
+{
+   int c[16], c0, c1, c8, c9, v0, v1, v2, v3;
+   idct_fold_4x4(c, data, dq);
+   // fold the 4x4 coefficients to 2x2, columns then rows
+   c0 = c[0];
+   c1 = IDCT_FOLD(c[1], c[3], 3784, 1567);
+   c8 = IDCT_FOLD(c[4], c[12], 3784, 1567);
+   c9 = IDCT_FOLD(IDCT_FOLD(c[5], c[13], 3784, 1567), IDCT_FOLD(c[7], c[15], 3784, 1567), 3784, 1567);
+   v0 = ((c0 + c8) * 2896 + 256) >> 9, v2 = ((c0 - c8) * 2896 + 256) >> 9;
+   v1 = ((c1 + c9) * 2896 + 256) >> 9, v3 = ((c1 - c9) * 2896 + 256) >> 9;
+   out[0]            = clamp(((v0 + v1) * 2896 + 65536 + (128<<17)) >> 17);
+   out[1]            = clamp(((v0 - v1) * 2896 + 65536 + (128<<17)) >> 17);
+   out[out_stride]   = clamp(((v2 + v3) * 2896 + 65536 + (128<<17)) >> 17);
+   out[out_stride+1] = clamp(((v2 - v3) * 2896 + 65536 + (128<<17)) >> 17);
+}
+
+// the block's average is just its DC term
+static void idct_block_1x1(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   STBI_NOTUSED(out_stride);
+   out[0] = clamp(((data[0] * dequantize[0] + 4) >> 3) + 128);
+}
+
+#ifdef STBI_SSE2
+// the same integer IDCT on eight columns (then rows) at once, 16-bit values
+// with 32-bit products via madd, so the output matches idct_block exactly
+// for any coefficients a valid stream can produce
+static void idct_block_sse2(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((short) (x),(short) (y),(short) (x),(short) (y),(short) (x),(short) (y),(short) (x),(short) (y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // interleave steps for the transposes
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   // one IDCT_1D on eight lanes; see the scalar macro for the algebra, the
+   // constant pairs are its multiplies folded together
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(f2f(0.5411961f), f2f(0.5411961f) + f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(f2f(0.5411961f) + f2f( 0.765366865f), f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(f2f(1.175875602f) + f2f(-0.899976223f), f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(f2f(1.175875602f), f2f(1.175875602f) + f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(f2f(-1.961570560f) + f2f( 0.298631336f), f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(f2f(-1.961570560f), f2f(-1.961570560f) + f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(f2f(-0.390180644f) + f2f( 2.053119869f), f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(f2f(-0.390180644f), f2f(-0.390180644f) + f2f( 1.501321110f));
+
+   // rounding biases of the two passes, as in idct_block
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load and dequantize
+   #ifdef STBI_SIMD
+   #define dct_load(k) \
+      _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + (k)*8)), \
+                      _mm_loadu_si128((const __m128i *) (dequantize + (k)*8)))
+   #else
+   #define dct_load(k) \
+      _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + (k)*8)), \
+                      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (dequantize + (k)*8)), _mm_setzero_si128()))
+   #endif
+   row0 = dct_load(0);
+   row1 = dct_load(1);
+   row2 = dct_load(2);
+   row3 = dct_load(3);
+   row4 = dct_load(4);
+   row5 = dct_load(5);
+   row6 = dct_load(6);
+   row7 = dct_load(7);
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack with unsigned saturation, which is the clamp to 0..255
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+   #undef dct_const
+   #undef dct_rot
+   #undef dct_widen
+   #undef dct_wadd
+   #undef dct_wsub
+   #undef dct_bfly32o
+   #undef dct_interleave8
+   #undef dct_interleave16
+   #undef dct_pass
+   #undef dct_load
+}
+#endif // STBI_SSE2
+
 #ifdef STBI_SIMD
-static stbi_idct_8x8 stbi_idct_installed = idct_block;
+static stbi_idct_8x8 stbi_idct_installed;
 
 void stbi_install_idct(stbi_idct_8x8 func)
 {
@@ -1352,78 +2992,218 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int parse_entropy_coded_data(jpeg *z)
+// decodes 'count' MCUs of the current scan starting at MCU 'first'
+static int decode_mcus(jpeg *z, int first, int count)
 {
-   reset(z);
+   int m;
+   STBI__ALIGN16 short data[64];
    if (z->scan_n == 1) {
-      int i,j;
-      #ifdef STBI_SIMD
-      __declspec(align(16))
-      #endif
-      short data[64];
-      int n = z->order[0];
+      // non-interleaved: every block is an MCU
+      int n = z->order[0], bs = 8 >> z->img_comp[n].shift;
+      int w = (z->img_comp[n].x+7) >> 3;
+      for (m=first; m < first+count; ++m) {
+         int i = m % w, j = m / w;
+         if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+         z->idct_block_kernel[z->img_comp[n].shift](z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+      }
+   } else {
+      for (m=first; m < first+count; ++m) {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x, k, x, y;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k], bs = 8 >> z->img_comp[n].shift;
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*bs;
+                  int y2 = (j*z->img_comp[n].v + y)*bs;
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                  z->idct_block_kernel[z->img_comp[n].shift](z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+typedef struct
+{
+   jpeg *z;
+   uint8 **start;         // restart interval k is start[k] up to start[k+1]
+   int intervals, per_task, mcus;
+   const char **failure;  // per task, NULL if it succeeded
+} jpeg_scan_job;
+
+// decodes a run of restart intervals with its own entropy decoder state
+static void jpeg_scan_task(void *arg, int index)
+{
+   jpeg_scan_job *job = (jpeg_scan_job *) arg;
+   jpeg j = *job->z;
+   stbi s = *job->z->s;
+   int k, first = index * job->per_task, last = first + job->per_task;
+   if (last > job->intervals) last = job->intervals;
+   j.s = &s;
+   for (k=first; k < last; ++k) {
+      int mcu = k * j.restart_interval;
+      int count = job->mcus - mcu < j.restart_interval ? job->mcus - mcu : j.restart_interval;
+      s.img_buffer = job->start[k];
+      s.img_buffer_end = job->start[k+1];
+      reset(&j);
+      if (!decode_mcus(&j, mcu, count)) {
+         job->failure[index] = failure_reason;
+         return;
+      }
+   }
+}
+
+// restart intervals are independent, so with a parallel_for and the scan in
+// memory they can be found up front and decoded concurrently. Returns -1 if
+// the scan doesn't qualify (or its markers don't add up), so the caller
+// decodes it serially.
+static int parse_entropy_coded_data_parallel(jpeg *z)
+{
+   stbi *s = z->s;
+   jpeg_scan_job job;
+   uint8 *p, *end;
+   int n, k, tasks;
+   if (!s->settings.parallel_for || !z->restart_interval || s->read_from_callbacks) return -1;
+   if (z->scan_n == 1) {
+      int c = z->order[0];
+      job.mcus = ((z->img_comp[c].x+7) >> 3) * ((z->img_comp[c].y+7) >> 3);
+   } else
+      job.mcus = z->img_mcu_x * z->img_mcu_y;
+   job.intervals = (job.mcus + z->restart_interval-1) / z->restart_interval;
+   if (job.intervals < 2) return -1;
+
+   job.start = (uint8 **) scratch_malloc(s->arena, (job.intervals+1) * sizeof(uint8 *));
+   if (!job.start) return -1;
+   job.start[0] = s->img_buffer;
+   n = 1;
+   p = s->img_buffer;
+   end = s->img_buffer_end;
+   for (;;) {
+      p = (uint8 *) memchr(p, 0xff, end - p);
+      if (p == NULL || p+1 >= end) break;
+      if (p[1] == 0x00)      p += 2;  // stuffed byte
+      else if (p[1] == 0xff) p += 1;  // fill byte
+      else if (RESTART(p[1]) && n < job.intervals) job.start[n++] = p += 2;
+      else break;                     // the marker ending the scan
+   }
+   if (n != job.intervals || p == NULL || p+1 >= end || RESTART(p[1])) {
+      scratch_free(s->arena, job.start);
+      return -1;
+   }
+   job.start[n] = p+2;
+
+   tasks = job.intervals < 64 ? job.intervals : 64;
+   job.per_task = (job.intervals + tasks-1) / tasks;
+   tasks = (job.intervals + job.per_task-1) / job.per_task;
+   job.z = z;
+   job.failure = (const char **) scratch_malloc(s->arena, tasks * sizeof(const char *));
+   if (!job.failure) { scratch_free(s->arena, job.start); return -1; }
+   for (k=0; k < tasks; ++k) job.failure[k] = NULL;
+
+   stbi_parallel(s, jpeg_scan_task, &job, tasks);
+
+   for (k=0; k < tasks; ++k)
+      if (job.failure[k]) break;
+   if (k < tasks) failure_reason = job.failure[k];
+   scratch_free(s->arena, job.failure);
+   scratch_free(s->arena, job.start);
+   if (k < tasks) return 0;
+
+   // continue after the marker, exactly as if the scan was decoded serially
+   s->img_buffer = p+2;
+   z->marker = p[1];
+   z->code_bits = 0;
+   z->nomore = 1;
+   return 1;
+}
+
+// decodes row j of MCUs (of blocks, in a single-component scan), counting
+// down restart intervals as it goes. Planes with fewer rows than the image
+// are used as a ring. Returns 0 on error, 2 if the data ends early at a
+// marker that isn't a restart, 1 otherwise.
+static int decode_mcu_row(jpeg *z, int j)
+{
+   int i;
+   STBI__ALIGN16 short data[64];
+   if (z->scan_n == 1) {
+      int n = z->order[0], bs = 8 >> z->img_comp[n].shift;
       // non-interleaved data, we just need to process one block at a time,
       // in trivial scanline order
       // number of blocks to do just depends on how many actual "pixels" this
       // component has, independent of interleaved MCU blocking and such
       int w = (z->img_comp[n].x+7) >> 3;
-      int h = (z->img_comp[n].y+7) >> 3;
-      for (j=0; j < h; ++j) {
-         for (i=0; i < w; ++i) {
-            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-            #ifdef STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-            #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-            #endif
-            // every data block is an MCU, so countdown the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+      uint8 *row = z->img_comp[n].data + z->img_comp[n].w2 * ((j*bs) % z->img_comp[n].h2);
+      for (i=0; i < w; ++i) {
+         if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+         z->idct_block_kernel[z->img_comp[n].shift](row+i*bs, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 2;
+            reset(z);
          }
       }
    } else { // interleaved!
-      int i,j,k,x,y;
-      short data[64];
-      for (j=0; j < z->img_mcu_y; ++j) {
-         for (i=0; i < z->img_mcu_x; ++i) {
-            // scan an interleaved mcu... process scan_n components in order
-            for (k=0; k < z->scan_n; ++k) {
-               int n = z->order[k];
-               // scan out an mcu's worth of this component; that's just determined
-               // by the basic H and V specified for the component
-               for (y=0; y < z->img_comp[n].v; ++y) {
-                  for (x=0; x < z->img_comp[n].h; ++x) {
-                     int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
-                     if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                     #ifdef STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-                     #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-                     #endif
-                  }
+      int k,x,y;
+      uint8 *row[4];
+      for (k=0; k < z->scan_n; ++k) {
+         int n = z->order[k];
+         row[k] = z->img_comp[n].data + z->img_comp[n].w2 * ((j*z->img_comp[n].v*(8 >> z->img_comp[n].shift)) % z->img_comp[n].h2);
+      }
+      for (i=0; i < z->img_mcu_x; ++i) {
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k], bs = 8 >> z->img_comp[n].shift;
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*bs;
+                  int y2 = y*bs;
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                  z->idct_block_kernel[z->img_comp[n].shift](row[k]+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                }
             }
-            // after all interleaved components, that's an interleaved MCU,
-            // so now count down the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+         }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 2;
+            reset(z);
          }
       }
    }
    return 1;
 }
 
+// rows of MCUs (of blocks, in a single-component scan) in the current scan
+static int scan_mcu_rows(jpeg *z)
+{
+   if (z->scan_n == 1)
+      return (z->img_comp[z->order[0]].y+7) >> 3;
+   return z->img_mcu_y;
+}
+
+static int parse_entropy_coded_data(jpeg *z)
+{
+   int j, rows, r = parse_entropy_coded_data_parallel(z);
+   if (r >= 0) return r;
+   reset(z);
+   rows = scan_mcu_rows(z);
+   for (j=0; j < rows; ++j) {
+      r = decode_mcu_row(z, j);
+      if (r != 1) return r != 0;
+   }
+   return 1;
+}
+
 static int process_marker(jpeg *z, int m)
 {
    int L;
@@ -1449,13 +3229,10 @@ static int process_marker(jpeg *z, int m)
             if (t > 3) return e("bad DQT table","Corrupt JPEG");
             for (i=0; i < 64; ++i)
                z->dequant[t][dezigzag[i]] = get8u(z->s);
-            #ifdef STBI_SIMD
-            for (i=0; i < 64; ++i)
-               z->dequant2[t][i] = z->dequant[t][i];
-            #endif
             L -= 65;
          }
-         return L==0;
+         if (L != 0) return e("bad DQT len","Corrupt JPEG");
+         return 1;
 
       case 0xC4: // DHT - define huffman table
          L = get16(z->s)-2;
@@ -1482,14 +3259,18 @@ static int process_marker(jpeg *z, int m)
                v[i] = get8u(z->s);
             L -= m;
          }
-         return L==0;
+         if (L != 0) return e("bad DHT len","Corrupt JPEG");
+         return 1;
    }
    // check for comment block or APP blocks
    if ((m >= 0xE0 && m <= 0xEF) || m == 0xFE) {
-      skip(z->s, get16(z->s)-2);
+      // a length under 2 would step backwards, forever on truncated data
+      L = get16(z->s);
+      if (L < 2) return e("bad COM len","Corrupt JPEG");
+      skip(z->s, L-2);
       return 1;
    }
-   return 0;
+   return e("unknown marker","Corrupt JPEG");
 }
 
 // after we see SOS
@@ -1506,7 +3287,7 @@ static int process_scan_header(jpeg *z)
       for (which = 0; which < z->s->img_n; ++which)
          if (z->img_comp[which].id == id)
             break;
-      if (which == z->s->img_n) return 0;
+      if (which == z->s->img_n) return e("bad SOS component","Corrupt JPEG");
       z->img_comp[which].hd = q >> 4;   if (z->img_comp[which].hd > 3) return e("bad DC huff","Corrupt JPEG");
       z->img_comp[which].ha = q & 15;   if (z->img_comp[which].ha > 3) return e("bad AC huff","Corrupt JPEG");
       z->order[i] = which;
@@ -1565,19 +3346,26 @@ static int process_frame_header(jpeg *z, int scan)
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
    for (i=0; i < s->img_n; ++i) {
+      int ratio = h_max / z->img_comp[i].h;
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
       z->img_comp[i].y = (s->img_y * z->img_comp[i].v + v_max-1) / v_max;
+      // when downscaling, a component subsampled by the same power of two
+      // both ways decodes to bigger blocks, up to the output's resolution,
+      // rather than being upsampled back to it with its detail lost
+      z->img_comp[i].shift = z->scale_shift;
+      if (ratio * z->img_comp[i].h == h_max && ratio * z->img_comp[i].v == v_max && (ratio & (ratio-1)) == 0)
+         while (ratio > 1 && z->img_comp[i].shift > 0) ratio >>= 1, --z->img_comp[i].shift;
       // to simplify generation, we'll allocate enough memory to decode
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (e.g. a 16x16 iMCU on an image of width 33); we won't
       // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->img_comp[i].shift);
+      z->img_comp[i].h2 = (z->ring_mcu_rows ? z->ring_mcu_rows : z->img_mcu_y) * z->img_comp[i].v * (8 >> z->img_comp[i].shift);
+      z->img_comp[i].raw_data = scratch_malloc(s->arena, z->img_comp[i].w2 * z->img_comp[i].h2+15);
       if (z->img_comp[i].raw_data == NULL) {
          for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
+            scratch_free(s->arena, z->img_comp[i].raw_data);
             z->img_comp[i].data = NULL;
          }
          return e("outofmem", "Out of memory");
@@ -1636,7 +3424,7 @@ static int decode_jpeg_image(jpeg *j)
                   j->marker = get8u(j->s);
                   break;
                } else if (x != 0) {
-                  return 0;
+                  return e("junk before marker","Corrupt JPEG");
                }
             }
             // if we reach eof without hitting a marker, get_marker() below will fail and we'll eventually return 0
@@ -1729,6 +3517,45 @@ static uint8 *resample_row_hv_2(uint8 *out, uint8 *in_near, uint8 *in_far, int w
    return out;
 }
 
+#ifdef STBI_SSE2
+// resample_row_hv_2 eight input samples at a time; same integer math
+static uint8 *resample_row_hv_2_sse2(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
+{
+   int i,t0,t1;
+   __m128i zero  = _mm_setzero_si128();
+   __m128i three = _mm_set1_epi16(3);
+   __m128i bias  = _mm_set1_epi16(8);
+   if (w < 9) return resample_row_hv_2(out, in_near, in_far, w, hs);
+
+   t1 = 3*in_near[0] + in_far[0];
+   out[0] = div4(t1+2);
+   // t[i] = 3*near[i]+far[i]; out[2i-1] and out[2i] mix t[i-1] and t[i]
+   for (i=1; i+8 <= w; i += 8) {
+      __m128i np = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i-1)), zero);
+      __m128i fp = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far  + i-1)), zero);
+      __m128i nc = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i  )), zero);
+      __m128i fc = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far  + i  )), zero);
+      __m128i prev = _mm_add_epi16(_mm_mullo_epi16(np, three), fp);
+      __m128i curr = _mm_add_epi16(_mm_mullo_epi16(nc, three), fc);
+      __m128i odd  = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(prev, three), curr), bias), 4);
+      __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(curr, three), prev), bias), 4);
+      __m128i o8   = _mm_packus_epi16(odd,  zero);
+      __m128i e8   = _mm_packus_epi16(even, zero);
+      _mm_storeu_si128((__m128i *) (out + i*2-1), _mm_unpacklo_epi8(o8, e8));
+   }
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = div16(3*t0 + t1 + 8);
+      out[i*2  ] = div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = div4(t1+2);
+
+   return out;
+}
+#endif // STBI_SSE2
+
 static uint8 *resample_row_generic(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
 {
    // resample with nearest-neighbor
@@ -1764,13 +3591,75 @@ static void YCbCr_to_RGB_row(uint8 *out, const uint8 *y, const uint8 *pcb, const
       out[0] = (uint8)r;
       out[1] = (uint8)g;
       out[2] = (uint8)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
 
+#ifdef STBI_SSE2
+// YCbCr_to_RGB_row eight pixels at a time. Each constant is split into a
+// multiple of 65536, applied as a shift of the 16-bit sum, plus a 16-bit
+// remainder for madd, so the 32-bit sums are exactly the scalar ones.
+static void YCbCr_to_RGB_sse2(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   int i,k;
+   __m128i zero  = _mm_setzero_si128();
+   __m128i bias  = _mm_set1_epi16(128);
+   __m128i round = _mm_set1_epi32(32768);
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   // (cr,cb) pair weights: r = (y+cr)<<16, g = (y-cr)<<16, b = (y+2*cb)<<16 plus these
+   __m128i kr = _mm_setr_epi16((short) (float2fixed(1.40200f) - 65536), 0, (short) (float2fixed(1.40200f) - 65536), 0,
+                               (short) (float2fixed(1.40200f) - 65536), 0, (short) (float2fixed(1.40200f) - 65536), 0);
+   __m128i kg = _mm_setr_epi16((short) (65536 - float2fixed(0.71414f)), (short) -float2fixed(0.34414f),
+                               (short) (65536 - float2fixed(0.71414f)), (short) -float2fixed(0.34414f),
+                               (short) (65536 - float2fixed(0.71414f)), (short) -float2fixed(0.34414f),
+                               (short) (65536 - float2fixed(0.71414f)), (short) -float2fixed(0.34414f));
+   __m128i kb = _mm_setr_epi16(0, (short) (float2fixed(1.77200f) - 131072), 0, (short) (float2fixed(1.77200f) - 131072),
+                               0, (short) (float2fixed(1.77200f) - 131072), 0, (short) (float2fixed(1.77200f) - 131072));
+   STBI__ALIGN16 uint8 rgba[32];
+
+   for (i=0; i+8 <= count; i += 8) {
+      __m128i yv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y   + i)), zero);
+      __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb + i)), zero), bias);
+      __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr + i)), zero), bias);
+      __m128i rh = _mm_add_epi16(yv, cr);
+      __m128i gh = _mm_sub_epi16(yv, cr);
+      __m128i bh = _mm_add_epi16(yv, _mm_add_epi16(cb, cb));
+      __m128i cc_l = _mm_unpacklo_epi16(cr, cb);
+      __m128i cc_h = _mm_unpackhi_epi16(cr, cb);
+      // unpacking under zero puts the 16-bit sums in the high halves: x<<16
+      __m128i r_l = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(zero, rh), round), _mm_madd_epi16(cc_l, kr));
+      __m128i r_h = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(zero, rh), round), _mm_madd_epi16(cc_h, kr));
+      __m128i g_l = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(zero, gh), round), _mm_madd_epi16(cc_l, kg));
+      __m128i g_h = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(zero, gh), round), _mm_madd_epi16(cc_h, kg));
+      __m128i b_l = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(zero, bh), round), _mm_madd_epi16(cc_l, kb));
+      __m128i b_h = _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(zero, bh), round), _mm_madd_epi16(cc_h, kb));
+      // >> 16, then pack with saturation, which is the clamp to 0..255
+      __m128i r8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(r_l, 16), _mm_srai_epi32(r_h, 16)), zero);
+      __m128i g8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(g_l, 16), _mm_srai_epi32(g_h, 16)), zero);
+      __m128i b8 = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(b_l, 16), _mm_srai_epi32(b_h, 16)), zero);
+      __m128i rg = _mm_unpacklo_epi8(r8, g8);
+      __m128i ba = _mm_unpacklo_epi8(b8, alpha);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) (out     ), _mm_unpacklo_epi16(rg, ba));
+         _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi16(rg, ba));
+      } else {
+         _mm_store_si128((__m128i *) (rgba     ), _mm_unpacklo_epi16(rg, ba));
+         _mm_store_si128((__m128i *) (rgba + 16), _mm_unpackhi_epi16(rg, ba));
+         for (k=0; k < 8; ++k) {
+            out[k*3+0] = rgba[k*4+0];
+            out[k*3+1] = rgba[k*4+1];
+            out[k*3+2] = rgba[k*4+2];
+         }
+      }
+      out += step*8;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif // STBI_SSE2
+
 #ifdef STBI_SIMD
-static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
+static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed;
 
 void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 {
@@ -1778,6 +3667,28 @@ void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 }
 #endif
 
+// picks the fastest kernels this CPU supports; installed ones win
+static void jpeg_select_kernels(jpeg *z)
+{
+   z->idct_block_kernel[0]     = idct_block;
+   z->YCbCr_to_RGB_kernel      = YCbCr_to_RGB_row;
+   z->resample_row_hv_2_kernel = resample_row_hv_2;
+   #ifdef STBI_SSE2
+   if (stbi__cpu() & STBI__CPU_SSE2) {
+      z->idct_block_kernel[0]     = idct_block_sse2;
+      z->YCbCr_to_RGB_kernel      = YCbCr_to_RGB_sse2;
+      z->resample_row_hv_2_kernel = resample_row_hv_2_sse2;
+   }
+   #endif
+   #ifdef STBI_SIMD
+   if (stbi_idct_installed)  z->idct_block_kernel[0] = stbi_idct_installed;
+   if (stbi_YCbCr_installed) z->YCbCr_to_RGB_kernel = stbi_YCbCr_installed;
+   #endif
+   z->idct_block_kernel[1] = idct_block_4x4;
+   z->idct_block_kernel[2] = idct_block_2x2;
+   z->idct_block_kernel[3] = idct_block_1x1;
+}
+
 
 // clean up the temporary component buffers
 static void cleanup_jpeg(jpeg *j)
@@ -1785,25 +3696,117 @@ static void cleanup_jpeg(jpeg *j)
    int i;
    for (i=0; i < j->s->img_n; ++i) {
       if (j->img_comp[i].data) {
-         free(j->img_comp[i].raw_data);
+         scratch_free(j->s->arena, j->img_comp[i].raw_data);
          j->img_comp[i].data = NULL;
       }
       if (j->img_comp[i].linebuf) {
-         free(j->img_comp[i].linebuf);
+         stbi__free(j->img_comp[i].linebuf);
          j->img_comp[i].linebuf = NULL;
       }
    }
 }
 
-typedef struct
+typedef struct
+{
+   resample_row_func resample;
+   int hs,vs;   // expansion factor in each axis
+   int w_lores; // horizontal pixels pre-expansion
+   int h_lores; // vertical pixels pre-expansion
+} stbi_resample;
+
+typedef struct
+{
+   jpeg *z;
+   stbi_resample res_comp[4];
+   uint8 *output;
+   uint8 *linebuf;  // decode_n line buffers per band
+   int w, h;        // output size, smaller than the image when downscaling
+   int n, decode_n, band_height;
+   stbi_post post;
+} jpeg_rows_job;
+
+// resamples and color-converts output row j. The source rows follow from
+// j alone, so rows are independent: output row j sits (j + vs/2) / vs rows
+// into the vertical expansion, blending its two nearest source rows.
+static void jpeg_convert_row(jpeg_rows_job *job, int j, uint8 *out, uint8 *linebuf)
+{
+   jpeg *z = job->z;
+   int n = job->n, i, k;
+   uint8 *coutput[4];
+   for (k=0; k < job->decode_n; ++k) {
+      stbi_resample *r = &job->res_comp[k];
+      int q = j + (r->vs >> 1);
+      int ystep = q % r->vs, m = q / r->vs, last = r->h_lores - 1;
+      int row1 = m < last ? m : last;
+      int row0 = m-1 < last ? (m > 0 ? m-1 : 0) : last;
+      uint8 *line0 = z->img_comp[k].data + (row0 % z->img_comp[k].h2) * z->img_comp[k].w2;
+      uint8 *line1 = z->img_comp[k].data + (row1 % z->img_comp[k].h2) * z->img_comp[k].w2;
+      int y_bot = ystep >= (r->vs >> 1);
+      coutput[k] = r->resample(linebuf + k * (job->w + 3),
+                               y_bot ? line1 : line0,
+                               y_bot ? line0 : line1,
+                               r->w_lores, r->hs);
+   }
+   if (n >= 3) {
+      uint8 *y = coutput[0];
+      if (z->s->img_n == 3) {
+         z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], job->w, n);
+      } else
+         for (i=0; i < (int) job->w; ++i) {
+            out[0] = out[1] = out[2] = y[i];
+            if (n == 4) out[3] = 255;
+            out += n;
+         }
+   } else {
+      uint8 *y = coutput[0];
+      if (n == 1)
+         for (i=0; i < (int) job->w; ++i) out[i] = y[i];
+      else
+         for (i=0; i < (int) job->w; ++i) *out++ = y[i], *out++ = 255;
+   }
+}
+
+// converts the output rows of one band
+static void jpeg_rows_task(void *arg, int band)
 {
-   resample_row_func resample;
-   uint8 *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi_resample;
+   jpeg_rows_job *job = (jpeg_rows_job *) arg;
+   int j, j0 = band * job->band_height, j1 = j0 + job->band_height;
+   uint8 *linebuf = job->linebuf + band * job->decode_n * (job->w + 3);
+   if (j1 > job->h) j1 = job->h;
+   for (j=j0; j < j1; ++j) {
+      uint8 *out = job->output + job->n * job->w * (job->post.flags & STBI_FLIP_VERTICALLY ? job->h-1-j : j);
+      jpeg_convert_row(job, j, out, linebuf);
+      post_row(&job->post, out, out, job->w);
+   }
+}
+
+// sets up the resamplers for n output components, decode_n of them decoded
+static void jpeg_rows_start(jpeg *z, jpeg_rows_job *job, int n, int decode_n)
+{
+   int k;
+   job->z = z;
+   job->n = n;
+   job->decode_n = decode_n;
+   job->w = (z->s->img_x + (1 << z->scale_shift)-1) >> z->scale_shift;
+   job->h = (z->s->img_y + (1 << z->scale_shift)-1) >> z->scale_shift;
+   post_start(&job->post, 0, n);
+   for (k=0; k < decode_n; ++k) {
+      stbi_resample *r = &job->res_comp[k];
+      // what subsampling its bigger blocks did not already make up for
+      int grown = z->scale_shift - z->img_comp[k].shift;
+
+      r->hs      = (z->img_h_max / z->img_comp[k].h) >> grown;
+      r->vs      = (z->img_v_max / z->img_comp[k].v) >> grown;
+      r->w_lores = (job->w + r->hs-1) / r->hs;
+      r->h_lores = ((job->h << grown) * z->img_comp[k].v + z->img_v_max-1) / z->img_v_max;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = resample_row_generic;
+   }
+}
 
 static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
@@ -1811,6 +3814,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return epuc("bad req_comp", "Internal error");
    z->s->img_n = 0;
+   jpeg_select_kernels(z);
 
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { cleanup_jpeg(z); return NULL; }
@@ -1825,83 +3829,37 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
 
    // resample and color-convert
    {
-      int k;
-      uint i,j;
-      uint8 *output;
-      uint8 *coutput[4];
-
-      stbi_resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi_resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
-         else                               r->resample = resample_row_generic;
-      }
+      int bands;
+      jpeg_rows_job job;
+
+      jpeg_rows_start(z, &job, n, decode_n);
+      post_start(&job.post, z->s->settings.post, n);
+      z->s->post_done = 1;
+
+      // bands of rows run in parallel when there is a parallel_for
+      bands = z->s->settings.parallel_for ? (job.h + 31) / 32 : 1;
+      if (bands > 64) bands = 64;
+      job.band_height = (job.h + bands-1) / bands;
+      bands = (job.h + job.band_height-1) / job.band_height;
+
+      // line buffers big enough for upsampling off the edges with upsample
+      // factor of 4, one per component per band
+      job.linebuf = (uint8 *) scratch_malloc(z->s->arena, bands * decode_n * (job.w + 3));
+      if (!job.linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
       // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s->img_x * z->s->img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+      job.output = (uint8 *) result_malloc(z->s, n * job.w * job.h);
+      if (!job.output) { scratch_free(z->s->arena, job.linebuf); cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         uint8 *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi_resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            uint8 *y = coutput[0];
-            if (z->s->img_n == 3) {
-               #ifdef STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               #endif
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            uint8 *y = coutput[0];
-            if (n == 1)
-               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-            else
-               for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
-         }
-      }
+      stbi_parallel(z->s, jpeg_rows_task, &job, bands);
+
+      scratch_free(z->s->arena, job.linebuf);
       cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = job.w;
+      *out_y = job.h;
       if (comp) *comp  = z->s->img_n; // report original components, not output
-      return output;
+      return job.output;
    }
 }
 
@@ -1909,6 +3867,9 @@ static unsigned char *stbi_jpeg_load(stbi *s, int *x, int *y, int *comp, int req
 {
    jpeg j;
    j.s = s;
+   j.scale_shift = s->scale_shift;
+   j.ring_mcu_rows = 0;
+   s->scale_done = 1;
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
@@ -1949,14 +3910,48 @@ static int stbi_jpeg_info(stbi *s, int *x, int *y, int *comp)
 //      - fast huffman
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  10 // accelerate all cases in default tables, plus most extra bits
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
+// fast table entries: the low 8 bits are how many bits the entry consumes,
+// the next 8 bits say what the top 16 bits hold. For lengths and distances
+// whose code plus extra bits fit in ZFAST_BITS, the entry holds the final
+// value, so one lookup replaces a decode plus a zreceive.
+enum
+{
+   ZFAST_LITERAL,   // literal byte
+   ZFAST_VALUE,     // match length or distance, extra bits included
+   ZFAST_SYMBOL,    // raw symbol, extra bits (if any) still to be read
+   ZFAST_END        // end of block
+};
+
+// what a huffman table decodes, selects how its fast entries are built
+enum
+{
+   ZTABLE_PLAIN,
+   ZTABLE_LENGTH,
+   ZTABLE_DISTANCE
+};
+
+static const int length_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int length_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int dist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint32 fast[1 << ZFAST_BITS];
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
@@ -1981,19 +3976,40 @@ stbi_inline static int bit_reverse(int v, int bits)
    return bitreverse16(v) >> (16-bits);
 }
 
-static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
+// fast table entry for symbol sym with an s-bit code, at table index k
+// (the bits above the code in k are the extra bits that follow it)
+static uint32 zfast_entry(int table, int sym, int s, int k)
+{
+   int extra, base;
+   if (table == ZTABLE_LENGTH) {
+      if (sym < 256)  return ((uint32) sym << 16) | (ZFAST_LITERAL << 8) | s;
+      if (sym == 256) return (ZFAST_END << 8) | s;
+      extra = length_extra[sym-257];
+      base  = length_base[sym-257];
+   } else if (table == ZTABLE_DISTANCE && sym < 30) {
+      extra = dist_extra[sym];
+      base  = dist_base[sym];
+   } else
+      return ((uint32) sym << 16) | (ZFAST_SYMBOL << 8) | s;
+   if (s + extra > ZFAST_BITS)
+      return ((uint32) sym << 16) | (ZFAST_SYMBOL << 8) | s;
+   base += (k >> s) & ((1 << extra) - 1);
+   return ((uint32) base << 16) | (ZFAST_VALUE << 8) | (s + extra);
+}
+
+static int zbuild_huffman(zhuffman *z, const uint8 *sizelist, int num, int table)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
    for (i=1; i < 16; ++i)
-      assert(sizes[i] <= (1 << i));
+      if (sizes[i] > (1 << i)) return e("bad sizes","Corrupt PNG");
    code = 0;
    for (i=1; i < 16; ++i) {
       next_code[i] = code;
@@ -2016,7 +4032,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = zfast_entry(table, i, s, k);
                k += (1 << s);
             }
          }
@@ -2029,73 +4045,140 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
-//    we require PNG read all the IDATs and combine them into a single
-//    memory buffer
+//    the input is a list of memory segments read back to back; PNG
+//    decoding from memory points them straight at the IDAT payloads,
+//    other sources combine the IDATs into a single segment
+
+typedef struct
+{
+   uint8 *data;
+   uint32 len;
+} zsegment;
 
 typedef struct
 {
-   uint8 *zbuffer, *zbuffer_end;
+   uint8 *zbuffer, *zbuffer_end;   // current segment
+   zsegment *segments;
+   int num_segments, next_segment;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer;  // only the low num_bits bits are ever set
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   stbi_arena *zarena;  // where an expandable output lives, NULL for the heap
+   int   partial;  // stop after the first block past 64KB of output
 
+   // for the streaming decoder, see zinflate_step
+   char *zout_stop;  // huffman blocks pause here; NULL never pauses
+   int   zstate, zfinal, zstored;
+   int   zoverrun;   // a read went past the end of the input
+   int   zpad;       // zero bits at the top of code_buffer from past the end
+
+   // last, so the fields above can be saved without them
    zhuffman z_length, z_distance;
 } zbuf;
 
+// moves to the next non-empty segment, returns 0 at the end of the input
+static int znext_segment(zbuf *z)
+{
+   while (z->next_segment < z->num_segments) {
+      zsegment *g = &z->segments[z->next_segment++];
+      z->zbuffer     = g->data;
+      z->zbuffer_end = g->data + g->len;
+      if (g->len) return 1;
+   }
+   return 0;
+}
+
+static void zstart(zbuf *z, zsegment *segments, int count)
+{
+   z->segments = segments;
+   z->num_segments = count;
+   z->next_segment = 0;
+   z->zbuffer = z->zbuffer_end = NULL;
+   z->partial = 0;
+   z->zarena = NULL;
+   z->zpad = 0;
+   znext_segment(z);
+}
+
 stbi_inline static int zget8(zbuf *z)
 {
-   if (z->zbuffer >= z->zbuffer_end) return 0;
+   if (z->zbuffer >= z->zbuffer_end)
+      if (!znext_segment(z)) { z->zoverrun = 1; return 0; }
    return *z->zbuffer++;
 }
 
+// little-endian load written out bytewise; compilers turn it into one load
+stbi_inline static uint64 zload64(uint8 const *p)
+{
+   return  (uint64) p[0]        | ((uint64) p[1] <<  8) | ((uint64) p[2] << 16) | ((uint64) p[3] << 24) |
+          ((uint64) p[4] << 32) | ((uint64) p[5] << 40) | ((uint64) p[6] << 48) | ((uint64) p[7] << 56);
+}
+
+// tops the bit buffer up to at least 56 bits
 static void fill_bits(zbuf *z)
 {
-   do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // take as many whole bytes as fit, then drop the bits past them
+      int n = (63 - z->num_bits) >> 3;
+      z->code_buffer |= zload64(z->zbuffer) << z->num_bits;
+      z->zbuffer += n;
+      z->num_bits += n * 8;
+      z->code_buffer &= ((uint64) 1 << z->num_bits) - 1;
+   } else {
+      // near the end, reads past the input are zero bits
+      do {
+         if (z->zbuffer >= z->zbuffer_end && !znext_segment(z)) {
+            z->zoverrun = 1;
+            z->zpad += 8;
+         } else
+            z->code_buffer |= (uint64) *z->zbuffer++ << z->num_bits;
+         z->num_bits += 8;
+      } while (z->num_bits <= 55);
+   }
 }
 
 stbi_inline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
+// consumes one code (plus its extra bits when the fast table covers them)
+// and returns the fast-table style entry for it, or 0 for an invalid code
+stbi_inline static uint32 zhuffman_decode(zbuf *a, zhuffman *z)
 {
    int b,s,k;
+   uint32 entry;
    if (a->num_bits < 16) fill_bits(a);
-   b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
+   entry = z->fast[a->code_buffer & ZFAST_MASK];
+   if (entry) {
+      s = entry & 255;
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return z->value[b];
+      return entry;
    }
 
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
-   if (s == 16) return -1; // invalid code!
+   if (s == 16) return 0; // invalid code!
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
    assert(z->size[b] == s);
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   return ((uint32) z->value[b] << 16) | (ZFAST_SYMBOL << 8) | s;
 }
 
 static int expand(zbuf *z, int n)  // need to make room for n bytes
@@ -2107,7 +4190,7 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
    limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) realloc(z->zout_start, limit);
+   q = (char *) scratch_realloc(z->zarena, z->zout_start, limit);
    if (q == NULL) return e("outofmem", "Out of memory");
    z->zout_start = q;
    z->zout       = q + cur;
@@ -2115,44 +4198,78 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
    return 1;
 }
 
-static int length_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static int length_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static int dist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+// copies a len-byte match from dist bytes back; the source may overlap the
+// destination, which repeats the last dist bytes
+stbi_inline static void zcopy_match(zbuf *a, int len, int dist)
+{
+   uint8 *q = (uint8 *) a->zout;
+   uint8 *p = q - dist;
+   if (dist == 1) {
+      memset(q, *p, len);
+   } else if (dist >= 8 && a->zout_end - a->zout >= len + 8) {
+      // 8-byte chunks never read bytes they are writing; the last one may
+      // spill up to 7 bytes past the match, which later output overwrites
+      uint8 *end = q + len;
+      do {
+         memcpy(q, p, 8);
+         q += 8; p += 8;
+      } while (q < end);
+   } else if (dist >= len) {
+      memcpy(q, p, len);
+   } else {
+      int i;
+      for (i=0; i < len; ++i)
+         q[i] = p[i];
+   }
+   a->zout += len;
+}
 
+// returns 1 at the end of the block, 2 when paused at zout_stop
 static int parse_huffman_block(zbuf *a)
 {
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+      uint32 entry;
+      int kind, z, len, dist;
+      if (a->zout_stop && a->zout >= a->zout_stop) return 2;
+      // decoding into the zero padding means the data was cut short; a
+      // run of zero codes could otherwise grow the output forever
+      if (a->num_bits < a->zpad) return e("outofdata","Corrupt PNG");
+      // enough bits for a length and a distance, both with extra bits
+      if (a->num_bits < 48) fill_bits(a);
+      entry = zhuffman_decode(a, &a->z_length);
+      if (!entry) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+      kind = (entry >> 8) & 255;
+      z = entry >> 16;
+      if (kind == ZFAST_SYMBOL) {
+         if (z < 256) kind = ZFAST_LITERAL;
+         else if (z == 256) kind = ZFAST_END;
+         else {
+            z -= 257;
+            len = length_base[z];
+            if (length_extra[z]) len += zreceive(a, length_extra[z]);
+            z = len;
+            kind = ZFAST_VALUE;
+         }
+      }
+      if (kind == ZFAST_LITERAL) {
          if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
          *a->zout++ = (char) z;
+      } else if (kind == ZFAST_END) {
+         return 1;
       } else {
-         uint8 *p;
-         int len,dist;
-         if (z == 256) return 1;
-         z -= 257;
-         len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
-         dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
+         len = z;
+         entry = zhuffman_decode(a, &a->z_distance);
+         if (!entry) return e("bad huffman code","Corrupt PNG");
+         z = entry >> 16;
+         if (((entry >> 8) & 255) == ZFAST_SYMBOL) {
+            if (z >= 30) return e("bad huffman code","Corrupt PNG");
+            dist = dist_base[z];
+            if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
+         } else
+            dist = z;
          if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
          if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
-         while (len--)
-            *a->zout++ = *p++;
+         zcopy_match(a, len, dist);
       }
    }
 }
@@ -2174,36 +4291,41 @@ static int compute_huffman_codes(zbuf *a)
       int s = zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (uint8) s;
    }
-   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19, ZTABLE_PLAIN)) return 0;
 
    n = 0;
    while (n < hlit + hdist) {
-      int c = zhuffman_decode(a, &z_codelength);
-      assert(c >= 0 && c < 19);
+      uint32 entry = zhuffman_decode(a, &z_codelength);
+      int c = entry >> 16;
+      if (!entry || c >= 19) return e("bad codelengths", "Corrupt PNG");
       if (c < 16)
          lencodes[n++] = (uint8) c;
-      else if (c == 16) {
-         c = zreceive(a,2)+3;
-         memset(lencodes+n, lencodes[n-1], c);
-         n += c;
-      } else if (c == 17) {
-         c = zreceive(a,3)+3;
-         memset(lencodes+n, 0, c);
-         n += c;
-      } else {
-         assert(c == 18);
-         c = zreceive(a,7)+11;
-         memset(lencodes+n, 0, c);
+      else {
+         int fill = 0;
+         if (c == 16) {
+            if (n == 0) return e("bad codelengths", "Corrupt PNG");
+            fill = lencodes[n-1];
+            c = zreceive(a,2)+3;
+         } else if (c == 17)
+            c = zreceive(a,3)+3;
+         else {
+            assert(c == 18);
+            c = zreceive(a,7)+11;
+         }
+         // a repeat must not run past the code lengths
+         if (n + c > hlit + hdist) return e("bad codelengths", "Corrupt PNG");
+         memset(lencodes+n, fill, c);
          n += c;
       }
    }
    if (n != hlit+hdist) return e("bad codelengths","Corrupt PNG");
-   if (!zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!zbuild_huffman(&a->z_length, lencodes, hlit, ZTABLE_LENGTH)) return 0;
+   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, ZTABLE_DISTANCE)) return 0;
    return 1;
 }
 
-static int parse_uncompressed_block(zbuf *a)
+// reads a stored block's header, returns its length or -1 if corrupt
+static int zstored_header(zbuf *a)
 {
    uint8 header[4];
    int len,nlen,k;
@@ -2211,24 +4333,57 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
-   if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
+   if (nlen != (len ^ 0xffff)) {
+      e("zlib corrupt","Corrupt PNG");
+      return -1;
+   }
+   return len;
+}
+
+// copies up to len bytes of a stored block, returns how many were there
+static int zstored_copy(zbuf *a, int len)
+{
+   int left = len;
+   // the bit buffer can still hold the first bytes of the block
+   while (a->num_bits > 0 && left > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --left;
+   }
+   // the rest may span several input segments
+   while (left > 0) {
+      int n = (int) (a->zbuffer_end - a->zbuffer);
+      if (n == 0) {
+         if (!znext_segment(a)) { a->zoverrun = 1; break; }
+         continue;
+      }
+      if (n > left) n = left;
+      memcpy(a->zout, a->zbuffer, n);
+      a->zbuffer += n;
+      a->zout += n;
+      left -= n;
+   }
+   return len - left;
+}
+
+static int parse_uncompressed_block(zbuf *a)
+{
+   int len = zstored_header(a);
+   if (len < 0) return 0;
    if (a->zout + len > a->zout_end)
       if (!expand(a, len)) return 0;
-   memcpy(a->zout, a->zbuffer, len);
-   a->zbuffer += len;
-   a->zout += len;
+   if (zstored_copy(a, len) != len) return e("read past buffer","Corrupt PNG");
    return 1;
 }
 
@@ -2245,20 +4400,35 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// fixed Huffman code lengths (RFC 1951 3.2.6): literals 0-143 are 8 bits,
+// 144-255 are 9, 256-279 are 7 and 280-287 are 8; all distances are 5
+static const uint8 default_length[288] =
+{
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static const uint8 default_distance[32] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
-int stbi_png_partial; // a quick hack to only allow decoding some of a PNG... I should implement real streaming support instead
 static int parse_zlib(zbuf *a, int parse_header)
 {
    int final, type;
@@ -2266,6 +4436,7 @@ static int parse_zlib(zbuf *a, int parse_header)
       if (!parse_zlib_header(a)) return 0;
    a->num_bits = 0;
    a->code_buffer = 0;
+   a->zpad = 0;
    do {
       final = zreceive(a,1);
       type = zreceive(a,2);
@@ -2276,15 +4447,14 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
-            if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
-            if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
+            if (!zbuild_huffman(&a->z_length  , default_length  , 288, ZTABLE_LENGTH  )) return 0;
+            if (!zbuild_huffman(&a->z_distance, default_distance,  32, ZTABLE_DISTANCE)) return 0;
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
          if (!parse_huffman_block(a)) return 0;
       }
-      if (stbi_png_partial && a->zout - a->zout_start > 65536)
+      if (a->partial && a->zout - a->zout_start > 65536)
          break;
    } while (!final);
    return 1;
@@ -2296,83 +4466,138 @@ static int do_zlib(zbuf *a, char *obuf, int olen, int exp, int parse_header)
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zout_stop  = NULL;
 
    return parse_zlib(a, parse_header);
 }
 
-char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+// inflate for the streaming decoder, resumable between calls: decodes until
+// the output reaches zout_stop, a block ends, or the stream ends. zstate
+// says where it is: 0 before the zlib header, 1 between blocks, 2 in a
+// huffman block, 3 in a stored block with zstored bytes left, 4 at the end.
+// Returning at block ends means the tables only change in calls that start
+// between blocks, so a caller can save the state without them. The caller
+// provides enough room past zout_stop for one more match (258 bytes, plus 8
+// for zcopy_match). Reads past the input are zeros, as in the other paths,
+// and set zoverrun, so the caller can tell running dry from the end.
+static int zinflate_step(zbuf *a)
 {
-   zbuf a;
-   char *p = (char *) malloc(initial_size);
-   if (p == NULL) return NULL;
-   a.zbuffer = (uint8 *) buffer;
-   a.zbuffer_end = (uint8 *) buffer + len;
-   if (do_zlib(&a, p, initial_size, 1, 1)) {
-      if (outlen) *outlen = (int) (a.zout - a.zout_start);
-      return a.zout_start;
-   } else {
-      free(a.zout_start);
-      return NULL;
+   for (;;) {
+      switch (a->zstate) {
+         case 0:
+            if (!parse_zlib_header(a)) return 0;
+            a->num_bits = 0;
+            a->code_buffer = 0;
+            a->zstate = 1;
+            break;
+         case 1: {
+            int type;
+            if (a->zfinal) { a->zstate = 4; break; }
+            if (a->zout >= a->zout_stop) return 1;
+            a->zfinal = zreceive(a,1);
+            type = zreceive(a,2);
+            if (type == 0) {
+               a->zstored = zstored_header(a);
+               if (a->zstored < 0) return 0;
+               a->zstate = 3;
+            } else if (type == 3) {
+               return e("bad block type","Corrupt PNG");
+            } else {
+               if (type == 1) {
+                  if (!zbuild_huffman(&a->z_length  , default_length  , 288, ZTABLE_LENGTH  )) return 0;
+                  if (!zbuild_huffman(&a->z_distance, default_distance,  32, ZTABLE_DISTANCE)) return 0;
+               } else {
+                  if (!compute_huffman_codes(a)) return 0;
+               }
+               a->zstate = 2;
+            }
+            break;
+         }
+         case 2:
+            switch (parse_huffman_block(a)) {
+               case 0: return 0;
+               case 2: return 1;
+            }
+            a->zstate = 1;
+            return 1;
+         case 3: {
+            int n = a->zstored;
+            if (n > a->zout_stop - a->zout) n = (int) (a->zout_stop - a->zout);
+            if (n == 0 && a->zstored) return 1;
+            n = zstored_copy(a, n);
+            a->zstored -= n;
+            if (a->zstored == 0) a->zstate = 1;
+            return 1;
+         }
+         default:
+            return 1;
+      }
    }
 }
 
-char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
-{
-   return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
-}
-
-char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+// inflates into a buffer of initial_size that grows as needed, from the
+// arena if there is one
+static char *zlib_decode_segments(stbi_arena *arena, zsegment *segments, int count, int initial_size, int *outlen, int parse_header, int partial)
 {
    zbuf a;
-   char *p = (char *) malloc(initial_size);
+   char *p = (char *) scratch_malloc(arena, initial_size);
    if (p == NULL) return NULL;
-   a.zbuffer = (uint8 *) buffer;
-   a.zbuffer_end = (uint8 *) buffer + len;
+   zstart(&a, segments, count);
+   a.partial = partial;
+   a.zarena = arena;
    if (do_zlib(&a, p, initial_size, 1, parse_header)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      free(a.zout_start);
+      scratch_free(arena, a.zout_start);
       return NULL;
    }
 }
 
-int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
+static int zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen, int parse_header)
 {
    zbuf a;
-   a.zbuffer = (uint8 *) ibuffer;
-   a.zbuffer_end = (uint8 *) ibuffer + ilen;
-   if (do_zlib(&a, obuffer, olen, 0, 1))
+   zsegment g;
+   g.data = (uint8 *) ibuffer;
+   g.len  = (uint32) ilen;
+   zstart(&a, &g, 1);
+   if (do_zlib(&a, obuffer, olen, 0, parse_header))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
 }
 
+char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+{
+   zsegment g;
+   g.data = (uint8 *) buffer;
+   g.len  = (uint32) len;
+   return zlib_decode_segments(NULL, &g, 1, initial_size, outlen, parse_header, 0);
+}
+
+char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
+{
+   return stbi_zlib_decode_malloc_guesssize_headerflag(buffer, len, initial_size, outlen, 1);
+}
+
+char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
+{
+   return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
+}
+
+int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
+{
+   return zlib_decode_buffer(obuffer, olen, ibuffer, ilen, 1);
+}
+
 char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int *outlen)
 {
-   zbuf a;
-   char *p = (char *) malloc(16384);
-   if (p == NULL) return NULL;
-   a.zbuffer = (uint8 *) buffer;
-   a.zbuffer_end = (uint8 *) buffer+len;
-   if (do_zlib(&a, p, 16384, 1, 0)) {
-      if (outlen) *outlen = (int) (a.zout - a.zout_start);
-      return a.zout_start;
-   } else {
-      free(a.zout_start);
-      return NULL;
-   }
+   return stbi_zlib_decode_malloc_guesssize_headerflag(buffer, len, 16384, outlen, 0);
 }
 
 int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffer, int ilen)
 {
-   zbuf a;
-   a.zbuffer = (uint8 *) ibuffer;
-   a.zbuffer_end = (uint8 *) ibuffer + ilen;
-   if (do_zlib(&a, obuffer, olen, 0, 0))
-      return (int) (a.zout - a.zout_start);
-   else
-      return -1;
+   return zlib_decode_buffer(obuffer, olen, ibuffer, ilen, 0);
 }
 
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
@@ -2415,6 +4640,14 @@ typedef struct
 {
    stbi *s;
    uint8 *idata, *expanded, *out;
+   zsegment *idat;      // IDAT payloads referenced in place, for memory input
+   int idat_count;
+   int out_scratch;     // out is the palette indices, in scratch memory
+
+   // what SCAN_stream found before the first IDAT, whose length is idat_len
+   uint8 palette[1024], pal_img_n, has_trans, tc[3];
+   int interlace, iphone;
+   uint32 idat_len;
 } png;
 
 
@@ -2423,34 +4656,297 @@ enum {
    F_avg_first, F_paeth_first
 };
 
-static uint8 first_row_filter[5] =
+static const uint8 first_row_filter[5] =
 {
    F_none, F_sub, F_none, F_avg_first, F_paeth_first
 };
 
-static int paeth(int a, int b, int c)
+static int paeth(int a, int b, int c)
+{
+   int p = a + b - c;
+   int pa = abs(p-a);
+   int pb = abs(p-b);
+   int pc = abs(p-c);
+   if (pa <= pb && pa <= pc) return a;
+   if (pb <= pc) return b;
+   return c;
+}
+
+// create the png data from post-deflated data
+#ifdef STBI_SSE2
+// SIMD unfiltering of whole rows when the output has the same layout as the
+// filtered data. cur, prior and raw point at the second pixel of the row
+// (the first is handled by the scalar code), count is the number of pixels
+// left. Sub, Avg and Paeth depend on the pixel to the left, so they run one
+// pixel per step (Sub does four per step with a prefix sum); Up has no
+// dependency and runs 16 or 32 bytes per step.
+
+static stbi_inline __m128i stbi__load32(uint8 const *p)
+{
+   uint32 v; memcpy(&v, p, 4); return _mm_cvtsi32_si128((int) v);
+}
+
+static stbi_inline void stbi__store32(uint8 *p, __m128i v)
+{
+   uint32 x = (uint32) _mm_cvtsi128_si32(v); memcpy(p, &x, 4);
+}
+
+static void png_unfilter_up_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 n)
+{
+   uint32 i = 0;
+   for (; i + 16 <= n; i += 16) {
+      __m128i r = _mm_loadu_si128((__m128i const *) (raw + i));
+      __m128i b = _mm_loadu_si128((__m128i const *) (prior + i));
+      _mm_storeu_si128((__m128i *) (cur + i), _mm_add_epi8(r, b));
+   }
+   for (; i < n; ++i)
+      cur[i] = raw[i] + prior[i];
+}
+
+STBI__TARGET("avx2")
+static void png_unfilter_up_avx2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 n)
+{
+   uint32 i = 0;
+   for (; i + 32 <= n; i += 32) {
+      __m256i r = _mm256_loadu_si256((__m256i const *) (raw + i));
+      __m256i b = _mm256_loadu_si256((__m256i const *) (prior + i));
+      _mm256_storeu_si256((__m256i *) (cur + i), _mm256_add_epi8(r, b));
+   }
+   // the tail is legacy SSE code; entering it with the upper halves dirty
+   // slows every SSE instruction after it
+   _mm256_zeroupper();
+   png_unfilter_up_sse2(cur + i, prior + i, raw + i, n - i);
+}
+
+// Sub on 4-byte pixels: four pixels per step as a prefix sum within the register
+static void png_unfilter_sub4_sse2(uint8 *cur, uint8 const *raw, uint32 count)
+{
+   uint32 i = 0;
+   __m128i a = _mm_shuffle_epi32(stbi__load32(cur - 4), 0);
+   for (; i + 4 <= count; i += 4) {
+      __m128i x = _mm_loadu_si128((__m128i const *) (raw + i*4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+      x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+      x = _mm_add_epi8(x, a);
+      _mm_storeu_si128((__m128i *) (cur + i*4), x);
+      a = _mm_shuffle_epi32(x, 0xff);
+   }
+   for (; i < count; ++i) {
+      a = _mm_add_epi8(stbi__load32(raw + i*4), a);
+      stbi__store32(cur + i*4, a);
+   }
+}
+
+// Sub on 3-byte pixels: the 4-byte loads and stores touch one byte of the
+// next pixel, so the last pixel is left to the caller's scalar loop
+static void png_unfilter_sub3_sse2(uint8 *cur, uint8 const *raw, uint32 count)
+{
+   uint32 i;
+   __m128i a = stbi__load32(cur - 3);
+   for (i=0; i + 1 < count; ++i) {
+      a = _mm_add_epi8(stbi__load32(raw + i*3), a);
+      stbi__store32(cur + i*3, a);
+   }
+}
+
+// the PNG average rounds down, _mm_avg_epu8 rounds up
+static stbi_inline __m128i stbi__avg_floor(__m128i a, __m128i b)
+{
+   __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+static void png_unfilter_avg_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 count, int n)
+{
+   uint32 i;
+   __m128i a = stbi__load32(cur - n);
+   // with 3-byte pixels the last pixel would store past the row
+   if (n == 3) --count;
+   for (i=0; i < count; ++i) {
+      __m128i b = stbi__load32(prior + i*n);
+      a = _mm_add_epi8(stbi__load32(raw + i*n), stbi__avg_floor(a, b));
+      stbi__store32(cur + i*n, a);
+   }
+}
+
+// branch-free paeth predictor on 16-bit lanes
+static stbi_inline __m128i stbi__abs16(__m128i x)
+{
+   return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static void png_unfilter_paeth_sse2(uint8 *cur, uint8 const *prior, uint8 const *raw, uint32 count, int n)
+{
+   uint32 i;
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = _mm_unpacklo_epi8(stbi__load32(cur - n), zero);
+   __m128i c = _mm_unpacklo_epi8(stbi__load32(prior - n), zero);
+   if (n == 3) --count;
+   for (i=0; i < count; ++i) {
+      __m128i b = _mm_unpacklo_epi8(stbi__load32(prior + i*n), zero);
+      __m128i r = stbi__load32(raw + i*n);
+      __m128i pa = _mm_sub_epi16(b, c);   // p - a
+      __m128i pb = _mm_sub_epi16(a, c);   // p - b
+      __m128i pc = _mm_add_epi16(pa, pb); // p - c
+      __m128i not_a, not_b, pred;
+      pa = stbi__abs16(pa);
+      pb = stbi__abs16(pb);
+      pc = stbi__abs16(pc);
+      // a if pa <= pb && pa <= pc, else b if pb <= pc, else c
+      not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+      not_b = _mm_cmpgt_epi16(pb, pc);
+      pred = _mm_or_si128(_mm_and_si128(not_b, c), _mm_andnot_si128(not_b, b));
+      pred = _mm_or_si128(_mm_and_si128(not_a, pred), _mm_andnot_si128(not_a, a));
+      a = _mm_unpacklo_epi8(_mm_add_epi8(r, _mm_packus_epi16(pred, pred)), zero);
+      stbi__store32(cur + i*n, _mm_packus_epi16(a, a));
+      c = b;
+   }
+}
+
+// returns the number of pixels unfiltered; the caller finishes the rest
+static uint32 png_unfilter_simd(int filter, int n, uint8 *cur, uint8 *prior, uint8 *raw, uint32 count)
+{
+   int cpu = stbi__cpu();
+   if (!(cpu & STBI__CPU_SSE2) || count < 2) return 0;
+   switch (filter) {
+      case F_up:
+         if (cpu & STBI__CPU_AVX2) png_unfilter_up_avx2(cur, prior, raw, count*n);
+         else                      png_unfilter_up_sse2(cur, prior, raw, count*n);
+         return count;
+      case F_sub:
+         if (n == 4) { png_unfilter_sub4_sse2(cur, raw, count); return count; }
+         if (n == 3) { png_unfilter_sub3_sse2(cur, raw, count); return count-1; }
+         break;
+      case F_avg:
+         if (n == 4 || n == 3) { png_unfilter_avg_sse2(cur, prior, raw, count, n); return n == 3 ? count-1 : count; }
+         break;
+      case F_paeth:
+         if (n == 4 || n == 3) { png_unfilter_paeth_sse2(cur, prior, raw, count, n); return n == 3 ? count-1 : count; }
+         break;
+   }
+   return 0;
+}
+#endif // STBI_SSE2
+
+// unfilters one row of x pixels with img_n components from raw into cur,
+// whose pixels have out_n components (img_n, or img_n+1 with alpha 255).
+// prior is the previous output row; first rows pass a first_row_filter.
+static void png_unfilter_row(uint8 *cur, uint8 *prior, uint8 *raw, int filter, int img_n, int out_n, uint32 x)
+{
+   uint32 i;
+   int k;
+   // handle first pixel explicitly
+   for (k=0; k < img_n; ++k) {
+      switch (filter) {
+         case F_none       : cur[k] = raw[k]; break;
+         case F_sub        : cur[k] = raw[k]; break;
+         case F_up         : cur[k] = raw[k] + prior[k]; break;
+         case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
+         case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
+         case F_avg_first  : cur[k] = raw[k]; break;
+         case F_paeth_first: cur[k] = raw[k]; break;
+      }
+   }
+   if (img_n != out_n) cur[img_n] = 255;
+   raw += img_n;
+   cur += out_n;
+   prior += out_n;
+   // this is a little gross, so that we don't switch per-pixel or per-component
+   if (img_n == out_n) {
+      uint32 first = 1;
+      #ifdef STBI_SSE2
+      if (x > 1) {
+         uint32 done = png_unfilter_simd(filter, img_n, cur, prior, raw, x-1);
+         raw += done*img_n; cur += done*img_n; prior += done*img_n;
+         first += done;
+      }
+      #endif
+      #define CASE(f) \
+          case f:     \
+             for (i=x-first; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
+      }
+      #undef CASE
+   } else {
+      assert(img_n+1 == out_n);
+      #define CASE(f) \
+          case f:     \
+             for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
+                for (k=0; k < img_n; ++k)
+      switch (filter) {
+         CASE(F_none)  cur[k] = raw[k]; break;
+         CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
+         CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
+         CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
+         CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
+         CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
+         CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
+      }
+      #undef CASE
+   }
+}
+
+// the Adam7 passes: where each starts, and its spacing
+static const uint8 png_xorig[7] = { 0,4,0,2,0,1,0 };
+static const uint8 png_yorig[7] = { 0,0,4,0,2,0,1 };
+static const uint8 png_xspc[7]  = { 8,8,4,4,2,2,1 };
+static const uint8 png_yspc[7]  = { 8,8,8,4,4,2,2 };
+
+static uint32 png_pass_width(stbi *s, int p)
+{
+   return (s->img_x - png_xorig[p] + png_xspc[p]-1) / png_xspc[p];
+}
+
+static uint32 png_pass_height(stbi *s, int p)
+{
+   return (s->img_y - png_yorig[p] + png_yspc[p]-1) / png_yspc[p];
+}
+
+// the size of the inflated image data that the header promises: a filter
+// byte and img_n bytes a pixel for every row, of every pass if interlaced
+static uint32 png_raw_size(stbi *s, int interlaced)
+{
+   uint32 size = 0;
+   int p;
+   if (!interlaced)
+      return (s->img_n * s->img_x + 1) * s->img_y;
+   for (p=0; p < 7; ++p) {
+      uint32 x = png_pass_width(s, p), y = png_pass_height(s, p);
+      if (x && y) size += (s->img_n * x + 1) * y;
+   }
+   return size;
+}
+
+// the decoded image goes to the caller, unless it is palette indices
+// that expand_palette replaces, which only need scratch memory
+static uint8 *png_alloc_out(png *a, uint32 size)
+{
+   if (a->out_scratch) return (uint8 *) scratch_malloc(a->s->arena, size);
+   return (uint8 *) result_malloc(a->s, size);
+}
+
+static void png_free_out(png *a, uint8 *p)
 {
-   int p = a + b - c;
-   int pa = abs(p-a);
-   int pb = abs(p-b);
-   int pc = abs(p-c);
-   if (pa <= pb && pa <= pc) return a;
-   if (pb <= pc) return b;
-   return c;
+   if (a->out_scratch) scratch_free(a->s->arena, p);
+   else result_free(a->s, p);
 }
 
-// create the png data from post-deflated data
-static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
+// unfilters an image, or one interlace pass of it, into out; touches
+// nothing but out, so the passes can be unfiltered on several threads
+static int png_unfilter_image(stbi *s, uint8 *out, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
 {
-   stbi *s = a->s;
-   uint32 i,j,stride = x*out_n;
-   int k;
+   uint32 j,stride = x*out_n;
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
-   if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
-   if (!a->out) return e("outofmem", "Out of memory");
-   if (!stbi_png_partial) {
+   if (!s->settings.png_partial) {
       if (s->img_x == x && s->img_y == y) {
          if (raw_len != (img_n * x + 1) * y) return e("not enough pixels","Corrupt PNG");
       } else { // interlaced:
@@ -2458,111 +4954,225 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
       }
    }
    for (j=0; j < y; ++j) {
-      uint8 *cur = a->out + stride*j;
+      uint8 *cur = out + stride*j;
       uint8 *prior = cur - stride;
       int filter = *raw++;
       if (filter > 4) return e("invalid filter","Corrupt PNG");
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
-      // handle first pixel explicitly
-      for (k=0; k < img_n; ++k) {
-         switch (filter) {
-            case F_none       : cur[k] = raw[k]; break;
-            case F_sub        : cur[k] = raw[k]; break;
-            case F_up         : cur[k] = raw[k] + prior[k]; break;
-            case F_avg        : cur[k] = raw[k] + (prior[k]>>1); break;
-            case F_paeth      : cur[k] = (uint8) (raw[k] + paeth(0,prior[k],0)); break;
-            case F_avg_first  : cur[k] = raw[k]; break;
-            case F_paeth_first: cur[k] = raw[k]; break;
-         }
-      }
-      if (img_n != out_n) cur[img_n] = 255;
-      raw += img_n;
-      cur += out_n;
-      prior += out_n;
-      // this is a little gross, so that we don't switch per-pixel or per-component
-      if (img_n == out_n) {
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, raw+=img_n,cur+=img_n,prior+=img_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-img_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-img_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],prior[k],prior[k-img_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-img_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-img_n],0,0)); break;
-         }
-         #undef CASE
+      png_unfilter_row(cur, prior, raw, filter, img_n, out_n, x);
+      raw += img_n * x;
+   }
+   return 1;
+}
+
+static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
+{
+   stbi *s = a->s;
+   if (s->settings.png_partial) y = 1;
+   a->out = png_alloc_out(a, x * y * out_n);
+   if (!a->out) return e("outofmem", "Out of memory");
+   return png_unfilter_image(s, a->out, raw, raw_len, out_n, x, y);
+}
+
+#ifdef STBI_SSE2
+// png_interleave for 1, 2 and 4-byte pixels, 16 bytes of a and of b at a
+// time; returns how many pairs it did
+static uint32 png_interleave_sse2(uint8 *dest, uint8 const *a, uint8 const *b, uint32 pairs, int n)
+{
+   uint32 i, step = 16 / n;
+   for (i=0; i + step <= pairs; i += step) {
+      __m128i va = _mm_loadu_si128((__m128i const *) (a + i*n));
+      __m128i vb = _mm_loadu_si128((__m128i const *) (b + i*n));
+      __m128i lo, hi;
+      if (n == 1) {
+         lo = _mm_unpacklo_epi8(va, vb);
+         hi = _mm_unpackhi_epi8(va, vb);
+      } else if (n == 2) {
+         lo = _mm_unpacklo_epi16(va, vb);
+         hi = _mm_unpackhi_epi16(va, vb);
       } else {
-         assert(img_n+1 == out_n);
-         #define CASE(f) \
-             case f:     \
-                for (i=x-1; i >= 1; --i, cur[img_n]=255,raw+=img_n,cur+=out_n,prior+=out_n) \
-                   for (k=0; k < img_n; ++k)
-         switch (filter) {
-            CASE(F_none)  cur[k] = raw[k]; break;
-            CASE(F_sub)   cur[k] = raw[k] + cur[k-out_n]; break;
-            CASE(F_up)    cur[k] = raw[k] + prior[k]; break;
-            CASE(F_avg)   cur[k] = raw[k] + ((prior[k] + cur[k-out_n])>>1); break;
-            CASE(F_paeth)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],prior[k],prior[k-out_n])); break;
-            CASE(F_avg_first)    cur[k] = raw[k] + (cur[k-out_n] >> 1); break;
-            CASE(F_paeth_first)  cur[k] = (uint8) (raw[k] + paeth(cur[k-out_n],0,0)); break;
-         }
-         #undef CASE
+         lo = _mm_unpacklo_epi32(va, vb);
+         hi = _mm_unpackhi_epi32(va, vb);
       }
+      _mm_storeu_si128((__m128i *) (dest + 2*i*n), lo);
+      _mm_storeu_si128((__m128i *) (dest + 2*i*n + 16), hi);
    }
-   return 1;
+   return i;
 }
+#endif // STBI_SSE2
 
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
+// writes count pixels of n bytes to dest, taking them from a and b in
+// turn: a has the (count+1)/2 at even positions, b the count/2 at odd ones
+static void png_interleave(uint8 *dest, uint8 const *a, uint8 const *b, uint32 count, int n)
 {
-   uint8 *final;
-   int p;
-   int save;
-   if (!interlaced)
-      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y);
-   save = stbi_png_partial;
-   stbi_png_partial = 0;
+   uint32 i = 0, pairs = count / 2;
+   int k;
+   #ifdef STBI_SSE2
+   if (n != 3 && (stbi__cpu() & STBI__CPU_SSE2))
+      i = png_interleave_sse2(dest, a, b, pairs, n);
+   #endif
+   for (; i < pairs; ++i) {
+      for (k=0; k < n; ++k) {
+         dest[2*i*n + k]     = a[i*n + k];
+         dest[2*i*n + n + k] = b[i*n + k];
+      }
+   }
+   if (count & 1)
+      memcpy(dest + 2*pairs*n, a + pairs*n, n);
+}
+
+typedef struct
+{
+   stbi *s;
+   uint8 *raw;              // the whole inflated image
+   uint32 raw_len;
+   int out_n;
+   uint8 *pass[7];          // each pass unfiltered; NULL if it is empty
+   uint32 offset[7];        // where each pass starts in raw
+   const char *failure[7];  // per pass, NULL if it succeeded
+   uint8 *final, *linebuf;  // linebuf: two half-width rows per band
+   uint32 band_height;
+} png_adam7_job;
+
+static void png_adam7_pass_task(void *arg, int index)
+{
+   png_adam7_job *job = (png_adam7_job *) arg;
+   int p = 6 - index;  // the largest passes first
+   if (job->pass[p] && !png_unfilter_image(job->s, job->pass[p], job->raw + job->offset[p], job->raw_len - job->offset[p],
+                                           job->out_n, png_pass_width(job->s, p), png_pass_height(job->s, p)))
+      job->failure[p] = failure_reason;
+}
+
+static uint8 *png_adam7_row(png_adam7_job *job, int p, uint32 row)
+{
+   if (job->pass[p] == NULL) return NULL;
+   return job->pass[p] + row * png_pass_width(job->s, p) * job->out_n;
+}
+
+// builds row y of the image from the passes: odd rows are all pass 7, and
+// even rows interleave pass 6 with the even columns, which in turn come
+// from passes 5, 3 and 4, or 1, 2 and 4
+static void png_adam7_merge_row(png_adam7_job *job, uint32 y, uint8 *half, uint8 *quarter)
+{
+   int n = job->out_n;
+   uint32 w = job->s->img_x;
+   uint8 *dest = job->final + y * w * n, *even;
+   if (y & 1) {
+      memcpy(dest, png_adam7_row(job, 6, y >> 1), w * n);
+      return;
+   }
+   if (y & 2)
+      even = png_adam7_row(job, 4, y >> 2);
+   else {
+      uint8 *fourth;
+      if (y & 4)
+         fourth = png_adam7_row(job, 2, y >> 3);
+      else {
+         png_interleave(quarter, png_adam7_row(job, 0, y >> 3), png_adam7_row(job, 1, y >> 3), (w+3) >> 2, n);
+         fourth = quarter;
+      }
+      png_interleave(half, fourth, png_adam7_row(job, 3, y >> 2), (w+1) >> 1, n);
+      even = half;
+   }
+   png_interleave(dest, even, png_adam7_row(job, 5, y >> 1), w, n);
+}
+
+static void png_adam7_merge_task(void *arg, int band)
+{
+   png_adam7_job *job = (png_adam7_job *) arg;
+   uint32 y, w = job->s->img_x, line = ((w+1) >> 1) + ((w+3) >> 2);
+   uint32 first = band * job->band_height, last = first + job->band_height;
+   uint8 *half = job->linebuf + band * line * job->out_n;
+   uint8 *quarter = half + ((w+1) >> 1) * job->out_n;
+   if (last > job->s->img_y) last = job->s->img_y;
+   for (y=first; y < last; ++y)
+      png_adam7_merge_row(job, y, half, quarter);
+}
 
-   // de-interlacing
-   final = (uint8 *) malloc(a->s->img_x * a->s->img_y * out_n);
+// de-interlacing: the passes occupy known stretches of the inflated data,
+// so they are unfiltered independently (concurrently with a parallel_for)
+// and then merged a row at a time, also in parallel bands
+static int create_png_image_adam7(png *a, uint8 *raw, uint32 raw_len, int out_n)
+{
+   stbi *s = a->s;
+   png_adam7_job job;
+   uint8 *passes;
+   uint32 offset = 0, size = 0;
+   int p, bands;
+
+   job.s = s;
+   job.raw = raw;
+   job.raw_len = raw_len;
+   job.out_n = out_n;
    for (p=0; p < 7; ++p) {
-      int xorig[] = { 0,4,0,2,0,1,0 };
-      int yorig[] = { 0,0,4,0,2,0,1 };
-      int xspc[]  = { 8,8,4,4,2,2,1 };
-      int yspc[]  = { 8,8,8,4,4,2,2 };
-      int i,j,x,y;
-      // pass1_x[4] = 0, pass1_x[5] = 1, pass1_x[12] = 1
-      x = (a->s->img_x - xorig[p] + xspc[p]-1) / xspc[p];
-      y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      uint32 x = png_pass_width(s, p), y = png_pass_height(s, p);
+      job.offset[p] = offset;
+      job.failure[p] = NULL;
       if (x && y) {
-         if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
-            free(final);
-            return 0;
-         }
-         for (j=0; j < y; ++j)
-            for (i=0; i < x; ++i)
-               memcpy(final + (j*yspc[p]+yorig[p])*a->s->img_x*out_n + (i*xspc[p]+xorig[p])*out_n,
-                      a->out + (j*x+i)*out_n, out_n);
-         free(a->out);
-         raw += (x*out_n+1)*y;
-         raw_len -= (x*out_n+1)*y;
+         offset += (s->img_n * x + 1) * y;
+         size += x * y * out_n;
       }
    }
-   a->out = final;
+   if (raw_len < offset) return e("not enough pixels","Corrupt PNG");
+
+   bands = s->settings.parallel_for ? (s->img_y + 31) / 32 : 1;
+   if (bands > 64) bands = 64;
+   job.band_height = (s->img_y + bands-1) / bands;
+   bands = (s->img_y + job.band_height-1) / job.band_height;
+
+   // final is allocated first so it is the one that can land in the
+   // caller's buffer
+   job.final = png_alloc_out(a, s->img_x * s->img_y * out_n);
+   if (!job.final) return e("outofmem", "Out of memory");
+   passes = (uint8 *) scratch_malloc(s->arena, size);
+   job.linebuf = (uint8 *) scratch_malloc(s->arena, bands * (((s->img_x+1) >> 1) + ((s->img_x+3) >> 2)) * out_n);
+   if (!passes || !job.linebuf) {
+      scratch_free(s->arena, job.linebuf);
+      scratch_free(s->arena, passes);
+      png_free_out(a, job.final);
+      return e("outofmem", "Out of memory");
+   }
+   for (p=0, size=0; p < 7; ++p) {
+      uint32 x = png_pass_width(s, p), y = png_pass_height(s, p);
+      job.pass[p] = x && y ? passes + size : NULL;
+      size += x * y * out_n;
+   }
+
+   stbi_parallel(s, png_adam7_pass_task, &job, 7);
+   for (p=0; p < 7; ++p)
+      if (job.failure[p]) break;
+   if (p < 7) {
+      failure_reason = job.failure[p];
+      scratch_free(s->arena, job.linebuf);
+      scratch_free(s->arena, passes);
+      png_free_out(a, job.final);
+      return 0;
+   }
+   stbi_parallel(s, png_adam7_merge_task, &job, bands);
 
-   stbi_png_partial = save;
+   scratch_free(s->arena, job.linebuf);
+   scratch_free(s->arena, passes);
+   a->out = job.final;
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
 {
-   stbi *s = z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   int save, result;
+   if (!interlaced)
+      return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y);
+   // always the whole image; png_partial is only for the first row
+   save = a->s->settings.png_partial;
+   a->s->settings.png_partial = 0;
+   result = create_png_image_adam7(a, raw, raw_len, out_n);
+   a->s->settings.png_partial = save;
+   return result;
+}
+
+static void transparency_pixels(uint8 *p, uint32 pixel_count, uint8 tc[3], int out_n)
+{
+   uint32 i;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
@@ -2580,20 +5190,17 @@ static int compute_transparency(png *z, uint8 tc[3], int out_n)
          p += 4;
       }
    }
-   return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static int compute_transparency(png *z, uint8 tc[3], int out_n)
 {
-   uint32 i, pixel_count = a->s->img_x * a->s->img_y;
-   uint8 *p, *temp_out, *orig = a->out;
-
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
-
-   // between here and free(out) below, exitting would leak
-   temp_out = p;
+   transparency_pixels(z->out, z->s->img_x * z->s->img_y, tc, out_n);
+   return 1;
+}
 
+static void palette_pixels(uint8 *p, uint8 const *orig, uint32 pixel_count, uint8 const *palette, int pal_img_n)
+{
+   uint32 i;
    if (pal_img_n == 3) {
       for (i=0; i < pixel_count; ++i) {
          int n = orig[i]*4;
@@ -2612,24 +5219,33 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
          p += 4;
       }
    }
-   free(a->out);
+}
+
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+{
+   uint32 pixel_count = a->s->img_x * a->s->img_y;
+   uint8 *temp_out;
+
+   temp_out = (uint8 *) result_malloc(a->s, pixel_count * pal_img_n);
+   if (temp_out == NULL) return e("outofmem", "Out of memory");
+
+   palette_pixels(temp_out, a->out, pixel_count, palette, pal_img_n);
+   png_free_out(a, a->out);
    a->out = temp_out;
+   a->out_scratch = 0;
 
    STBI_NOTUSED(len);
 
    return 1;
 }
 
-static int stbi_unpremultiply_on_load = 0;
-static int stbi_de_iphone_flag = 0;
-
 void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply)
 {
-   stbi_unpremultiply_on_load = flag_true_if_should_unpremultiply;
+   settings_current()->unpremultiply_on_load = flag_true_if_should_unpremultiply;
 }
 void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert)
 {
-   stbi_de_iphone_flag = flag_true_if_should_convert;
+   settings_current()->de_iphone = flag_true_if_should_convert;
 }
 
 static void stbi_de_iphone(png *z)
@@ -2637,9 +5253,16 @@ static void stbi_de_iphone(png *z)
    stbi *s = z->s;
    uint32 i, pixel_count = s->img_x * s->img_y;
    uint8 *p = z->out;
+   int swap = !(s->settings.post & STBI_SWAP_RB);
+   int unpremultiply = s->settings.unpremultiply_on_load;
+
+   // the pixels are premultiplied BGR(A): if the post-processing asks for
+   // either of those, keep it as it is, and take it off the post-processing
+   if (s->settings.post & STBI_PREMULTIPLY_ALPHA) unpremultiply = 0;
+   s->settings.post &= ~(STBI_SWAP_RB | STBI_PREMULTIPLY_ALPHA);
 
    if (s->img_out_n == 3) {  // convert bgr to rgb
-      for (i=0; i < pixel_count; ++i) {
+      for (i=0; swap && i < pixel_count; ++i) {
          uint8 t = p[0];
          p[0] = p[2];
          p[2] = t;
@@ -2647,22 +5270,23 @@ static void stbi_de_iphone(png *z)
       }
    } else {
       assert(s->img_out_n == 4);
-      if (stbi_unpremultiply_on_load) {
-         // convert bgr to rgb and unpremultiply
+      if (unpremultiply) {
+         // convert bgr to rgb (unless keeping bgr) and unpremultiply
+         int r = swap ? 2 : 0, b = 2 - r;
          for (i=0; i < pixel_count; ++i) {
             uint8 a = p[3];
-            uint8 t = p[0];
+            uint8 t = p[b];
             if (a) {
-               p[0] = p[2] * 255 / a;
+               p[0] = p[r] * 255 / a;
                p[1] = p[1] * 255 / a;
                p[2] =  t   * 255 / a;
             } else {
-               p[0] = p[2];
+               p[0] = p[r];
                p[2] = t;
             }
             p += 4;
          }
-      } else {
+      } else if (swap) {
          // convert bgr to rgb
          for (i=0; i < pixel_count; ++i) {
             uint8 t = p[0];
@@ -2679,12 +5303,15 @@ static int parse_png_file(png *z, int scan, int req_comp)
    uint8 palette[1024], pal_img_n=0;
    uint8 has_trans=0, tc[3];
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, iphone=0;
+   int first=1,k,interlace=0, iphone=0, idat_limit=0;
    stbi *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->out_scratch = 0;
+   z->idat = NULL;
+   z->idat_count = 0;
 
    if (!check_png_header(s)) return 0;
 
@@ -2694,7 +5321,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
       chunk c = get_chunk_header(s);
       switch (c.type) {
          case PNG_TYPE('C','g','B','I'):
-            iphone = stbi_de_iphone_flag;
+            iphone = s->settings.de_iphone;
             skip(s, c.length);
             break;
          case PNG_TYPE('I','H','D','R'): {
@@ -2714,7 +5341,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
-               if (scan == SCAN_header) return 1;
+               // if SCAN_header, have to scan to see if we have a tRNS
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
@@ -2741,7 +5368,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
 
          case PNG_TYPE('t','R','N','S'): {
             if (first) return e("first not IHDR", "Corrupt PNG");
-            if (z->idata) return e("tRNS after IDAT","Corrupt PNG");
+            if (z->idata || z->idat_count) return e("tRNS after IDAT","Corrupt PNG");
             if (pal_img_n) {
                if (scan == SCAN_header) { s->img_n = 4; return 1; }
                if (pal_len == 0) return e("tRNS before PLTE","Corrupt PNG");
@@ -2752,6 +5379,8 @@ static int parse_png_file(png *z, int scan, int req_comp)
             } else {
                if (!(s->img_n & 1)) return e("tRNS with alpha","Corrupt PNG");
                if (c.length != (uint32) s->img_n*2) return e("bad tRNS len","Corrupt PNG");
+               // the colour key becomes an alpha channel
+               if (scan == SCAN_header) { ++s->img_n; return 1; }
                has_trans = 1;
                for (k=0; k < s->img_n; ++k)
                   tc[k] = (uint8) get16(s); // non 8-bit images will be larger
@@ -2762,13 +5391,42 @@ static int parse_png_file(png *z, int scan, int req_comp)
          case PNG_TYPE('I','D','A','T'): {
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return e("no PLTE","Corrupt PNG");
-            if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (scan == SCAN_header) { if (pal_img_n) s->img_n = pal_img_n; return 1; }
+            if (scan == SCAN_stream) {
+               // the streaming decoder reads the IDATs itself
+               memcpy(z->palette, palette, sizeof(palette));
+               z->pal_img_n = pal_img_n;
+               z->has_trans = has_trans;
+               memcpy(z->tc, tc, sizeof(tc));
+               z->interlace = interlace;
+               z->iphone = iphone;
+               // the streaming decoder counts the chunk down in an int
+               if (c.length > 0x7fffffff) return e("bad IDAT len","Corrupt PNG");
+               z->idat_len = c.length;
+               return 1;
+            }
+            if (!s->read_from_callbacks) {
+               // the whole file is in memory: inflate reads the chunks where they are
+               if (c.length > (uint32) (s->img_buffer_end - s->img_buffer)) return e("outofdata","Corrupt PNG");
+               if (z->idat_count == idat_limit) {
+                  zsegment *p;
+                  idat_limit = idat_limit ? idat_limit*2 : 8;
+                  p = (zsegment *) scratch_realloc(s->arena, z->idat, idat_limit * sizeof(zsegment));
+                  if (p == NULL) return e("outofmem", "Out of memory");
+                  z->idat = p;
+               }
+               z->idat[z->idat_count].data = s->img_buffer;
+               z->idat[z->idat_count].len  = c.length;
+               ++z->idat_count;
+               s->img_buffer += c.length;
+               break;
+            }
             if (ioff + c.length > idata_limit) {
                uint8 *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
+               p = (uint8 *) scratch_realloc(s->arena, z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!getn(s, z->idata+ioff,c.length)) return e("outofdata","Corrupt PNG");
@@ -2777,20 +5435,39 @@ static int parse_png_file(png *z, int scan, int req_comp)
          }
 
          case PNG_TYPE('I','E','N','D'): {
-            uint32 raw_len;
+            uint32 raw_len, raw_size, deflated = ioff;
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
-            if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            if (z->idata == NULL && z->idat_count == 0) return e("no IDAT","Corrupt PNG");
+            // inflate straight into a buffer of the size the header gives,
+            // so it never has to grow; deflate cannot expand more than
+            // 1032:1, which keeps a corrupt header from claiming a gigabyte
+            for (k=0; k < z->idat_count; ++k)
+               deflated += z->idat[k].len;
+            raw_size = png_raw_size(s, interlace);
+            if (deflated < (1 << 20) && raw_size / 1032 > deflated)
+               raw_size = deflated * 1032;
+            if (raw_size < 64) raw_size = 64;
+            if (z->idata) {
+               zsegment g;
+               g.data = z->idata;
+               g.len  = ioff;
+               z->expanded = (uint8 *) zlib_decode_segments(s->arena, &g, 1, raw_size, (int *) &raw_len, !iphone, s->settings.png_partial);
+            } else
+               z->expanded = (uint8 *) zlib_decode_segments(s->arena, z->idat, z->idat_count, raw_size, (int *) &raw_len, !iphone, s->settings.png_partial);
             if (z->expanded == NULL) return 0; // zlib should set error
-            free(z->idata); z->idata = NULL;
+            scratch_free(s->arena, z->idata); z->idata = NULL;
+            scratch_free(s->arena, z->idat);  z->idat  = NULL;
+            z->out_scratch = pal_img_n != 0;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
             if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
-            if (has_trans)
+            if (has_trans) {
                if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+               s->img_n = s->img_out_n; // report the alpha channel we added
+            }
             if (iphone && s->img_out_n > 2)
                stbi_de_iphone(z);
             if (pal_img_n) {
@@ -2801,7 +5478,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (!expand_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             }
-            free(z->expanded); z->expanded = NULL;
+            scratch_free(s->arena, z->expanded); z->expanded = NULL;
             return 1;
          }
 
@@ -2811,7 +5488,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
                // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               static STBI_THREAD_LOCAL char invalid_chunk[] = "XXXX chunk not known";
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
@@ -2835,7 +5512,7 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       result = p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
-         result = convert_format(result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
+         result = convert_format(p->s, result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          p->s->img_out_n = req_comp;
          if (result == NULL) return result;
       }
@@ -2843,9 +5520,10 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   free(p->out);      p->out      = NULL;
-   free(p->expanded); p->expanded = NULL;
-   free(p->idata);    p->idata    = NULL;
+   png_free_out(p, p->out);              p->out      = NULL;
+   scratch_free(p->s->arena, p->expanded); p->expanded = NULL;
+   scratch_free(p->s->arena, p->idata);    p->idata    = NULL;
+   scratch_free(p->s->arena, p->idat);     p->idat     = NULL;
 
    return result;
 }
@@ -2952,9 +5630,9 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
    uint8 *out;
    unsigned int mr=0,mg=0,mb=0,ma=0, fake_a=0;
-   stbi_uc pal[256][4];
+   stbi_uc pal[256][4], *row;
    int psize=0,i,j,compress=0,width;
-   int bpp, flip_vertically, pad, target, offset, hsz;
+   int bpp, flip_vertically, pad, target, offset, hsz, extra=0;
    if (get8(s) != 'B' || get8(s) != 'M') return epuc("not BMP", "Corrupt BMP");
    get32le(s); // discard filesize
    get16le(s); // discard reserved
@@ -2962,6 +5640,9 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    offset = get32le(s);
    hsz = get32le(s);
    if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return epuc("unknown BMP", "BMP type not supported: unknown");
+   // the pixels cannot start inside the headers; the palette, if any, is
+   // sized from the space between them, so it fits as well
+   if (offset < 14 + hsz) return epuc("bad offset", "Corrupt BMP");
    if (hsz == 12) {
       s->img_x = get16le(s);
       s->img_y = get16le(s);
@@ -2976,7 +5657,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    s->img_y = abs((int) s->img_y);
    if (hsz == 12) {
       if (bpp < 24)
-         psize = (offset - 14 - 24) / 3;
+         psize = (offset - 14 - hsz) / 3;
    } else {
       compress = get32le(s);
       if (compress == 1 || compress == 2) return epuc("BMP RLE", "BMP type not supported: RLE");
@@ -3010,6 +5691,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
                mr = get32le(s);
                mg = get32le(s);
                mb = get32le(s);
+               extra = 12; // the masks follow the header
                // not documented, but generated by photoshop and handled by mspaint
                if (mr == mg && mg == mb) {
                   // ?!?!?
@@ -3036,51 +5718,49 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       target = req_comp;
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
-   out = (stbi_uc *) malloc(target * s->img_x * s->img_y);
+   if (s->img_x && (1 << 28) / s->img_x < s->img_y) return epuc("too large", "Image too large to decode");
+   out = (stbi_uc *) result_malloc(s, target * s->img_x * s->img_y);
    if (!out) return epuc("outofmem", "Out of memory");
+   // rows are read whole, and written straight to where they end up
    if (bpp < 16) {
-      int z=0;
-      if (psize == 0 || psize > 256) { free(out); return epuc("invalid", "Corrupt BMP"); }
-      for (i=0; i < psize; ++i) {
-         pal[i][2] = get8u(s);
-         pal[i][1] = get8u(s);
-         pal[i][0] = get8u(s);
-         if (hsz != 12) get8(s);
+      stbi_uc raw_pal[256*4];
+      int entry = hsz == 12 ? 3 : 4;
+      if (psize <= 0 || psize > 256) { result_free(s, out); return epuc("invalid", "Corrupt BMP"); }
+      getn_pad(s, raw_pal, psize * entry);
+      memset(raw_pal + psize * entry, 0, (256 - psize) * entry);
+      for (i=0; i < 256; ++i) {
+         pal[i][0] = raw_pal[i*entry+2];
+         pal[i][1] = raw_pal[i*entry+1];
+         pal[i][2] = raw_pal[i*entry+0];
          pal[i][3] = 255;
       }
-      skip(s, offset - 14 - hsz - psize * (hsz == 12 ? 3 : 4));
+      skip(s, offset - 14 - hsz - psize * entry);
       if (bpp == 4) width = (s->img_x + 1) >> 1;
       else if (bpp == 8) width = s->img_x;
-      else { free(out); return epuc("bad bpp", "Corrupt BMP"); }
+      else { result_free(s, out); return epuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
+      row = (stbi_uc *) scratch_malloc(s->arena, width + pad);
+      if (!row) { result_free(s, out); return epuc("outofmem", "Out of memory"); }
       for (j=0; j < (int) s->img_y; ++j) {
-         for (i=0; i < (int) s->img_x; i += 2) {
-            int v=get8(s),v2=0;
-            if (bpp == 4) {
-               v2 = v & 15;
-               v >>= 4;
-            }
-            out[z++] = pal[v][0];
-            out[z++] = pal[v][1];
-            out[z++] = pal[v][2];
-            if (target == 4) out[z++] = 255;
-            if (i+1 == (int) s->img_x) break;
-            v = (bpp == 8) ? get8(s) : v2;
-            out[z++] = pal[v][0];
-            out[z++] = pal[v][1];
-            out[z++] = pal[v][2];
-            if (target == 4) out[z++] = 255;
+         stbi_uc *o = out + (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x * target;
+         getn_pad(s, row, width + pad);
+         for (i=0; i < (int) s->img_x; ++i) {
+            int v = bpp == 8 ? row[i] : (i & 1) ? row[i>>1] & 15 : row[i>>1] >> 4;
+            // a whole entry at a time; with three components the fourth
+            // byte is overwritten by the next pixel
+            if (target == 4 || i+1 < (int) s->img_x)
+               memcpy(o + i*target, pal[v], 4);
+            else
+               memcpy(o + i*target, pal[v], 3);
          }
-         skip(s, pad);
       }
    } else {
       int rshift=0,gshift=0,bshift=0,ashift=0,rcount=0,gcount=0,bcount=0,acount=0;
-      int z = 0;
       int easy=0;
-      skip(s, offset - 14 - hsz);
+      skip(s, offset - 14 - hsz - extra);
       if (bpp == 24) width = 3 * s->img_x;
       else if (bpp == 16) width = 2*s->img_x;
-      else /* bpp = 32 and pad = 0 */ width=0;
+      else /* bpp = 32 and pad = 0 */ width = 4*s->img_x;
       pad = (-width) & 3;
       if (bpp == 24) {
          easy = 1;
@@ -3089,51 +5769,45 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) { free(out); return epuc("bad masks", "Corrupt BMP"); }
+         if (!mr || !mg || !mb) { result_free(s, out); return epuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = high_bit(mr)-7; rcount = bitcount(mr);
-         gshift = high_bit(mg)-7; gcount = bitcount(mr);
-         bshift = high_bit(mb)-7; bcount = bitcount(mr);
-         ashift = high_bit(ma)-7; acount = bitcount(mr);
+         gshift = high_bit(mg)-7; gcount = bitcount(mg);
+         bshift = high_bit(mb)-7; bcount = bitcount(mb);
+         ashift = high_bit(ma)-7; acount = bitcount(ma);
       }
+      row = (stbi_uc *) scratch_malloc(s->arena, width + pad);
+      if (!row) { result_free(s, out); return epuc("outofmem", "Out of memory"); }
       for (j=0; j < (int) s->img_y; ++j) {
+         stbi_uc *o = out + (flip_vertically ? (int) s->img_y-1-j : j) * s->img_x * target;
+         getn_pad(s, row, width + pad);
          if (easy) {
-            for (i=0; i < (int) s->img_x; ++i) {
-               int a;
-               out[z+2] = get8u(s);
-               out[z+1] = get8u(s);
-               out[z+0] = get8u(s);
-               z += 3;
-               a = (easy == 2 ? get8(s) : 255);
-               if (target == 4) out[z++] = (uint8) a;
-            }
+            swizzle_row(o, row, easy == 2 ? 4 : 3, target, s->img_x);
          } else {
+            stbi_uc *r = row;
             for (i=0; i < (int) s->img_x; ++i) {
-               uint32 v = (bpp == 16 ? get16le(s) : get32le(s));
+               uint32 v;
                int a;
-               out[z++] = (uint8) shiftsigned(v & mr, rshift, rcount);
-               out[z++] = (uint8) shiftsigned(v & mg, gshift, gcount);
-               out[z++] = (uint8) shiftsigned(v & mb, bshift, bcount);
+               if (bpp == 16) {
+                  v = r[0] | (r[1] << 8);
+                  r += 2;
+               } else {
+                  v = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32) r[3] << 24);
+                  r += 4;
+               }
+               *o++ = (uint8) shiftsigned(v & mr, rshift, rcount);
+               *o++ = (uint8) shiftsigned(v & mg, gshift, gcount);
+               *o++ = (uint8) shiftsigned(v & mb, bshift, bcount);
                a = (ma ? shiftsigned(v & ma, ashift, acount) : 255);
-               if (target == 4) out[z++] = (uint8) a;
+               if (target == 4) *o++ = (uint8) a;
             }
          }
-         skip(s, pad);
-      }
-   }
-   if (flip_vertically) {
-      stbi_uc t;
-      for (j=0; j < (int) s->img_y>>1; ++j) {
-         stbi_uc *p1 = out +      j     *s->img_x*target;
-         stbi_uc *p2 = out + (s->img_y-1-j)*s->img_x*target;
-         for (i=0; i < (int) s->img_x*target; ++i) {
-            t = p1[i], p1[i] = p2[i], p2[i] = t;
-         }
       }
    }
+   scratch_free(s->arena, row);
 
    if (req_comp && req_comp != target) {
-      out = convert_format(out, target, req_comp, s->img_x, s->img_y);
+      out = convert_format(s, out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // convert_format frees input on failure
    }
 
@@ -3154,7 +5828,7 @@ static stbi_uc *stbi_bmp_load(stbi *s,int *x, int *y, int *comp, int req_comp)
 
 static int tga_info(stbi *s, int *x, int *y, int *comp)
 {
-    int tga_w, tga_h, tga_comp;
+    int tga_w, tga_h, tga_comp, tga_indexed, tga_palette_bits;
     int sz;
     get8u(s);                   // discard Offset
     sz = get8u(s);              // color type
@@ -3162,10 +5836,16 @@ static int tga_info(stbi *s, int *x, int *y, int *comp)
         stbi_rewind(s);
         return 0;      // only RGB or indexed allowed
     }
+    tga_indexed = sz;
     sz = get8u(s);              // image type
     // only RGB or grey allowed, +/- RLE
-    if ((sz != 1) && (sz != 2) && (sz != 3) && (sz != 9) && (sz != 10) && (sz != 11)) return 0;
-    skip(s,9);
+    if ((sz != 1) && (sz != 2) && (sz != 3) && (sz != 9) && (sz != 10) && (sz != 11)) {
+        stbi_rewind(s);
+        return 0;
+    }
+    skip(s,4);                  // palette start and length
+    tga_palette_bits = get8u(s);
+    skip(s,4);                  // origin
     tga_w = get16le(s);
     if( tga_w < 1 ) {
         stbi_rewind(s);
@@ -3182,7 +5862,8 @@ static int tga_info(stbi *s, int *x, int *y, int *comp)
         stbi_rewind(s);
         return 0;
     }
-    tga_comp = sz;
+    // like tga_load, paletted images have the palette's components
+    tga_comp = tga_indexed ? tga_palette_bits : sz;
     if (x) *x = tga_w;
     if (y) *y = tga_h;
     if (comp) *comp = tga_comp / 8;
@@ -3240,12 +5921,12 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    //   image data
    unsigned char *tga_data;
    unsigned char *tga_palette = NULL;
-   int i, j;
-   unsigned char raw_data[4];
-   unsigned char trans_data[4];
+   unsigned char *tga_row, *tga_colours;
+   int tga_pixel, tga_comp;
+   int i, j, n;
+   unsigned char RLE_pixel[4];
    int RLE_count = 0;
    int RLE_repeating = 0;
-   int read_next_pixel = 1;
 
    //   do a tiny bit of precessing
    if ( tga_image_type >= 8 )
@@ -3267,11 +5948,19 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       return NULL; // we don't report this as a bad TGA because we don't even know if it's TGA
    }
 
+   if ( (1 << 28) / tga_width < tga_height )
+   {
+      return epuc("too large", "Image too large to decode");
+   }
+
    //   If I'm paletted, then I'll use the number of bits from the palette
    if ( tga_indexed )
    {
       tga_bits_per_pixel = tga_palette_bits;
    }
+   //   bytes per pixel in the file, and in the colours it stands for
+   tga_pixel = tga_indexed ? 1 : tga_bits_per_pixel / 8;
+   tga_comp = tga_bits_per_pixel / 8;
 
    //   tga info
    *x = tga_width;
@@ -3286,7 +5975,7 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       //   force a new number of components
       *comp = tga_bits_per_pixel/8;
    }
-   tga_data = (unsigned char*)malloc( tga_width * tga_height * req_comp );
+   tga_data = (unsigned char*)result_malloc(s, tga_width * tga_height * req_comp );
    if (!tga_data) return epuc("outofmem", "Out of memory");
 
    //   skip to the data's starting position (offset usually = 0)
@@ -3296,148 +5985,108 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    {
       //   any data to skip? (offset usually = 0)
       skip(s, tga_palette_start );
+      if ( tga_palette_len < 1 )
+      {
+         result_free(s, tga_data);
+         return epuc("bad palette", "Corrupt TGA");
+      }
       //   load the palette
-      tga_palette = (unsigned char*)malloc( tga_palette_len * tga_palette_bits / 8 );
-      if (!tga_palette) return epuc("outofmem", "Out of memory");
+      tga_palette = (unsigned char*)scratch_malloc( s->arena, tga_palette_len * tga_palette_bits / 8 );
+      if (!tga_palette)
+      {
+         result_free(s, tga_data);
+         return epuc("outofmem", "Out of memory");
+      }
       if (!getn(s, tga_palette, tga_palette_len * tga_palette_bits / 8 )) {
-         free(tga_data);
-         free(tga_palette);
+         result_free(s, tga_data);
+         scratch_free(s->arena, tga_palette);
          return epuc("bad palette", "Corrupt TGA");
       }
    }
-   //   load the data
-   trans_data[0] = trans_data[1] = trans_data[2] = trans_data[3] = 0;
-   for (i=0; i < tga_width * tga_height; ++i)
+   //   load the data, a row at a time: the row as it is in the file (with
+   //   runs expanded), then the colours it stands for, then those converted
+   tga_row = (unsigned char*)scratch_malloc( s->arena, tga_width * (tga_pixel + 4) );
+   if (!tga_row)
+   {
+      result_free(s, tga_data);
+      if (tga_palette) scratch_free(s->arena, tga_palette);
+      return epuc("outofmem", "Out of memory");
+   }
+   tga_colours = tga_row + tga_width * tga_pixel;
+   for (j = 0; j < tga_height; ++j)
    {
-      //   if I'm in RLE mode, do I need to get a RLE chunk?
-      if ( tga_is_RLE )
+      //   the rows are stored bottom up unless the inverted flag says not
+      unsigned char *dest = tga_data + (tga_inverted ? tga_height - 1 - j : j) * tga_width * req_comp;
+      unsigned char *src = tga_row;
+      if ( !tga_is_RLE )
       {
-         if ( RLE_count == 0 )
-         {
-            //   yep, get the next byte as a RLE command
-            int RLE_cmd = get8u(s);
-            RLE_count = 1 + (RLE_cmd & 127);
-            RLE_repeating = RLE_cmd >> 7;
-            read_next_pixel = 1;
-         } else if ( !RLE_repeating )
-         {
-            read_next_pixel = 1;
-         }
+         getn_pad(s, tga_row, tga_width * tga_pixel);
       } else
       {
-         read_next_pixel = 1;
-      }
-      //   OK, if I need to read a pixel, do it now
-      if ( read_next_pixel )
-      {
-         //   load however much data we did have
-         if ( tga_indexed )
+         //   runs carry on from one row to the next
+         for (i = 0; i < tga_width; i += n)
          {
-            //   read in 1 byte, then perform the lookup
-            int pal_idx = get8u(s);
-            if ( pal_idx >= tga_palette_len )
+            if ( RLE_count == 0 )
             {
-               //   invalid index
-               pal_idx = 0;
+               //   get the next byte as a RLE command, and the pixel it repeats
+               int RLE_cmd = get8u(s);
+               RLE_count = 1 + (RLE_cmd & 127);
+               RLE_repeating = RLE_cmd >> 7;
+               if ( RLE_repeating ) getn_pad(s, RLE_pixel, tga_pixel);
             }
-            pal_idx *= tga_bits_per_pixel / 8;
-            for (j = 0; j*8 < tga_bits_per_pixel; ++j)
+            n = RLE_count < tga_width - i ? RLE_count : tga_width - i;
+            if ( RLE_repeating )
             {
-               raw_data[j] = tga_palette[pal_idx+j];
-            }
-         } else
-         {
-            //   read in the data raw
-            for (j = 0; j*8 < tga_bits_per_pixel; ++j)
+               int k;
+               for (k = 0; k < n; ++k)
+                  memcpy(tga_row + (i + k) * tga_pixel, RLE_pixel, tga_pixel);
+            } else
             {
-               raw_data[j] = get8u(s);
+               getn_pad(s, tga_row + i * tga_pixel, n * tga_pixel);
             }
+            RLE_count -= n;
          }
-         //   convert raw to the intermediate format
-         switch (tga_bits_per_pixel)
+      }
+      if ( (tga_bits_per_pixel & 7) || tga_comp < 1 || tga_comp > 4 )
+      {
+         //   a palette of some other size gives no colours
+         memset(dest, 0, tga_width * req_comp);
+         continue;
+      }
+      if ( tga_indexed )
+      {
+         //   look the colours up, then carry on as if they were in the file
+         for (i = 0; i < tga_width; ++i)
          {
-         case 8:
-            //   Luminous => RGBA
-            trans_data[0] = raw_data[0];
-            trans_data[1] = raw_data[0];
-            trans_data[2] = raw_data[0];
-            trans_data[3] = 255;
-            break;
-         case 16:
-            //   Luminous,Alpha => RGBA
-            trans_data[0] = raw_data[0];
-            trans_data[1] = raw_data[0];
-            trans_data[2] = raw_data[0];
-            trans_data[3] = raw_data[1];
-            break;
-         case 24:
-            //   BGR => RGBA
-            trans_data[0] = raw_data[2];
-            trans_data[1] = raw_data[1];
-            trans_data[2] = raw_data[0];
-            trans_data[3] = 255;
-            break;
-         case 32:
-            //   BGRA => RGBA
-            trans_data[0] = raw_data[2];
-            trans_data[1] = raw_data[1];
-            trans_data[2] = raw_data[0];
-            trans_data[3] = raw_data[3];
-            break;
+            int pal_idx = tga_row[i] < tga_palette_len ? tga_row[i] : 0;
+            memcpy(tga_colours + i * tga_comp, tga_palette + pal_idx * tga_comp, tga_comp);
          }
-         //   clear the reading flag for the next pixel
-         read_next_pixel = 0;
-      } // end of reading a pixel
-      //   convert to final format
-      switch (req_comp)
-      {
-      case 1:
-         //   RGBA => Luminance
-         tga_data[i*req_comp+0] = compute_y(trans_data[0],trans_data[1],trans_data[2]);
-         break;
-      case 2:
-         //   RGBA => Luminance,Alpha
-         tga_data[i*req_comp+0] = compute_y(trans_data[0],trans_data[1],trans_data[2]);
-         tga_data[i*req_comp+1] = trans_data[3];
-         break;
-      case 3:
-         //   RGBA => RGB
-         tga_data[i*req_comp+0] = trans_data[0];
-         tga_data[i*req_comp+1] = trans_data[1];
-         tga_data[i*req_comp+2] = trans_data[2];
-         break;
-      case 4:
-         //   RGBA => RGBA
-         tga_data[i*req_comp+0] = trans_data[0];
-         tga_data[i*req_comp+1] = trans_data[1];
-         tga_data[i*req_comp+2] = trans_data[2];
-         tga_data[i*req_comp+3] = trans_data[3];
-         break;
+         src = tga_colours;
       }
-      //   in case we're in RLE mode, keep counting down
-      --RLE_count;
-   }
-   //   do I need to invert the image?
-   if ( tga_inverted )
-   {
-      for (j = 0; j*2 < tga_height; ++j)
+      //   8 bits is luminance, 16 luminance and alpha, 24 and 32 BGR(A)
+      if ( tga_comp == req_comp && tga_comp <= 2 )
+      {
+         memcpy(dest, src, tga_width * req_comp);
+      } else if ( tga_comp <= 2 )
+      {
+         convert_row(dest, src, tga_comp, req_comp, tga_width);
+      } else if ( req_comp >= 3 )
+      {
+         swizzle_row(dest, src, tga_comp, req_comp, tga_width);
+      } else
       {
-         int index1 = j * tga_width * req_comp;
-         int index2 = (tga_height - 1 - j) * tga_width * req_comp;
-         for (i = tga_width * req_comp; i > 0; --i)
+         for (i = 0; i < tga_width; ++i, src += tga_comp)
          {
-            unsigned char temp = tga_data[index1];
-            tga_data[index1] = tga_data[index2];
-            tga_data[index2] = temp;
-            ++index1;
-            ++index2;
+            dest[i*req_comp+0] = compute_y(src[2],src[1],src[0]);
+            if ( req_comp == 2 ) dest[i*req_comp+1] = tga_comp == 4 ? src[3] : 255;
          }
       }
    }
+   scratch_free( s->arena, tga_row );
    //   clear my palette, if I had one
    if ( tga_palette != NULL )
    {
-      free( tga_palette );
+      scratch_free( s->arena, tga_palette );
    }
    //   the things I do to get rid of an error message, and yet keep
    //   Microsoft's C compilers happy... [8^(
@@ -3475,7 +6124,7 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    int channelCount, compression;
    int channel, i, count, len;
    int w,h;
-   uint8 *out;
+   uint8 *out, *row;
 
    // Check identifier
    if (get32(s) != 0x38425053)   // "8BPS"
@@ -3532,7 +6181,11 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       return epuc("bad compression", "PSD has an unknown compression format");
 
    // Create the destination image.
-   out = (stbi_uc *) malloc(4 * w*h);
+   if (w < 0 || h < 0)
+      return epuc("bad size", "Corrupt PSD image");
+   if (w && (1 << 28) / w < h)
+      return epuc("too large", "Image too large to decode");
+   out = (stbi_uc *) result_malloc(s, 4 * w*h);
    if (!out) return epuc("outofmem", "Out of memory");
    pixelCount = w*h;
 
@@ -3562,7 +6215,8 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             // Fill this channel with default data.
             for (i = 0; i < pixelCount; i++) *p = (channel == 3 ? 255 : 0), p += 4;
          } else {
-            // Read the RLE data.
+            // Read the RLE data; a run that goes past the end of the
+            // channel is read in full, but only stored up to the end.
             count = 0;
             while (count < pixelCount) {
                len = get8(s);
@@ -3570,13 +6224,14 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
                   // No-op.
                } else if (len < 128) {
                   // Copy next len+1 bytes literally.
+                  uint8 run[128];
                   len++;
+                  getn_pad(s, run, len);
+                  if (len > pixelCount - count) len = pixelCount - count;
+                  for (i = 0; i < len; i++)
+                     p[i*4] = run[i];
+                  p += 4*len;
                   count += len;
-                  while (len) {
-                     *p = get8u(s);
-                     p += 4;
-                     len--;
-                  }
                } else if (len > 128) {
                   uint8   val;
                   // Next -len+1 bytes in the dest are replicated from next source byte.
@@ -3584,12 +6239,11 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
                   len ^= 0x0FF;
                   len += 2;
                   val = get8u(s);
+                  if (len > pixelCount - count) len = pixelCount - count;
+                  for (i = 0; i < len; i++)
+                     p[i*4] = val;
+                  p += 4*len;
                   count += len;
-                  while (len) {
-                     *p = val;
-                     p += 4;
-                     len--;
-                  }
                }
             }
          }
@@ -3599,28 +6253,37 @@ static stbi_uc *psd_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       // We're at the raw image data.  It's each channel in order (Red, Green, Blue, Alpha, ...)
       // where each channel consists of an 8-bit value for each pixel in the image.
 
-      // Read the data by channel.
+      // Read the data by channel, a row at a time.
+      row = (uint8 *) scratch_malloc(s->arena, w > 0 && h > 0 ? w : 1);
+      if (!row) { result_free(s, out); return epuc("outofmem", "Out of memory"); }
       for (channel = 0; channel < 4; channel++) {
          uint8 *p;
 
          p = out + channel;
-         if (channel > channelCount) {
+         if (channel >= channelCount) {
             // Fill this channel with default data.
             for (i = 0; i < pixelCount; i++) *p = channel == 3 ? 255 : 0, p += 4;
          } else {
             // Read the data.
-            for (i = 0; i < pixelCount; i++)
-               *p = get8u(s), p += 4;
+            for (count = 0; count < pixelCount; count += w) {
+               getn_pad(s, row, w);
+               for (i = 0; i < w; i++)
+                  p[i*4] = row[i];
+               p += 4*w;
+            }
          }
       }
+      scratch_free(s->arena, row);
    }
 
    if (req_comp && req_comp != 4) {
-      out = convert_format(out, 4, req_comp, w, h);
+      out = convert_format(s, out, 4, req_comp, w, h);
       if (out == NULL) return out; // convert_format frees input on failure
    }
 
-   if (comp) *comp = channelCount;
+   // the channels are always expanded to RGBA, so report that (which is
+   // also what stbi_info says) rather than what the file had
+   if (comp) *comp = 4;
    *y = h;
    *x = w;
 
@@ -3684,6 +6347,41 @@ static stbi_uc *pic_readval(stbi *s, int channel, stbi_uc *dest)
    return dest;
 }
 
+// reads count values into every fourth byte of dest: the values that are
+// already in the buffer are copied out in one go, the rest are read one at
+// a time, so the end of the file is found exactly where pic_readval would
+static stbi_uc *pic_readvals(stbi *s, int channel, stbi_uc *dest, int count)
+{
+   int mask=0x80, i, k, n=0, avail;
+   int chan[4];
+
+   for (i=0; i<4; ++i, mask>>=1)
+      if (channel & mask)
+         chan[n++] = i;
+   if (n == 0) return dest + 4*count;
+
+   while (count > 0) {
+      avail = (int) (s->img_buffer_end - s->img_buffer) / n;
+      if (avail > count) avail = count;
+      if (n == 3 && chan[2] == 2) {
+         for (i=0; i<avail; ++i, dest+=4, s->img_buffer+=3)
+            memcpy(dest, s->img_buffer, 3);
+      } else {
+         for (i=0; i<avail; ++i, dest+=4)
+            for (k=0; k<n; ++k)
+               dest[chan[k]] = *s->img_buffer++;
+      }
+      count -= avail;
+      if (count > 0) {
+         if (!pic_readval(s,channel,dest)) return 0;
+         dest += 4;
+         --count;
+      }
+   }
+
+   return dest;
+}
+
 static void pic_copyval(int channel,stbi_uc *dest,const stbi_uc *src)
 {
    int mask=0x80,i;
@@ -3732,14 +6430,10 @@ static stbi_uc *pic_load2(stbi *s,int width,int height,int *comp, stbi_uc *resul
             default:
                return epuc("bad format","packet has bad compression type");
 
-            case 0: {//uncompressed
-               int x;
-
-               for(x=0;x<width;++x, dest+=4)
-                  if (!pic_readval(s,packet->channel,dest))
-                     return 0;
+            case 0: //uncompressed
+               if (!pic_readvals(s,packet->channel,dest,width))
+                  return 0;
                break;
-            }
 
             case 1://Pure RLE
                {
@@ -3766,7 +6460,7 @@ static stbi_uc *pic_load2(stbi *s,int width,int height,int *comp, stbi_uc *resul
             case 2: {//Mixed RLE
                int left=width;
                while (left>0) {
-                  int count = get8(s), i;
+                  int count = get8(s);
                   if (at_eof(s))  return epuc("bad file","file too short (mixed read count)");
 
                   if (count >= 128) { // Repeated
@@ -3789,9 +6483,8 @@ static stbi_uc *pic_load2(stbi *s,int width,int height,int *comp, stbi_uc *resul
                      ++count;
                      if (count>left) return epuc("bad file","scanline overrun");
 
-                     for(i=0;i<count;++i, dest+=4)
-                        if (!pic_readval(s,packet->channel,dest))
-                           return 0;
+                     dest = pic_readvals(s,packet->channel,dest,count);
+                     if (!dest) return 0;
                   }
                   left-=count;
                }
@@ -3815,24 +6508,25 @@ static stbi_uc *pic_load(stbi *s,int *px,int *py,int *comp,int req_comp)
    x = get16(s);
    y = get16(s);
    if (at_eof(s))  return epuc("bad file","file too short (pic header)");
-   if ((1 << 28) / x < y) return epuc("too large", "Image too large to decode");
+   if (x && (1 << 28) / x < y) return epuc("too large", "Image too large to decode");
 
    get32(s); //skip `ratio'
    get16(s); //skip `fields'
    get16(s); //skip `pad'
 
    // intermediate buffer is RGBA
-   result = (stbi_uc *) malloc(x*y*4);
+   result = (stbi_uc *) result_malloc(s, x*y*4);
+   if (!result) return epuc("outofmem", "Out of memory");
    memset(result, 0xff, x*y*4);
 
    if (!pic_load2(s,x,y,comp, result)) {
-      free(result);
-      result=0;
+      result_free(s, result);
+      return 0;
    }
    *px = x;
    *py = y;
    if (req_comp == 0) req_comp = *comp;
-   result=convert_format(result,4,req_comp,x,y);
+   result=convert_format(s,result,4,req_comp,x,y);
 
    return result;
 }
@@ -3855,6 +6549,7 @@ typedef struct stbi_gif_lzw_struct {
    int16 prefix;
    uint8 first;
    uint8 suffix;
+   uint16 length;  // pixels in the string, so it can be written in one go
 } stbi_gif_lzw;
 
 typedef struct stbi_gif_struct
@@ -3872,6 +6567,23 @@ typedef struct stbi_gif_struct
    int max_x, max_y;
    int cur_x, cur_y;
    int line_size;
+
+   // LZW decoder state, kept here so the raster can arrive a sub-block at
+   // a time (see stbi_gif_lzw_block)
+   int32 lzw_cs, clear, codesize, codemask, avail, oldcode, valid_bits;
+   uint32 bits;
+   int lzw_first;
+
+   // animation: the last frame's delay in 1/100 s and disposal method;
+   // prev holds the canvas from before a frame that restores it
+   int delay, dispose;
+   uint8 *prev;
+
+   // the streaming decoder keeps one row in out: row_base is the offset of
+   // that row in the image, and row_done is called as each row fills up
+   int row_base;
+   void (*row_done)(struct stbi_gif_struct *g);
+   void *row_user;
 } stbi_gif;
 
 static int gif_test(stbi *s)
@@ -3898,8 +6610,10 @@ static void stbi_gif_parse_colortable(stbi *s, uint8 pal[256][4], int num_entrie
       pal[i][2] = get8u(s);
       pal[i][1] = get8u(s);
       pal[i][0] = get8u(s);
-      pal[i][3] = transp ? 0 : 255;
+      pal[i][3] = transp == i ? 0 : 255;
    }
+   // encoders may put the transparent index past the end of a short table
+   if (transp >= num_entries) pal[transp][3] = 0;
 }
 
 static int stbi_gif_header(stbi *s, stbi_gif *g, int *comp, int is_info)
@@ -3942,105 +6656,131 @@ static int stbi_gif_info_raw(stbi *s, int *x, int *y, int *comp)
    return 1;
 }
 
-static void stbi_out_gif_code(stbi_gif *g, uint16 code)
+// transparent pixels leave what is under them
+static void stbi_gif_put(stbi_gif *g, uint8 *p, uint8 index)
 {
-   uint8 *p, *c;
-
-   // recurse to decode the prefixes, since the linked-list is backwards,
-   // and working backwards through an interleaved image would be nasty
-   if (g->codes[code].prefix >= 0)
-      stbi_out_gif_code(g, g->codes[code].prefix);
-
-   if (g->cur_y >= g->max_y) return;
-
-   p = &g->out[g->cur_x + g->cur_y];
-   c = &g->color_table[g->codes[code].suffix * 4];
-
+   uint8 *c = &g->color_table[index * 4];
    if (c[3] >= 128) {
       p[0] = c[2];
       p[1] = c[1];
       p[2] = c[0];
       p[3] = c[3];
    }
-   g->cur_x += 4;
+}
 
-   if (g->cur_x >= g->max_x) {
-      g->cur_x = g->start_x;
-      g->cur_y += g->step;
+static void stbi_gif_next_row(stbi_gif *g)
+{
+   g->cur_x = g->start_x;
+   if (g->row_done) g->row_done(g);
+   g->cur_y += g->step;
 
-      while (g->cur_y >= g->max_y && g->parse > 0) {
-         g->step = (1 << g->parse) * g->line_size;
-         g->cur_y = g->start_y + (g->step >> 1);
-         --g->parse;
-      }
+   while (g->cur_y >= g->max_y && g->parse > 0) {
+      g->step = (1 << g->parse) * g->line_size;
+      g->cur_y = g->start_y + (g->step >> 1);
+      --g->parse;
    }
 }
 
-static uint8 *stbi_process_gif_raster(stbi *s, stbi_gif *g)
+static void stbi_out_gif_code(stbi_gif *g, int32 code)
 {
-   uint8 lzw_cs;
-   int32 len, code;
-   uint32 first;
-   int32 codesize, codemask, avail, oldcode, bits, valid_bits, clear;
-   stbi_gif_lzw *p;
+   uint8 string[4096];
+   int n = g->codes[code].length, i;
 
-   lzw_cs = get8u(s);
-   clear = 1 << lzw_cs;
-   first = 1;
-   codesize = lzw_cs + 1;
-   codemask = (1 << codesize) - 1;
-   bits = 0;
-   valid_bits = 0;
-   for (code = 0; code < clear; code++) {
+   if (g->cur_y >= g->max_y) return;
+
+   if (g->cur_x + n*4 <= g->max_x) {
+      // the whole string lands in this row, so it is written backwards
+      // while walking the prefix chain, which is stored backwards anyway
+      uint8 *p = &g->out[g->cur_x + (n-1)*4 + g->cur_y - g->row_base];
+      for (; code >= 0; code = g->codes[code].prefix, p -= 4)
+         stbi_gif_put(g, p, g->codes[code].suffix);
+      g->cur_x += n*4;
+      if (g->cur_x >= g->max_x)
+         stbi_gif_next_row(g);
+   } else {
+      // it wraps, maybe into another interlace pass: unpack it first
+      for (i=n; code >= 0; code = g->codes[code].prefix)
+         string[--i] = g->codes[code].suffix;
+      for (i=0; i < n && g->cur_y < g->max_y; ++i) {
+         stbi_gif_put(g, &g->out[g->cur_x + g->cur_y - g->row_base], string[i]);
+         g->cur_x += 4;
+         if (g->cur_x >= g->max_x)
+            stbi_gif_next_row(g);
+      }
+   }
+}
+
+static int stbi_gif_lzw_start(stbi_gif *g, int lzw_cs)
+{
+   int32 code;
+   // larger sizes would need more than the 4096 codes there is room for
+   if (lzw_cs > 11) return e("bad code size", "Corrupt GIF");
+   g->lzw_cs = lzw_cs;
+   g->clear = 1 << lzw_cs;
+   g->lzw_first = 1;
+   g->codesize = lzw_cs + 1;
+   g->codemask = (1 << g->codesize) - 1;
+   g->bits = 0;
+   g->valid_bits = 0;
+   for (code = 0; code < g->clear; code++) {
       g->codes[code].prefix = -1;
       g->codes[code].first = (uint8) code;
       g->codes[code].suffix = (uint8) code;
+      g->codes[code].length = 1;
    }
 
    // support no starting clear code
-   avail = clear+2;
-   oldcode = -1;
+   g->avail = g->clear+2;
+   g->oldcode = -1;
+   return 1;
+}
+
+// decodes the codes in one data sub-block. Returns 1 to continue with the
+// next sub-block, 2 at the end of stream code, 0 on errors.
+static int stbi_gif_lzw_block(stbi_gif *g, uint8 const *data, int len)
+{
+   int32 codesize = g->codesize, codemask = g->codemask, avail = g->avail;
+   int32 oldcode = g->oldcode, valid_bits = g->valid_bits;
+   int32 clear = g->clear;
+   uint32 bits = g->bits;
+   int r = 1;
+   stbi_gif_lzw *p;
 
-   len = 0;
    for(;;) {
       if (valid_bits < codesize) {
-         if (len == 0) {
-            len = get8(s); // start new block
-            if (len == 0)
-               return g->out;
-         }
-         --len;
-         bits |= (int32) get8(s) << valid_bits;
-         valid_bits += 8;
+         // top up to as much as 32 bits, so most codes need no refill
+         if (len == 0) break;
+         do {
+            bits |= (uint32) *data++ << valid_bits;
+            valid_bits += 8;
+         } while (--len > 0 && valid_bits <= 24);
       } else {
          int32 code = bits & codemask;
          bits >>= codesize;
          valid_bits -= codesize;
-         // @OPTIMIZE: is there some way we can accelerate the non-clear path?
          if (code == clear) {  // clear code
-            codesize = lzw_cs + 1;
+            codesize = g->lzw_cs + 1;
             codemask = (1 << codesize) - 1;
             avail = clear + 2;
             oldcode = -1;
-            first = 0;
+            g->lzw_first = 0;
          } else if (code == clear + 1) { // end of stream code
-            skip(s, len);
-            while ((len = get8(s)) > 0)
-               skip(s,len);
-            return g->out;
+            r = 2;
+            break;
          } else if (code <= avail) {
-            if (first) return epuc("no clear code", "Corrupt GIF");
+            if (g->lzw_first) return e("no clear code", "Corrupt GIF");
 
             if (oldcode >= 0) {
                p = &g->codes[avail++];
-               if (avail > 4096)        return epuc("too many codes", "Corrupt GIF");
+               if (avail > 4096)        return e("too many codes", "Corrupt GIF");
                p->prefix = (int16) oldcode;
                p->first = g->codes[oldcode].first;
                p->suffix = (code == avail) ? p->first : g->codes[code].first;
+               p->length = g->codes[oldcode].length + 1;
             } else if (code == avail)
-               return epuc("illegal code in raster", "Corrupt GIF");
+               return e("illegal code in raster", "Corrupt GIF");
 
-            stbi_out_gif_code(g, (uint16) code);
+            stbi_out_gif_code(g, code);
 
             if ((avail & codemask) == 0 && avail <= 0x0FFF) {
                codesize++;
@@ -4049,53 +6789,99 @@ static uint8 *stbi_process_gif_raster(stbi *s, stbi_gif *g)
 
             oldcode = code;
          } else {
-            return epuc("illegal code in raster", "Corrupt GIF");
+            return e("illegal code in raster", "Corrupt GIF");
          }
       }
    }
+   g->codesize = codesize; g->codemask = codemask; g->avail = avail;
+   g->oldcode = oldcode; g->bits = bits; g->valid_bits = valid_bits;
+   return r;
 }
 
-static void stbi_fill_gif_background(stbi_gif *g)
+static uint8 *stbi_process_gif_raster(stbi *s, stbi_gif *g)
+{
+   uint8 block[255];
+   int i, len, r;
+
+   if (!stbi_gif_lzw_start(g, get8u(s))) return NULL;
+   for(;;) {
+      len = get8(s); // start new block
+      if (len == 0)
+         return g->out;
+      if (s->img_buffer + len <= s->img_buffer_end) {
+         memcpy(block, s->img_buffer, len);
+         s->img_buffer += len;
+      } else {
+         for (i=0; i < len; ++i)
+            block[i] = get8u(s);
+      }
+      r = stbi_gif_lzw_block(g, block, len);
+      if (r == 0) return NULL;
+      if (r == 2) {
+         while ((len = get8(s)) > 0)
+            skip(s,len);
+         return g->out;
+      }
+   }
+}
+
+// the canvas starts as the background colour, fully transparent, which is
+// also what a frame with disposal method 2 leaves behind
+static void stbi_gif_background(stbi_gif *g, uint8 *p, int count)
 {
    int i;
    uint8 *c = g->pal[g->bgindex];
-   // @OPTIMIZE: write a dword at a time
-   for (i = 0; i < g->w * g->h * 4; i += 4) {
-      uint8 *p  = &g->out[i];
+   for (i=0; i < count; ++i, p += 4) {
       p[0] = c[2];
       p[1] = c[1];
       p[2] = c[0];
-      p[3] = c[3];
+      p[3] = 0;
+   }
+}
+
+static void stbi_fill_gif_background(stbi_gif *g)
+{
+   stbi_gif_background(g, g->out, g->w * g->h);
+}
+
+// undoes the last frame within its rectangle, as its disposal method says
+// (0 and 1 leave it in place)
+static void stbi_gif_dispose(stbi_gif *g)
+{
+   int y;
+   for (y = g->start_y; y < g->max_y; y += g->line_size) {
+      if (g->dispose == 2)
+         stbi_gif_background(g, g->out + y + g->start_x, (g->max_x - g->start_x) >> 2);
+      else if (g->dispose == 3 && g->prev)
+         memcpy(g->out + y + g->start_x, g->prev + y + g->start_x, g->max_x - g->start_x);
    }
+   g->dispose = 0;
 }
 
-// this function is designed to support animated gifs, although stb_image doesn't support it
-static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
+// decodes the next frame onto the canvas in g->out, which is kept between
+// calls for animations; returns (uint8 *) 1 after the last frame
+static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp)
 {
    int i;
-   uint8 *old_out = 0;
 
    if (g->out == 0) {
       if (!stbi_gif_header(s, g, comp,0))     return 0; // failure_reason set by stbi_gif_header
-      g->out = (uint8 *) malloc(4 * g->w * g->h);
+      g->out = (uint8 *) result_malloc(s, 4 * g->w * g->h);
       if (g->out == 0)                      return epuc("outofmem", "Out of memory");
       stbi_fill_gif_background(g);
-   } else {
-      // animated-gif-only path
-      if (((g->eflags & 0x1C) >> 2) == 3) {
-         old_out = g->out;
-         g->out = (uint8 *) malloc(4 * g->w * g->h);
-         if (g->out == 0)                   return epuc("outofmem", "Out of memory");
-         memcpy(g->out, old_out, g->w*g->h*4);
-      }
-   }
+   } else
+      stbi_gif_dispose(g);
+
+   // a graphic control extension only applies to the image after it
+   g->eflags = 0;
+   g->transparent = -1;
+   g->delay = 0;
 
    for (;;) {
       switch (get8(s)) {
          case 0x2C: /* Image Descriptor */
          {
             int32 x, y, w, h;
-            uint8 *o;
 
             x = get16le(s);
             y = get16le(s);
@@ -4134,12 +6920,16 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
             } else
                return epuc("missing color table", "Corrupt GIF");
 
-            o = stbi_process_gif_raster(s, g);
-            if (o == NULL) return NULL;
+            g->dispose = (g->eflags >> 2) & 7;
+            if (g->dispose == 3) {
+               if (g->prev == NULL) {
+                  g->prev = (uint8 *) scratch_malloc(s->arena, 4 * g->w * g->h);
+                  if (g->prev == NULL)         return epuc("outofmem", "Out of memory");
+               }
+               memcpy(g->prev, g->out, 4 * g->w * g->h);
+            }
 
-            if (req_comp && req_comp != 4)
-               o = convert_format(o, 4, req_comp, g->w, g->h);
-            return o;
+            return stbi_process_gif_raster(s, g);
          }
 
          case 0x21: // Comment Extension.
@@ -4149,7 +6939,7 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
                len = get8(s);
                if (len == 4) {
                   g->eflags = get8(s);
-                  get16le(s); // delay
+                  g->delay = get16le(s);
                   g->transparent = get8(s);
                } else {
                   skip(s, len);
@@ -4170,24 +6960,142 @@ static uint8 *stbi_gif_load_next(stbi *s, stbi_gif *g, int *comp, int req_comp)
    }
 }
 
-static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+static stbi_uc *stbi_gif_load(stbi *s, int *x, int *y, int *comp, int req_comp)
+{
+   uint8 *u = 0;
+   stbi_gif g={0};
+
+   u = stbi_gif_load_next(s, &g, comp);
+   scratch_free(s->arena, g.prev);
+   if (u == (void *) 1) u = 0;  // end of animated gif marker
+   if (u == 0) {
+      result_free(s, g.out);
+      return 0;
+   }
+   *x = g.w;
+   *y = g.h;
+   if (req_comp && req_comp != 4)
+      u = convert_format(s, u, 4, req_comp, g.w, g.h);
+   return u;
+}
+
+static int stbi_gif_info(stbi *s, int *x, int *y, int *comp)
+{
+   return stbi_gif_info_raw(s,x,y,comp);
+}
+
+struct stbi_gif_anim
+{
+   stbi s;
+   stbi_gif g;
+   uint8 const *buffer;  // memory input
+   int len;
+   #ifndef STBI_NO_STDIO
+   FILE *f;              // file input, ours to close
+   #endif
+   uint8 *frame;         // the canvas post-processed, when that is on
+   int done;
+};
+
+// (re)starts reading at the first frame
+static void gif_anim_start(stbi_gif_anim *a)
+{
+   stbi__free(a->g.out);
+   stbi__free(a->g.prev);
+   memset(&a->g, 0, sizeof(a->g));
+   #ifndef STBI_NO_STDIO
+   if (a->f) {
+      fseek(a->f, 0, SEEK_SET);
+      start_file(&a->s, a->f);
+   } else
+   #endif
+      start_mem(&a->s, a->buffer, a->len);
+   a->done = 0;
+}
+
+static stbi_gif_anim *gif_anim_alloc(void)
+{
+   stbi_gif_anim *a = (stbi_gif_anim *) stbi__malloc(sizeof(*a));
+   if (a == NULL) { e("outofmem", "Out of memory"); return NULL; }
+   memset(a, 0, sizeof(*a));
+   return a;
+}
+
+// checks the header once the input is set; frees 'a' if it is no GIF
+static stbi_gif_anim *gif_anim_begin(stbi_gif_anim *a, int *x, int *y)
+{
+   gif_anim_start(a);
+   if (!stbi_gif_info_raw(&a->s, x, y, NULL)) {
+      e("not GIF", "Not a GIF");
+      stbi_gif_anim_close(a);
+      return NULL;
+   }
+   gif_anim_start(a);
+   return a;
+}
+
+stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y)
 {
-   uint8 *u = 0;
-   stbi_gif g={0};
+   stbi_gif_anim *a = gif_anim_alloc();
+   if (a == NULL) return NULL;
+   a->buffer = buffer;
+   a->len = len;
+   return gif_anim_begin(a, x, y);
+}
 
-   u = stbi_gif_load_next(s, &g, comp, req_comp);
-   if (u == (void *) 1) u = 0;  // end of animated gif marker
-   if (u) {
-      *x = g.w;
-      *y = g.h;
-   }
+#ifndef STBI_NO_STDIO
+stbi_gif_anim *stbi_gif_anim_open(char const *filename, int *x, int *y)
+{
+   FILE *f = fopen(filename, "rb");
+   stbi_gif_anim *a;
+   if (!f) { e("can't fopen", "Unable to open file"); return NULL; }
+   a = gif_anim_alloc();
+   if (a == NULL) { fclose(f); return NULL; }
+   a->f = f;
+   return gif_anim_begin(a, x, y);
+}
+#endif
 
+stbi_uc *stbi_gif_anim_next(stbi_gif_anim *a, int *delay_ms)
+{
+   uint8 *u;
+   int comp;
+   if (a->done) return NULL;
+   u = stbi_gif_load_next(&a->s, &a->g, &comp);
+   if (u == NULL || u == (uint8 *) 1) {
+      if (u) e("no more frames", "End of animation");
+      a->done = 1;
+      return NULL;
+   }
+   if (delay_ms) *delay_ms = a->g.delay * 10;
+   if (a->s.settings.post) {
+      // the canvas itself has to stay as decoded for the next frame
+      if (a->frame == NULL) {
+         a->frame = (uint8 *) stbi__malloc(4 * a->g.w * a->g.h);
+         if (a->frame == NULL) { a->done = 1; return epuc("outofmem", "Out of memory"); }
+      }
+      memcpy(a->frame, u, 4 * a->g.w * a->g.h);
+      post_image(&a->s, a->frame, 4, a->g.w, a->g.h);
+      return a->frame;
+   }
    return u;
 }
 
-static int stbi_gif_info(stbi *s, int *x, int *y, int *comp)
+void stbi_gif_anim_rewind(stbi_gif_anim *a)
 {
-   return stbi_gif_info_raw(s,x,y,comp);
+   gif_anim_start(a);
+}
+
+void stbi_gif_anim_close(stbi_gif_anim *a)
+{
+   if (a == NULL) return;
+   #ifndef STBI_NO_STDIO
+   if (a->f) fclose(a->f);
+   #endif
+   stbi__free(a->g.out);
+   stbi__free(a->g.prev);
+   stbi__free(a->frame);
+   stbi__free(a);
 }
 
 
@@ -4235,12 +7143,22 @@ static char *hdr_gettoken(stbi *z, char *buffer)
    return buffer;
 }
 
-static void hdr_convert(float *output, stbi_uc *input, int req_comp)
+// 2^(e-136) for each RGBE exponent byte, exactly what ldexp gives; 0 for
+// e=0, which makes the colour 0 as the format requires
+static void hdr_exponents(float scale[256])
+{
+   int i;
+   scale[0] = 0;
+   for (i=1; i < 256; ++i)
+      scale[i] = (float) ldexp(1.0f, i - (int)(128 + 8));
+}
+
+static void hdr_convert(float *output, stbi_uc *input, int req_comp, float const *scale)
 {
    if ( input[3] != 0 ) {
       float f1;
       // Exponent
-      f1 = (float) ldexp(1.0f, input[3] - (int)(128 + 8));
+      f1 = scale[input[3]];
       if (req_comp <= 2)
          output[0] = (input[0] + input[1] + input[2]) * f1 / 3;
       else {
@@ -4262,6 +7180,37 @@ static void hdr_convert(float *output, stbi_uc *input, int req_comp)
    }
 }
 
+// converts a run of RGBE pixels; for 3 and 4 components four pixels a step
+// become four vectors of R,G,B times their exponent, stored overlapping for
+// 3 components, so that step stops short of the last pixel
+static void hdr_convert_row(float *output, stbi_uc *input, int count, int req_comp, float const *scale)
+{
+   int i = 0;
+   #ifdef STBI_SSE2
+   if ((req_comp == 3 || req_comp == 4) && (stbi__cpu() & STBI__CPU_SSE2)) {
+      __m128 opaque = _mm_setr_ps(0,0,0,1);
+      __m128 rgb = _mm_castsi128_ps(_mm_setr_epi32(-1,-1,-1,0));
+      __m128i zero = _mm_setzero_si128();
+      for (; i + 4 + (req_comp == 3) <= count; i += 4) {
+         __m128i v = _mm_loadu_si128((__m128i const *) (input + i*4));
+         __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+         __m128 p[4];
+         int k;
+         p[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+         p[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+         p[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+         p[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+         for (k=0; k < 4; ++k) {
+            __m128 c = _mm_and_ps(_mm_mul_ps(p[k], _mm_set1_ps(scale[input[(i+k)*4+3]])), rgb);
+            _mm_storeu_ps(output + (i+k)*req_comp, _mm_or_ps(c, opaque));
+         }
+      }
+   }
+   #endif
+   for (; i < count; ++i)
+      hdr_convert(output + i*req_comp, input + i*4, req_comp, scale);
+}
+
 static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 {
    char buffer[HDR_BUFLEN];
@@ -4270,6 +7219,7 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    int width, height;
    stbi_uc *scanline;
    float *hdr_data;
+   float scale[256];
    int len;
    unsigned char count, value;
    int i, j, k, c1,c2, z;
@@ -4306,7 +7256,9 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    if (req_comp == 0) req_comp = 3;
 
    // Read data
-   hdr_data = (float *) malloc(height * width * req_comp * sizeof(float));
+   hdr_data = (float *) stbi__malloc(height * width * req_comp * sizeof(float));
+   if (hdr_data == NULL) return epf("outofmem", "Out of memory");
+   hdr_exponents(scale);
 
    // Load image data
    // image data is stored as some number of sca
@@ -4316,8 +7268,8 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
          for (i=0; i < width; ++i) {
             stbi_uc rgbe[4];
            main_decode_loop:
-            getn(s, rgbe, 4);
-            hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp);
+            if (!getn(s, rgbe, 4)) { stbi__free(hdr_data); return epf("outofdata", "corrupt HDR"); }
+            hdr_convert(hdr_data + j * width * req_comp + i * req_comp, rgbe, req_comp, scale);
          }
       }
    } else {
@@ -4336,21 +7288,28 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             rgbe[1] = (uint8) c2;
             rgbe[2] = (uint8) len;
             rgbe[3] = (uint8) get8u(s);
-            hdr_convert(hdr_data, rgbe, req_comp);
+            hdr_convert(hdr_data, rgbe, req_comp, scale);
             i = 1;
             j = 0;
-            free(scanline);
+            scratch_free(s->arena, scanline);
             goto main_decode_loop; // yes, this makes no sense
          }
          len <<= 8;
          len |= get8(s);
-         if (len != width) { free(hdr_data); free(scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
-         if (scanline == NULL) scanline = (stbi_uc *) malloc(width * 4);
+         if (len != width) { stbi__free(hdr_data); scratch_free(s->arena, scanline); return epf("invalid decoded scanline length", "corrupt HDR"); }
+         if (scanline == NULL) {
+            scanline = (stbi_uc *) scratch_malloc(s->arena, width * 4);
+            if (scanline == NULL) { stbi__free(hdr_data); return epf("outofmem", "Out of memory"); }
+         }
 
          for (k = 0; k < 4; ++k) {
             i = 0;
             while (i < width) {
                count = get8u(s);
+               // a count of 0, which is also what the end of the input reads
+               // as, would never finish the scanline
+               z = count > 128 ? count - 128 : count;
+               if (z == 0 || z > width - i) { stbi__free(hdr_data); scratch_free(s->arena, scanline); return epf("bad RLE data in HDR", "corrupt HDR"); }
                if (count > 128) {
                   // Run
                   value = get8u(s);
@@ -4364,10 +7323,9 @@ static float *hdr_load(stbi *s, int *x, int *y, int *comp, int req_comp)
                }
             }
          }
-         for (i=0; i < width; ++i)
-            hdr_convert(hdr_data+(j*width + i)*req_comp, scanline + i*4, req_comp);
+         hdr_convert_row(hdr_data + j*width*req_comp, scanline, width, req_comp, scale);
       }
-      free(scanline);
+      scratch_free(s->arena, scanline);
    }
 
    return hdr_data;
@@ -4384,7 +7342,9 @@ static int stbi_hdr_info(stbi *s, int *x, int *y, int *comp)
    char *token;
    int valid = 0;
 
-   if (strcmp(hdr_gettoken(s,buffer), "#?RADIANCE") != 0) {
+   // check the signature first: reading a whole line of some other format
+   // could run past the bytes stbi_rewind can go back to
+   if (!hdr_test(s)) {
        stbi_rewind( s );
        return 0;
    }
@@ -4420,7 +7380,7 @@ static int stbi_hdr_info(stbi *s, int *x, int *y, int *comp)
 
 static int stbi_bmp_info(stbi *s, int *x, int *y, int *comp)
 {
-   int hsz;
+   int hsz, bpp, compress, alpha = 0;
    if (get8(s) != 'B' || get8(s) != 'M') {
        stbi_rewind( s );
        return 0;
@@ -4436,13 +7396,34 @@ static int stbi_bmp_info(stbi *s, int *x, int *y, int *comp)
       *y = get16le(s);
    } else {
       *x = get32le(s);
-      *y = get32le(s);
+      *y = abs((int) get32le(s)); // negative for top-down images
    }
    if (get16le(s) != 1) {
        stbi_rewind( s );
        return 0;
    }
-   *comp = get16le(s) / 8;
+   bpp = get16le(s);
+   if (bpp == 1) {
+       stbi_rewind( s );
+       return 0;
+   }
+   // bmp_load gives 3 components unless there is an alpha mask: that is
+   // implied for uncompressed 32-bit version 3 headers, and explicit in
+   // version 4; palettes and 16-bit pixels come out as RGB
+   if (hsz != 12) {
+      compress = get32le(s);
+      if (compress == 1 || compress == 2) {
+          stbi_rewind( s );
+          return 0;
+      }
+      if (hsz == 108) {
+         skip(s, 20 + 12);
+         alpha = get32le(s) != 0;
+      } else if (bpp == 32 && compress == 0) {
+         alpha = 1;
+      }
+   }
+   *comp = alpha ? 4 : 3;
    return 1;
 }
 
@@ -4482,12 +7463,14 @@ static int stbi_pic_info(stbi *s, int *x, int *y, int *comp)
    int act_comp=0,num_packets=0,chained;
    pic_packet_t packets[10];
 
-   skip(s, 92);
+   if (!pic_test(s)) {
+       stbi_rewind( s );
+       return 0;
+   }
 
    *x = get16(s);
    *y = get16(s);
-   if (at_eof(s))  return 0;
-   if ( (*x) != 0 && (1 << 28) / (*x) < (*y)) {
+   if (at_eof(s) || *x == 0 || (1 << 28) / (*x) < (*y)) {
        stbi_rewind( s );
        return 0;
    }
@@ -4497,8 +7480,10 @@ static int stbi_pic_info(stbi *s, int *x, int *y, int *comp)
    do {
       pic_packet_t *packet;
 
-      if (num_packets==sizeof(packets)/sizeof(packets[0]))
-         return 0;
+      if (num_packets==sizeof(packets)/sizeof(packets[0])) {
+          stbi_rewind( s );
+          return 0;
+      }
 
       packet = &packets[num_packets++];
       chained = get8(s);
@@ -4583,6 +7568,800 @@ int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int *x, int
    return stbi_info_main(&s,x,y,comp);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+//  streaming decoder
+//
+//  Input is buffered until a step can use it, and each step decodes from
+//  the buffered bytes as if they were the whole file. A step that reads past
+//  them (stbi.overrun, zbuf.zoverrun) is undone from a checkpoint and only
+//  retried once as much input again has arrived, so a step that needs a lot
+//  of input still costs linear time overall; rows also wait for about as
+//  much input as the previous row took before trying. Rows that can't come
+//  out in order (interlaced PNG and GIF, multi-scan JPEG) make us keep the
+//  whole file and decode it with the normal loaders when the input ends.
+
+enum
+{
+   STREAM_sniff=0,
+   STREAM_png_header,
+   STREAM_png_idat,    // copying chunk_left bytes of IDAT into zin
+   STREAM_png_crc,
+   STREAM_png_chunk,
+   STREAM_png_tail,    // past the IDATs, the rest of the input is ignored
+   STREAM_jpeg_header,
+   STREAM_jpeg_rows,
+   STREAM_gif_header,
+   STREAM_gif_block,
+   STREAM_gif_raster,
+   STREAM_whole,       // keeping the whole file, see stream_whole
+   STREAM_done,
+   STREAM_failed
+};
+
+enum { STREAM_png=1, STREAM_jpeg, STREAM_gif };
+
+struct stbi_stream
+{
+   int state, format;
+   int req_comp;
+   stbi_stream_row row;
+   void *user;
+   int x, y, comp, have_info;
+   int next_y;                  // next row for the callback
+
+   stbi s;                      // reads the unconsumed part of in
+   uint8 *in;
+   int in_pos, in_len, in_size;
+   int keep;                    // keep consumed input, the file may be needed whole
+   int ended;                   // the caller said the input is complete
+   size_t fed, retry_at;        // a starved step waits for fed >= retry_at
+   int row_bytes;               // input the last row took, to guess the next
+
+   uint8 *row_buf;              // format-converted output row
+   uint8 *work;                 // png palette row, gif frame row
+   stbi_post post;              // settings.post, for the output rows
+
+   // png: IDAT payloads collect in zin, inflate into window
+   png p;
+   zbuf z;
+   uint8 *zin;
+   int zin_pos, zin_len, zin_size, zin_complete, zin_row;
+   uint32 chunk_left;
+   uint8 *window, *cur, *prior;
+   int window_size, raw_pos, raw_len, img_out_n;
+
+   // jpeg: the component planes hold two MCU rows
+   jpeg j;
+   jpeg_rows_job job;
+   int mcu_row, planes;
+
+   // gif
+   stbi_gif g;
+   uint8 gif_bg[4];
+};
+
+static int stream_fail(stbi_stream *st)
+{
+   if (st->planes) { cleanup_jpeg(&st->j); st->planes = 0; }
+   st->state = STREAM_failed;
+   return -1;
+}
+
+// points the reader at the unconsumed input
+static stbi *stream_reader(stbi_stream *st)
+{
+   stbi *s = &st->s;
+   s->img_buffer = s->img_buffer_original = st->in + st->in_pos;
+   s->img_buffer_end = st->in + st->in_len;
+   s->overrun = 0;
+   return s;
+}
+
+static int stream_starved(stbi_stream *st)
+{
+   return !st->ended && (st->s.overrun || st->s.img_buffer > st->s.img_buffer_end);
+}
+
+// a step ran out of input with 'avail' bytes to work with: retry once the
+// input has doubled, or grown past what the last row took, whichever is
+// more. Returns 0 (no progress).
+static int stream_wait(stbi_stream *st, int avail)
+{
+   int want = avail * 2, guess = st->row_bytes + (st->row_bytes >> 3);
+   if (want < guess) want = guess;
+   if (want < avail + 64) want = avail + 64;
+   st->retry_at = st->fed + (want - avail);
+   return 0;
+}
+
+static void stream_commit(stbi_stream *st)
+{
+   st->in_pos = (int) (st->s.img_buffer - st->in);
+}
+
+// passes a row of n-component pixels on, converted to req_comp and
+// post-processed
+static void stream_put_row(stbi_stream *st, uint8 const *src, int n)
+{
+   int y = st->next_y++;
+   if (st->req_comp && st->req_comp != n) {
+      convert_row(st->row_buf, src, n, st->req_comp, st->x);
+      src = st->row_buf;
+   }
+   if (st->post.flags & ~STBI_FLIP_VERTICALLY) {
+      post_row(&st->post, st->row_buf, src, st->x);
+      src = st->row_buf;
+   }
+   if (st->post.flags & STBI_FLIP_VERTICALLY) y = st->y-1 - y;
+   st->row(st->user, y, src);
+}
+
+static void stream_set_info(stbi_stream *st, int x, int y, int comp)
+{
+   st->x = x;
+   st->y = y;
+   st->comp = comp;
+   st->have_info = 1;
+   post_start(&st->post, st->s.settings.post, st->req_comp ? st->req_comp : comp);
+}
+
+// grows buf (holding len bytes from pos on) to fit n more, dropping the
+// bytes before pos once they are at least half of it
+static int stream_reserve(uint8 **buf, int *pos, int *len, int *size, int n)
+{
+   if (*pos && *pos >= *len - *pos) {
+      memmove(*buf, *buf + *pos, *len - *pos);
+      *len -= *pos;
+      *pos = 0;
+   }
+   if (*len + n > *size) {
+      int limit = *size ? *size : 4096;
+      uint8 *q;
+      while (*len + n > limit)
+         limit *= 2;
+      q = (uint8 *) stbi__realloc(*buf, limit);
+      if (q == NULL) return e("outofmem", "Out of memory");
+      *buf = q;
+      *size = limit;
+   }
+   return 1;
+}
+
+// decodes the kept file with the normal loader once the input has ended
+static int stream_whole(stbi_stream *st)
+{
+   stbi s;
+   uint8 *data = NULL;
+   int i, x, y, comp, n;
+   if (!st->ended) return 0;
+   start_mem(&s, st->in, st->in_len);
+   s.settings = st->s.settings;
+   s.settings.post = 0; // stream_put_row does it
+   if (st->row_buf == NULL && (st->post.flags & ~STBI_FLIP_VERTICALLY)) {
+      st->row_buf = (uint8 *) stbi__malloc(st->x * 4);
+      if (st->row_buf == NULL) { e("outofmem", "Out of memory"); return stream_fail(st); }
+   }
+   switch (st->format) {
+      case STREAM_png:  data = stbi_png_load (&s, &x, &y, &comp, st->req_comp); break;
+      case STREAM_jpeg: data = stbi_jpeg_load(&s, &x, &y, &comp, st->req_comp); break;
+      case STREAM_gif:  data = stbi_gif_load (&s, &x, &y, &comp, st->req_comp); break;
+   }
+   if (data == NULL) return stream_fail(st);
+   n = st->req_comp ? st->req_comp : st->comp;
+   for (i=st->next_y; i < y; ++i)
+      stream_put_row(st, data + i*x*n, n);
+   stbi__free(data);
+   st->state = STREAM_done;
+   return 1;
+}
+
+static int stream_sniff(stbi_stream *st)
+{
+   stbi *s;
+   if (st->in_len - st->in_pos < 8 && !st->ended) return 0;
+   s = stream_reader(st);
+   if      (stbi_png_test(s))  st->format = STREAM_png,  st->state = STREAM_png_header;
+   else if (stbi_jpeg_test(s)) st->format = STREAM_jpeg, st->state = STREAM_jpeg_header;
+   else if (stbi_gif_test(s))  st->format = STREAM_gif,  st->state = STREAM_gif_header;
+   else {
+      e("unknown image type", "Streaming works on PNG, JPEG and GIF only");
+      return stream_fail(st);
+   }
+   return 1;
+}
+
+// PNG
+
+static int stream_png_header(stbi_stream *st)
+{
+   png *p = &st->p;
+   stbi *s = stream_reader(st);
+   int r, comp;
+   p->s = s;
+   r = parse_png_file(p, SCAN_stream, st->req_comp);
+   if (stream_starved(st)) return stream_wait(st, st->in_len - st->in_pos);
+   if (!r) return stream_fail(st);
+   stream_commit(st);
+   if (p->iphone) {
+      e("iphone png", "PNG not supported: iPhone format, when streaming");
+      return stream_fail(st);
+   }
+   if ((st->req_comp == s->img_n+1 && st->req_comp != 3 && !p->pal_img_n) || p->has_trans)
+      st->img_out_n = s->img_n+1;
+   else
+      st->img_out_n = s->img_n;
+   // a colour key counts as alpha, since the rows carry it
+   comp = p->pal_img_n ? p->pal_img_n : p->has_trans ? st->img_out_n : s->img_n;
+   stream_set_info(st, s->img_x, s->img_y, comp);
+   if (p->interlace) {
+      st->state = STREAM_whole;
+      return 1;
+   }
+   st->keep = 0;
+   st->raw_len = s->img_n * st->x + 1;
+   // 32K of history, and room for a row (plus the most a match overshoots
+   // it) a few times over, so compacting moves at most 32K per 32K decoded
+   st->window_size = 65536 + 2 * (st->raw_len + 274);
+   st->window  = (uint8 *) stbi__malloc(st->window_size);
+   st->cur     = (uint8 *) stbi__malloc(st->x * 4);
+   st->prior   = (uint8 *) stbi__malloc(st->x * 4);
+   st->work    = (uint8 *) stbi__malloc(st->x * 4);
+   st->row_buf = (uint8 *) stbi__malloc(st->x * 4);
+   if (!st->window || !st->cur || !st->prior || !st->work || !st->row_buf) {
+      e("outofmem", "Out of memory");
+      return stream_fail(st);
+   }
+   st->z.zout_start = st->z.zout = (char *) st->window;
+   st->z.zout_end = (char *) st->window + st->window_size;
+   st->z.z_expandable = 0;
+   st->z.zstate = st->z.zfinal = st->z.zstored = 0;
+   st->raw_pos = 0;
+   st->chunk_left = p->idat_len;
+   st->state = STREAM_png_idat;
+   return 1;
+}
+
+// moves IDAT payloads from the input to zin, and notices the end of them
+static int stream_png_chunks(stbi_stream *st)
+{
+   int avail = st->in_len - st->in_pos, n;
+   switch (st->state) {
+      case STREAM_png_idat:
+         n = avail < (int) st->chunk_left ? avail : (int) st->chunk_left;
+         if (n) {
+            if (!stream_reserve(&st->zin, &st->zin_pos, &st->zin_len, &st->zin_size, n)) return stream_fail(st);
+            memcpy(st->zin + st->zin_len, st->in + st->in_pos, n);
+            st->zin_len += n;
+            st->in_pos += n;
+            st->chunk_left -= n;
+         }
+         if (st->chunk_left == 0) st->state = STREAM_png_crc;
+         if (n > 0 || st->chunk_left == 0) return 1;
+         break;
+      case STREAM_png_crc:
+         if (avail < 4) break;
+         st->in_pos += 4;
+         st->state = STREAM_png_chunk;
+         return 1;
+      case STREAM_png_chunk: {
+         chunk c;
+         if (avail < 8) break;
+         c = get_chunk_header(stream_reader(st));
+         stream_commit(st);
+         if (c.type == PNG_TYPE('I','D','A','T')) {
+            // as for the first IDAT
+            if (c.length > 0x7fffffff) { e("bad IDAT len","Corrupt PNG"); return stream_fail(st); }
+            st->chunk_left = c.length;
+            st->state = STREAM_png_idat;
+         } else {
+            st->zin_complete = 1;
+            st->state = STREAM_png_tail;
+         }
+         return 1;
+      }
+      default:
+         // past the image data
+         st->in_pos = st->in_len;
+         return 0;
+   }
+   if (st->ended) {
+      // whatever arrived of the IDATs is all there is
+      st->zin_complete = 1;
+      st->state = STREAM_png_tail;
+      return 1;
+   }
+   return 0;
+}
+
+// unfilters one row of inflated data and passes it on
+static int stream_png_row(stbi_stream *st, uint8 *raw)
+{
+   png *p = &st->p;
+   int img_n = st->s.img_n, n = st->img_out_n;
+   int filter = *raw++;
+   uint8 *src = st->cur, *t;
+   if (filter > 4) { e("invalid filter","Corrupt PNG"); return stream_fail(st); }
+   if (st->next_y == 0) filter = first_row_filter[filter];
+   png_unfilter_row(st->cur, st->prior, raw, filter, img_n, n, st->x);
+   if (p->has_trans)
+      transparency_pixels(st->cur, st->x, p->tc, n);
+   if (p->pal_img_n) {
+      n = st->req_comp >= 3 ? st->req_comp : p->pal_img_n;
+      palette_pixels(st->work, st->cur, st->x, p->palette, n);
+      src = st->work;
+   }
+   stream_put_row(st, src, n);
+   t = st->cur; st->cur = st->prior; st->prior = t;
+   return 1;
+}
+
+static int stream_png_rows(stbi_stream *st)
+{
+   zbuf *z = &st->z;
+   int progress = 0;
+   while (st->next_y < st->y) {
+      zsegment seg;
+      uint8 save[offsetof(zbuf, z_length)];
+      char *out_before;
+      int zin_before, state_before, avail;
+      int have = (int) ((uint8 *) z->zout - st->window) - st->raw_pos;
+      if (have >= st->raw_len) {
+         if (stream_png_row(st, st->window + st->raw_pos) < 0) return -1;
+         st->raw_pos += st->raw_len;
+         if (st->zin_row) st->row_bytes = st->zin_row;
+         st->zin_row = 0;
+         progress = 1;
+         continue;
+      }
+      if (z->zstate == 4) { e("not enough pixels","Corrupt PNG"); return stream_fail(st); }
+
+      // keep 32K of history (and the partial row) at the start of the window
+      if (st->window_size - ((uint8 *) z->zout - st->window) < st->raw_len + 274) {
+         int used = (int) ((uint8 *) z->zout - st->window);
+         int drop = used - 32768;
+         if (drop > st->raw_pos) drop = st->raw_pos;
+         if (drop > 0) {
+            memmove(st->window, st->window + drop, used - drop);
+            z->zout -= drop;
+            st->raw_pos -= drop;
+         }
+      }
+
+      // rows tend to take as much input as the last one did
+      avail = st->zin_len - st->zin_pos;
+      if (!st->zin_complete && avail < st->row_bytes)
+         return progress ? 1 : stream_wait(st, avail);
+
+      // the tables are left out of the checkpoint, see zinflate_step
+      memcpy(save, z, sizeof(save));
+      seg.data = st->zin + st->zin_pos;
+      seg.len  = (uint32) avail;
+      zstart(z, &seg, 1);
+      z->zoverrun = 0;
+      z->zout_stop = (char *) st->window + st->raw_pos + st->raw_len;
+      out_before = z->zout;
+      zin_before = st->zin_pos;
+      state_before = z->zstate;
+      if (!zinflate_step(z)) {
+         if (z->zoverrun && !st->zin_complete) { memcpy(z, save, sizeof(save)); return progress ? 1 : stream_wait(st, avail); }
+         return stream_fail(st);
+      }
+      if (z->zoverrun && !st->zin_complete) { memcpy(z, save, sizeof(save)); return progress ? 1 : stream_wait(st, avail); }
+      if (z->zbuffer) st->zin_pos = (int) (z->zbuffer - st->zin);
+      st->zin_row += st->zin_pos - zin_before;
+      if (z->zout == out_before && st->zin_pos == zin_before && z->zstate == state_before) {
+         // the input has ended partway through a stored block
+         e("outofdata","Corrupt PNG");
+         return stream_fail(st);
+      }
+      progress = 1;
+   }
+   st->state = STREAM_done;
+   return 1;
+}
+
+static int stream_png(stbi_stream *st)
+{
+   int r = stream_png_chunks(st), rows;
+   if (r < 0) return r;
+   rows = stream_png_rows(st);
+   if (rows < 0) return rows;
+   return rows || r;
+}
+
+// JPEG
+
+static int stream_jpeg_header(stbi_stream *st)
+{
+   jpeg *z = &st->j;
+   stbi *s = stream_reader(st);
+   int m, r, decode_n;
+   z->s = s;
+   z->scale_shift = 0;
+   z->ring_mcu_rows = 2;
+   z->restart_interval = 0;
+   s->img_n = 0;
+   jpeg_select_kernels(z);
+   r = decode_jpeg_header(z, SCAN_load);
+   if (r) {
+      st->planes = 1;
+      m = get_marker(z);
+      while (!SOS(m)) {
+         if (!process_marker(z, m)) { r = 0; break; }
+         m = get_marker(z);
+      }
+      if (r) r = process_scan_header(z);
+   }
+   if (!r || stream_starved(st)) {
+      if (st->planes) cleanup_jpeg(z);
+      st->planes = 0;
+      if (stream_starved(st)) return stream_wait(st, st->in_len - st->in_pos);
+      return stream_fail(st);
+   }
+   stream_commit(st);
+   stream_set_info(st, s->img_x, s->img_y, s->img_n);
+   if (z->scan_n != s->img_n) {
+      // one component per scan: no row is complete before the last scan
+      cleanup_jpeg(z);
+      st->planes = 0;
+      st->state = STREAM_whole;
+      return 1;
+   }
+   st->keep = 0;
+
+   decode_n = (s->img_n == 3 && st->req_comp && st->req_comp < 3) ? 1 : s->img_n;
+   jpeg_rows_start(z, &st->job, st->req_comp ? st->req_comp : s->img_n, decode_n);
+   st->job.linebuf = (uint8 *) stbi__malloc(decode_n * (st->job.w + 3));
+   st->row_buf = (uint8 *) stbi__malloc(st->job.n * st->job.w);
+   if (!st->job.linebuf || !st->row_buf) {
+      e("outofmem", "Out of memory");
+      return stream_fail(st);
+   }
+   reset(z);
+   st->mcu_row = 0;
+   st->state = STREAM_jpeg_rows;
+   return 1;
+}
+
+// converts the output rows whose source rows have all been decoded
+static void stream_jpeg_emit(stbi_stream *st)
+{
+   jpeg *z = &st->j;
+   jpeg_rows_job *job = &st->job;
+   int k, rows = scan_mcu_rows(z);
+   while (st->next_y < job->h) {
+      for (k=0; k < job->decode_n; ++k) {
+         stbi_resample *r = &job->res_comp[k];
+         int m = (st->next_y + (r->vs >> 1)) / r->vs;
+         int row1 = m < r->h_lores-1 ? m : r->h_lores-1;
+         int decoded = st->mcu_row * (z->scan_n == 1 ? 8 : z->img_comp[k].v * 8);
+         if (st->mcu_row < rows && row1 >= decoded) return;
+      }
+      jpeg_convert_row(job, st->next_y, st->row_buf, job->linebuf);
+      stream_put_row(st, st->row_buf, job->n);
+   }
+}
+
+static int stream_jpeg_rows(stbi_stream *st)
+{
+   jpeg *z = &st->j;
+   int rows = scan_mcu_rows(z), progress = 0;
+   while (st->mcu_row < rows) {
+      uint32 code_buffer = z->code_buffer;
+      int code_bits = z->code_bits, nomore = z->nomore, todo = z->todo, k, r;
+      unsigned char marker = z->marker;
+      int dc_pred[4];
+      if (!st->ended && st->in_len - st->in_pos < st->row_bytes)
+         return progress ? 1 : stream_wait(st, st->in_len - st->in_pos);
+      for (k=0; k < 4; ++k) dc_pred[k] = z->img_comp[k].dc_pred;
+      stream_reader(st);
+      r = decode_mcu_row(z, st->mcu_row);
+      if (stream_starved(st)) {
+         z->code_buffer = code_buffer;
+         z->code_bits = code_bits;
+         z->nomore = nomore;
+         z->todo = todo;
+         z->marker = marker;
+         for (k=0; k < 4; ++k) z->img_comp[k].dc_pred = dc_pred[k];
+         return progress ? 1 : stream_wait(st, st->in_len - st->in_pos);
+      }
+      if (r == 0) return stream_fail(st);
+      st->row_bytes = (int) (st->s.img_buffer - st->s.img_buffer_original);
+      stream_commit(st);
+      // data that ends early at a marker leaves the rest of the image as is
+      st->mcu_row = r == 2 ? rows : st->mcu_row+1;
+      stream_jpeg_emit(st);
+      progress = 1;
+   }
+   cleanup_jpeg(z);
+   st->planes = 0;
+   st->state = STREAM_done;
+   return 1;
+}
+
+// GIF
+
+static void stream_gif_clear(stbi_stream *st)
+{
+   int i;
+   for (i=0; i < st->x; ++i)
+      memcpy(st->work + i*4, st->gif_bg, 4);
+}
+
+// stbi_gif.row_done
+static void stream_gif_row(stbi_gif *g)
+{
+   stbi_stream *st = (stbi_stream *) g->row_user;
+   if (st->next_y < st->y)
+      stream_put_row(st, st->work, 4);
+   stream_gif_clear(st);
+   g->row_base += g->line_size;
+}
+
+// the rest of the image after the first frame's data
+static int stream_gif_finish(stbi_stream *st)
+{
+   while (st->next_y < st->y) {
+      stream_put_row(st, st->work, 4);
+      stream_gif_clear(st);
+   }
+   st->state = STREAM_done;
+   return 1;
+}
+
+static int stream_gif_header(stbi_stream *st)
+{
+   stbi_gif *g = &st->g;
+   stbi *s = stream_reader(st);
+   int comp;
+   memset(g, 0, sizeof(*g));
+   if (!stbi_gif_header(s, g, &comp, 0) || stream_starved(st)) {
+      if (stream_starved(st)) return stream_wait(st, st->in_len - st->in_pos);
+      return stream_fail(st);
+   }
+   stream_commit(st);
+   stream_set_info(st, g->w, g->h, comp);
+   // the background as stbi_fill_gif_background sees it
+   st->gif_bg[0] = g->pal[g->bgindex][2];
+   st->gif_bg[1] = g->pal[g->bgindex][1];
+   st->gif_bg[2] = g->pal[g->bgindex][0];
+   st->gif_bg[3] = 0;
+   st->state = STREAM_gif_block;
+   return 1;
+}
+
+// the blocks before the first image, then its descriptor
+static int stream_gif_block(stbi_stream *st)
+{
+   stbi_gif *g = &st->g;
+   stbi *s = stream_reader(st);
+   int i, len;
+   switch (get8(s)) {
+      case 0x2C: {
+         int32 x, y, w, h;
+         x = get16le(s);
+         y = get16le(s);
+         w = get16le(s);
+         h = get16le(s);
+         if (stream_starved(st)) break;
+         if (((x + w) > (g->w)) || ((y + h) > (g->h))) {
+            e("bad Image Descriptor", "Corrupt GIF");
+            return stream_fail(st);
+         }
+         g->line_size = g->w * 4;
+         g->start_x = x * 4;
+         g->start_y = y * g->line_size;
+         g->max_x   = g->start_x + w * 4;
+         g->max_y   = g->start_y + h * g->line_size;
+         g->cur_x   = g->start_x;
+         g->cur_y   = g->start_y;
+         g->step    = g->line_size;
+         g->parse   = 0;
+         g->lflags = get8(s);
+         if (g->lflags & 0x40) {
+            // interlaced rows arrive in four passes
+            if (stream_starved(st)) break;
+            st->state = STREAM_whole;
+            return 1;
+         }
+         if (g->lflags & 0x80) {
+            stbi_gif_parse_colortable(s,g->lpal, 2 << (g->lflags & 7), g->eflags & 0x01 ? g->transparent : -1);
+            g->color_table = (uint8 *) g->lpal;
+         } else if (g->flags & 0x80) {
+            for (i=0; i < 256; ++i)
+               g->pal[i][3] = 255;
+            if (g->transparent >= 0 && (g->eflags & 0x01))
+               g->pal[g->transparent][3] = 0;
+            g->color_table = (uint8 *) g->pal;
+         } else {
+            e("missing color table", "Corrupt GIF");
+            return stream_fail(st);
+         }
+         i = get8u(s);
+         if (stream_starved(st)) break;
+         if (!stbi_gif_lzw_start(g, i)) return stream_fail(st);
+         stream_commit(st);
+         st->keep = 0;
+
+         st->work    = (uint8 *) stbi__malloc(st->x * 4);
+         st->row_buf = (uint8 *) stbi__malloc(st->x * 4);
+         if (!st->work || !st->row_buf) {
+            e("outofmem", "Out of memory");
+            return stream_fail(st);
+         }
+         stream_gif_clear(st);
+         while (st->next_y < y)
+            stream_put_row(st, st->work, 4);
+         g->out = st->work;
+         g->row_base = g->start_y;
+         g->row_done = stream_gif_row;
+         g->row_user = st;
+         st->state = STREAM_gif_raster;
+         return 1;
+      }
+
+      case 0x21: // Comment Extension.
+         if (get8(s) == 0xF9) { // Graphic Control Extension.
+            len = get8(s);
+            if (len == 4) {
+               g->eflags = get8(s);
+               get16le(s); // delay
+               g->transparent = get8(s);
+            } else {
+               skip(s, len);
+               if (stream_starved(st)) break;
+               stream_commit(st);
+               return 1;
+            }
+         }
+         while ((len = get8(s)) != 0)
+            skip(s, len);
+         if (stream_starved(st)) break;
+         stream_commit(st);
+         return 1;
+
+      case 0x3B: // gif stream termination code
+         if (stream_starved(st)) break;
+         e("no image", "Corrupt GIF");
+         return stream_fail(st);
+
+      default:
+         if (stream_starved(st)) break;
+         e("unknown code", "Corrupt GIF");
+         return stream_fail(st);
+   }
+   return stream_wait(st, st->in_len - st->in_pos);
+}
+
+// feeds whole data sub-blocks to the LZW decoder
+static int stream_gif_raster(stbi_stream *st)
+{
+   int progress = 0;
+   for (;;) {
+      int avail = st->in_len - st->in_pos, len, r;
+      if (avail < 1) break;
+      len = st->in[st->in_pos];
+      if (len == 0) {
+         st->in_pos += 1;
+         return stream_gif_finish(st);
+      }
+      if (avail < 1 + len) {
+         if (st->ended) {
+            // what there is of the last block, then the image ends
+            if (!stbi_gif_lzw_block(&st->g, st->in + st->in_pos + 1, avail - 1)) return stream_fail(st);
+            st->in_pos = st->in_len;
+            return stream_gif_finish(st);
+         }
+         st->retry_at = st->fed + (1 + len - avail);
+         break;
+      }
+      r = stbi_gif_lzw_block(&st->g, st->in + st->in_pos + 1, len);
+      if (r == 0) return stream_fail(st);
+      st->in_pos += 1 + len;
+      if (r == 2) return stream_gif_finish(st);
+      progress = 1;
+   }
+   if (st->ended) return stream_gif_finish(st);
+   return progress;
+}
+
+// runs the decoder as far as the input allows: returns 1 if it got
+// somewhere, 0 if it needs more input (or is done), -1 on errors
+static int stream_step(stbi_stream *st)
+{
+   switch (st->state) {
+      case STREAM_sniff:       return stream_sniff(st);
+      case STREAM_png_header:  return stream_png_header(st);
+      case STREAM_png_idat:
+      case STREAM_png_crc:
+      case STREAM_png_chunk:
+      case STREAM_png_tail:    return stream_png(st);
+      case STREAM_jpeg_header: return stream_jpeg_header(st);
+      case STREAM_jpeg_rows:   return stream_jpeg_rows(st);
+      case STREAM_gif_header:  return stream_gif_header(st);
+      case STREAM_gif_block:   return stream_gif_block(st);
+      case STREAM_gif_raster:  return stream_gif_raster(st);
+      case STREAM_whole:       return stream_whole(st);
+      case STREAM_failed:      return -1;
+   }
+   return 0;
+}
+
+stbi_stream *stbi_stream_begin(int req_comp, stbi_stream_row row, void *user)
+{
+   stbi_stream *st;
+   if (req_comp < 0 || req_comp > 4) { e("bad req_comp", "Internal error"); return NULL; }
+   st = (stbi_stream *) stbi__malloc(sizeof(*st));
+   if (st == NULL) { e("outofmem", "Out of memory"); return NULL; }
+   memset(st, 0, sizeof(*st));
+   start_mem(&st->s, NULL, 0);
+   st->req_comp = req_comp;
+   st->row = row;
+   st->user = user;
+   st->keep = 1;
+   st->state = STREAM_sniff;
+   return st;
+}
+
+int stbi_stream_feed(stbi_stream *st, stbi_uc const *data, int len)
+{
+   int r, pos = 0;
+   if (st->state == STREAM_failed) return 0;
+   if (len > 0) {
+      if (st->state == STREAM_done || st->state == STREAM_png_tail) return 1;
+      // nothing is dropped until we know the file isn't needed whole
+      if (!stream_reserve(&st->in, st->keep ? &pos : &st->in_pos, &st->in_len, &st->in_size, len)) {
+         stream_fail(st);
+         return 0;
+      }
+      memcpy(st->in + st->in_len, data, len);
+      st->in_len += len;
+      st->fed += len;
+      if (st->fed < st->retry_at) return 1;
+   } else
+      st->ended = 1;
+
+   while ((r = stream_step(st)) > 0)
+      ;
+   if (r < 0) return 0;
+   if (st->ended && st->state != STREAM_done) {
+      e("outofdata", "Image data ended early");
+      stream_fail(st);
+      return 0;
+   }
+   return 1;
+}
+
+int stbi_stream_info(stbi_stream *st, int *x, int *y, int *comp)
+{
+   if (!st->have_info) return 0;
+   if (x) *x = st->x;
+   if (y) *y = st->y;
+   if (comp) *comp = st->comp;
+   return 1;
+}
+
+int stbi_stream_done(stbi_stream *st)
+{
+   return st->state == STREAM_done;
+}
+
+void stbi_stream_end(stbi_stream *st)
+{
+   if (st == NULL) return;
+   if (st->planes) cleanup_jpeg(&st->j);
+   stbi__free(st->in);
+   stbi__free(st->row_buf);
+   stbi__free(st->work);
+   stbi__free(st->zin);
+   stbi__free(st->window);
+   stbi__free(st->cur);
+   stbi__free(st->prior);
+   stbi__free(st->job.linebuf);
+   stbi__free(st);
+}
+
 #endif // STBI_HEADER_FILE_ONLY
 
 /*
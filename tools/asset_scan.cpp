@@ -0,0 +1,167 @@
+// asset_scan: lists the size of every image under the given directories
+// without decoding any pixels, along with the texture memory it will take
+// once uploaded, to budget VRAM and size atlases before anything is loaded.
+//
+// build: c++ -O2 tools/asset_scan.cpp -x c GemSwap/stb_image.c -o asset_scan
+// usage: asset_scan [-f rgba|bc1|bc3|bc7|etc2] [-n] [dir or file ...]
+//        -f  the texture format the images are uploaded as (default rgba)
+//        -n  no mipmaps (by default the full chain is counted, as Texture does)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+extern "C" int stbi_info(char const *filename, int *x, int *y, int *comp);
+extern "C" const char *stbi_failure_reason(void);
+
+enum TextureFormat
+{
+    TEXTURE_RGBA,   // uncompressed, 4 bytes per texel
+    TEXTURE_BC1,    // 8 bytes per 4x4 block
+    TEXTURE_BC3,    // 16 bytes per 4x4 block
+    TEXTURE_BC7,    // 16 bytes per 4x4 block
+    TEXTURE_ETC2    // 16 bytes per 4x4 block
+};
+
+static const char* formatNames[] = { "rgba", "bc1", "bc3", "bc7", "etc2" };
+
+struct ImageInfo
+{
+    std::string path;
+    int width, height, components;
+    long long gpuBytes;
+};
+
+// bytes for one mip level; block formats round up to whole 4x4 blocks
+static long long levelBytes(int w, int h, TextureFormat format)
+{
+    if (format == TEXTURE_RGBA) return (long long)w * h * 4;
+    long long blocks = (long long)((w + 3) / 4) * ((h + 3) / 4);
+    return blocks * (format == TEXTURE_BC1 ? 8 : 16);
+}
+
+static long long textureBytes(int w, int h, TextureFormat format, bool mipmaps)
+{
+    long long total = levelBytes(w, h, format);
+    while (mipmaps && (w > 1 || h > 1)) {
+        w = std::max(w / 2, 1);
+        h = std::max(h / 2, 1);
+        total += levelBytes(w, h, format);
+    }
+    return total;
+}
+
+// the extensions stb_image can read
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+// collects image files below path, in name order so runs can be diffed
+static void findImages(const std::string& path, std::vector<std::string>& files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "%s: not found\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string child = path + "/" + names[i];
+        if (stat(child.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            findImages(child, files);
+        else if (isImage(names[i]))
+            files.push_back(child);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: asset_scan [-f rgba|bc1|bc3|bc7|etc2] [-n] [dir or file ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    TextureFormat format = TEXTURE_RGBA;
+    bool mipmaps = true;
+    std::vector<std::string> roots;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            if (++i == argc) usage();
+            int f = 0;
+            while (f < 5 && strcmp(argv[i], formatNames[f]) != 0) f++;
+            if (f == 5) usage();
+            format = (TextureFormat)f;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            mipmaps = false;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            roots.push_back(argv[i]);
+        }
+    }
+    if (roots.empty()) roots.push_back(".");
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < roots.size(); i++) findImages(roots[i], files);
+
+    std::vector<ImageInfo> images;
+    int failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        ImageInfo info;
+        info.path = files[i];
+        if (!stbi_info(files[i].c_str(), &info.width, &info.height, &info.components)) {
+            fprintf(stderr, "%s: %s\n", files[i].c_str(), stbi_failure_reason());
+            failed++;
+            continue;
+        }
+        info.gpuBytes = textureBytes(info.width, info.height, format, mipmaps);
+        images.push_back(info);
+    }
+
+    long long totalBytes = 0, totalTexels = 0;
+    int widest = 0, tallest = 0;
+    printf("%-48s %11s %4s %12s\n", "file", "size", "comp", formatNames[format]);
+    for (size_t i = 0; i < images.size(); i++) {
+        const ImageInfo& info = images[i];
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", info.width, info.height);
+        printf("%-48s %11s %4d %12lld\n", info.path.c_str(), size, info.components, info.gpuBytes);
+        totalBytes += info.gpuBytes;
+        totalTexels += (long long)info.width * info.height;
+        widest = std::max(widest, info.width);
+        tallest = std::max(tallest, info.height);
+    }
+    printf("%d images, %lld texels, largest %dx%d, %.2f MB as %s%s\n",
+           (int)images.size(), totalTexels, widest, tallest, totalBytes / (1024.0 * 1024.0),
+           formatNames[format], mipmaps ? " with mipmaps" : "");
+
+    return failed ? 1 : 0;
+}
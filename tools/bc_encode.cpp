@@ -0,0 +1,581 @@
+// bc_encode: compresses images to BC1, BC3 or BC7 ahead of time, with the
+// full mip chain, and writes each as a KTX file next to the source
+// (asteroid.png -> asteroid.bc3.ktx). The game uploads these as they are,
+// so the driver neither compresses at load nor holds the RGBA copy, and
+// the texture takes 8 (BC1) or 4 (BC3, BC7) times less memory than RGBA.
+// Pixels are flipped and premultiplied as the game's loader does it.
+//
+// build: c++ -O2 -pthread tools/bc_encode.cpp -x c GemSwap/stb_image.c -o bc_encode
+// usage: bc_encode [-f bc1|bc3|bc7] [-n] [-j threads] image ...
+//        -f  the format (default bc3)
+//        -n  the base level only, for textures loaded without mipmaps
+//        -j  encoding threads (default one per core)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+extern "C" unsigned char *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+extern "C" void stbi_set_post_process(int flags);
+// as in stb_image.c, and as GemSwap/main.cpp sets them
+enum { STBI_FLIP_VERTICALLY = 1, STBI_PREMULTIPLY_ALPHA = 2 };
+
+enum Format
+{
+    FORMAT_BC1,     // RGB with 1-bit alpha, 8 bytes per 4x4 block
+    FORMAT_BC3,     // RGB plus interpolated alpha, 16 bytes per 4x4 block
+    FORMAT_BC7      // RGBA, 16 bytes per 4x4 block, encoded with mode 6
+};
+
+static const char* formatNames[] = { "bc1", "bc3", "bc7" };
+static const unsigned int formatInternal[] = { 0x83F1, 0x83F3, 0x8E8C };   // GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, ..._DXT5_EXT, GL_COMPRESSED_RGBA_BPTC_UNORM
+
+static int blockBytes(Format format)
+{
+    return format == FORMAT_BC1 ? 8 : 16;
+}
+
+// dot products of the 16 RGBA pixels of a block with dir
+static void projectBlock(const unsigned char* block, const int dir[4], int dots[16])
+{
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i d = _mm_setr_epi16(dir[0], dir[1], dir[2], dir[3], dir[0], dir[1], dir[2], dir[3]);
+    for (int i = 0; i < 16; i += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(block + i * 4));
+        // two pixels per register, each giving rg and ba partial sums
+        __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), d));
+        __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), d));
+        __m128i rg = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i ba = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_si128((__m128i*)(dots + i), _mm_add_epi32(rg, ba));
+    }
+#else
+    for (int i = 0; i < 16; i++) {
+        const unsigned char* p = block + i * 4;
+        dots[i] = p[0] * dir[0] + p[1] * dir[1] + p[2] * dir[2] + p[3] * dir[3];
+    }
+#endif
+}
+
+// the two ends of the block's spread along its principal axis, over the
+// pixels in mask and the first channels components
+static bool principalEnds(const unsigned char* block, int channels, unsigned int mask, float start[4], float end[4])
+{
+    float mean[4] = {0, 0, 0, 0};
+    int count = 0;
+    for (int i = 0; i < 16; i++) {
+        if (!(mask & (1 << i))) continue;
+        for (int c = 0; c < channels; c++) mean[c] += block[i * 4 + c];
+        count++;
+    }
+    if (count == 0) return false;
+    for (int c = 0; c < channels; c++) mean[c] /= count;
+
+    float cov[4][4] = {{0}};
+    for (int i = 0; i < 16; i++) {
+        if (!(mask & (1 << i))) continue;
+        float d[4];
+        for (int c = 0; c < channels; c++) d[c] = block[i * 4 + c] - mean[c];
+        for (int a = 0; a < channels; a++)
+            for (int b = 0; b < channels; b++) cov[a][b] += d[a] * d[b];
+    }
+
+    // power iteration, started from the diagonal so it is never orthogonal
+    float axis[4] = {1, 1, 1, 1};
+    for (int iteration = 0; iteration < 8; iteration++) {
+        float next[4] = {0, 0, 0, 0}, length = 0;
+        for (int a = 0; a < channels; a++) {
+            for (int b = 0; b < channels; b++) next[a] += cov[a][b] * axis[b];
+            length = std::max(length, fabsf(next[a]));
+        }
+        if (length == 0) break;
+        for (int a = 0; a < channels; a++) axis[a] = next[a] / length;
+    }
+
+    float low = 0, high = 0, norm = 0;
+    for (int c = 0; c < channels; c++) norm += axis[c] * axis[c];
+    for (int i = 0; i < 16; i++) {
+        if (!(mask & (1 << i))) continue;
+        float t = 0;
+        for (int c = 0; c < channels; c++) t += (block[i * 4 + c] - mean[c]) * axis[c];
+        low = std::min(low, t / norm);
+        high = std::max(high, t / norm);
+    }
+    for (int c = 0; c < 4; c++) {
+        start[c] = c < channels ? std::min(std::max(mean[c] + axis[c] * low, 0.0f), 255.0f) : 255;
+        end[c] = c < channels ? std::min(std::max(mean[c] + axis[c] * high, 0.0f), 255.0f) : 255;
+    }
+    return true;
+}
+
+// endpoints minimising the squared error for fixed interpolation weights,
+// weight[i] being how far pixel i lies from start to end
+static bool leastSquaresEnds(const unsigned char* block, int channels, unsigned int mask, const float weight[16], float start[4], float end[4])
+{
+    float aa = 0, bb = 0, ab = 0, ax[4] = {0, 0, 0, 0}, bx[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 16; i++) {
+        if (!(mask & (1 << i))) continue;
+        float b = weight[i], a = 1 - b;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for (int c = 0; c < channels; c++) {
+            ax[c] += a * block[i * 4 + c];
+            bx[c] += b * block[i * 4 + c];
+        }
+    }
+    float det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f) return false;
+    for (int c = 0; c < channels; c++) {
+        start[c] = std::min(std::max((bb * ax[c] - ab * bx[c]) / det, 0.0f), 255.0f);
+        end[c] = std::min(std::max((aa * bx[c] - ab * ax[c]) / det, 0.0f), 255.0f);
+    }
+    return true;
+}
+
+// ---- BC1 colour blocks, also the colour half of BC3
+
+static int pack565(const float c[4])
+{
+    int r = (int)(c[0] * 31 / 255 + 0.5f), g = (int)(c[1] * 63 / 255 + 0.5f), b = (int)(c[2] * 31 / 255 + 0.5f);
+    return (r << 11) | (g << 5) | b;
+}
+
+static void unpack565(int packed, int c[4])
+{
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+    c[3] = 0;
+}
+
+struct ColorBlock
+{
+    int color0, color1;
+    unsigned int indices;       // 2 bits per pixel, pixel 0 lowest
+    int error;
+};
+
+// indices for two 565 endpoints; with transparent set the block is coded
+// in three colour mode and the pixels outside opaque take index 3, which
+// decodes to transparent black
+static ColorBlock fitColors(const unsigned char* block, int color0, int color1, bool transparent, unsigned int opaque)
+{
+    ColorBlock result;
+    // four colour mode needs color0 > color1, three colour mode the reverse
+    if (transparent ? color0 > color1 : color0 < color1) std::swap(color0, color1);
+    result.color0 = color0;
+    result.color1 = color1;
+
+    int palette[4][4];
+    unpack565(color0, palette[0]);
+    unpack565(color1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        if (transparent) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        } else {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+    }
+
+    // the position of each pixel between the endpoints picks its index
+    int dir[4] = {palette[1][0] - palette[0][0], palette[1][1] - palette[0][1], palette[1][2] - palette[0][2], 0};
+    int dots[16];
+    projectBlock(block, dir, dots);
+    int origin = palette[0][0] * dir[0] + palette[0][1] * dir[1] + palette[0][2] * dir[2];
+    int length = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+    static const int fourColors[4] = {0, 2, 3, 1}, threeColors[3] = {0, 2, 1};
+
+    result.indices = 0;
+    result.error = 0;
+    for (int i = 0; i < 16; i++) {
+        const unsigned char* p = block + i * 4;
+        int index;
+        if (transparent && !(opaque & (1 << i))) {
+            index = 3;
+        } else if (transparent) {
+            int t = 4 * (dots[i] - origin);
+            index = threeColors[(t > length) + (t > 3 * length)];
+        } else {
+            int t = 6 * (dots[i] - origin);
+            index = fourColors[(t > length) + (t > 3 * length) + (t > 5 * length)];
+        }
+        result.indices |= index << (i * 2);
+        if (transparent && index == 3) continue;
+        for (int c = 0; c < 3; c++) result.error += (p[c] - palette[index][c]) * (p[c] - palette[index][c]);
+    }
+    return result;
+}
+
+static void encodeColorBlock(const unsigned char* block, bool allowTransparent, unsigned char* out)
+{
+    unsigned int opaque = 0;
+    for (int i = 0; i < 16; i++)
+        if (block[i * 4 + 3] >= 128) opaque |= 1 << i;
+    bool transparent = allowTransparent && opaque != 0xFFFF;
+    unsigned int fitted = transparent ? opaque : 0xFFFF;
+
+    ColorBlock best;
+    float start[4], end[4];
+    if (!principalEnds(block, 3, fitted, start, end)) {
+        // nothing opaque
+        best.color0 = best.color1 = 0;
+        best.indices = 0xFFFFFFFF;
+    } else {
+        best = fitColors(block, pack565(start), pack565(end), transparent, opaque);
+        // refit the endpoints to the chosen indices, and keep whichever is closer
+        for (int pass = 0; pass < 2; pass++) {
+            float weight[16];
+            for (int i = 0; i < 16; i++) {
+                int index = (best.indices >> (i * 2)) & 3;
+                weight[i] = index == 0 ? 0 : index == 1 ? 1 : transparent ? 0.5f : index == 2 ? 1 / 3.0f : 2 / 3.0f;
+            }
+            if (!leastSquaresEnds(block, 3, fitted, weight, start, end)) break;
+            ColorBlock refined = fitColors(block, pack565(start), pack565(end), transparent, opaque);
+            if (refined.error >= best.error) break;
+            best = refined;
+        }
+    }
+    out[0] = (unsigned char)best.color0;
+    out[1] = (unsigned char)(best.color0 >> 8);
+    out[2] = (unsigned char)best.color1;
+    out[3] = (unsigned char)(best.color1 >> 8);
+    for (int i = 0; i < 4; i++) out[4 + i] = (unsigned char)(best.indices >> (i * 8));
+}
+
+// ---- BC3 alpha blocks
+
+static void encodeAlphaBlock(const unsigned char* block, unsigned char* out)
+{
+    int low = 255, high = 0;
+    for (int i = 0; i < 16; i++) {
+        low = std::min(low, (int)block[i * 4 + 3]);
+        high = std::max(high, (int)block[i * 4 + 3]);
+    }
+    // alpha0 > alpha1 selects eight interpolated levels, from alpha0 at step 0 to alpha1 at step 7
+    out[0] = (unsigned char)high;
+    out[1] = (unsigned char)low;
+    unsigned long long indices = 0;
+    if (high > low) {
+        static const int codes[8] = {0, 2, 3, 4, 5, 6, 7, 1};
+        int range = high - low;
+        for (int i = 0; i < 16; i++) {
+            int step = ((high - block[i * 4 + 3]) * 14 + range) / (2 * range);
+            indices |= (unsigned long long)codes[step] << (i * 3);
+        }
+    }
+    for (int i = 0; i < 6; i++) out[2 + i] = (unsigned char)(indices >> (i * 8));
+}
+
+// ---- BC7 mode 6: one subset, RGBA endpoints of 7 bits plus a p-bit, 4-bit indices
+
+static const int bc7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+struct BC7Block
+{
+    int ends[2][4];             // 7 bits each
+    int pbits[2];
+    unsigned char indices[16];
+    int error;
+};
+
+// 7-bit endpoint and p-bit nearest to the colour
+static void quantizeBC7(const float color[4], int end[4], int& pbit)
+{
+    int bestError = -1;
+    for (int p = 0; p < 2; p++) {
+        int q[4], error = 0;
+        for (int c = 0; c < 4; c++) {
+            q[c] = std::min(std::max((int)((color[c] - p) / 2 + 0.5f), 0), 127);
+            int d = ((q[c] << 1) | p) - (int)(color[c] + 0.5f);
+            error += d * d;
+        }
+        if (bestError < 0 || error < bestError) {
+            bestError = error;
+            pbit = p;
+            memcpy(end, q, sizeof(q));
+        }
+    }
+}
+
+static BC7Block fitBC7(const unsigned char* block, const float start[4], const float end[4])
+{
+    BC7Block result;
+    quantizeBC7(start, result.ends[0], result.pbits[0]);
+    quantizeBC7(end, result.ends[1], result.pbits[1]);
+
+    int e0[4], e1[4], palette[16][4];
+    for (int c = 0; c < 4; c++) {
+        e0[c] = (result.ends[0][c] << 1) | result.pbits[0];
+        e1[c] = (result.ends[1][c] << 1) | result.pbits[1];
+    }
+    for (int j = 0; j < 16; j++)
+        for (int c = 0; c < 4; c++) palette[j][c] = ((64 - bc7Weights[j]) * e0[c] + bc7Weights[j] * e1[c] + 32) >> 6;
+
+    int dir[4] = {e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2], e1[3] - e0[3]};
+    int dots[16];
+    projectBlock(block, dir, dots);
+    int origin = e0[0] * dir[0] + e0[1] * dir[1] + e0[2] * dir[2] + e0[3] * dir[3];
+    int length = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2] + dir[3] * dir[3];
+
+    result.error = 0;
+    for (int i = 0; i < 16; i++) {
+        // compared against the midpoints between neighbouring weights
+        int t = 128 * (dots[i] - origin), index = 0;
+        while (index < 15 && t > length * (bc7Weights[index] + bc7Weights[index + 1])) index++;
+        result.indices[i] = (unsigned char)index;
+        for (int c = 0; c < 4; c++) {
+            int d = block[i * 4 + c] - palette[index][c];
+            result.error += d * d;
+        }
+    }
+    return result;
+}
+
+// writes count bits of value at bit position pos, lowest bit first
+static void putBits(unsigned char* out, int& pos, unsigned int value, int count)
+{
+    for (int i = 0; i < count; i++, pos++)
+        if (value & (1u << i)) out[pos >> 3] |= (unsigned char)(1 << (pos & 7));
+}
+
+static void encodeBC7Block(const unsigned char* block, unsigned char* out)
+{
+    float start[4], end[4];
+    principalEnds(block, 4, 0xFFFF, start, end);
+    BC7Block best = fitBC7(block, start, end);
+    for (int pass = 0; pass < 2; pass++) {
+        float weight[16];
+        for (int i = 0; i < 16; i++) weight[i] = bc7Weights[best.indices[i]] / 64.0f;
+        if (!leastSquaresEnds(block, 4, 0xFFFF, weight, start, end)) break;
+        BC7Block refined = fitBC7(block, start, end);
+        if (refined.error >= best.error) break;
+        best = refined;
+    }
+
+    // pixel 0 has an implied leading 0 in its index; swap the ends to give it one
+    if (best.indices[0] & 8) {
+        for (int c = 0; c < 4; c++) std::swap(best.ends[0][c], best.ends[1][c]);
+        std::swap(best.pbits[0], best.pbits[1]);
+        for (int i = 0; i < 16; i++) best.indices[i] = (unsigned char)(15 - best.indices[i]);
+    }
+
+    memset(out, 0, 16);
+    int pos = 0;
+    putBits(out, pos, 1 << 6, 7);
+    for (int c = 0; c < 4; c++) {
+        putBits(out, pos, best.ends[0][c], 7);
+        putBits(out, pos, best.ends[1][c], 7);
+    }
+    putBits(out, pos, best.pbits[0], 1);
+    putBits(out, pos, best.pbits[1], 1);
+    for (int i = 0; i < 16; i++) putBits(out, pos, best.indices[i], i == 0 ? 3 : 4);
+}
+
+// ---- images
+
+struct Level
+{
+    int width, height;
+    std::vector<unsigned char> pixels;      // RGBA
+    std::vector<unsigned char> blocks;
+};
+
+// 2x2 box filter of an RGBA image, odd edges are clamped, as Texture builds its chain
+static void downsample(const Level& src, Level& dst)
+{
+    dst.width = std::max(src.width / 2, 1);
+    dst.height = std::max(src.height / 2, 1);
+    dst.pixels.resize((size_t)dst.width * dst.height * 4);
+    for (int y = 0; y < dst.height; y++) {
+        int y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+        for (int x = 0; x < dst.width; x++) {
+            int x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+            for (int c = 0; c < 4; c++) {
+                int sum = src.pixels[(y0 * src.width + x0) * 4 + c] + src.pixels[(y0 * src.width + x1) * 4 + c] +
+                          src.pixels[(y1 * src.width + x0) * 4 + c] + src.pixels[(y1 * src.width + x1) * 4 + c];
+                dst.pixels[(y * dst.width + x) * 4 + c] = (unsigned char)((sum + 2) >> 2);
+            }
+        }
+    }
+}
+
+static void encodeBlock(const Level& level, int bx, int by, Format format, unsigned char* out)
+{
+    // edge blocks repeat the last row and column
+    unsigned char block[64];
+    for (int y = 0; y < 4; y++) {
+        int sy = std::min(by * 4 + y, level.height - 1);
+        for (int x = 0; x < 4; x++) {
+            int sx = std::min(bx * 4 + x, level.width - 1);
+            memcpy(block + (y * 4 + x) * 4, &level.pixels[((size_t)sy * level.width + sx) * 4], 4);
+        }
+    }
+    switch (format) {
+        case FORMAT_BC1:
+            encodeColorBlock(block, true, out);
+            break;
+        case FORMAT_BC3:
+            encodeAlphaBlock(block, out);
+            encodeColorBlock(block, false, out + 8);
+            break;
+        case FORMAT_BC7:
+            encodeBC7Block(block, out);
+            break;
+    }
+}
+
+struct BlockRow
+{
+    Level* level;
+    int row;
+};
+
+// encodes every level, block rows shared out between the threads
+static void encodeLevels(std::vector<Level>& levels, Format format, int threadCount)
+{
+    std::vector<BlockRow> rows;
+    for (size_t i = 0; i < levels.size(); i++) {
+        Level& level = levels[i];
+        int blocksWide = (level.width + 3) / 4, blocksHigh = (level.height + 3) / 4;
+        level.blocks.resize((size_t)blocksWide * blocksHigh * blockBytes(format));
+        for (int row = 0; row < blocksHigh; row++) {
+            BlockRow r = {&level, row};
+            rows.push_back(r);
+        }
+    }
+
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i = next++; i < (int)rows.size(); i = next++) {
+            Level& level = *rows[i].level;
+            int blocksWide = (level.width + 3) / 4;
+            for (int bx = 0; bx < blocksWide; bx++)
+                encodeBlock(level, bx, rows[i].row, format, &level.blocks[((size_t)rows[i].row * blocksWide + bx) * blockBytes(format)]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++) threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+}
+
+// KTX 1.1, which the game reads back in Texture
+static bool writeKTX(const std::string& path, const std::vector<Level>& levels, Format format)
+{
+    static const unsigned char identifier[12] = {0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n'};
+    unsigned int header[13] = {
+        0x04030201,                 // endianness
+        0, 1, 0,                    // glType, glTypeSize, glFormat: compressed
+        formatInternal[format],
+        0x1908,                     // glBaseInternalFormat: GL_RGBA
+        (unsigned int)levels[0].width, (unsigned int)levels[0].height, 0,
+        0, 1,                       // array elements, faces
+        (unsigned int)levels.size(),
+        0                           // key/value data
+    };
+
+    std::string temp = path + ".tmp";
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(identifier, sizeof(identifier), 1, f) == 1 && fwrite(header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < levels.size(); i++) {
+        // blocks are 8 or 16 bytes, so levels never need padding to 4
+        unsigned int size = (unsigned int)levels[i].blocks.size();
+        ok = fwrite(&size, sizeof(size), 1, f) == 1 && fwrite(&levels[i].blocks[0], 1, size, f) == size;
+    }
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: bc_encode [-f bc1|bc3|bc7] [-n] [-j threads] image ...\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    Format format = FORMAT_BC3;
+    bool mipmaps = true;
+    int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<std::string> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            if (++i == argc) usage();
+            int f = 0;
+            while (f < 3 && strcmp(argv[i], formatNames[f]) != 0) f++;
+            if (f == 3) usage();
+            format = (Format)f;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            mipmaps = false;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (++i == argc) usage();
+            threadCount = atoi(argv[i]);
+            if (threadCount < 1) usage();
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (inputs.empty()) usage();
+
+    stbi_set_post_process(STBI_FLIP_VERTICALLY | STBI_PREMULTIPLY_ALPHA);
+    int failed = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        int width, height, components;
+        unsigned char* pixels = stbi_load(inputs[i].c_str(), &width, &height, &components, 4);
+        if (!pixels) {
+            fprintf(stderr, "%s: %s\n", inputs[i].c_str(), stbi_failure_reason());
+            failed++;
+            continue;
+        }
+
+        std::vector<Level> levels(1);
+        levels[0].width = width;
+        levels[0].height = height;
+        levels[0].pixels.assign(pixels, pixels + (size_t)width * height * 4);
+        stbi_image_free(pixels);
+        while (mipmaps && (levels.back().width > 1 || levels.back().height > 1)) {
+            levels.push_back(Level());
+            downsample(levels[levels.size() - 2], levels.back());
+        }
+
+        encodeLevels(levels, format, threadCount);
+
+        size_t dot = inputs[i].rfind('.');
+        size_t slash = inputs[i].rfind('/');
+        std::string stem = dot != std::string::npos && (slash == std::string::npos || dot > slash) ? inputs[i].substr(0, dot) : inputs[i];
+        std::string output = stem + "." + formatNames[format] + ".ktx";
+        if (!writeKTX(output, levels, format)) {
+            fprintf(stderr, "%s: could not write\n", output.c_str());
+            failed++;
+            continue;
+        }
+        size_t bytes = 0;
+        for (size_t l = 0; l < levels.size(); l++) bytes += levels[l].blocks.size();
+        printf("%s: %dx%d, %d levels, %.1f KB\n", output.c_str(), width, height, (int)levels.size(), bytes / 1024.0);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+// context_check: loads every image under the given directories, along with
+// cut-off and corrupted copies of each, through one stbi_context reused for
+// all of them in a shuffled order, for each req_comp, and checks every
+// result and failure message against a plain stbi_load_from_memory.
+// stbi_load_ctx is checked against stbi_load for the files themselves. An
+// allocator set here counts heap calls, so the warmed-up context must make
+// no more of them than plain loads do, and checks that nothing is left
+// allocated at the end. Build it with -fsanitize=address as well.
+//
+// build: c++ -O2 tools/context_check.cpp -x c GemSwap/stb_image.c -o context_check
+// usage: context_check [dir ...]   (default GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <set>
+#include <algorithm>
+#include <dirent.h>
+
+typedef unsigned char stbi_uc;
+typedef struct stbi_context stbi_context;
+typedef struct
+{
+    void *(*malloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *p, size_t size);
+    void (*free)(void *user, void *p);
+    void *user;
+} stbi_allocator;
+extern "C" stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+extern "C" void stbi_set_allocator(stbi_allocator const *allocator);
+extern "C" stbi_context *stbi_context_create(void);
+extern "C" void stbi_context_destroy(stbi_context *ctx);
+extern "C" stbi_uc *stbi_load_from_memory_ctx(stbi_context *ctx, stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" stbi_uc *stbi_load_ctx(stbi_context *ctx, char const *filename, int *x, int *y, int *comp, int req_comp);
+
+// every block the library holds, and how many heap calls it has made
+struct Heap
+{
+    std::set<void*> live;
+    int calls;
+};
+
+static void* countedMalloc(void* user, size_t size)
+{
+    Heap* heap = (Heap*)user;
+    void* p = malloc(size);
+    heap->calls++;
+    if (p) heap->live.insert(p);
+    return p;
+}
+
+static void* countedRealloc(void* user, void* p, size_t size)
+{
+    Heap* heap = (Heap*)user;
+    void* q = realloc(p, size);
+    heap->calls++;
+    if (q) {
+        heap->live.erase(p);
+        heap->live.insert(q);
+    }
+    return q;
+}
+
+static void countedFree(void* user, void* p)
+{
+    Heap* heap = (Heap*)user;
+    if (!p) return;
+    heap->calls++;
+    heap->live.erase(p);
+    free(p);
+}
+
+struct Result
+{
+    std::vector<stbi_uc> pixels;
+    int width, height, components;
+    std::string failure;        // empty if the decode succeeded
+};
+
+struct Input
+{
+    std::string name;
+    std::vector<stbi_uc> data;
+};
+
+// the extensions stb_image can read
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && isImage(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<stbi_uc>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+// takes over the pixels a load returned
+static Result result(stbi_uc* pixels, int width, int height, int components, int reqComp)
+{
+    Result r;
+    r.width = r.height = r.components = 0;
+    if (pixels) {
+        r.width = width;
+        r.height = height;
+        r.components = components;
+        r.pixels.assign(pixels, pixels + (size_t)width * height * (reqComp ? reqComp : components));
+        stbi_image_free(pixels);
+    } else {
+        const char* reason = stbi_failure_reason();
+        r.failure = reason ? reason : "?";
+    }
+    return r;
+}
+
+static Result load(stbi_context* ctx, const std::vector<stbi_uc>& data, int reqComp)
+{
+    int w = 0, h = 0, comp = 0;
+    stbi_uc* pixels = ctx ? stbi_load_from_memory_ctx(ctx, &data[0], (int)data.size(), &w, &h, &comp, reqComp)
+                          : stbi_load_from_memory(&data[0], (int)data.size(), &w, &h, &comp, reqComp);
+    return result(pixels, w, h, comp, reqComp);
+}
+
+static bool same(const Result& a, const Result& b)
+{
+    return a.failure == b.failure && a.pixels == b.pixels && a.width == b.width && a.height == b.height &&
+           a.components == b.components;
+}
+
+static std::string describe(const Result& r)
+{
+    char text[64];
+    if (!r.failure.empty()) return "failed: " + r.failure;
+    snprintf(text, sizeof(text), "%dx%dx%d", r.width, r.height, r.components);
+    return text;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) dirs.push_back(argv[i]);
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], files);
+    if (files.empty()) {
+        fprintf(stderr, "usage: context_check [dir ...]\n");
+        return 2;
+    }
+
+    // each file, cut off early, at half and one byte short, and with a
+    // stretch of its middle scrambled
+    srand(1234);
+    std::vector<Input> inputs;
+    int bad = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        Input input;
+        input.name = files[i];
+        if (!readFile(files[i], input.data)) {
+            fprintf(stderr, "%s: could not read\n", files[i].c_str());
+            bad++;
+            continue;
+        }
+        inputs.push_back(input);
+        size_t size = input.data.size();
+        static const char* cuts[] = { " (first 40 bytes)", " (first half)", " (one byte short)" };
+        size_t lengths[] = { std::min(size, (size_t)40), std::max(size / 2, (size_t)1), std::max(size - 1, (size_t)1) };
+        for (int c = 0; c < 3; c++) {
+            Input cut;
+            cut.name = files[i] + cuts[c];
+            cut.data.assign(input.data.begin(), input.data.begin() + lengths[c]);
+            inputs.push_back(cut);
+        }
+        Input scrambled = input;
+        scrambled.name += " (scrambled)";
+        for (size_t k = size / 2; k < std::min(size, size / 2 + 64); k++) scrambled.data[k] = (stbi_uc)rand();
+        inputs.push_back(scrambled);
+    }
+
+    Heap heap;
+    heap.calls = 0;
+    stbi_allocator counted = { countedMalloc, countedRealloc, countedFree, &heap };
+    stbi_set_allocator(&counted);
+
+    int runs = 0, plainCalls = 0, contextCalls = 0;
+    std::vector<size_t> order(inputs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    stbi_context* ctx = stbi_context_create();
+    for (int reqComp = 0; reqComp <= 4; reqComp++) {
+        std::vector<Result> expected(inputs.size());
+        int calls = heap.calls;
+        for (size_t i = 0; i < inputs.size(); i++) expected[i] = load(NULL, inputs[i].data, reqComp);
+        plainCalls += heap.calls - calls;
+
+        // the first pass grows the context; the second is counted
+        for (size_t i = order.size(); i > 1; i--) std::swap(order[i - 1], order[rand() % i]);
+        for (int pass = 0; pass < 2; pass++) {
+            calls = heap.calls;
+            for (size_t k = 0; k < order.size(); k++) {
+                size_t i = order[k];
+                Result got = load(ctx, inputs[i].data, reqComp);
+                runs++;
+                if (!same(got, expected[i])) {
+                    fprintf(stderr, "%s: req_comp %d with the context %s, without %s\n", inputs[i].name.c_str(), reqComp,
+                            describe(got).c_str(), describe(expected[i]).c_str());
+                    bad++;
+                }
+            }
+            if (pass == 1) contextCalls += heap.calls - calls;
+        }
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        int w = 0, h = 0, comp = 0;
+        stbi_uc* pixels = stbi_load(files[i].c_str(), &w, &h, &comp, 4);
+        Result expected = result(pixels, w, h, comp, 4);
+        pixels = stbi_load_ctx(ctx, files[i].c_str(), &w, &h, &comp, 4);
+        Result got = result(pixels, w, h, comp, 4);
+        runs++;
+        if (!same(got, expected)) {
+            fprintf(stderr, "%s: stbi_load_ctx %s, stbi_load %s\n", files[i].c_str(), describe(got).c_str(), describe(expected).c_str());
+            bad++;
+        }
+    }
+    stbi_context_destroy(ctx);
+
+    if (contextCalls > plainCalls) {
+        fprintf(stderr, "the context made %d heap calls, plain loads %d\n", contextCalls, plainCalls);
+        bad++;
+    }
+    if (!heap.live.empty()) {
+        fprintf(stderr, "%d blocks left allocated\n", (int)heap.live.size());
+        bad++;
+    }
+    stbi_set_allocator(NULL);
+
+    printf("%d runs, %d bad, heap calls %d plain, %d with a context\n", runs, bad, plainCalls, contextCalls);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+// convert_bench: times stb_image's component conversion (the req_comp step
+// of every load) for all twelve source/destination combinations, with the
+// plain C loops against the SSSE3 and AVX2 kernels, so a change to either
+// can be checked for speed as well as for matching output.
+//
+// build: c++ -O2 tools/convert_bench.cpp -o convert_bench -lpthread
+// usage: convert_bench [width] [rows]   (default a 1024x1024 image)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+// the kernels are static, so the decoder is built into this file
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2 | STBI__CPU_SSSE3, STBI__CPU_SSE2 | STBI__CPU_SSSE3 | STBI__CPU_AVX2 };
+static const char* levelNames[] = { "scalar", "ssse3", "avx2" };
+static const int levelCount = 3;
+#else
+static const int levels[] = { 0 };
+static const char* levelNames[] = { "scalar" };
+static const int levelCount = 1;
+#endif
+
+// best of a few runs, in megapixels per second
+static double timeConvert(int n, int m, int width, int rows, const std::vector<unsigned char>& src, std::vector<unsigned char>& dest)
+{
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int j = 0; j < rows; j++)
+            convert_row(&dest[(size_t)j * width * m], &src[(size_t)j * width * n], n, m, width);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = (double)width * rows / seconds / 1e6;
+        if (rate > best) best = rate;
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    int width = argc > 1 ? atoi(argv[1]) : 1024;
+    int rows = argc > 2 ? atoi(argv[2]) : 1024;
+    if (width <= 0 || rows <= 0) {
+        fprintf(stderr, "usage: convert_bench [width] [rows]\n");
+        return 2;
+    }
+
+    int available = stbi__cpu();
+    std::vector<unsigned char> src((size_t)width * rows * 4), dest((size_t)width * rows * 4), expected((size_t)width * rows * 4);
+    for (size_t i = 0; i < src.size(); i++) src[i] = (unsigned char)rand();
+
+    printf("%dx%d, Mpixels/s\n%-6s", width, rows, "");
+    for (int l = 0; l < levelCount; l++) printf(" %9s", levelNames[l]);
+    printf("\n");
+
+    int mismatches = 0;
+    for (int n = 1; n <= 4; n++) {
+        for (int m = 1; m <= 4; m++) {
+            if (n == m) continue;
+            printf("%d -> %d ", n, m);
+            for (int l = 0; l < levelCount; l++) {
+                if ((available & levels[l]) != levels[l]) {
+                    printf(" %9s", "-");
+                    continue;
+                }
+                stbi__cpu_flags = levels[l];
+                double rate = timeConvert(n, m, width, rows, src, l == 0 ? expected : dest);
+                if (l > 0 && memcmp(&dest[0], &expected[0], (size_t)width * rows * m) != 0) {
+                    printf(" %8s!", "differs");
+                    mismatches++;
+                } else {
+                    printf(" %9.0f", rate);
+                }
+            }
+            printf("\n");
+        }
+    }
+    stbi__cpu_flags = available;
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,188 @@
+// decode_stress: decodes every image under the given directories from many
+// threads at once and compares each result, and each failure message,
+// with a single-threaded decode of the same file. Half the threads switch
+// to thread-local settings and flip their images, so settings leaking
+// between threads show up as mismatches as well. Run it under
+// -fsanitize=thread to catch races that happen to produce the right pixels.
+//
+// build: c++ -O2 -pthread tools/decode_stress.cpp -x c GemSwap/stb_image.c -o decode_stress
+// usage: decode_stress [-t threads] [-r rounds] [dir ...]
+//        (default 16 threads, 4 rounds, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <dirent.h>
+
+extern "C" unsigned char *stbi_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+extern "C" void stbi_set_thread_local_settings(int flag_true_if_thread_local);
+extern "C" void stbi_set_post_process(int flags);
+enum { STBI_FLIP_VERTICALLY = 1 };
+
+struct Result
+{
+    std::vector<unsigned char> pixels;
+    int width, height;
+    std::string failure;        // empty if the decode succeeded
+};
+
+struct Input
+{
+    std::string path;
+    std::vector<unsigned char> data;
+    Result expected[2];         // as loaded, and flipped
+};
+
+// the extensions stb_image can read
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && isImage(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static Result decode(const std::vector<unsigned char>& data)
+{
+    Result result;
+    result.width = result.height = 0;
+    int comp;
+    unsigned char* pixels = stbi_load_from_memory(&data[0], (int)data.size(), &result.width, &result.height, &comp, 4);
+    if (pixels) {
+        result.pixels.assign(pixels, pixels + (size_t)result.width * result.height * 4);
+        stbi_image_free(pixels);
+    } else {
+        const char* reason = stbi_failure_reason();
+        result.failure = reason ? reason : "?";
+    }
+    return result;
+}
+
+static bool same(const Result& a, const Result& b)
+{
+    return a.failure == b.failure && a.pixels == b.pixels && (!a.failure.empty() || (a.width == b.width && a.height == b.height));
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: decode_stress [-t threads] [-r rounds] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int threadCount = 16, rounds = 4;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-r") == 0) {
+            if (i + 1 == argc) usage();
+            int value = atoi(argv[i + 1]);
+            if (value < 1) usage();
+            if (argv[i][1] == 't') threadCount = value;
+            else rounds = value;
+            i++;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], files);
+
+    // every file, and a truncated copy of each so failures are exercised too
+    std::vector<Input> inputs;
+    for (size_t i = 0; i < files.size(); i++) {
+        Input input;
+        input.path = files[i];
+        if (!readFile(files[i], input.data)) {
+            fprintf(stderr, "%s: could not read\n", files[i].c_str());
+            continue;
+        }
+        inputs.push_back(input);
+        input.path += " (truncated)";
+        input.data.resize(std::min(input.data.size(), (size_t)40));
+        inputs.push_back(input);
+    }
+    if (inputs.empty()) usage();
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        inputs[i].expected[0] = decode(inputs[i].data);
+        stbi_set_post_process(STBI_FLIP_VERTICALLY);
+        inputs[i].expected[1] = decode(inputs[i].data);
+        stbi_set_post_process(0);
+    }
+
+    // each thread walks the inputs from its own starting point, so different
+    // decoders and different files overlap
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.push_back(std::thread([&, t]() {
+            int flipped = t & 1;
+            if (flipped) {
+                stbi_set_thread_local_settings(1);
+                stbi_set_post_process(STBI_FLIP_VERTICALLY);
+            }
+            for (int round = 0; round < rounds; round++) {
+                for (size_t k = 0; k < inputs.size(); k++) {
+                    const Input& input = inputs[(k + (size_t)t * 7) % inputs.size()];
+                    if (!same(decode(input.data), input.expected[flipped])) {
+                        fprintf(stderr, "%s: thread %d got a different result\n", input.path.c_str(), t);
+                        mismatches++;
+                    }
+                }
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+
+    printf("%d files, %d threads x %d rounds, %d mismatches\n", (int)files.size(), threadCount, rounds, mismatches.load());
+    return mismatches ? 1 : 0;
+}
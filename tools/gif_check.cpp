@@ -0,0 +1,434 @@
+// gif_check: builds animated GIFs from random frames, each a random
+// rectangle of the canvas with a random disposal method (0-3), transparent
+// index, global or local colour table and interlacing, compressed with LZW
+// strings that cross sub-block boundaries and clear codes at random. Every
+// frame stbi_gif_anim_next gives must match the frames composed here, with
+// their delays; the first must match stbi_load_from_memory; a rewind must
+// give them all again; and a flipped animation must give them flipped.
+// Truncated copies must fail cleanly. The GIFs under the given directories
+// get the stbi_load, rewind and truncation checks. Build it with
+// -fsanitize=address as well to catch reads and writes out of bounds.
+//
+// build: c++ -O2 tools/gif_check.cpp -x c GemSwap/stb_image.c -o gif_check
+// usage: gif_check [-n files] [dir ...]   (default 300 files, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <dirent.h>
+
+typedef unsigned char stbi_uc;
+typedef struct stbi_gif_anim stbi_gif_anim;
+extern "C" stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+extern "C" void stbi_set_post_process(int flags);
+extern "C" stbi_gif_anim *stbi_gif_anim_open_memory(stbi_uc const *buffer, int len, int *x, int *y);
+extern "C" stbi_uc *stbi_gif_anim_next(stbi_gif_anim *anim, int *delay_ms);
+extern "C" void stbi_gif_anim_rewind(stbi_gif_anim *anim);
+extern "C" void stbi_gif_anim_close(stbi_gif_anim *anim);
+enum { STBI_FLIP_VERTICALLY = 1 };
+
+struct Frame
+{
+    std::vector<stbi_uc> canvas;  // RGBA, as it should look once the frame is drawn
+    int delayMs;
+};
+
+static void findGifs(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name[0] != '.' && name.size() > 4 && name.compare(name.size() - 4, 4, ".gif") == 0) names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<stbi_uc>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static void put16(std::vector<stbi_uc>& out, int v)
+{
+    out.push_back((stbi_uc)v);
+    out.push_back((stbi_uc)(v >> 8));
+}
+
+// LSB-first codes, cut into sub-blocks of random length
+struct BitWriter
+{
+    std::vector<stbi_uc> bytes;
+    unsigned int bits;
+    int count;
+
+    BitWriter() : bits(0), count(0) {}
+
+    void code(int c, int size)
+    {
+        bits |= (unsigned int)c << count;
+        count += size;
+        while (count >= 8) {
+            bytes.push_back((stbi_uc)bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void finish(std::vector<stbi_uc>& out)
+    {
+        if (count > 0) bytes.push_back((stbi_uc)bits);
+        size_t pos = 0;
+        while (pos < bytes.size()) {
+            int n = (int)std::min(bytes.size() - pos, (size_t)(1 + rand() % 255));
+            out.push_back((stbi_uc)n);
+            out.insert(out.end(), bytes.begin() + pos, bytes.begin() + pos + n);
+            pos += n;
+        }
+        out.push_back(0);
+    }
+};
+
+// a GIF LZW encoder. The decoder adds each table entry one code later than
+// the encoder does, so the code size grows here once the entry just added
+// needs the wider code. Clear codes come when the table is full, and at random.
+static void encodeLzw(std::vector<stbi_uc>& out, const std::vector<stbi_uc>& indices, int minSize)
+{
+    int clear = 1 << minSize, size = minSize + 1, next = clear + 2;
+    std::map<std::pair<int, int>, int> table;
+    BitWriter w;
+    out.push_back((stbi_uc)minSize);
+    w.code(clear, size);
+    int cur = indices[0];
+    for (size_t i = 1; i <= indices.size(); i++) {
+        if (i < indices.size()) {
+            std::map<std::pair<int, int>, int>::iterator found = table.find(std::make_pair(cur, (int)indices[i]));
+            if (found != table.end()) {
+                cur = found->second;
+                continue;
+            }
+        }
+        w.code(cur, size);
+        if (i < indices.size()) table[std::make_pair(cur, (int)indices[i])] = next;
+        if (next == (1 << size) && size < 12) size++;
+        next++;
+        if (i < indices.size() && (next == 4096 || rand() % 200 == 0)) {
+            w.code(clear, size);
+            table.clear();
+            size = minSize + 1;
+            next = clear + 2;
+        }
+        if (i < indices.size()) cur = indices[i];
+    }
+    w.code(clear + 1, size);
+    w.finish(out);
+}
+
+// a few colours repeated in runs, so LZW finds strings
+static std::vector<stbi_uc> randomIndices(int count, int colours)
+{
+    std::vector<stbi_uc> indices(count);
+    int run = 0;
+    stbi_uc value = 0;
+    for (int i = 0; i < count; i++) {
+        if (run-- <= 0) {
+            value = (stbi_uc)(rand() % colours);
+            run = rand() % 6;
+        }
+        indices[i] = value;
+    }
+    return indices;
+}
+
+static void randomPalette(std::vector<stbi_uc>& out, std::vector<stbi_uc>& rgb, int entries)
+{
+    rgb.resize(entries * 3);
+    for (int i = 0; i < entries * 3; i++) rgb[i] = (stbi_uc)(rand() % 256);
+    out.insert(out.end(), rgb.begin(), rgb.end());
+}
+
+// the rows of an interlaced frame in the order they are stored
+static std::vector<int> rowOrder(int height, bool interlaced)
+{
+    std::vector<int> rows;
+    if (!interlaced) {
+        for (int y = 0; y < height; y++) rows.push_back(y);
+        return rows;
+    }
+    static const int start[] = { 0, 4, 2, 1 }, step[] = { 8, 8, 4, 2 };
+    for (int pass = 0; pass < 4; pass++)
+        for (int y = start[pass]; y < height; y += step[pass]) rows.push_back(y);
+    return rows;
+}
+
+// a random animation, and what each of its frames should look like
+static std::vector<stbi_uc> makeGif(std::vector<Frame>& frames)
+{
+    int width = 1 + rand() % 48, height = 1 + rand() % 48;
+    int globalBits = 1 + rand() % 8, globalEntries = 1 << globalBits;
+    int background = rand() % 256;
+    std::vector<stbi_uc> out, globalRgb;
+    out.insert(out.end(), "GIF89a", "GIF89a" + 6);
+    put16(out, width);
+    put16(out, height);
+    out.push_back((stbi_uc)(0x80 | (globalBits - 1)));
+    out.push_back((stbi_uc)background);
+    out.push_back(0);
+    randomPalette(out, globalRgb, globalEntries);
+
+    // the background is the global colour, or black past the table, and clear
+    stbi_uc bg[4] = { 0, 0, 0, 0 };
+    if (background < globalEntries) memcpy(bg, &globalRgb[background * 3], 3);
+    std::vector<stbi_uc> canvas((size_t)width * height * 4);
+    for (size_t i = 0; i < canvas.size(); i += 4) memcpy(&canvas[i], bg, 4);
+
+    int frameCount = 1 + rand() % 6, lastDispose = 0, lx = 0, ly = 0, lw = 0, lh = 0;
+    std::vector<stbi_uc> saved;
+    frames.clear();
+    for (int f = 0; f < frameCount; f++) {
+        // undo the last frame as it asked
+        for (int y = ly; y < ly + lh; y++) {
+            stbi_uc* row = &canvas[((size_t)y * width + lx) * 4];
+            if (lastDispose == 2)
+                for (int x = 0; x < lw; x++) memcpy(row + x * 4, bg, 4);
+            else if (lastDispose == 3)
+                memcpy(row, &saved[((size_t)y * width + lx) * 4], lw * 4);
+        }
+
+        int fw = 1 + rand() % width, fh = 1 + rand() % height;
+        int fx = rand() % (width - fw + 1), fy = rand() % (height - fh + 1);
+        int dispose = rand() % 4, delay = rand() % 500;
+        bool hasTransparent = rand() % 2 != 0, interlaced = rand() % 3 == 0;
+        bool local = rand() % 3 == 0;
+        int localBits = 1 + rand() % 8, entries = local ? 1 << localBits : globalEntries;
+        int transparent = rand() % (entries + 2);  // sometimes past the table
+
+        if (rand() % 4) {
+            static const stbi_uc comment[] = { 0x21, 0xFE, 3, 'a', 'b', 'c', 0 };
+            out.insert(out.end(), comment, comment + sizeof(comment));
+        }
+        out.push_back(0x21);
+        out.push_back(0xF9);
+        out.push_back(4);
+        out.push_back((stbi_uc)(dispose << 2 | (hasTransparent ? 1 : 0)));
+        put16(out, delay);
+        out.push_back((stbi_uc)transparent);
+        out.push_back(0);
+
+        out.push_back(0x2C);
+        put16(out, fx);
+        put16(out, fy);
+        put16(out, fw);
+        put16(out, fh);
+        out.push_back((stbi_uc)((local ? 0x80 | (localBits - 1) : 0) | (interlaced ? 0x40 : 0)));
+        std::vector<stbi_uc> rgb = globalRgb;
+        if (local) randomPalette(out, rgb, entries);
+
+        std::vector<stbi_uc> indices = randomIndices(fw * fh, entries);
+        encodeLzw(out, indices, std::max(2, local ? localBits : globalBits));
+
+        if (dispose == 3) saved = canvas;
+        std::vector<int> rows = rowOrder(fh, interlaced);
+        for (int r = 0; r < fh; r++) {
+            for (int x = 0; x < fw; x++) {
+                int index = indices[(size_t)r * fw + x];
+                if (hasTransparent && index == transparent) continue;
+                stbi_uc* p = &canvas[((size_t)(fy + rows[r]) * width + fx + x) * 4];
+                memcpy(p, &rgb[index * 3], 3);
+                p[3] = 255;
+            }
+        }
+        Frame frame;
+        frame.canvas = canvas;
+        frame.delayMs = delay * 10;
+        frames.push_back(frame);
+        lastDispose = dispose;
+        lx = fx, ly = fy, lw = fw, lh = fh;
+    }
+    out.push_back(0x3B);
+    return out;
+}
+
+static std::vector<stbi_uc> flipped(const std::vector<stbi_uc>& canvas, int width, int height)
+{
+    std::vector<stbi_uc> out(canvas.size());
+    size_t stride = (size_t)width * 4;
+    for (int y = 0; y < height; y++) memcpy(&out[y * stride], &canvas[(height - 1 - y) * stride], stride);
+    return out;
+}
+
+// all the frames an animation gives, up to 'limit', and whether it ended cleanly
+static std::vector<Frame> decodeFrames(stbi_gif_anim* anim, int width, int height, int limit, bool& ended)
+{
+    std::vector<Frame> frames;
+    ended = false;
+    for (int i = 0; i <= limit; i++) {
+        Frame frame;
+        stbi_uc* canvas = stbi_gif_anim_next(anim, &frame.delayMs);
+        if (!canvas) {
+            const char* reason = stbi_failure_reason();
+            ended = reason && strcmp(reason, "no more frames") == 0;
+            break;
+        }
+        frame.canvas.assign(canvas, canvas + (size_t)width * height * 4);
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+static bool sameFrames(const std::vector<Frame>& a, const std::vector<Frame>& b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+        if (a[i].canvas != b[i].canvas || a[i].delayMs != b[i].delayMs) return false;
+    return true;
+}
+
+// the checks that need no knowledge of what the file holds: the first
+// frame is what stbi_load gives, a rewind repeats the frames, and cut-off
+// copies fail without crashing
+static int checkFile(const std::string& name, const std::vector<stbi_uc>& data, std::vector<Frame>& frames, int& runs)
+{
+    int bad = 0, width, height;
+    runs++;
+    stbi_gif_anim* anim = stbi_gif_anim_open_memory(&data[0], (int)data.size(), &width, &height);
+    if (!anim) {
+        fprintf(stderr, "%s: %s\n", name.c_str(), stbi_failure_reason());
+        return 1;
+    }
+    bool ended;
+    frames = decodeFrames(anim, width, height, 1000, ended);
+    if (frames.empty() || !ended) {
+        fprintf(stderr, "%s: %d frames, then %s\n", name.c_str(), (int)frames.size(), stbi_failure_reason());
+        bad++;
+    }
+
+    runs++;
+    int w, h, comp;
+    stbi_uc* first = stbi_load_from_memory(&data[0], (int)data.size(), &w, &h, &comp, 4);
+    if (!first || frames.empty() || w != width || h != height || memcmp(first, &frames[0].canvas[0], frames[0].canvas.size()) != 0) {
+        fprintf(stderr, "%s: stbi_load differs from the first frame\n", name.c_str());
+        bad++;
+    }
+    stbi_image_free(first);
+
+    runs++;
+    stbi_gif_anim_rewind(anim);
+    if (!sameFrames(decodeFrames(anim, width, height, 1000, ended), frames) || !ended) {
+        fprintf(stderr, "%s: the frames differ after a rewind\n", name.c_str());
+        bad++;
+    }
+    stbi_gif_anim_close(anim);
+
+    for (int cut = 0; cut < 4; cut++) {
+        std::vector<stbi_uc> part(data.begin(), data.begin() + 13 + rand() % (data.size() - 13));
+        runs++;
+        anim = stbi_gif_anim_open_memory(&part[0], (int)part.size(), &w, &h);
+        if (anim) {
+            decodeFrames(anim, w, h, (int)frames.size() + 1, ended);
+            stbi_gif_anim_close(anim);
+        }
+    }
+    return bad;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: gif_check [-n files] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int fileCount = 300;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc) usage();
+            fileCount = atoi(argv[++i]);
+            if (fileCount < 1) usage();
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    srand(1234);
+    int runs = 0, bad = 0;
+    for (int f = 0; f < fileCount; f++) {
+        std::vector<Frame> expected, frames;
+        std::vector<stbi_uc> gif = makeGif(expected);
+        char name[32];
+        snprintf(name, sizeof(name), "generated %d", f);
+        bad += checkFile(name, gif, frames, runs);
+
+        runs++;
+        if (!sameFrames(frames, expected)) {
+            for (size_t i = 0; i < std::min(frames.size(), expected.size()); i++) {
+                if (frames[i].canvas != expected[i].canvas || frames[i].delayMs != expected[i].delayMs) {
+                    fprintf(stderr, "%s: frame %d of %d differs\n", name, (int)i, (int)expected.size());
+                    break;
+                }
+            }
+            if (frames.size() != expected.size())
+                fprintf(stderr, "%s: %d frames, expected %d\n", name, (int)frames.size(), (int)expected.size());
+            bad++;
+        }
+
+        // the canvas has to stay as decoded while the frames come back flipped
+        int width, height;
+        runs++;
+        stbi_set_post_process(STBI_FLIP_VERTICALLY);
+        stbi_gif_anim* anim = stbi_gif_anim_open_memory(&gif[0], (int)gif.size(), &width, &height);
+        stbi_set_post_process(0);
+        bool ended;
+        std::vector<Frame> flips = anim ? decodeFrames(anim, width, height, 1000, ended) : std::vector<Frame>();
+        for (size_t i = 0; i < expected.size(); i++) expected[i].canvas = flipped(expected[i].canvas, width, height);
+        if (!sameFrames(flips, expected)) {
+            fprintf(stderr, "%s: flipped frames differ\n", name);
+            bad++;
+        }
+        stbi_gif_anim_close(anim);
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findGifs(dirs[i], files);
+    for (size_t i = 0; i < files.size(); i++) {
+        std::vector<stbi_uc> data;
+        std::vector<Frame> frames;
+        if (!readFile(files[i], data) || data.size() < 14) {
+            fprintf(stderr, "%s: could not read\n", files[i].c_str());
+            bad++;
+            continue;
+        }
+        bad += checkFile(files[i], data, frames, runs);
+    }
+
+    printf("%d runs, %d bad\n", runs, bad);
+    return bad ? 1 : 0;
+}
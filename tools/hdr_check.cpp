@@ -0,0 +1,343 @@
+// hdr_check: builds Radiance files from random RGBE pixels, some stored flat
+// and some run-length coded with runs and dumps of random length, and loads
+// each at every CPU level. stbi_loadf must give, bit for bit, what ldexp of
+// the exponent gives, for each req_comp; stbi_load must come within one step
+// of pow with the to-LDR gamma and scale. Files whose runs overshoot the
+// scanline must fail. The PNGs under the given directories are then loaded
+// with stbi_loadf and checked against pow with the to-HDR gamma and scale.
+// Build it with -fsanitize=address as well to catch reads and writes out of
+// bounds.
+//
+// build: c++ -O2 tools/hdr_check.cpp -o hdr_check -lpthread
+// usage: hdr_check [-n files] [dir ...]   (default 300 files, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+
+// the CPU level is internal, so the decoder is built into this file
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2 };
+static const int levelCount = 2;
+#else
+static const int levels[] = { 0 };
+static const int levelCount = 1;
+#endif
+
+static void findPngs(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name[0] != '.' && name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+// mostly exponents near 128, where colours are near 1, with 0 (black), the
+// smallest and the largest mixed in
+static unsigned char randomExponent()
+{
+    switch (rand() % 8) {
+    case 0: return 0;
+    case 1: return rand() % 2 ? 1 : 255;
+    case 2: return (unsigned char)(rand() % 256);
+    default: return (unsigned char)(118 + rand() % 20);
+    }
+}
+
+// pixels that repeat their neighbour's channels often enough to give runs
+static std::vector<unsigned char> randomPixels(int width, int height)
+{
+    std::vector<unsigned char> rgbe((size_t)width * height * 4);
+    for (size_t i = 0; i < rgbe.size(); i += 4) {
+        for (int k = 0; k < 4; k++) {
+            if (i >= 4 && rand() % 3 == 0) rgbe[i + k] = rgbe[i - 4 + k];
+            else rgbe[i + k] = k < 3 ? (unsigned char)(rand() % 256) : randomExponent();
+        }
+    }
+    return rgbe;
+}
+
+// one channel of a scanline as runs (count over 128) and dumps, of random lengths
+static void encodeChannel(std::vector<unsigned char>& out, const unsigned char* row, int width, int k)
+{
+    int i = 0;
+    while (i < width) {
+        int run = 1;
+        while (i + run < width && run < 127 && row[(i + run) * 4 + k] == row[i * 4 + k]) run++;
+        if (run >= 2 && rand() % 4) {
+            out.push_back((unsigned char)(128 + run));
+            out.push_back(row[i * 4 + k]);
+            i += run;
+        } else {
+            int dump = 1 + rand() % std::min(128, width - i);
+            out.push_back((unsigned char)dump);
+            for (int z = 0; z < dump; z++) out.push_back(row[(i + z) * 4 + k]);
+            i += dump;
+        }
+    }
+}
+
+// a Radiance file; run-length coded needs a width of 8 to 32767, and flat
+// data at those widths must not start with what looks like a scanline header
+static std::vector<unsigned char> makeHdr(const std::vector<unsigned char>& rgbe, int width, int height, bool rle)
+{
+    char header[128];
+    snprintf(header, sizeof(header), "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+    std::vector<unsigned char> out(header, header + strlen(header));
+    if (!rle) {
+        out.insert(out.end(), rgbe.begin(), rgbe.end());
+        return out;
+    }
+    for (int j = 0; j < height; j++) {
+        out.push_back(2);
+        out.push_back(2);
+        out.push_back((unsigned char)(width >> 8));
+        out.push_back((unsigned char)width);
+        for (int k = 0; k < 4; k++) encodeChannel(out, &rgbe[(size_t)j * width * 4], width, k);
+    }
+    return out;
+}
+
+// what the format defines each pixel to be
+static std::vector<float> expectedFloats(const std::vector<unsigned char>& rgbe, int n)
+{
+    std::vector<float> out(rgbe.size() / 4 * n);
+    for (size_t i = 0; i < rgbe.size() / 4; i++) {
+        const unsigned char* p = &rgbe[i * 4];
+        float* o = &out[i * n];
+        float f = p[3] ? (float)ldexp(1.0, p[3] - 136) : 0.0f;
+        if (n <= 2) {
+            o[0] = (p[0] + p[1] + p[2]) * f / 3;
+        } else {
+            o[0] = p[0] * f;
+            o[1] = p[1] * f;
+            o[2] = p[2] * f;
+        }
+        if (n == 2) o[1] = 1;
+        if (n == 4) o[3] = 1;
+    }
+    return out;
+}
+
+static int toLdr(double v)
+{
+    v = v * 255 + 0.5;
+    return v <= 0 ? 0 : v >= 255 ? 255 : (int)v;
+}
+
+// the 8-bit load must be within one of pow, and alpha exact
+static bool closeToLdr(const unsigned char* got, const std::vector<float>& floats, int n, float gamma, float scale)
+{
+    int colours = n & 1 ? n : n - 1;
+    for (size_t i = 0; i < floats.size(); i++) {
+        int want = (int)(i % n) < colours ? toLdr(pow(floats[i] / scale, 1 / gamma)) : toLdr(floats[i]);
+        if (abs(got[i] - want) > ((int)(i % n) < colours ? 1 : 0)) return false;
+    }
+    return true;
+}
+
+static int checkHdr(const std::vector<unsigned char>& file, const std::vector<unsigned char>& rgbe, int width, int height,
+                    const char* what, float gamma, float scale, int& runs)
+{
+    int bad = 0;
+    for (int l = 0; l < levelCount; l++) {
+        if ((stbi__cpu() & levels[l]) != levels[l]) continue;
+        int available = stbi__cpu();
+        stbi__cpu_flags = levels[l];
+        for (int reqComp = 0; reqComp <= 4; reqComp++) {
+            int n = reqComp ? reqComp : 3;
+            std::vector<float> expected = expectedFloats(rgbe, n);
+            int x, y, comp;
+            runs++;
+            float* loaded = stbi_loadf_from_memory(&file[0], (int)file.size(), &x, &y, &comp, reqComp);
+            if (!loaded || x != width || y != height || comp != 3) {
+                fprintf(stderr, "%s %dx%d: req_comp %d level %d: %s\n", what, width, height, reqComp, levels[l],
+                        loaded ? "wrong size" : stbi_failure_reason());
+                bad++;
+            } else if (memcmp(loaded, &expected[0], expected.size() * sizeof(float)) != 0) {
+                fprintf(stderr, "%s %dx%d: req_comp %d level %d: floats differ from ldexp\n", what, width, height, reqComp, levels[l]);
+                bad++;
+            }
+            stbi_image_free(loaded);
+
+            runs++;
+            unsigned char* ldr = stbi_load_from_memory(&file[0], (int)file.size(), &x, &y, &comp, reqComp);
+            if (!ldr || x != width || y != height) {
+                fprintf(stderr, "%s %dx%d: 8-bit req_comp %d level %d: %s\n", what, width, height, reqComp, levels[l],
+                        ldr ? "wrong size" : stbi_failure_reason());
+                bad++;
+            } else if (!closeToLdr(ldr, expected, n, gamma, scale)) {
+                fprintf(stderr, "%s %dx%d: 8-bit req_comp %d level %d: more than one step from pow\n", what, width, height,
+                        reqComp, levels[l]);
+                bad++;
+            }
+            stbi_image_free(ldr);
+        }
+        stbi__cpu_flags = available;
+    }
+    return bad;
+}
+
+// a run or dump in the last channel of the last row that carries on past its end
+static int checkOvershoot(const std::vector<unsigned char>& rgbe, int width, int height, int& runs)
+{
+    int bad = 0;
+    for (int dump = 0; dump <= 1; dump++) {
+        std::vector<unsigned char> file = makeHdr(rgbe, width, height, false);
+        file.resize(file.size() - rgbe.size());
+        for (int j = 0; j < height; j++) {
+            file.push_back(2);
+            file.push_back(2);
+            file.push_back((unsigned char)(width >> 8));
+            file.push_back((unsigned char)width);
+            for (int k = 0; k < 4; k++) {
+                if (j < height - 1 || k < 3) {
+                    encodeChannel(file, &rgbe[(size_t)j * width * 4], width, k);
+                    continue;
+                }
+                // width - 1 pixels, then 8 more than the one left
+                file.push_back((unsigned char)(128 + width - 1));
+                file.push_back(0);
+                file.push_back((unsigned char)(dump ? 9 : 128 + 9));
+                for (int z = 0; z < (dump ? 9 : 1); z++) file.push_back(0);
+            }
+        }
+        int x, y, comp;
+        runs++;
+        float* loaded = stbi_loadf_from_memory(&file[0], (int)file.size(), &x, &y, &comp, 0);
+        if (loaded) {
+            fprintf(stderr, "%dx%d: a %s past the end of the scanline was accepted\n", width, height, dump ? "dump" : "run");
+            stbi_image_free(loaded);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// stbi_loadf of an 8-bit image is pow of each colour over 255, and alpha over 255
+static int checkLdr(const std::string& path, float gamma, float scale, int& runs)
+{
+    std::vector<unsigned char> data;
+    if (!readFile(path, data)) {
+        fprintf(stderr, "%s: could not read\n", path.c_str());
+        return 1;
+    }
+    int bad = 0;
+    for (int reqComp = 0; reqComp <= 4; reqComp++) {
+        int w, h, comp, fw, fh, fcomp;
+        unsigned char* ldr = stbi_load_from_memory(&data[0], (int)data.size(), &w, &h, &comp, reqComp);
+        float* hdr = stbi_loadf_from_memory(&data[0], (int)data.size(), &fw, &fh, &fcomp, reqComp);
+        runs++;
+        if (!ldr || !hdr || fw != w || fh != h || fcomp != comp) {
+            fprintf(stderr, "%s: req_comp %d: %s\n", path.c_str(), reqComp, ldr && hdr ? "sizes differ" : stbi_failure_reason());
+            bad++;
+        } else {
+            int n = reqComp ? reqComp : comp, colours = n & 1 ? n : n - 1;
+            size_t count = (size_t)w * h * n;
+            for (size_t i = 0; i < count; i++) {
+                bool alpha = (int)(i % n) >= colours;
+                double want = alpha ? ldr[i] / 255.0 : pow(ldr[i] / 255.0, gamma) * scale;
+                if (fabs(hdr[i] - want) > (alpha ? 1e-7 : 1e-6 * (want + 1e-30))) {
+                    fprintf(stderr, "%s: req_comp %d: %g for %d, expected %g\n", path.c_str(), reqComp, hdr[i], ldr[i], want);
+                    bad++;
+                    break;
+                }
+            }
+        }
+        stbi_image_free(ldr);
+        stbi_image_free(hdr);
+    }
+    return bad;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hdr_check [-n files] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int fileCount = 300;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc) usage();
+            fileCount = atoi(argv[++i]);
+            if (fileCount < 1) usage();
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    // the gamma and scale each file is converted to 8 bits with, and PNGs to floats with
+    static const float gammas[] = { 2.2f, 1.0f, 1.8f };
+    static const float scales[] = { 1.0f, 1.0f, 4.0f };
+
+    srand(1234);
+    int runs = 0, bad = 0;
+    for (int f = 0; f < fileCount; f++) {
+        // flat below 8 wide, and flat or run-length coded above
+        bool rle = f % 3 != 0;
+        int width = rle || f % 2 ? 8 + rand() % 300 : 1 + rand() % 7;
+        int height = 1 + rand() % 24;
+        std::vector<unsigned char> rgbe = randomPixels(width, height);
+        if (!rle && width >= 8 && rgbe[0] == 2) rgbe[0] = 3;
+        std::vector<unsigned char> file = makeHdr(rgbe, width, height, rle);
+        int setting = f % 3;
+        stbi_hdr_to_ldr_gamma(gammas[setting]);
+        stbi_hdr_to_ldr_scale(scales[setting]);
+        bad += checkHdr(file, rgbe, width, height, rle ? "run-length coded" : "flat", gammas[setting], scales[setting], runs);
+        if (rle) bad += checkOvershoot(rgbe, width, height, runs);
+    }
+    stbi_hdr_to_ldr_gamma(2.2f);
+    stbi_hdr_to_ldr_scale(1.0f);
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findPngs(dirs[i], files);
+    for (int setting = 0; setting < 3; setting++) {
+        stbi_ldr_to_hdr_gamma(gammas[setting]);
+        stbi_ldr_to_hdr_scale(scales[setting]);
+        for (size_t i = 0; i < files.size(); i++) bad += checkLdr(files[i], gammas[setting], scales[setting], runs);
+    }
+    stbi_ldr_to_hdr_gamma(2.2f);
+    stbi_ldr_to_hdr_scale(1.0f);
+
+    printf("%d runs, %d bad\n", runs, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,807 @@
+// io_check: writes random BMP, TGA, PSD and PIC files in every layout the
+// decoders read a row or a run at a time (palette and 16-bit BMPs, bit
+// field masks, top-down and bottom-up rows, run-length TGAs with runs across
+// rows, raw and PackBits PSDs, and PIC packets of each kind) and checks that
+// loading each one gives back the pixels written. Each file, along with
+// cut-off and corrupted copies, is then loaded at each CPU level for each
+// req_comp from memory, through callbacks and from a FILE, and all three
+// must give the same pixels or the same failure message. The images under
+// the given directories are written out the same way. Build it with
+// -fsanitize=address as well.
+//
+// build: c++ -O2 tools/io_check.cpp -o io_check -lpthread
+// usage: io_check [-n files] [dir ...]
+//        (default 300 files, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+
+// the CPU level is internal, so the decoder is built into this file
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2, STBI__CPU_SSE2 | STBI__CPU_AVX2 };
+static const int levelCount = 3;
+#else
+static const int levels[] = { 0 };
+static const int levelCount = 1;
+#endif
+
+// a corrupted size can ask for a gigabyte; anything past this fails the
+// same way from every source instead
+static const size_t heapLimit = 16 << 20;
+
+static void* limitedMalloc(void* user, size_t size)
+{
+    (void)user;
+    return size > heapLimit ? NULL : malloc(size);
+}
+
+static void* limitedRealloc(void* user, void* p, size_t size)
+{
+    (void)user;
+    return size > heapLimit ? NULL : realloc(p, size);
+}
+
+static void limitedFree(void* user, void* p)
+{
+    (void)user;
+    free(p);
+}
+
+struct Image
+{
+    int width, height;
+    std::vector<unsigned char> rgba;
+};
+
+// a file as written, and what loading it with req_comp 0 must give
+struct Encoded
+{
+    std::string name;
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> expected;
+    int components;
+};
+
+struct Result
+{
+    std::vector<unsigned char> pixels;
+    int width, height, components;
+    std::string failure;        // empty if the decode succeeded
+};
+
+// the extensions stb_image can read
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && isImage(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static void putLe16(std::vector<unsigned char>& out, unsigned int v)
+{
+    out.push_back((unsigned char)v);
+    out.push_back((unsigned char)(v >> 8));
+}
+
+static void putLe32(std::vector<unsigned char>& out, unsigned int v)
+{
+    putLe16(out, v & 0xffff);
+    putLe16(out, v >> 16);
+}
+
+static void putBe16(std::vector<unsigned char>& out, unsigned int v)
+{
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+static void putBe32(std::vector<unsigned char>& out, unsigned int v)
+{
+    putBe16(out, v >> 16);
+    putBe16(out, v & 0xffff);
+}
+
+static void putJunk(std::vector<unsigned char>& out, int n)
+{
+    for (int i = 0; i < n; i++) out.push_back((unsigned char)rand());
+}
+
+// rows of noise, flat colour and short runs, so the run-length writers
+// have both kinds of packet to write. Some are small enough for the whole
+// file to fit in the decoder's first read through callbacks.
+static Image randomImage()
+{
+    Image img;
+    int size = rand() % 8;
+    img.width = 1 + rand() % (size == 0 ? 3 : size < 6 ? 60 : 300);
+    img.height = 1 + rand() % (size == 0 ? 3 : 40);
+    bool opaque = rand() % 3 == 0;
+    img.rgba.resize((size_t)img.width * img.height * 4);
+    unsigned char colour[4] = { 0, 0, 0, 255 };
+    for (int y = 0; y < img.height; y++) {
+        int kind = rand() % 3, left = 0;
+        for (int x = 0; x < img.width; x++) {
+            if (kind == 0 || left-- <= 0) {
+                for (int c = 0; c < 4; c++) colour[c] = (unsigned char)rand();
+                left = kind == 1 ? img.width : rand() % 6;
+            }
+            unsigned char* p = &img.rgba[((size_t)y * img.width + x) * 4];
+            memcpy(p, colour, 4);
+            if (opaque) p[3] = 255;
+        }
+    }
+    return img;
+}
+
+// the top-left corner of an image from a directory, at most 160 square
+static bool fileImage(const std::string& path, Image& img)
+{
+    std::vector<unsigned char> data;
+    if (!readFile(path, data)) return false;
+    int w, h, comp;
+    unsigned char* pixels = stbi_load_from_memory(&data[0], (int)data.size(), &w, &h, &comp, 4);
+    if (!pixels) return false;
+    img.width = std::min(w, 160);
+    img.height = std::min(h, 160);
+    img.rgba.resize((size_t)img.width * img.height * 4);
+    for (int y = 0; y < img.height; y++)
+        memcpy(&img.rgba[(size_t)y * img.width * 4], pixels + (size_t)y * w * 4, (size_t)img.width * 4);
+    stbi_image_free(pixels);
+    return true;
+}
+
+// a palette of n random colours, and an index into it for each pixel that
+// follows the image, so flat areas stay flat
+static void makePalette(const Image& img, int n, std::vector<unsigned char>& palette, std::vector<unsigned char>& indices)
+{
+    palette.clear();
+    for (int i = 0; i < n * 4; i++) palette.push_back((unsigned char)rand());
+    indices.resize((size_t)img.width * img.height);
+    for (size_t i = 0; i < indices.size(); i++) {
+        const unsigned char* p = &img.rgba[i * 4];
+        indices[i] = (unsigned char)((p[0] * 7 + p[1] * 3 + p[2] + p[3]) % n);
+    }
+}
+
+// the top n bits of v as the decoder widens them to 8, by repeating them
+static int widen(int v, int n)
+{
+    int top = (v >> (8 - n)) << (8 - n), result = top;
+    for (int z = n; z < 8; z += n) result += top >> z;
+    return result;
+}
+
+static int maskShift(unsigned int mask)
+{
+    int shift = 0;
+    while (!(mask >> shift & 1)) shift++;
+    return shift;
+}
+
+static int maskBits(unsigned int mask)
+{
+    int bits = 0;
+    for (; mask; mask >>= 1) bits += mask & 1;
+    return bits;
+}
+
+static Encoded writeBmp(const Image& img, int variant)
+{
+    static const char* names[] = { "24-bit", "32-bit", "32-bit BGRA masks", "32-bit RGBA masks", "32-bit no alpha",
+                                   "16-bit 555", "16-bit 565", "16-bit 1555", "16-bit 4444", "8-bit", "4-bit",
+                                   "8-bit OS/2", "24-bit OS/2", "4-bit v4" };
+    static const int bpps[] = { 24, 32, 32, 32, 32, 16, 16, 16, 16, 8, 4, 8, 24, 4 };
+    static const int headers[] = { 40, 40, 108, 108, 40, 40, 40, 108, 108, 40, 40, 12, 12, 108 };
+    static const unsigned int masks[14][4] = {
+        { 0, 0, 0, 0 }, { 0xff0000, 0xff00, 0xff, 0xff000000u }, { 0xff0000, 0xff00, 0xff, 0xff000000u },
+        { 0xff, 0xff00, 0xff0000, 0xff000000u }, { 0xff0000, 0xff00, 0xff, 0 }, { 0x7c00, 0x3e0, 0x1f, 0 },
+        { 0xf800, 0x7e0, 0x1f, 0 }, { 0x7c00, 0x3e0, 0x1f, 0x8000 }, { 0xf00, 0xf0, 0xf, 0xf000 },
+    };
+    int bpp = bpps[variant], hsz = headers[variant], w = img.width, h = img.height;
+    bool topDown = hsz != 12 && rand() % 2;
+    bool fields = variant == 4 || variant == 6;     // masks after a 40-byte header
+    int entry = hsz == 12 ? 3 : 4;
+
+    Encoded e;
+    char name[64];
+    snprintf(name, sizeof(name), "bmp %s%s", names[variant], topDown ? " top-down" : "");
+    e.name = name;
+    std::vector<unsigned char> palette, indices;
+    int colours = 0;
+    if (bpp < 16) {
+        colours = 1 + rand() % (bpp == 4 ? 16 : 256);
+        makePalette(img, colours, palette, indices);
+    }
+    // a gap before the pixels, except after a palette, whose size is taken
+    // from where the pixels start
+    int gap = bpp < 16 ? 0 : rand() % 9;
+    int offset = 14 + hsz + (fields ? 12 : 0) + colours * entry + gap;
+    int stride = ((w * bpp + 7) / 8 + 3) & ~3;
+
+    std::vector<unsigned char>& out = e.data;
+    out.push_back('B');
+    out.push_back('M');
+    putLe32(out, offset + stride * h);
+    putLe32(out, 0);
+    putLe32(out, offset);
+    putLe32(out, hsz);
+    if (hsz == 12) {
+        putLe16(out, w);
+        putLe16(out, h);
+        putLe16(out, 1);
+        putLe16(out, bpp);
+    } else {
+        putLe32(out, w);
+        putLe32(out, topDown ? -h : h);
+        putLe16(out, 1);
+        putLe16(out, bpp);
+        putLe32(out, fields ? 3 : 0);
+        for (int i = 0; i < 5; i++) putLe32(out, 0);
+        if (fields)
+            for (int i = 0; i < 3; i++) putLe32(out, masks[variant][i]);
+        if (hsz == 108) {
+            for (int i = 0; i < 4; i++) putLe32(out, masks[variant][i]);
+            putJunk(out, 52);
+        }
+    }
+    for (int i = 0; i < colours; i++) {
+        out.push_back(palette[i * 4 + 2]);
+        out.push_back(palette[i * 4 + 1]);
+        out.push_back(palette[i * 4 + 0]);
+        if (entry == 4) out.push_back(0);
+    }
+    putJunk(out, gap);
+
+    const unsigned int* m = masks[variant];
+    e.components = (bpp == 32 && (m[3] || (hsz == 40 && !fields))) || (bpp == 16 && m[3]) ? 4 : 3;
+    if (bpp == 32 && hsz == 40 && !fields) m = masks[1];
+    e.expected.resize((size_t)w * h * e.components);
+    for (int j = 0; j < h; j++) {
+        int y = topDown ? j : h - 1 - j;
+        size_t start = out.size();
+        for (int x = 0; x < w; x++) {
+            const unsigned char* p = &img.rgba[((size_t)y * w + x) * 4];
+            unsigned char* q = &e.expected[((size_t)y * w + x) * e.components];
+            if (bpp < 16) {
+                int index = indices[(size_t)y * w + x];
+                if (bpp == 8) out.push_back((unsigned char)index);
+                else if (x & 1) out.back() |= (unsigned char)index;
+                else out.push_back((unsigned char)(index << 4));
+                memcpy(q, &palette[index * 4], 3);
+            } else if (bpp == 24) {
+                out.push_back(p[2]);
+                out.push_back(p[1]);
+                out.push_back(p[0]);
+                memcpy(q, p, 3);
+            } else {
+                unsigned int v = bpp == 32 && !m[3] ? (unsigned int)rand() << 24 : 0;
+                for (int c = 0; c < 4; c++) {
+                    if (!m[c]) continue;
+                    int bits = maskBits(m[c]);
+                    v |= (unsigned int)(p[c] >> (8 - bits)) << maskShift(m[c]);
+                    if (c < e.components) q[c] = (unsigned char)widen(p[c], bits);
+                }
+                if (e.components == 4 && !m[3]) q[3] = 255;
+                if (bpp == 16) putLe16(out, v);
+                else putLe32(out, v);
+            }
+        }
+        out.resize(start + stride);
+    }
+    return e;
+}
+
+// packs pixels of n bytes into TGA runs, which may carry over a row's end
+static void tgaRuns(std::vector<unsigned char>& out, const std::vector<unsigned char>& pixels, int n, int width)
+{
+    bool rows = rand() % 2;
+    size_t count = pixels.size() / n;
+    for (size_t i = 0; i < count;) {
+        size_t limit = std::min(count - i, (size_t)1 + rand() % 128);
+        if (rows) limit = std::min(limit, (size_t)width - i % width);
+        size_t run = 1;
+        while (run < limit && !memcmp(&pixels[(i + run) * n], &pixels[i * n], n)) run++;
+        if (run > 1 || rand() % 4 == 0) {
+            out.push_back((unsigned char)(128 + run - 1));
+            out.insert(out.end(), &pixels[i * n], &pixels[i * n] + n);
+        } else {
+            while (run < limit && memcmp(&pixels[(i + run) * n], &pixels[(i + run - 1) * n], n)) run++;
+            out.push_back((unsigned char)(run - 1));
+            out.insert(out.end(), &pixels[i * n], &pixels[(i + run) * n]);
+        }
+        i += run;
+    }
+}
+
+static Encoded writeTga(const Image& img, int variant, bool rle)
+{
+    static const char* names[] = { "24-bit", "32-bit", "grey", "grey alpha", "24-bit palette", "32-bit palette" };
+    static const int types[] = { 2, 2, 3, 3, 1, 1 };
+    static const int bpps[] = { 24, 32, 8, 16, 24, 32 };
+    int w = img.width, h = img.height;
+    bool indexed = types[variant] == 1, topDown = rand() % 2;
+    int n = indexed ? 1 : bpps[variant] / 8, idLength = rand() % 3 ? 0 : rand() % 20;
+
+    Encoded e;
+    char name[64];
+    snprintf(name, sizeof(name), "tga %s%s%s", names[variant], rle ? " RLE" : "", topDown ? " top-down" : "");
+    e.name = name;
+    e.components = bpps[variant] / 8;
+    std::vector<unsigned char> palette, indices;
+    int colours = 0;
+    if (indexed) {
+        colours = 1 + rand() % 256;
+        makePalette(img, colours, palette, indices);
+    }
+
+    std::vector<unsigned char>& out = e.data;
+    out.push_back((unsigned char)idLength);
+    out.push_back(indexed ? 1 : 0);
+    out.push_back((unsigned char)(types[variant] + (rle ? 8 : 0)));
+    putLe16(out, 0);
+    putLe16(out, colours);
+    out.push_back(indexed ? (unsigned char)bpps[variant] : 0);
+    putLe32(out, 0);
+    putLe16(out, w);
+    putLe16(out, h);
+    out.push_back(indexed ? 8 : (unsigned char)bpps[variant]);
+    out.push_back((unsigned char)((topDown ? 0x20 : 0) | (e.components == 4 ? 8 : 0)));
+    putJunk(out, idLength);
+    for (int i = 0; i < colours; i++) {
+        out.push_back(palette[i * 4 + 2]);
+        out.push_back(palette[i * 4 + 1]);
+        out.push_back(palette[i * 4 + 0]);
+        if (e.components == 4) out.push_back(palette[i * 4 + 3]);
+    }
+
+    std::vector<unsigned char> pixels;
+    e.expected.resize((size_t)w * h * e.components);
+    for (int j = 0; j < h; j++) {
+        int y = topDown ? j : h - 1 - j;
+        for (int x = 0; x < w; x++) {
+            const unsigned char* p = &img.rgba[((size_t)y * w + x) * 4];
+            unsigned char* q = &e.expected[((size_t)y * w + x) * e.components];
+            if (indexed) {
+                int index = indices[(size_t)y * w + x];
+                pixels.push_back((unsigned char)index);
+                p = &palette[index * 4];
+            } else if (n <= 2) {
+                pixels.push_back(p[0]);
+                if (n == 2) pixels.push_back(p[3]);
+            } else {
+                pixels.push_back(p[2]);
+                pixels.push_back(p[1]);
+                pixels.push_back(p[0]);
+                if (n == 4) pixels.push_back(p[3]);
+            }
+            if (e.components <= 2) {
+                q[0] = p[0];
+                if (e.components == 2) q[1] = p[3];
+            } else {
+                memcpy(q, p, e.components);
+            }
+        }
+    }
+    if (rle) tgaRuns(out, pixels, n, w);
+    else out.insert(out.end(), pixels.begin(), pixels.end());
+    return e;
+}
+
+// one row of a PSD channel in PackBits, with the odd no-op thrown in
+static void packBits(std::vector<unsigned char>& out, const unsigned char* row, int n)
+{
+    for (int i = 0; i < n;) {
+        if (rand() % 16 == 0) out.push_back(128);
+        int limit = std::min(n - i, 1 + rand() % 128), run = 1;
+        while (run < limit && row[i + run] == row[i]) run++;
+        if (run > 1) {
+            out.push_back((unsigned char)(257 - run));
+            out.push_back(row[i]);
+        } else {
+            while (run < limit && row[i + run] != row[i + run - 1]) run++;
+            out.push_back((unsigned char)(run - 1));
+            out.insert(out.end(), row + i, row + i + run);
+        }
+        i += run;
+    }
+}
+
+static Encoded writePsd(const Image& img, int channels, bool rle)
+{
+    int w = img.width, h = img.height;
+    Encoded e;
+    char name[64];
+    snprintf(name, sizeof(name), "psd %d channels%s", channels, rle ? " RLE" : "");
+    e.name = name;
+    e.components = 4;
+    e.expected = img.rgba;
+    if (channels == 3)
+        for (size_t i = 3; i < e.expected.size(); i += 4) e.expected[i] = 255;
+
+    std::vector<unsigned char>& out = e.data;
+    out.insert(out.end(), "8BPS", "8BPS" + 4);
+    putBe16(out, 1);
+    putJunk(out, 6);
+    putBe16(out, channels);
+    putBe32(out, h);
+    putBe32(out, w);
+    putBe16(out, 8);
+    putBe16(out, 3);
+    for (int section = 0; section < 3; section++) {
+        int length = rand() % 3 ? 0 : rand() % 40;
+        putBe32(out, length);
+        putJunk(out, length);
+    }
+    putBe16(out, rle ? 1 : 0);
+
+    std::vector<unsigned char> plane((size_t)w * h);
+    std::vector<unsigned char> packed, counts;
+    for (int c = 0; c < channels; c++) {
+        for (size_t i = 0; i < plane.size(); i++) plane[i] = c < 4 ? img.rgba[i * 4 + c] : (unsigned char)rand();
+        if (!rle) {
+            out.insert(out.end(), plane.begin(), plane.end());
+            continue;
+        }
+        for (int y = 0; y < h; y++) {
+            size_t start = packed.size();
+            packBits(packed, &plane[(size_t)y * w], w);
+            putBe16(counts, (unsigned int)(packed.size() - start));
+        }
+    }
+    out.insert(out.end(), counts.begin(), counts.end());
+    out.insert(out.end(), packed.begin(), packed.end());
+    return e;
+}
+
+// one row of the channels a PIC packet holds, in its compression type
+static void picPacket(std::vector<unsigned char>& out, const unsigned char* row, int w, int channel, int type)
+{
+    std::vector<unsigned char> values;
+    for (int x = 0; x < w; x++)
+        for (int c = 0; c < 4; c++)
+            if (channel & (0x80 >> c)) values.push_back(row[x * 4 + c]);
+    int n = (int)values.size() / w;
+    if (type == 0) {
+        out.insert(out.end(), values.begin(), values.end());
+        return;
+    }
+    for (int i = 0; i < w;) {
+        int limit = type == 1 ? std::min(w - i, 1 + rand() % 255) : std::min(w - i, 1 + rand() % 300), run = 1;
+        while (run < limit && !memcmp(&values[(i + run) * n], &values[i * n], n)) run++;
+        if (type == 1) {
+            // a count past the row's end is cut to fit
+            out.push_back((unsigned char)(run == w - i && rand() % 2 ? 255 : run));
+        } else if (run > 1 && run <= 128 && rand() % 4) {
+            out.push_back((unsigned char)(run + 127));
+        } else if (run > 1) {
+            out.push_back(128);
+            putBe16(out, run);
+        } else {
+            limit = std::min(limit, 128);
+            while (run < limit && memcmp(&values[(i + run) * n], &values[(i + run - 1) * n], n)) run++;
+            out.push_back((unsigned char)(run - 1));
+            out.insert(out.end(), &values[i * n], &values[(i + run) * n]);
+            i += run;
+            continue;
+        }
+        out.insert(out.end(), &values[i * n], &values[(i + 1) * n]);
+        i += run;
+    }
+}
+
+static Encoded writePic(const Image& img)
+{
+    static const char* typeNames[] = { "raw", "pure RLE", "mixed RLE" };
+    int w = img.width, h = img.height;
+    bool alpha = rand() % 2, split = alpha && rand() % 2;
+    int channels[2] = { alpha && !split ? 0xf0 : 0xe0, 0x10 };
+    int types[2] = { rand() % 3, rand() % 3 };
+    int packets = split ? 2 : 1;
+
+    Encoded e;
+    char name[64];
+    if (split) snprintf(name, sizeof(name), "pic %s RGB, %s alpha", typeNames[types[0]], typeNames[types[1]]);
+    else snprintf(name, sizeof(name), "pic %s %s", typeNames[types[0]], alpha ? "RGBA" : "RGB");
+    e.name = name;
+    e.components = alpha ? 4 : 3;
+    e.expected.resize((size_t)w * h * e.components);
+    for (size_t i = 0; i < (size_t)w * h; i++) memcpy(&e.expected[i * e.components], &img.rgba[i * 4], e.components);
+
+    std::vector<unsigned char>& out = e.data;
+    static const unsigned char magic[] = { 0x53, 0x80, 0xf6, 0x34 };
+    out.insert(out.end(), magic, magic + 4);
+    putJunk(out, 84);
+    out.insert(out.end(), "PICT", "PICT" + 4);
+    putBe16(out, w);
+    putBe16(out, h);
+    putJunk(out, 8);
+    for (int p = 0; p < packets; p++) {
+        out.push_back(p + 1 < packets);
+        out.push_back(8);
+        out.push_back((unsigned char)types[p]);
+        out.push_back((unsigned char)channels[p]);
+    }
+    for (int y = 0; y < h; y++)
+        for (int p = 0; p < packets; p++) picPacket(out, &img.rgba[(size_t)y * w * 4], w, channels[p], types[p]);
+    return e;
+}
+
+// one file of each format, in a random layout
+static void writeAll(const Image& img, std::vector<Encoded>& files)
+{
+    files.push_back(writeBmp(img, rand() % 14));
+    files.push_back(writeTga(img, rand() % 6, rand() % 2));
+    files.push_back(writePsd(img, 3 + rand() % 3, rand() % 2));
+    files.push_back(writePic(img));
+}
+
+// a file read through callbacks, which hand over all that is asked for
+struct Reader
+{
+    const unsigned char* data;
+    int size, pos;
+};
+
+static int readBytes(void* user, char* data, int size)
+{
+    Reader* r = (Reader*)user;
+    int n = std::min(size, r->size - r->pos);
+    memcpy(data, r->data + r->pos, n);
+    r->pos += n;
+    return n;
+}
+
+static void skipBytes(void* user, unsigned n)
+{
+    Reader* r = (Reader*)user;
+    r->pos += (int)std::min(n, (unsigned)(r->size - r->pos));
+}
+
+static int atEnd(void* user)
+{
+    Reader* r = (Reader*)user;
+    return r->pos >= r->size;
+}
+
+static const char* sourceNames[] = { "memory", "callbacks", "a FILE" };
+
+static Result load(const std::vector<unsigned char>& data, FILE* f, int source, int reqComp)
+{
+    Result r;
+    r.width = r.height = r.components = 0;
+    unsigned char* pixels;
+    if (source == 0) {
+        pixels = stbi_load_from_memory(&data[0], (int)data.size(), &r.width, &r.height, &r.components, reqComp);
+    } else if (source == 1) {
+        static const stbi_io_callbacks callbacks = { readBytes, skipBytes, atEnd };
+        Reader reader = { &data[0], (int)data.size(), 0 };
+        pixels = stbi_load_from_callbacks(&callbacks, &reader, &r.width, &r.height, &r.components, reqComp);
+    } else {
+        rewind(f);
+        pixels = stbi_load_from_file(f, &r.width, &r.height, &r.components, reqComp);
+    }
+    if (pixels) {
+        r.pixels.assign(pixels, pixels + (size_t)r.width * r.height * (reqComp ? reqComp : r.components));
+        stbi_image_free(pixels);
+    } else {
+        const char* reason = stbi_failure_reason();
+        r.failure = reason ? reason : "?";
+    }
+    return r;
+}
+
+static bool same(const Result& a, const Result& b)
+{
+    return a.failure == b.failure && a.pixels == b.pixels && a.width == b.width && a.height == b.height &&
+           a.components == b.components;
+}
+
+// loads data from each source at each CPU level for each req_comp, and
+// compares everything with the load from memory at the first level
+static int checkSources(const std::string& name, const std::vector<unsigned char>& data, Result& plain, int& runs)
+{
+    int bad = 0, available = stbi__cpu();
+    FILE* f = tmpfile();
+    if (!f || fwrite(&data[0], 1, data.size(), f) != data.size()) {
+        fprintf(stderr, "%s: could not write a temporary file\n", name.c_str());
+        if (f) fclose(f);
+        return 1;
+    }
+    for (int reqComp = 0; reqComp <= 4; reqComp++) {
+        Result first;
+        for (int l = 0; l < levelCount; l++) {
+            if ((available & levels[l]) != levels[l]) continue;
+            stbi__cpu_flags = levels[l];
+            for (int source = 0; source < 3; source++) {
+                Result got = load(data, f, source, reqComp);
+                runs++;
+                if (l == 0 && source == 0) {
+                    first = got;
+                    if (reqComp == 0) plain = got;
+                } else if (!same(got, first)) {
+                    fprintf(stderr, "%s: req_comp %d at CPU level %d from %s %s%s, from memory at level 0 %s%s\n",
+                            name.c_str(), reqComp, levels[l], sourceNames[source], got.failure.empty() ? "succeeded" : "failed: ",
+                            got.failure.c_str(), first.failure.empty() ? "succeeded" : "failed: ", first.failure.c_str());
+                    bad++;
+                }
+            }
+        }
+    }
+    stbi__cpu_flags = available;
+    fclose(f);
+
+    int x[2], y[2], comp[2], ok[2];
+    static const stbi_io_callbacks callbacks = { readBytes, skipBytes, atEnd };
+    Reader reader = { &data[0], (int)data.size(), 0 };
+    ok[0] = stbi_info_from_memory(&data[0], (int)data.size(), &x[0], &y[0], &comp[0]);
+    ok[1] = stbi_info_from_callbacks(&callbacks, &reader, &x[1], &y[1], &comp[1]);
+    runs++;
+    if (ok[0] != ok[1] || (ok[0] && (x[0] != x[1] || y[0] != y[1] || comp[0] != comp[1]))) {
+        fprintf(stderr, "%s: stbi_info differs between memory and callbacks\n", name.c_str());
+        bad++;
+    }
+    return bad;
+}
+
+// the file, then cut-off copies, one of them where a read through callbacks
+// ends, and copies with bytes changed, in the header and anywhere
+static int checkFile(const std::string& name, const Encoded& file, int& runs)
+{
+    Result plain;
+    int bad = checkSources(name, file.data, plain, runs);
+    runs++;
+    if (!plain.failure.empty()) {
+        fprintf(stderr, "%s: failed: %s\n", name.c_str(), plain.failure.c_str());
+        bad++;
+    } else if (plain.pixels != file.expected || plain.components != file.components) {
+        fprintf(stderr, "%s: %s\n", name.c_str(),
+                plain.components != file.components ? "wrong component count" : "differs from the pixels written");
+        bad++;
+    }
+
+    size_t size = file.data.size();
+    for (int m = 0; m < 6; m++) {
+        std::vector<unsigned char> data = file.data;
+        const char* how;
+        if (m < 2) {
+            data.resize(1 + rand() % (size - 1));
+            how = "cut off";
+        } else if (m == 2) {
+            data.resize(size > 128 ? 128 * (1 + rand() % ((size - 1) / 128)) : 1 + rand() % (size - 1));
+            how = "cut off at a read";
+        } else if (m == 3) {
+            data[rand() % std::min(size, (size_t)64)] ^= (unsigned char)(1 + rand() % 255);
+            how = "header changed";
+        } else if (m == 4) {
+            for (int k = rand() % 4; k >= 0; k--) data[rand() % size] ^= (unsigned char)(1 + rand() % 255);
+            how = "bytes changed";
+        } else {
+            size_t at = rand() % size;
+            for (size_t k = at; k < std::min(size, at + 8); k++) data[k] = (unsigned char)rand();
+            how = "scrambled";
+        }
+        Result ignored;
+        bad += checkSources(name + " (" + how + ")", data, ignored, runs);
+    }
+    return bad;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: io_check [-n files] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int fileCount = 300;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc) usage();
+            fileCount = atoi(argv[++i]);
+            if (fileCount < 1) usage();
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    stbi_allocator limited = { limitedMalloc, limitedRealloc, limitedFree, NULL };
+    stbi_set_allocator(&limited);
+    srand(1234);
+    int runs = 0, bad = 0;
+    for (int f = 0; f < fileCount; f++) {
+        Image img = randomImage();
+        std::vector<Encoded> files;
+        writeAll(img, files);
+        for (size_t i = 0; i < files.size(); i++) {
+            char name[128];
+            snprintf(name, sizeof(name), "generated %d (%s, %dx%d)", f, files[i].name.c_str(), img.width, img.height);
+            bad += checkFile(name, files[i], runs);
+        }
+    }
+
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], paths);
+    for (size_t i = 0; i < paths.size(); i++) {
+        Image img;
+        if (!fileImage(paths[i], img)) {
+            fprintf(stderr, "%s: could not load\n", paths[i].c_str());
+            bad++;
+            continue;
+        }
+        std::vector<Encoded> files;
+        writeAll(img, files);
+        for (size_t k = 0; k < files.size(); k++) bad += checkFile(paths[i] + " as " + files[k].name, files[k], runs);
+    }
+    stbi_set_allocator(NULL);
+
+    // an empty file must fail the same way from each source
+    static const unsigned char nothing[1] = { 0 };
+    static const stbi_io_callbacks callbacks = { readBytes, skipBytes, atEnd };
+    Reader reader = { nothing, 0, 0 };
+    int w, h, comp;
+    unsigned char* pixels = stbi_load_from_memory(nothing, 0, &w, &h, &comp, 0);
+    std::string fromMemory = pixels ? "" : stbi_failure_reason();
+    stbi_image_free(pixels);
+    pixels = stbi_load_from_callbacks(&callbacks, &reader, &w, &h, &comp, 0);
+    std::string fromCallbacks = pixels ? "" : stbi_failure_reason();
+    stbi_image_free(pixels);
+    runs++;
+    if (fromMemory.empty() || fromMemory != fromCallbacks) {
+        fprintf(stderr, "an empty file from memory %s, through callbacks %s\n", fromMemory.empty() ? "loaded" : fromMemory.c_str(),
+                fromCallbacks.empty() ? "loaded" : fromCallbacks.c_str());
+        bad++;
+    }
+
+    printf("%d runs, %d bad\n", runs, bad);
+    return bad ? 1 : 0;
+}
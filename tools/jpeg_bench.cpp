@@ -0,0 +1,170 @@
+// jpeg_bench: times JPEG decodes with the plain C IDCT, chroma upsampling
+// and YCbCr conversion against the SSE2 kernels, which are the only parts
+// that differ between the two runs, and checks the pixels agree exactly.
+//
+// build: c++ -O2 tools/jpeg_bench.cpp -o jpeg_bench -lpthread
+// usage: jpeg_bench [dir or file ...]   (default GemSwap, searched recursively)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// the kernels are picked from the CPU flags, which live in the decoder
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2 };
+static const char* levelNames[] = { "scalar", "sse2" };
+static const int levelCount = 2;
+#else
+static const int levels[] = { 0 };
+static const char* levelNames[] = { "scalar" };
+static const int levelCount = 1;
+#endif
+
+static bool isJpeg(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    return ext == "jpg" || ext == "jpeg";
+}
+
+// collects JPEG files below path, in name order
+static void findJpegs(const std::string& path, std::vector<std::string>& files)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "%s: not found\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string child = path + "/" + names[i];
+        if (stat(child.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            findJpegs(child, files);
+        else if (isJpeg(names[i]))
+            files.push_back(child);
+    }
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+// best of a few decodes, in milliseconds; the last result is kept in pixels
+static double timeDecode(const std::vector<unsigned char>& file, std::vector<unsigned char>& pixels, int& width, int& height)
+{
+    double best = -1;
+    for (int run = 0; run < 5; run++) {
+        int comp;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        unsigned char* result = stbi_load_from_memory(&file[0], (int)file.size(), &width, &height, &comp, 0);
+        double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e3;
+        if (!result) return -1;
+        pixels.assign(result, result + (size_t)width * height * comp);
+        stbi_image_free(result);
+        if (best < 0 || ms < best) best = ms;
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> roots;
+    for (int i = 1; i < argc; i++) roots.push_back(argv[i]);
+    if (roots.empty()) roots.push_back("GemSwap");
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < roots.size(); i++) findJpegs(roots[i], files);
+    if (files.empty()) {
+        fprintf(stderr, "no JPEG files found\nusage: jpeg_bench [dir or file ...]\n");
+        return 2;
+    }
+
+    int available = stbi__cpu();
+    printf("%-40s %11s", "file, ms", "size");
+    for (int l = 0; l < levelCount; l++) printf(" %9s", levelNames[l]);
+    printf("\n");
+
+    double totals[levelCount] = {0};
+    int mismatches = 0, failed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        std::vector<unsigned char> file, expected, pixels;
+        if (!readFile(files[i], file)) {
+            fprintf(stderr, "%s: could not read\n", files[i].c_str());
+            failed++;
+            continue;
+        }
+        double times[levelCount];
+        int width = 0, height = 0;
+        bool ok = true, differs = false;
+        for (int l = 0; l < levelCount && ok; l++) {
+            if ((available & levels[l]) != levels[l]) {
+                times[l] = -1;
+                continue;
+            }
+            stbi__cpu_flags = levels[l];
+            times[l] = timeDecode(file, l == 0 ? expected : pixels, width, height);
+            ok = times[l] >= 0;
+            if (ok && l > 0 && pixels != expected) differs = true;
+        }
+        stbi__cpu_flags = available;
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", files[i].c_str(), stbi_failure_reason());
+            failed++;
+            continue;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", width, height);
+        printf("%-40s %11s", files[i].c_str(), size);
+        for (int l = 0; l < levelCount; l++) {
+            if (times[l] < 0) {
+                printf(" %9s", "-");
+                continue;
+            }
+            printf(" %9.2f", times[l]);
+            totals[l] += times[l];
+        }
+        if (differs) {
+            printf("  differs!");
+            mismatches++;
+        }
+        printf("\n");
+    }
+
+    printf("%-40s %11s", "total", "");
+    for (int l = 0; l < levelCount; l++) printf(" %9.2f", totals[l]);
+    printf("\n");
+    return mismatches || failed ? 1 : 0;
+}
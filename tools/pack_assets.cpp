@@ -0,0 +1,261 @@
+// pack_assets: packs the images under the given directories into one
+// archive the game maps at startup, so loading a texture is a lookup in a
+// sorted table instead of a path walk and an open per file. Files with the
+// same contents are stored once, however many names they have.
+//
+// build: c++ -O2 tools/pack_assets.cpp -o pack_assets
+// usage: pack_assets [-o archive] [dir ...]   (default GemSwap/assets.pak from GemSwap)
+//        names in the archive are paths relative to the directory given,
+//        e.g. "asteroid.png" or "sprites/fireball.png"
+//
+// layout, little-endian, shared with AssetArchive in GemSwap/main.cpp:
+//   AssetArchiveHeader
+//   AssetEntry[entryCount], sorted by name hash, then name
+//   names, not terminated, at namesOffset
+//   contents, each on a 16 byte boundary
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+static const unsigned int archiveMagic = 0x4B505347;   // "GSPK"
+static const unsigned int archiveVersion = 1;
+
+struct AssetArchiveHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int entryCount;
+    unsigned int namesSize;
+    unsigned long long namesOffset;
+    unsigned long long size;            // of the whole archive
+};
+
+struct AssetEntry
+{
+    unsigned long long nameHash;
+    unsigned long long contentHash;     // of the file, as the texture cache hashes it
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned int nameOffset;            // from namesOffset
+    unsigned int nameLength;
+};
+
+struct Asset
+{
+    std::string name;
+    unsigned long long nameHash;
+    int content;                        // index into the stored contents
+};
+
+// 64-bit FNV-1a, the hash the game uses for names and file contents
+static unsigned long long hashBytes(const void* data, size_t size, unsigned long long h = 14695981039346656037ULL)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// the extensions stb_image can read, and the KTX files of tools/bc_encode.cpp
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic", "ktx" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+// collects image files below root as names relative to it
+static void findImages(const std::string& root, const std::string& relative, std::vector<std::string>& names)
+{
+    std::string path = relative.empty() ? root : root + "/" + relative;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) {
+        fprintf(stderr, "%s: not a directory\n", path.c_str());
+        return;
+    }
+    std::vector<std::string> children;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') children.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(children.begin(), children.end());
+    for (size_t i = 0; i < children.size(); i++) {
+        std::string child = relative.empty() ? children[i] : relative + "/" + children[i];
+        struct stat st;
+        if (stat((root + "/" + child).c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            findImages(root, child, names);
+        else if (isImage(children[i]))
+            names.push_back(child);
+    }
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size >= 0 && (size == 0 || fread(&data[0], 1, size, f) == (size_t)size);
+    fclose(f);
+    return ok;
+}
+
+static bool byName(const Asset& a, const Asset& b)
+{
+    if (a.nameHash != b.nameHash) return a.nameHash < b.nameHash;
+    return a.name < b.name;
+}
+
+static unsigned long long align16(unsigned long long offset)
+{
+    return (offset + 15) & ~15ULL;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: pack_assets [-o archive] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    std::string output = "GemSwap/assets.pak";
+    std::vector<std::string> roots;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            if (++i == argc) usage();
+            output = argv[i];
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            roots.push_back(argv[i]);
+        }
+    }
+    if (roots.empty()) roots.push_back("GemSwap");
+
+    std::vector<Asset> assets;
+    std::vector<std::vector<unsigned char> > contents;
+    std::vector<unsigned long long> contentHashes;
+    std::multimap<unsigned long long, int> byContent;
+    unsigned long long looseBytes = 0;
+    int failed = 0;
+
+    for (size_t r = 0; r < roots.size(); r++) {
+        std::vector<std::string> names;
+        findImages(roots[r], "", names);
+        for (size_t i = 0; i < names.size(); i++) {
+            std::vector<unsigned char> data;
+            if (!readFile(roots[r] + "/" + names[i], data)) {
+                fprintf(stderr, "%s/%s: could not read\n", roots[r].c_str(), names[i].c_str());
+                failed++;
+                continue;
+            }
+            looseBytes += data.size();
+
+            // the same contents under another name share one copy
+            unsigned long long hash = hashBytes(data.empty() ? 0 : &data[0], data.size());
+            int content = -1;
+            std::pair<std::multimap<unsigned long long, int>::iterator, std::multimap<unsigned long long, int>::iterator> same = byContent.equal_range(hash);
+            for (std::multimap<unsigned long long, int>::iterator it = same.first; it != same.second; ++it) {
+                if (contents[it->second] == data) content = it->second;
+            }
+            if (content < 0) {
+                content = (int)contents.size();
+                contents.push_back(data);
+                contentHashes.push_back(hash);
+                byContent.insert(std::make_pair(hash, content));
+            }
+
+            Asset asset;
+            asset.name = names[i];
+            asset.nameHash = hashBytes(names[i].c_str(), names[i].size());
+            asset.content = content;
+            assets.push_back(asset);
+        }
+    }
+
+    std::sort(assets.begin(), assets.end(), byName);
+    for (size_t i = 1; i < assets.size(); i++) {
+        if (assets[i].name == assets[i - 1].name) {
+            fprintf(stderr, "%s: found in more than one directory\n", assets[i].name.c_str());
+            return 1;
+        }
+    }
+
+    AssetArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = archiveMagic;
+    header.version = archiveVersion;
+    header.entryCount = (unsigned int)assets.size();
+    header.namesOffset = sizeof(header) + assets.size() * sizeof(AssetEntry);
+
+    std::string names;
+    std::vector<AssetEntry> entries(assets.size());
+    for (size_t i = 0; i < assets.size(); i++) {
+        entries[i].nameHash = assets[i].nameHash;
+        entries[i].contentHash = contentHashes[assets[i].content];
+        entries[i].nameOffset = (unsigned int)names.size();
+        entries[i].nameLength = (unsigned int)assets[i].name.size();
+        names += assets[i].name;
+    }
+    header.namesSize = (unsigned int)names.size();
+
+    // contents follow the names in the order they were first seen
+    std::vector<unsigned long long> offsets(contents.size());
+    unsigned long long offset = align16(header.namesOffset + names.size());
+    for (size_t i = 0; i < contents.size(); i++) {
+        offsets[i] = offset;
+        offset = align16(offset + contents[i].size());
+    }
+    header.size = offset;
+    for (size_t i = 0; i < assets.size(); i++) {
+        entries[i].offset = offsets[assets[i].content];
+        entries[i].size = contents[assets[i].content].size();
+    }
+
+    // written beside the target and renamed, so the game never maps half an archive
+    std::string temp = output + ".tmp";
+    FILE* f = fopen(temp.c_str(), "wb");
+    if (!f) {
+        fprintf(stderr, "%s: could not create\n", temp.c_str());
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && !entries.empty()) ok = fwrite(&entries[0], sizeof(AssetEntry), entries.size(), f) == entries.size();
+    if (ok) ok = fwrite(names.data(), 1, names.size(), f) == names.size();
+    for (size_t i = 0; ok && i < contents.size(); i++) {
+        ok = fseek(f, offsets[i], SEEK_SET) == 0;
+        if (ok && !contents[i].empty()) ok = fwrite(&contents[i][0], 1, contents[i].size(), f) == contents[i].size();
+    }
+    // pad to the recorded size so the last entry's alignment is kept
+    if (ok && (unsigned long long)ftell(f) < header.size) ok = fseek(f, header.size - 1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(temp.c_str(), output.c_str()) != 0) {
+        remove(temp.c_str());
+        fprintf(stderr, "%s: could not write\n", output.c_str());
+        return 1;
+    }
+
+    printf("%s: %d files, %d stored, %.1f KB of %.1f KB loose\n", output.c_str(), (int)assets.size(),
+           (int)contents.size(), header.size / 1024.0, looseBytes / 1024.0);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,416 @@
+// parallel_check: builds random PNGs of every colour type, each written
+// both plain and Adam7-interlaced with a random filter on every row, and
+// loads them at each CPU level with no parallel_for, with one that runs the
+// tasks backwards on the calling thread, and with one that spreads them
+// over threads. The plain image must hold exactly the pixels written, and
+// every other load must match it, for each req_comp. Cut-off interlaced
+// copies must fail with the same message each way. The images under the
+// given directories, PNGs and JPEGs with restart markers alike, are loaded
+// each way and compared as well. Run it under -fsanitize=thread to catch
+// races between the passes.
+//
+// build: c++ -O2 -pthread tools/parallel_check.cpp -o parallel_check
+// usage: parallel_check [-n files] [-t threads] [dir ...]
+//        (default 200 files, 8 threads, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <dirent.h>
+
+// the CPU level is internal, so the decoder is built into this file
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2, STBI__CPU_SSE2 | STBI__CPU_AVX2 };
+static const int levelCount = 3;
+#else
+static const int levels[] = { 0 };
+static const int levelCount = 1;
+#endif
+
+static int threadCount = 8;
+
+// the task order a correct decode must not depend on
+static void backwards(void* user, void (*task)(void* arg, int index), void* arg, int count)
+{
+    (void)user;
+    for (int i = count - 1; i >= 0; i--) task(arg, i);
+}
+
+static void threaded(void* user, void (*task)(void* arg, int index), void* arg, int count)
+{
+    (void)user;
+    std::atomic<int> next(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::min(threadCount, count); t++) {
+        threads.push_back(std::thread([&]() {
+            for (int i = next++; i < count; i = next++) task(arg, i);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+static const stbi_parallel_for runners[] = { NULL, backwards, threaded };
+static const char* runnerNames[] = { "serial", "backwards", "threaded" };
+
+struct Result
+{
+    std::vector<unsigned char> pixels;
+    int width, height, components;
+    std::string failure;        // empty if the decode succeeded
+};
+
+// the extensions of the formats that have parallel paths
+static bool isParallel(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && isParallel(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static Result load(const std::vector<unsigned char>& data, int reqComp)
+{
+    Result r;
+    r.width = r.height = r.components = 0;
+    unsigned char* pixels = stbi_load_from_memory(&data[0], (int)data.size(), &r.width, &r.height, &r.components, reqComp);
+    if (pixels) {
+        r.pixels.assign(pixels, pixels + (size_t)r.width * r.height * (reqComp ? reqComp : r.components));
+        stbi_image_free(pixels);
+    } else {
+        const char* reason = stbi_failure_reason();
+        r.failure = reason ? reason : "?";
+    }
+    return r;
+}
+
+static bool same(const Result& a, const Result& b)
+{
+    return a.failure == b.failure && a.pixels == b.pixels && a.width == b.width && a.height == b.height &&
+           a.components == b.components;
+}
+
+static unsigned int crcTable[256];
+
+static void makeCrcTable()
+{
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+static void put32(std::vector<unsigned char>& out, unsigned int v)
+{
+    out.push_back((unsigned char)(v >> 24));
+    out.push_back((unsigned char)(v >> 16));
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+static void writeChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t len)
+{
+    put32(out, (unsigned int)len);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (len) out.insert(out.end(), data, data + len);
+    unsigned int crc = 0xffffffffu;
+    for (size_t i = start; i < out.size(); i++) crc = crcTable[(crc ^ out[i]) & 255] ^ (crc >> 8);
+    put32(out, crc ^ 0xffffffffu);
+}
+
+static int paethPredictor(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// the rows of a w x h image, each behind a random filter byte
+static void filterImage(std::vector<unsigned char>& out, const std::vector<unsigned char>& rows, int w, int h, int n)
+{
+    size_t stride = (size_t)w * n;
+    for (int y = 0; y < h; y++) {
+        const unsigned char* row = &rows[y * stride];
+        const unsigned char* prior = y ? row - stride : NULL;
+        int filter = rand() % 5;
+        out.push_back((unsigned char)filter);
+        for (size_t i = 0; i < stride; i++) {
+            int a = i >= (size_t)n ? row[i - n] : 0, b = prior ? prior[i] : 0, c = prior && i >= (size_t)n ? prior[i - n] : 0;
+            int predicted = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : filter == 4 ? paethPredictor(a, b, c) : 0;
+            out.push_back((unsigned char)(row[i] - predicted));
+        }
+    }
+}
+
+// zlib with stored blocks of random length, cut into IDATs of random length
+static void writeIdat(std::vector<unsigned char>& out, const std::vector<unsigned char>& raw)
+{
+    std::vector<unsigned char> z;
+    z.push_back(0x78);
+    z.push_back(0x01);
+    size_t pos = 0;
+    do {
+        size_t len = std::min(raw.size() - pos, (size_t)(1 + rand() % 65535));
+        z.push_back(pos + len == raw.size() ? 1 : 0);
+        z.push_back((unsigned char)len);
+        z.push_back((unsigned char)(len >> 8));
+        z.push_back((unsigned char)~len);
+        z.push_back((unsigned char)(~len >> 8));
+        z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    } while (pos < raw.size());
+    unsigned int a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+        a = (a + raw[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(z, b << 16 | a);
+    pos = 0;
+    while (pos < z.size()) {
+        size_t len = std::min(z.size() - pos, (size_t)(1 + rand() % 20000));
+        writeChunk(out, "IDAT", &z[pos], len);
+        pos += len;
+    }
+}
+
+// writes the image plain, then interlaced; trns is the chunk to add, if any
+static void makePngs(std::vector<unsigned char> files[2], const std::vector<unsigned char>& pixels, int w, int h, int color, int n,
+                     const std::vector<unsigned char>& palette, const std::vector<unsigned char>& trns)
+{
+    static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+    static const int x0[7] = { 0, 4, 0, 2, 0, 1, 0 }, y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+    static const int dx[7] = { 8, 8, 4, 4, 2, 2, 1 }, dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+    for (int interlaced = 0; interlaced <= 1; interlaced++) {
+        std::vector<unsigned char>& out = files[interlaced];
+        out.assign(signature, signature + 8);
+        std::vector<unsigned char> ihdr;
+        put32(ihdr, w);
+        put32(ihdr, h);
+        ihdr.push_back(8);
+        ihdr.push_back((unsigned char)color);
+        ihdr.push_back(0);
+        ihdr.push_back(0);
+        ihdr.push_back((unsigned char)interlaced);
+        writeChunk(out, "IHDR", &ihdr[0], ihdr.size());
+        if (!palette.empty()) writeChunk(out, "PLTE", &palette[0], palette.size());
+        if (!trns.empty()) writeChunk(out, "tRNS", &trns[0], trns.size());
+
+        std::vector<unsigned char> raw;
+        if (!interlaced) {
+            filterImage(raw, pixels, w, h, n);
+        } else {
+            for (int p = 0; p < 7; p++) {
+                int pw = (w - x0[p] + dx[p] - 1) / dx[p], ph = (h - y0[p] + dy[p] - 1) / dy[p];
+                if (pw <= 0 || ph <= 0) continue;
+                std::vector<unsigned char> pass;
+                for (int y = y0[p]; y < h; y += dy[p])
+                    for (int x = x0[p]; x < w; x += dx[p])
+                        pass.insert(pass.end(), &pixels[((size_t)y * w + x) * n], &pixels[((size_t)y * w + x) * n] + n);
+                filterImage(raw, pass, pw, ph, n);
+            }
+        }
+        writeIdat(out, raw);
+        writeChunk(out, "IEND", NULL, 0);
+    }
+}
+
+// a random image, and the pixels stbi_load should give for it with req_comp 0
+static void makeImage(std::vector<unsigned char> files[2], std::vector<unsigned char>& expected, int& comp, int& width, int& height)
+{
+    static const int colors[] = { 0, 2, 3, 4, 6 };
+    int color = colors[rand() % 5];
+    int n = color == 3 ? 1 : (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
+    switch (rand() % 4) {
+    case 0: width = 1 + rand() % 9, height = 1 + rand() % 9; break;   // some passes empty
+    case 1: width = 1 + rand() % 600, height = 1 + rand() % 20; break;
+    default: width = 1 + rand() % 200, height = 1 + rand() % 300; break;
+    }
+
+    // few distinct values, so the colour key matches some pixels
+    std::vector<unsigned char> pixels((size_t)width * height * n), palette, trns;
+    int paletteSize = 1 + rand() % 256;
+    for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (unsigned char)(color == 3 ? rand() % paletteSize : rand() % 4 * 85);
+    if (color == 3) {
+        for (int i = 0; i < paletteSize * 3; i++) palette.push_back((unsigned char)rand());
+        if (rand() % 2) {
+            int entries = 1 + rand() % paletteSize;
+            for (int i = 0; i < entries; i++) trns.push_back((unsigned char)rand());
+        }
+    } else if ((n == 1 || n == 3) && rand() % 2) {
+        for (int k = 0; k < n; k++) {
+            trns.push_back(0);
+            trns.push_back((unsigned char)(rand() % 4 * 85));
+        }
+    }
+    makePngs(files, pixels, width, height, color, n, palette, trns);
+
+    expected.clear();
+    if (color == 3) {
+        comp = trns.empty() ? 3 : 4;
+        for (size_t i = 0; i < pixels.size(); i++) {
+            expected.insert(expected.end(), &palette[pixels[i] * 3], &palette[pixels[i] * 3] + 3);
+            if (comp == 4) expected.push_back(pixels[i] < trns.size() ? trns[pixels[i]] : 255);
+        }
+    } else if (!trns.empty()) {
+        comp = n + 1;
+        for (size_t i = 0; i < pixels.size(); i += n) {
+            bool key = true;
+            for (int k = 0; k < n; k++) key = key && pixels[i + k] == trns[k * 2 + 1];
+            expected.insert(expected.end(), &pixels[i], &pixels[i] + n);
+            expected.push_back(key ? 0 : 255);
+        }
+    } else {
+        comp = n;
+        expected = pixels;
+    }
+}
+
+// loads data with each runner at each CPU level for each req_comp, and
+// compares everything with the first, serial load at the first level
+static int checkRunners(const std::string& name, const std::vector<unsigned char>& data, std::vector<Result>& serial, int& runs)
+{
+    int bad = 0, available = stbi__cpu();
+    serial.clear();
+    for (int reqComp = 0; reqComp <= 4; reqComp++) {
+        Result first;
+        for (int l = 0; l < levelCount; l++) {
+            if ((available & levels[l]) != levels[l]) continue;
+            stbi__cpu_flags = levels[l];
+            for (int r = 0; r < 3; r++) {
+                stbi_set_parallel_for(runners[r], NULL);
+                Result got = load(data, reqComp);
+                runs++;
+                if (l == 0 && r == 0) {
+                    first = got;
+                    serial.push_back(got);
+                } else if (!same(got, first)) {
+                    fprintf(stderr, "%s: req_comp %d at CPU level %d %s differs from serial scalar%s%s\n", name.c_str(), reqComp,
+                            levels[l], runnerNames[r], got.failure.empty() ? "" : ": ", got.failure.c_str());
+                    bad++;
+                }
+            }
+        }
+    }
+    stbi__cpu_flags = available;
+    stbi_set_parallel_for(NULL, NULL);
+    return bad;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: parallel_check [-n files] [-t threads] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    int fileCount = 200;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-t") == 0) {
+            if (i + 1 == argc) usage();
+            int value = atoi(argv[i + 1]);
+            if (value < 1) usage();
+            if (argv[i][1] == 'n') fileCount = value;
+            else threadCount = value;
+            i++;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    makeCrcTable();
+    srand(1234);
+    int runs = 0, bad = 0;
+    for (int f = 0; f < fileCount; f++) {
+        std::vector<unsigned char> files[2], expected;
+        int comp, width, height;
+        makeImage(files, expected, comp, width, height);
+        char name[64];
+        snprintf(name, sizeof(name), "generated %d (%dx%dx%d)", f, width, height, comp);
+
+        std::vector<Result> plain, interlaced;
+        bad += checkRunners(std::string(name) + " plain", files[0], plain, runs);
+        bad += checkRunners(std::string(name) + " interlaced", files[1], interlaced, runs);
+        runs++;
+        if (plain[0].pixels != expected || plain[0].components != comp || plain[0].width != width || plain[0].height != height) {
+            fprintf(stderr, "%s: plain %s\n", name, plain[0].failure.empty() ? "differs from the pixels written" : plain[0].failure.c_str());
+            bad++;
+        }
+        for (int reqComp = 0; reqComp <= 4; reqComp++) {
+            runs++;
+            if (!same(interlaced[reqComp], plain[reqComp])) {
+                fprintf(stderr, "%s: req_comp %d interlaced differs from plain\n", name, reqComp);
+                bad++;
+            }
+        }
+
+        // cut inside the image data, where the passes run out one by one
+        std::vector<unsigned char> cut(files[1].begin(), files[1].begin() + files[1].size() * (1 + rand() % 9) / 10);
+        std::vector<Result> ignored;
+        bad += checkRunners(std::string(name) + " interlaced, cut off", cut, ignored, runs);
+    }
+
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], paths);
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::vector<unsigned char> data;
+        std::vector<Result> ignored;
+        if (!readFile(paths[i], data)) {
+            fprintf(stderr, "%s: could not read\n", paths[i].c_str());
+            bad++;
+            continue;
+        }
+        bad += checkRunners(paths[i], data, ignored, runs);
+    }
+
+    printf("%d runs, %d bad\n", runs, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+// scale_check: loads every image under the given directories with
+// stbi_load_scaled at 1/1, 1/2, 1/4 and 1/8 size, for req_comp 0 and 4, and
+// checks each against the full-size decode box-filtered down here. Formats
+// that are decoded in full and filtered must match exactly; JPEGs, which
+// are reduced inside the IDCT, must come within an RMS error of the filtered
+// image in luma. Scale 1 must match stbi_load exactly for every format, and a scale
+// of 3 must be refused.
+//
+// build: c++ -O2 tools/scale_check.cpp -x c GemSwap/stb_image.c -o scale_check
+// usage: scale_check [-e rms] [dir ...]   (default rms 3, GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+
+extern "C" unsigned char *stbi_load_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" unsigned char *stbi_load_scaled_from_memory(unsigned char const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale);
+extern "C" unsigned char *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+
+// the extensions stb_image can read
+static bool isImage(const std::string& name)
+{
+    static const char* extensions[] = { "png", "jpg", "jpeg", "bmp", "tga", "psd", "gif", "hdr", "pic" };
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    for (size_t i = 0; i < ext.size(); i++) ext[i] = (char)tolower((unsigned char)ext[i]);
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+        if (ext == extensions[i]) return true;
+    return false;
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && isImage(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+// the average of each scale x scale square, rounded to nearest; squares cut
+// off by the right and bottom edges average only the pixels they cover
+static std::vector<unsigned char> boxFilter(const unsigned char* data, int w, int h, int n, int scale, int& w2, int& h2)
+{
+    w2 = (w + scale - 1) / scale;
+    h2 = (h + scale - 1) / scale;
+    std::vector<unsigned char> out((size_t)w2 * h2 * n);
+    for (int j = 0; j < h2; j++) {
+        int y1 = std::min(j * scale + scale, h);
+        for (int i = 0; i < w2; i++) {
+            int x1 = std::min(i * scale + scale, w);
+            int count = (x1 - i * scale) * (y1 - j * scale);
+            for (int k = 0; k < n; k++) {
+                int sum = count / 2;
+                for (int y = j * scale; y < y1; y++)
+                    for (int x = i * scale; x < x1; x++) sum += data[((size_t)y * w + x) * n + k];
+                out[((size_t)j * w2 + i) * n + k] = (unsigned char)(sum / count);
+            }
+        }
+    }
+    return out;
+}
+
+static bool isJpeg(const std::vector<unsigned char>& data)
+{
+    return data.size() > 2 && data[0] == 0xFF && data[1] == 0xD8;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: scale_check [-e rms] [dir ...]\n");
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    double maxRms = 3.0;
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-e") == 0) {
+            if (i + 1 == argc) usage();
+            maxRms = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            dirs.push_back(argv[i]);
+        }
+    }
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], files);
+    if (files.empty()) usage();
+
+    int runs = 0, bad = 0;
+    double worstRms = 0;
+    for (size_t f = 0; f < files.size(); f++) {
+        const char* path = files[f].c_str();
+        std::vector<unsigned char> data;
+        if (!readFile(files[f], data)) {
+            fprintf(stderr, "%s: could not read\n", path);
+            bad++;
+            continue;
+        }
+        bool jpeg = isJpeg(data);
+        for (int reqComp = 0; reqComp <= 4; reqComp += 4) {
+            int w, h, comp;
+            unsigned char* full = stbi_load_from_memory(&data[0], (int)data.size(), &w, &h, &comp, reqComp);
+            if (!full) {
+                fprintf(stderr, "%s: %s\n", path, stbi_failure_reason());
+                bad++;
+                break;
+            }
+            int n = reqComp ? reqComp : comp;
+            for (int scale = 1; scale <= 8; scale *= 2) {
+                int sw, sh, scomp, fw, fh, fcomp;
+                unsigned char* scaled = stbi_load_scaled_from_memory(&data[0], (int)data.size(), &sw, &sh, &scomp, reqComp, scale);
+                unsigned char* fromFile = stbi_load_scaled(path, &fw, &fh, &fcomp, reqComp, scale);
+                runs++;
+                int rw, rh;
+                std::vector<unsigned char> expected = boxFilter(full, w, h, n, scale, rw, rh);
+                if (!scaled || !fromFile || sw != rw || sh != rh || scomp != comp || fw != sw || fh != sh || fcomp != scomp) {
+                    fprintf(stderr, "%s: req_comp %d scale %d gave %dx%d, expected %dx%d%s\n", path, reqComp, scale,
+                            scaled ? sw : 0, scaled ? sh : 0, rw, rh, scaled ? "" : stbi_failure_reason());
+                    bad++;
+                } else if (memcmp(scaled, fromFile, expected.size()) != 0) {
+                    fprintf(stderr, "%s: req_comp %d scale %d differs between file and memory\n", path, reqComp, scale);
+                    bad++;
+                } else if (!jpeg || scale == 1) {
+                    if (memcmp(scaled, &expected[0], expected.size()) != 0) {
+                        fprintf(stderr, "%s: req_comp %d scale %d differs from the box filter\n", path, reqComp, scale);
+                        bad++;
+                    }
+                } else {
+                    // a block cut off by the edge is padded by the encoder, and
+                    // the IDCT averages the padding in as well, so only pixels
+                    // from whole 16x16 MCUs are compared. The full decode
+                    // upsamples subsampled colour before it is filtered here,
+                    // which the scaled one need not do, so luma is compared:
+                    // the colour conversion's weights cancel the chroma out
+                    int cw = w / 16 * 16 / scale, ch = h / 16 * 16 / scale;
+                    double sum = 0;
+                    for (int y = 0; y < ch; y++) {
+                        for (int x = 0; x < cw; x++) {
+                            size_t i = ((size_t)y * rw + x) * n;
+                            double d = n < 3 ? (double)scaled[i] - expected[i] :
+                                       0.299 * ((double)scaled[i] - expected[i]) + 0.587 * ((double)scaled[i + 1] - expected[i + 1]) +
+                                       0.114 * ((double)scaled[i + 2] - expected[i + 2]);
+                            sum += d * d;
+                        }
+                    }
+                    double rms = cw && ch ? sqrt(sum / ((double)cw * ch)) : 0;
+                    worstRms = std::max(worstRms, rms);
+                    if (rms > maxRms) {
+                        fprintf(stderr, "%s: req_comp %d scale %d is off by %.2f RMS\n", path, reqComp, scale, rms);
+                        bad++;
+                    }
+                }
+                stbi_image_free(scaled);
+                stbi_image_free(fromFile);
+            }
+            stbi_image_free(full);
+        }
+        int x, y, comp;
+        unsigned char* refused = stbi_load_scaled_from_memory(&data[0], (int)data.size(), &x, &y, &comp, 4, 3);
+        runs++;
+        if (refused) {
+            fprintf(stderr, "%s: scale 3 was accepted\n", path);
+            stbi_image_free(refused);
+            bad++;
+        }
+    }
+
+    printf("%d runs, %d bad, worst JPEG RMS %.2f\n", runs, bad, worstRms);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,223 @@
+// stream_check: feeds every PNG, JPEG and GIF under the given directories
+// to stbi_stream in pieces of random size, for each req_comp, and checks the
+// rows that come back against stbi_load_from_memory. It then feeds PNGs
+// whose IDAT lengths are past the 2^31-1 the format allows, in the first
+// IDAT and in a later one, which must fail cleanly. Build it with
+// -fsanitize=address as well to catch reads and writes out of bounds.
+//
+// build: c++ -O2 tools/stream_check.cpp -x c GemSwap/stb_image.c -o stream_check
+// usage: stream_check [dir ...]   (default GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+
+typedef unsigned char stbi_uc;
+typedef struct stbi_stream stbi_stream;
+typedef void (*stbi_stream_row)(void *user, int y, stbi_uc const *row);
+extern "C" stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" const char *stbi_failure_reason(void);
+extern "C" stbi_stream *stbi_stream_begin(int req_comp, stbi_stream_row row, void *user);
+extern "C" int stbi_stream_feed(stbi_stream *st, stbi_uc const *data, int len);
+extern "C" int stbi_stream_info(stbi_stream *st, int *x, int *y, int *comp);
+extern "C" int stbi_stream_done(stbi_stream *st);
+extern "C" void stbi_stream_end(stbi_stream *st);
+
+struct Check
+{
+    stbi_stream* stream;
+    const stbi_uc* expected;    // the image stbi_load_from_memory gave
+    int width, height, components;
+    int rows;                   // passed on so far
+    bool differs;
+};
+
+static void onRow(void* user, int y, stbi_uc const* row)
+{
+    Check* check = (Check*)user;
+    if (!check->components) {
+        int x, h, comp;
+        stbi_stream_info(check->stream, &x, &h, &comp);
+        check->components = comp;
+    }
+    size_t stride = (size_t)check->width * check->components;
+    if (y != check->rows || y >= check->height || memcmp(row, check->expected + y * stride, stride) != 0) check->differs = true;
+    check->rows++;
+}
+
+// feeds data in pieces of 1 to maxPiece bytes, then ends the input; false if a feed failed
+static bool feed(stbi_stream* stream, const std::vector<stbi_uc>& data, int maxPiece)
+{
+    size_t pos = 0;
+    while (pos < data.size()) {
+        int n = (int)std::min((size_t)(1 + rand() % maxPiece), data.size() - pos);
+        if (!stbi_stream_feed(stream, &data[pos], n)) return false;
+        pos += n;
+    }
+    return stbi_stream_feed(stream, NULL, 0) != 0;
+}
+
+static bool streamable(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = name.substr(dot + 1);
+    return ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "gif";
+}
+
+static void findImages(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.' && streamable(entry->d_name)) names.push_back(entry->d_name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+static bool readFile(const std::string& path, std::vector<stbi_uc>& data)
+{
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&data[0], 1, size, f) == (size_t)size;
+    fclose(f);
+    return ok;
+}
+
+static unsigned int get32(const stbi_uc* p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(stbi_uc* p, unsigned int v)
+{
+    p[0] = (stbi_uc)(v >> 24);
+    p[1] = (stbi_uc)(v >> 16);
+    p[2] = (stbi_uc)(v >> 8);
+    p[3] = (stbi_uc)v;
+}
+
+// the offset of the first IDAT chunk's length field, or 0
+static size_t findIdat(const std::vector<stbi_uc>& png)
+{
+    size_t pos = 8;
+    while (pos + 8 <= png.size()) {
+        if (memcmp(&png[pos + 4], "IDAT", 4) == 0) return pos;
+        pos += 12 + (size_t)get32(&png[pos]);
+    }
+    return 0;
+}
+
+// a file with a bad length must fail, not crash, whatever the piece size
+static bool expectFailure(const char* what, const std::string& path, const std::vector<stbi_uc>& data)
+{
+    bool ok = true;
+    for (int maxPiece = 1; maxPiece <= 65536; maxPiece *= 16) {
+        Check check;
+        memset(&check, 0, sizeof(check));
+        check.stream = stbi_stream_begin(4, onRow, &check);
+        if (feed(check.stream, data, maxPiece)) {
+            fprintf(stderr, "%s: %s was accepted\n", path.c_str(), what);
+            ok = false;
+        }
+        stbi_stream_end(check.stream);
+    }
+    return ok;
+}
+
+// IDAT lengths of 2^31 and over, first in the first IDAT, then in a second
+// one after the first half of the image data
+static int checkBadLengths(const std::string& path, const std::vector<stbi_uc>& png)
+{
+    size_t idat = findIdat(png);
+    if (!idat) return 0;
+    unsigned int length = get32(&png[idat]);
+    if (length < 2) return 0;
+    int bad = 0;
+
+    std::vector<stbi_uc> first = png;
+    put32(&first[idat], 0x80000000u | length);
+    if (!expectFailure("a first IDAT of 2^31 bytes or more", path, first)) bad++;
+
+    // the CRCs are not checked, so the split needs none of its own
+    unsigned int half = length / 2;
+    std::vector<stbi_uc> second(png.begin(), png.begin() + idat + 8 + half);
+    put32(&second[idat], half);
+    static const stbi_uc header[12] = { 0, 0, 0, 0, 0x80, 0, 0, 0, 'I', 'D', 'A', 'T' };
+    second.insert(second.end(), header, header + 12);
+    second.insert(second.end(), png.begin() + idat + 8 + half, png.end());
+    if (!expectFailure("a later IDAT of 2^31 bytes or more", path, second)) bad++;
+    return bad;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) dirs.push_back(argv[i]);
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findImages(dirs[i], files);
+    if (files.empty()) {
+        fprintf(stderr, "usage: stream_check [dir ...]\n");
+        return 2;
+    }
+
+    srand(1234);
+    int runs = 0, bad = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        std::vector<stbi_uc> data;
+        if (!readFile(files[i], data)) {
+            fprintf(stderr, "%s: could not read\n", files[i].c_str());
+            bad++;
+            continue;
+        }
+        for (int reqComp = 0; reqComp <= 4; reqComp++) {
+            Check check;
+            int comp;
+            memset(&check, 0, sizeof(check));
+            check.expected = stbi_load_from_memory(&data[0], (int)data.size(), &check.width, &check.height, &comp, reqComp);
+            if (!check.expected) {
+                fprintf(stderr, "%s: %s\n", files[i].c_str(), stbi_failure_reason());
+                bad++;
+                break;
+            }
+            check.components = reqComp;
+            check.stream = stbi_stream_begin(reqComp, onRow, &check);
+            bool ok = feed(check.stream, data, 4096);
+            runs++;
+            if (!ok || !stbi_stream_done(check.stream) || check.differs || check.rows != check.height) {
+                fprintf(stderr, "%s: req_comp %d streamed %d of %d rows%s%s\n", files[i].c_str(), reqComp, check.rows,
+                        check.height, check.differs ? ", differing" : "", ok ? "" : ", failed");
+                bad++;
+            }
+            stbi_stream_end(check.stream);
+            stbi_image_free((void*)check.expected);
+        }
+        if (data.size() > 8 && data[0] == 0x89 && data[1] == 'P') {
+            bad += checkBadLengths(files[i], data);
+            runs += 2;
+        }
+    }
+
+    printf("%d runs, %d bad\n", runs, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+// unfilter_bench: times PNG row unfiltering (the step after inflate in
+// every PNG load) for each filter type on real sprites, with the plain C
+// loops against the SSE2 and AVX2 kernels, so a change to either can be
+// checked for speed as well as for matching output. Each image is decoded
+// once, then refiltered whole with one filter at a time.
+//
+// build: c++ -O2 tools/unfilter_bench.cpp -o unfilter_bench -lpthread
+// usage: unfilter_bench [dir ...]   (default GemSwap/sprites GemSwap/asteroidtexturepack)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+
+// the kernels are static, so the decoder is built into this file
+#include "../GemSwap/stb_image.c"
+
+#ifdef STBI_SSE2
+static const int levels[] = { 0, STBI__CPU_SSE2, STBI__CPU_SSE2 | STBI__CPU_AVX2 };
+static const char* levelNames[] = { "scalar", "sse2", "avx2" };
+static const int levelCount = 3;
+#else
+static const int levels[] = { 0 };
+static const char* levelNames[] = { "scalar" };
+static const int levelCount = 1;
+#endif
+
+static const char* filterNames[] = { "none", "sub", "up", "avg", "paeth" };
+
+struct Image
+{
+    int width, height, components;
+    std::vector<unsigned char> pixels;
+};
+
+// the PNG files directly inside dir, in name order
+static void findPngs(const std::string& dir, std::vector<std::string>& files)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "%s: not a directory\n", dir.c_str());
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) names.push_back(name);
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for (size_t i = 0; i < names.size(); i++) files.push_back(dir + "/" + names[i]);
+}
+
+// filters every row of the image with one filter, as an encoder would; the
+// row above the first is taken as zero, which is what the first row filters mean
+static void filterImage(const Image& image, int filter, std::vector<unsigned char>& raw)
+{
+    int n = image.components, stride = image.width * n;
+    raw.resize((size_t)stride * image.height);
+    std::vector<unsigned char> zero(stride, 0);
+    for (int j = 0; j < image.height; j++) {
+        const unsigned char* cur = &image.pixels[(size_t)j * stride];
+        const unsigned char* prior = j ? cur - stride : &zero[0];
+        unsigned char* out = &raw[(size_t)j * stride];
+        for (int i = 0; i < stride; i++) {
+            int a = i >= n ? cur[i - n] : 0, b = prior[i], c = i >= n ? prior[i - n] : 0;
+            int predicted = 0;
+            switch (filter) {
+                case F_sub:   predicted = a; break;
+                case F_up:    predicted = b; break;
+                case F_avg:   predicted = (a + b) >> 1; break;
+                case F_paeth: predicted = paeth(a, b, c); break;
+            }
+            out[i] = (unsigned char)(cur[i] - predicted);
+        }
+    }
+}
+
+// best of a few runs, in megabytes of output per second
+static double timeUnfilter(const Image& image, int filter, const std::vector<unsigned char>& raw, std::vector<unsigned char>& out)
+{
+    int n = image.components, stride = image.width * n;
+    // a row of zeros above the image stands in for the first row filters
+    out.assign((size_t)stride * (image.height + 1), 0);
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int j = 0; j < image.height; j++)
+            png_unfilter_row(&out[(size_t)(j + 1) * stride], &out[(size_t)j * stride], (uint8*)&raw[(size_t)j * stride],
+                             filter, n, n, image.width);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = (double)stride * image.height / seconds / 1e6;
+        if (rate > best) best = rate;
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<std::string> dirs;
+    for (int i = 1; i < argc; i++) dirs.push_back(argv[i]);
+    if (dirs.empty()) {
+        dirs.push_back("GemSwap/sprites");
+        dirs.push_back("GemSwap/asteroidtexturepack");
+    }
+
+    std::vector<std::string> files;
+    for (size_t i = 0; i < dirs.size(); i++) findPngs(dirs[i], files);
+
+    std::vector<Image> images;
+    long long bytes = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        Image image;
+        unsigned char* pixels = stbi_load(files[i].c_str(), &image.width, &image.height, &image.components, 0);
+        if (!pixels) {
+            fprintf(stderr, "%s: %s\n", files[i].c_str(), stbi_failure_reason());
+            continue;
+        }
+        image.pixels.assign(pixels, pixels + (size_t)image.width * image.height * image.components);
+        stbi_image_free(pixels);
+        bytes += image.pixels.size();
+        images.push_back(image);
+    }
+    if (images.empty()) {
+        fprintf(stderr, "usage: unfilter_bench [dir ...]\n");
+        return 2;
+    }
+
+    int available = stbi__cpu();
+    printf("%d images, %.1f MB, MB/s\n%-6s", (int)images.size(), bytes / 1e6, "");
+    for (int l = 0; l < levelCount; l++) printf(" %9s", levelNames[l]);
+    printf("\n");
+
+    int mismatches = 0;
+    std::vector<unsigned char> raw, out;
+    for (int filter = F_sub; filter <= F_paeth; filter++) {
+        printf("%-6s", filterNames[filter]);
+        for (int l = 0; l < levelCount; l++) {
+            if ((available & levels[l]) != levels[l]) {
+                printf(" %9s", "-");
+                continue;
+            }
+            stbi__cpu_flags = levels[l];
+            // the rate over the whole set is total bytes over total time
+            double seconds = 0;
+            bool differs = false;
+            for (size_t i = 0; i < images.size(); i++) {
+                filterImage(images[i], filter, raw);
+                seconds += images[i].pixels.size() / 1e6 / timeUnfilter(images[i], filter, raw, out);
+                int stride = images[i].width * images[i].components;
+                if (memcmp(&out[stride], &images[i].pixels[0], images[i].pixels.size()) != 0) differs = true;
+            }
+            if (differs) {
+                printf(" %8s!", "differs");
+                mismatches++;
+            } else {
+                printf(" %9.0f", bytes / 1e6 / seconds);
+            }
+        }
+        printf("\n");
+    }
+    stbi__cpu_flags = available;
+    return mismatches ? 1 : 0;
+}